@@ -0,0 +1,63 @@
+#ifndef JUCE_AUDIO_IO_H
+#define JUCE_AUDIO_IO_H
+
+#include "../include/audio_io.h"
+#include "../include/log.h"
+#include <JuceHeader.h>
+
+// AudioIO on a JUCE audio device: ALSA, JACK, CoreAudio, WASAPI, ...
+class JuceAudioIO : public AudioIO, private juce::AudioSource {
+public:
+    // an empty type picks JUCE's default; false if no device could be opened
+    bool open(const std::string &type, int nChannels) {
+        numChannels = nChannels;
+        if (!type.empty()) deviceManager.setCurrentAudioDeviceType(type, true);
+        auto error = deviceManager.initialiseWithDefaultDevices(nChannels, nChannels);
+        if (error.isNotEmpty() || !deviceManager.getCurrentAudioDevice()) {
+            LOG(Error, PHY, "No audio device: %s", error.toRawUTF8());
+            return false;
+        }
+        return true;
+    }
+
+    ~JuceAudioIO() override { stop(); }
+
+    bool start(Callback blockCallback) override {
+        callback = std::move(blockCallback);
+        player.setSource(this);
+        deviceManager.addAudioCallback(&player);
+        return true;
+    }
+
+    void stop() override {
+        deviceManager.removeAudioCallback(&player);
+        player.setSource(nullptr);
+    }
+
+    [[nodiscard]] double sampleRate() const override {
+        auto *device = deviceManager.getCurrentAudioDevice();
+        return device ? device->getCurrentSampleRate() : DEFAULT_SAMPLE_RATE;
+    }
+
+    [[nodiscard]] int channels() const override { return numChannels; }
+
+private:
+    void prepareToPlay(int, double) override {}
+
+    void releaseResources() override {}
+
+    void getNextAudioBlock(const juce::AudioSourceChannelInfo &bufferToFill) override {
+        auto buffer = bufferToFill.buffer;
+        auto bufferSize = buffer->getNumSamples();
+        auto channelsUsed = (std::min)(buffer->getNumChannels(), numChannels);
+        callback(buffer->getArrayOfReadPointers(), buffer->getArrayOfWritePointers(), channelsUsed, bufferSize);
+        for (int ch = channelsUsed; ch < buffer->getNumChannels(); ++ch) buffer->clear(ch, 0, bufferSize);
+    }
+
+    juce::AudioDeviceManager deviceManager;
+    juce::AudioSourcePlayer player;
+    Callback callback;
+    int numChannels = 0;
+};
+
+#endif//JUCE_AUDIO_IO_H
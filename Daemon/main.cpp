@@ -0,0 +1,152 @@
+// Headless Node1 / Node2: the same client and gateway as the GUI apps, driven
+// from the command line and a control socket instead of buttons.
+//
+//     aetherd --node 2 --daemon --control 7002
+//     aetherd --node 1 --control 7001 --audio-type ALSA
+//
+// Control commands (one per line): stats, dns <domain>,
+// get <url> [file] (the body goes to the daemon's stdout without a file;
+// answers with the request number), cancel <number>,
+// ping [count] [size,size,...] [interval ms] [burst] (to the other node), quit.
+// With PROXY <port> in config.txt, node 1 also serves an HTTP / SOCKS5 proxy on
+// 127.0.0.1:<port> whose connections are tunnelled to node 2.
+#include "../include/audio_io.h"
+#include "../include/client.h"
+#include "../include/config.h"
+#include "../include/control.h"
+#include "../include/gateway.h"
+#include "../include/log.h"
+#include "../include/metrics.h"
+#include "../include/socket.h"
+#include "../include/trace.h"
+#include "juce_audio_io.h"
+#include <JuceHeader.h>
+#include <csignal>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+constexpr double DNS_ANSWER_TIMEOUT = 10.0;// seconds a control 'dns' waits for the gateway
+
+static std::atomic<bool> quit{false};
+
+static void onSignal(int) { quit = true; }
+
+// "ping [count] [size,size,...] [interval ms] [burst]"
+static std::string ping(const std::string &line, Client *client, Gateway *gateway) {
+    std::istringstream in(line);
+    std::string command, sizes;
+    PingOptions options;
+    in >> command >> options.count >> sizes >> options.intervalMs >> options.burst;
+    if (!sizes.empty()) {
+        options.sizes.clear();
+        std::istringstream list(sizes);
+        for (std::string size; std::getline(list, size, ',');) options.sizes.push_back(atoi(size.c_str()));
+    }
+    if (options.count <= 0 || options.sizes.empty() || options.intervalMs < 0 || options.burst <= 0) return "usage: ping [count] [size,size,...] [interval ms] [burst]";
+    return Pinger::report(client ? client->ping(options) : gateway->ping(options));
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s --node <1|2> [--control <port>] [--daemon] [--log <file>]\n"
+            "          [--audio-type <ALSA|JACK|...>] [--no-audio]\n",
+            program);
+}
+
+int main(int argc, char *argv[]) {
+    int node = 0, controlPort = 0;
+    bool daemon = false, simulated = false;
+    std::string logPath, audioType;
+    for (int i = 1; i < argc; ++i) {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--node") && hasValue) node = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--control") && hasValue)
+            controlPort = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--log") && hasValue)
+            logPath = argv[++i];
+        else if (!strcmp(argv[i], "--audio-type") && hasValue)
+            audioType = argv[++i];
+        else if (!strcmp(argv[i], "--daemon"))
+            daemon = true;
+        else if (!strcmp(argv[i], "--no-audio"))
+            simulated = true;
+        else
+            return usage(argv[0]), 2;
+    }
+    if (node != 1 && node != 2) return usage(argv[0]), 2;
+
+    // before any thread exists; config.txt is looked up in the current directory, so stay in it
+    if (daemon) {
+        set_daemon(nullptr);
+        if (logPath.empty()) logPath = "aetherd_node" + std::to_string(node) + ".log";
+    }
+    if (!logPath.empty() && !Log::open(logPath)) fprintf(stderr, "cannot open %s\n", logPath.c_str());
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+
+    juce::ScopedJuceInitialiser_GUI juceInit;// message manager only, no windows
+    auto lanes = GlobalConfig::current()->lanes;
+    std::unique_ptr<AudioIO> audio;
+    if (simulated) audio = std::make_unique<SimulatedAudioIO>(lanes);
+    else {
+        auto device = std::make_unique<JuceAudioIO>();
+        if (!device->open(audioType, lanes)) return Log::flush(), 1;
+        audio = std::move(device);
+    }
+    double sampleRate = audio->sampleRate();
+
+    std::unique_ptr<Client> client;
+    std::unique_ptr<Gateway> gateway;
+    if (node == 1) client = std::make_unique<Client>(sampleRate, Client::Callbacks{});
+    else
+        gateway = std::make_unique<Gateway>(sampleRate);
+    BondedLink &link = client ? client->bondedLink() : gateway->bondedLink();
+    Metrics::startReporter();
+
+    audio->start([&link](const float *const *input, float *const *output, int channels, int n) { link.processBlock(input, output, channels, n); });
+
+    std::unique_ptr<ControlServer> control;
+    if (controlPort > 0)
+        control = std::make_unique<ControlServer>((unsigned short) controlPort, [&](const std::string &line) -> std::string {
+            std::istringstream in(line);
+            std::string command, argument, path;
+            in >> command >> argument >> path;
+            if (command == "stats") return Metrics::text() + link.report();
+            if (command == "quit") return quit = true, "bye";
+            if (client && command == "dns" && !argument.empty()) {
+                RequestOptions options;
+                options.deadline = DNS_ANSWER_TIMEOUT;
+                auto reply = client->resolve(argument, options).reply.get();
+                return reply.status == RequestStatus::OK ? reply.ip : statusName(reply.status);
+            }
+            if (client && command == "get" && !argument.empty()) return "queued " + std::to_string(client->get(argument, path.empty() ? "-" : path).id);
+            if (client && command == "cancel" && !argument.empty()) return client->cancel((RequestId) atoi(argument.c_str())), "cancelled";
+            if (command == "ping") return ping(line, client.get(), gateway.get());
+            if (command == "send" && !argument.empty()) {// blocks until the other node has verified the file
+                auto result = client ? client->sendFile(argument) : gateway->sendFile(argument);
+                if (!result.ok) return "failed: " + result.error;
+                char text[96];
+                snprintf(text, sizeof(text), "sent %llu bytes in %.1f s (%.0f B/s)", (unsigned long long) result.bytes, result.seconds,
+                         result.seconds > 0 ? (double) result.bytes / result.seconds : 0.0);
+                return text;
+            }
+            return "unknown command: " + line;
+        });
+
+    LOG(Info, LINK, "Node%d running headless at %.0f Hz, %d lane(s)", node, sampleRate, lanes);
+    while (!quit) {
+        std::this_thread::sleep_for(200ms);
+        if (client) client->poll();
+    }
+
+    control = nullptr;
+    audio->stop();
+    client = nullptr;
+    gateway = nullptr;
+    Trace::dump("trace_node" + std::to_string(node) + ".bin");
+    Log::flush();
+    return 0;
+}
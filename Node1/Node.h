@@ -1,14 +1,13 @@
+#include "../include/client.h"
 #include "../include/config.h"
-#include "../include/reader.h"
-#include "../include/utils.h"
-#include "../include/writer.h"
+#include "../include/metrics.h"
+#include "../include/trace.h"
 #include <JuceHeader.h>
-#include <queue>
 #include <string>
 
 #pragma once
 
-class MainContentComponent : public juce::AudioAppComponent {
+class MainContentComponent : public juce::AudioAppComponent, private juce::Timer {
 public:
     MainContentComponent() {
         titleLabel.setText("Node 1: Client", juce::NotificationType::dontSendNotification);
@@ -29,11 +28,7 @@ public:
 
             aw->enterModalState(true, juce::ModalCallbackFunction::create([this, aw](int result) {
                 if (result == 1) { // 用户点了 OK
-                    std::string domain = aw->getTextEditorContents("domain").toStdString();
-                    auto conf2 = GlobalConfig().get(Config::NODE2);
-                    FrameType frame{ Config::DNS_REQ, Str2IPType("10.0.0.2"), 53, domain };
-                    writer->send(frame);
-                    std::cout << "[Sent] DNS Request for " << domain << " sent." << std::endl;
+                    if (client) client->dnsLookup(aw->getTextEditorContents("domain").toStdString());
                 }
                 delete aw;
                 }));
@@ -52,75 +47,72 @@ public:
 
             aw->enterModalState(true, juce::ModalCallbackFunction::create([this, aw](int result) {
                 if (result == 1) {
-                    currentUrl = aw->getTextEditorContents("url").toStdString();
-                    auto conf2 = GlobalConfig().get(Config::NODE2);
-                    FrameType synFrame{ Config::TCP_SYN, Str2IPType("10.0.0.2"), 80, "SEQ:0x12345678" };
-                    writer->send(synFrame);
-                    std::cout << "[TCP] SYN Sent for " << currentUrl << std::endl;
+                    if (client) client->httpGet(aw->getTextEditorContents("url").toStdString(), "response.html");
                 }
                 delete aw;
                 }));
             };
         addAndMakeVisible(httpButton);
 
-        setSize(600, 300);
-        setAudioChannels(1, 1);
+        // 链路统计面板，每秒刷新一次
+        statsPanel.setMultiLine(true);
+        statsPanel.setReadOnly(true);
+        statsPanel.setFont(juce::Font(juce::Font::getDefaultMonospacedFontName(), 12.0f, juce::Font::plain));
+        statsPanel.setBounds(20, 200, 560, 380);
+        addAndMakeVisible(statsPanel);
+        Metrics::startReporter();
+        startTimer(METRICS_PERIOD_MS);
+
+        setSize(600, 600);
+        setAudioChannels(GlobalConfig::current()->lanes, GlobalConfig::current()->lanes);
     }
 
-    ~MainContentComponent() override { shutdownAudio(); }
+    ~MainContentComponent() override {
+        stopTimer();
+        shutdownAudio();
+        Trace::dump("trace_node1.bin");
+    }
 
 private:
-    void initThreads() {
-        auto processFunc = [this](FrameType& frame) {
-            if (frame.type == Config::DNS_RSP) {
-                // 收到解析结果，直接弹窗显示给 TA 看，更显眼！
-                juce::NativeMessageBox::showMessageBoxAsync(juce::MessageBoxIconType::InfoIcon, "DNS Result", "Resolved IP: " + frame.body);
-                std::cout << "\n[DNS Result] Resolved IP: " << frame.body << std::endl;
-            }
-            else if (frame.type == Config::TCP_ACK) {
-                auto conf2 = GlobalConfig().get(Config::NODE2);
-                FrameType reqFrame{ Config::HTTP_REQ, Str2IPType("10.0.0.2"), 80, currentUrl };
-                writer->send(reqFrame);
-            }
-            else if (frame.type == Config::HTTP_RSP) {
-                // HTTP 结果太长，打印到控制台，同时弹个小提示
-                juce::NativeMessageBox::showMessageBoxAsync(juce::MessageBoxIconType::InfoIcon, "HTTP Success", "Page content received! See terminal.");
-                std::cout << "\n[HTTP Content]:\n" << frame.body << std::endl;
-            }
-            };
-        reader = new Reader(&directInput, &directInputLock, processFunc);
-        reader->startThread();
-        writer = new Writer(&directOutput, &directOutputLock);
+    void initThreads(double sampleRate) {
+        Client::Callbacks callbacks;
+        // 收到解析结果，直接弹窗显示给 TA 看，更显眼！
+        callbacks.dnsResult = [](const std::string& ip) {
+            juce::NativeMessageBox::showMessageBoxAsync(juce::MessageBoxIconType::InfoIcon, "DNS Result", "Resolved IP: " + ip);
+        };
+        // HTTP 结果边收边写进文件，整个响应收完（或超时）才弹一次窗
+        callbacks.httpDone = [](const Reassembler::Result& result) {
+            auto text = "HTTP " + juce::String(result.envelope.status) + " " + juce::String(result.envelope.get(HttpEnvelope::CONTENT_TYPE)) + "\n"
+                        + juce::String((juce::int64) result.bytes) + " bytes written to " + result.path + " ("
+                        + juce::String((juce::int64) result.received) + " of " + juce::String((juce::int64) result.total) + " on air)";
+            if (result.complete)
+                juce::NativeMessageBox::showMessageBoxAsync(juce::MessageBoxIconType::InfoIcon, "HTTP Success", text);
+            else
+                juce::NativeMessageBox::showMessageBoxAsync(juce::MessageBoxIconType::WarningIcon, "HTTP Incomplete", text);
+        };
+        client = std::make_unique<Client>(sampleRate, callbacks);
     }
 
-    void prepareToPlay(int, double) override { initThreads(); }
+    void timerCallback() override {
+        if (client) client->poll();
+        statsPanel.setText(Metrics::text() + (client ? client->bondedLink().report() : std::string()), false);
+    }
+
+    void prepareToPlay(int, double sampleRate) override { initThreads(sampleRate); }
 
     void getNextAudioBlock(const juce::AudioSourceChannelInfo& bufferToFill) override {
+        auto &link = client->bondedLink();
         auto buffer = bufferToFill.buffer;
         auto bufferSize = buffer->getNumSamples();
-        const float* data = buffer->getReadPointer(0);
-        directInputLock.enter();
-        for (int i = 0; i < bufferSize; ++i) { directInput.push(data[i]); }
-        directInputLock.exit();
-        buffer->clear();
-        float* writePos = buffer->getWritePointer(0);
-        directOutputLock.enter();
-        for (int i = 0; i < bufferSize; ++i) {
-            writePos[i] = directOutput.empty() ? 0.0f : directOutput.front();
-            if (!directOutput.empty()) directOutput.pop();
-        }
-        directOutputLock.exit();
+        auto channels = (std::min)(buffer->getNumChannels(), link.laneCount());
+        link.processBlock(buffer->getArrayOfReadPointers(), buffer->getArrayOfWritePointers(), channels, bufferSize);
+        for (int ch = channels; ch < buffer->getNumChannels(); ++ch) buffer->clear(ch, 0, bufferSize);
     }
 
-    void releaseResources() override {
-        if (reader) { reader->stopThread(1000); delete reader; reader = nullptr; }
-        delete writer; writer = nullptr;
-    }
+    void releaseResources() override { client = nullptr; }
 
-    Reader* reader{ nullptr }; Writer* writer{ nullptr };
-    std::queue<float> directInput; CriticalSection directInputLock;
-    std::queue<float> directOutput; CriticalSection directOutputLock;
+    std::unique_ptr<Client> client;
+    juce::TextEditor statsPanel;
     juce::Label titleLabel; juce::TextButton dnsButton, httpButton;
-    std::string currentUrl;
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MainContentComponent)
 };
\ No newline at end of file
@@ -1,14 +1,12 @@
 #include "../include/config.h"
-#include "../include/reader.h"
-#include "../include/utils.h"
-#include "../include/writer.h"
-#include "../include/socket.h"
+#include "../include/gateway.h"
+#include "../include/metrics.h"
+#include "../include/trace.h"
 #include <JuceHeader.h>
-#include <queue>
 
 #pragma once
 
-class MainContentComponent : public juce::AudioAppComponent {
+class MainContentComponent : public juce::AudioAppComponent, private juce::Timer {
 public:
     MainContentComponent() {
         titleLabel.setText("Node 2: Gateway", juce::NotificationType::dontSendNotification);
@@ -29,112 +27,45 @@ public:
             };
         addAndMakeVisible(settingsButton);
 
-        setSize(600, 300);
-        setAudioChannels(1, 1);
+        // 链路统计面板，每秒刷新一次
+        statsPanel.setMultiLine(true);
+        statsPanel.setReadOnly(true);
+        statsPanel.setFont(juce::Font(juce::Font::getDefaultMonospacedFontName(), 12.0f, juce::Font::plain));
+        statsPanel.setBounds(20, 200, 560, 380);
+        addAndMakeVisible(statsPanel);
+        Metrics::startReporter();
+        startTimer(METRICS_PERIOD_MS);
+
+        setSize(600, 600);
+        setAudioChannels(GlobalConfig::current()->lanes, GlobalConfig::current()->lanes);
     }
 
-    ~MainContentComponent() override { shutdownAudio(); }
+    ~MainContentComponent() override {
+        stopTimer();
+        shutdownAudio();
+        Trace::dump("trace_node2.bin");
+    }
 
 private:
-    void initThreads() {
-        auto processFunc = [this](FrameType& frame) {
-            socket_t tool;
-            auto conf1 = GlobalConfig().get(Config::NODE1); // 目标是发回给 Node 1
-
-            // --- 逻辑 1: 处理 DNS 请求 ---
-            if (frame.type == Config::DNS_REQ) {
-                fprintf(stderr, "[Gateway] DNS Query Received: %s\n", frame.body.c_str());
-                char ip[100] = { 0 };
-#if defined (_MSC_VER)
-                WSADATA wsaData; WSAStartup(MAKEWORD(2, 2), &wsaData);
-#endif
-                if (tool.hostname_to_ip(frame.body.c_str(), ip) == 0) {
-                    fprintf(stderr, "[Gateway] Resolved: %s -> %s\n", frame.body.c_str(), ip);
-                    FrameType resp{ Config::DNS_RSP, Str2IPType("1234"), 53, std::string(ip) };
-                    writer->send(resp);
-                }
-            }
-            // --- 逻辑 2: 处理 TCP SYN (握手第一步) ---
-            else if (frame.type == Config::TCP_SYN) {
-                fprintf(stderr, "[Gateway] TCP SYN Received (Handshake Part 1): %s\n", frame.body.c_str());
-                // 回复一个 ACK，告诉 Node 1 可以发 HTTP 请求了
-                FrameType ack{ Config::TCP_ACK, Str2IPType("1234"), 80, "ACK:OK" };
-                writer->send(ack);
-                fprintf(stderr, "[Gateway] TCP ACK Sent to Node 1.\n");
-            }
-            // --- 逻辑 3: 处理 HTTP 请求 (抓取网页) ---
-            // Node2/Node.h 里的 HTTP 处理部分
-            else if (frame.type == Config::HTTP_REQ) {
-                fprintf(stderr, "[Gateway] HTTP Request Received for: %s\n", frame.body.c_str());
-
-                char target_ip[100] = { 0 };
-                socket_t tool;
-#if defined (_MSC_VER)
-                WSADATA wsaData; WSAStartup(MAKEWORD(2, 2), &wsaData);
-#endif
-
-                if (tool.hostname_to_ip(frame.body.c_str(), target_ip) == 0) {
-                    tcp_client_t client;
-                    if (client.connect(target_ip, 80) == 0) {
-                        std::string httpRequest = "GET / HTTP/1.1\r\nHost: " + frame.body + "\r\nConnection: close\r\n\r\n";
-                        client.write_all(httpRequest.c_str(), (int)httpRequest.size());
-
-                        char buf[2048] = { 0 }; // 缓冲区开大一点
-                        int bytesRead = client.read_all(buf, 2047);
-
-                        if (bytesRead > 0) {
-                            fprintf(stderr, "[Gateway] Total: %d bytes. Starting segmentation...\n", bytesRead);
-
-                            // --- 关键修改：每 100 字节切一刀 ---
-                            int chunkSize = 100;
-                            for (int i = 0; i < bytesRead; i += chunkSize) {
-                                int currentSize = (std::min)(chunkSize, bytesRead - i);
-                                std::string chunkBody(buf + i, currentSize);
-
-                                // 构造小包发送 (IP强制写死为笔记本的 10.0.0.1，确保它能认出来)
-                                FrameType chunkFrame{ Config::HTTP_RSP, Str2IPType("10.0.0.1"), 80, chunkBody };
-                                writer->send(chunkFrame);
-
-                                fprintf(stderr, "[Gateway] Sent Chunk: %d/%d bytes\n", i + currentSize, bytesRead);
-
-                                // 物理层间隔：发完一段停一下，让笔记本喘口气
-                                std::this_thread::sleep_for(std::chrono::milliseconds(400));
-                            }
-                            fprintf(stderr, "[Gateway] All segments sent successfully.\n");
-                        }
-                    }
-                }
-            }
-            };
-        reader = new Reader(&directInput, &directInputLock, processFunc);
-        reader->startThread();
-        writer = new Writer(&directOutput, &directOutputLock);
+    void timerCallback() override {
+        statsPanel.setText(Metrics::text() + (gateway ? gateway->bondedLink().report() : std::string()), false);
     }
 
-    void prepareToPlay(int, double) override { initThreads(); }
+    void prepareToPlay(int, double sampleRate) override { gateway = std::make_unique<Gateway>(sampleRate); }
 
     void getNextAudioBlock(const juce::AudioSourceChannelInfo& bufferToFill) override {
+        auto &link = gateway->bondedLink();
         auto buffer = bufferToFill.buffer;
         auto bufferSize = buffer->getNumSamples();
-        const float* data = buffer->getReadPointer(0);
-        directInputLock.enter();
-        for (int i = 0; i < bufferSize; ++i) { directInput.push(data[i]); }
-        directInputLock.exit();
-        buffer->clear();
-        float* writePos = buffer->getWritePointer(0);
-        directOutputLock.enter();
-        for (int i = 0; i < bufferSize; ++i) {
-            writePos[i] = directOutput.empty() ? 0.0f : directOutput.front();
-            if (!directOutput.empty()) directOutput.pop();
-        }
-        directOutputLock.exit();
+        auto channels = (std::min)(buffer->getNumChannels(), link.laneCount());
+        link.processBlock(buffer->getArrayOfReadPointers(), buffer->getArrayOfWritePointers(), channels, bufferSize);
+        for (int ch = channels; ch < buffer->getNumChannels(); ++ch) buffer->clear(ch, 0, bufferSize);
     }
 
-    void releaseResources() override { delete reader; delete writer; }
+    void releaseResources() override { gateway = nullptr; }
 
-    Reader* reader{ nullptr }; Writer* writer{ nullptr };
-    std::queue<float> directInput; CriticalSection directInputLock;
-    std::queue<float> directOutput; CriticalSection directOutputLock;
+    std::unique_ptr<Gateway> gateway;
+    juce::TextEditor statsPanel;
     juce::Label titleLabel; juce::TextButton settingsButton;
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MainContentComponent)
 };
\ No newline at end of file
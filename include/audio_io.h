@@ -0,0 +1,80 @@
+#ifndef AUDIO_IO_H
+#define AUDIO_IO_H
+
+#include "passband.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+/* Where the link's samples come from and go to: a sound card, a simulation,
+ * a file. The core only talks to this interface; the JUCE device backend
+ * lives with the apps that link JUCE.
+ */
+class AudioIO {
+public:
+    // one block per call, from the backend's thread; output must be filled completely
+    using Callback = std::function<void(const float *const *input, float *const *output, int channels, int n)>;
+
+    virtual ~AudioIO() = default;
+
+    // false if the backend could not be started
+    virtual bool start(Callback callback) = 0;
+
+    // no callback runs after this returns
+    virtual void stop() = 0;
+
+    [[nodiscard]] virtual double sampleRate() const = 0;
+
+    [[nodiscard]] virtual int channels() const = 0;
+};
+
+constexpr int SIMULATED_BLOCK = 480;// samples per channel and callback, 10 ms at 48 kHz
+
+// no hardware: silence in, output thrown away, at the real-time rate
+class SimulatedAudioIO : public AudioIO {
+public:
+    explicit SimulatedAudioIO(int nChannels, double rate = DEFAULT_SAMPLE_RATE) : numChannels(nChannels), rate(rate) {}
+
+    ~SimulatedAudioIO() override { stop(); }
+
+    bool start(Callback callback) override {
+        stop();
+        running = true;
+        thread = std::thread([this, callback]() {
+            std::vector<float> silence((size_t) SIMULATED_BLOCK * numChannels, 0.0f), output(silence.size());
+            std::vector<const float *> in;
+            std::vector<float *> out;
+            for (int ch = 0; ch < numChannels; ++ch) {
+                in.push_back(silence.data() + ch * SIMULATED_BLOCK);
+                out.push_back(output.data() + ch * SIMULATED_BLOCK);
+            }
+            auto next = std::chrono::steady_clock::now();
+            auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(SIMULATED_BLOCK / rate));
+            while (running) {
+                callback(in.data(), out.data(), numChannels, SIMULATED_BLOCK);
+                next += period;
+                std::this_thread::sleep_until(next);
+            }
+        });
+        return true;
+    }
+
+    void stop() override {
+        running = false;
+        if (thread.joinable()) thread.join();
+    }
+
+    [[nodiscard]] double sampleRate() const override { return rate; }
+
+    [[nodiscard]] int channels() const override { return numChannels; }
+
+private:
+    int numChannels;
+    double rate;
+    std::atomic<bool> running{false};
+    std::thread thread;
+};
+
+#endif//AUDIO_IO_H
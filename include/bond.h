@@ -0,0 +1,548 @@
+#ifndef BOND_H
+#define BOND_H
+
+#include "capture.h"
+#include "config.h"
+#include "executor.h"
+#include "log.h"
+#include "mac.h"
+#include "metrics.h"
+#include "passband.h"
+#include "pool.h"
+#include "reader.h"
+#include "route.h"
+#include "thread.h"
+#include "trace.h"
+#include "utils.h"
+#include "writer.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+using SEQType = unsigned short;
+
+constexpr int LENGTH_SEQ = sizeof(SEQType);
+constexpr int MAX_LENGTH_BONDED_BODY = MAX_LENGTH_BODY - LENGTH_SEQ;
+constexpr int REORDER_WINDOW = 64;             // frames held back waiting for a gap; divides 65536
+constexpr double REORDER_TIMEOUT = 0.5;        // seconds before a gap is given up
+constexpr double REORDER_FLUSH = REORDER_TIMEOUT / 4;// how often held frames are checked while no frame arrives
+constexpr unsigned LANE_HEALTH_MIN_FRAMES = 16;// frames seen before a lane can be judged
+constexpr double LANE_HEALTH_DECAY = 0.97;     // weight of a frame against the one received after it
+constexpr double LANE_MAX_ERROR_RATE = 0.5;
+constexpr double LANE_RESTORE_ERROR_RATE = 0.2;// a dropped lane back below this rejoins the rotation
+constexpr double LANE_PROBATION = 10.0;        // seconds before a dropped lane is tried again anyway
+constexpr size_t LANE_SPARE_BURSTS = 16;       // emptied frame vectors a lane keeps for reuse
+
+/* One audio channel used as an independent link: its own sample queues,
+ * Reader and Writer. Frames to transmit are queued and sent by the lane's
+ * own thread, so all lanes are on the air at the same time.
+ */
+class Lane : public aether::Thread {
+public:
+    struct Burst {
+        std::vector<FrameType> frames;
+        int gapMs = 0;
+        MyTimer queued;
+    };
+
+    Lane(int laneIndex, ProcessorType processFunc, AddressFilter filter, IPType localAddress, double rate, const PassbandConfig *band)
+        : aether::Thread("Lane " + std::to_string(laneIndex)), index(laneIndex), writer(&output, &outputLock), sampleRate(rate) {
+        reader = std::make_unique<Reader>(&input, &inputLock, std::move(processFunc), std::move(filter));
+        if (band) modem = std::make_unique<PassbandModem>(*band);
+        // FDD bands never contend with the peer, so carrier sense is for the shared baseband only
+        else if (LINK_MAC)
+            mac = std::make_unique<Mac>(
+                    *reader,
+                    [this, localAddress](FrameType frame) {
+                        frame.src = localAddress;
+                        writer.send(frame);
+                    },
+                    [this]() { hasPending.signal(); }, localAddress);
+    }
+
+    ~Lane() override {
+        reader->stopThread(1000);
+        stopThread(1000);
+    }
+
+    void start() {
+        reader->startThread();
+        startThread();
+    }
+
+    // a burst whose frame vector was used before, so filling it does not allocate
+    Burst spareBurst() {
+        Burst burst;
+        const aether::ScopedLock lock(pendingLock);
+        if (!spare.empty()) {
+            burst.frames = std::move(spare.back());
+            spare.pop_back();
+        }
+        return burst;
+    }
+
+    void enqueue(Burst burst) {
+        {
+            const aether::ScopedLock lock(pendingLock);
+            pending.push(std::move(burst));
+            txQueue.set((int64_t) pending.size());
+        }
+        hasPending.signal();
+    }
+
+    // contend for the medium once, then send the frames back to back (gapMs apart)
+    void transmit(Burst &burst) {
+        if (mac) {
+            size_t bytes = 0;
+            for (auto &frame: burst.frames) bytes += LENGTH_PREAMBLE + frame.wholeLength() + LENGTH_CRC;
+            double seconds = (double) bytes * 8 * LENGTH_OF_ONE_BIT / sampleRate + burst.gapMs / 1000.0 * (double) burst.frames.size();
+            TRACE_SPAN("mac.acquire", bytes);
+            if (!mac->acquire(bytes, seconds, burst.frames.front().ip)) {
+                LOG(Warn, MAC, "Lane %d: medium busy, %zu frame(s) dropped", index, burst.frames.size());
+                recycle(burst);
+                return;
+            }
+        }
+        for (size_t i = 0; i < burst.frames.size(); ++i) {
+            if (i > 0 && burst.gapMs > 0) aether::Thread::sleep(burst.gapMs);
+            writer.send(burst.frames[i]);
+            ++framesSent;
+            framesTx.add();
+            sendToAir.record((uint64_t) (burst.queued.duration() * 1e6));
+        }
+        recycle(burst);
+    }
+
+    void run() override {
+        while (!threadShouldExit()) {
+            if (!hasPending.wait(100)) continue;
+            if (mac) mac->sendReplies();
+            while (!threadShouldExit()) {
+                Burst burst;
+                {
+                    const aether::ScopedLock lock(pendingLock);
+                    if (pending.empty()) break;
+                    burst = std::move(pending.front());
+                    pending.pop();
+                    txQueue.set((int64_t) pending.size());
+                }
+                transmit(burst);
+            }
+        }
+    }
+
+    // fraction of the recently received frames lost to LEN/CRC errors, as of the last updateErrorRate()
+    [[nodiscard]] double errorRate() const { return recentErrors; }
+
+    /* Folds in what the Reader counted since the last call. Older frames
+     * weigh less and less, so a lane that got better is judged by how it is
+     * now; within one call the order of good and bad frames is unknown.
+     */
+    void updateErrorRate() {
+        auto &s = reader->stats();
+        unsigned bad = s.lengthDiscards + s.crcDiscards, good = s.frames;
+        unsigned newBad = bad - seenBad, newFrames = newBad + good - seenGood;
+        seenBad = bad, seenGood = good;
+        if (newFrames == 0) return;
+        double decay = std::pow(LANE_HEALTH_DECAY, newFrames), added = (1 - decay) / (1 - LANE_HEALTH_DECAY);
+        badWeight = badWeight * decay + added * newBad / newFrames;
+        weight = weight * decay + added;
+        recentErrors = weight < LANE_HEALTH_MIN_FRAMES ? 0.0 : badWeight / weight;
+    }
+
+    // judge the lane from the frames received from now on
+    void forgetErrors() {
+        badWeight = weight = 0;
+        recentErrors = 0.0;
+    }
+
+    const int index;
+    SampleQueue input;
+    aether::CriticalSection inputLock;
+    SampleQueue output;
+    aether::CriticalSection outputLock;
+    std::unique_ptr<Reader> reader;
+    Writer writer;
+    std::unique_ptr<PassbandModem> modem;// null in baseband mode
+    std::unique_ptr<Mac> mac;            // null in passband mode or without LINK_MAC
+    std::atomic<unsigned> framesSent{0};
+    std::atomic<bool> enabled{true};
+    bool onProbation = false;// dropped for its error rate, not by dropLane()
+    MyTimer dropped;
+
+private:
+    // the bodies back to the pool, the emptied vector kept for spareBurst()
+    void recycle(Burst &burst) {
+        for (auto &frame: burst.frames) BodyPool::give(std::move(frame.body));
+        burst.frames.clear();
+        const aether::ScopedLock lock(pendingLock);
+        if (spare.size() < LANE_SPARE_BURSTS) spare.push_back(std::move(burst.frames));
+    }
+
+    Gauge &txQueue = Metrics::gauge("link.tx_queue_lane" + std::to_string(index));
+    Counter &framesTx = Metrics::counter("link.frames_tx");
+    Histogram &sendToAir = Metrics::histogram("link.send_to_air_us");
+    double sampleRate;
+    unsigned seenBad = 0, seenGood = 0;
+    double badWeight = 0, weight = 0;
+    std::atomic<double> recentErrors{0.0};
+    std::queue<Burst> pending;
+    std::vector<std::vector<FrameType>> spare;
+    aether::CriticalSection pendingLock;
+    aether::WaitableEvent hasPending;
+};
+
+/* Link bonding over several audio channels.
+ * With one lane the frames go out unchanged, exactly like with a bare Writer,
+ * but from the lane's thread: send() only queues, so a Reader callback that
+ * sends can return and let the Reader hear the CTS. With more lanes a SEQ is prepended to BODY, frames are striped
+ * round-robin over the enabled lanes and put back in order on receive; a
+ * gap is given up after REORDER_TIMEOUT even if no further frame arrives.
+ * If a PassbandConfig is given every lane runs through a PassbandModem.
+ * If a Router is given, outgoing frames get its address as SRC, the Readers
+ * drop frames for other nodes right after the header, and frames the Router
+ * is a hop for are sent on again instead of being processed.
+ */
+class BondedLink {
+public:
+    BondedLink(int nLanes, ProcessorType processFunc, double sampleRate, const PassbandConfig *band = nullptr, std::shared_ptr<Router> linkRouter = nullptr)
+        : process(std::move(processFunc)), router(std::move(linkRouter)), bitSeconds((band ? PASSBAND_SYMBOL : LENGTH_OF_ONE_BIT) / sampleRate) {
+        AddressFilter filter = nullptr;
+        if (router) filter = [this](const FrameType &header) { return router->accept(header, header.type == Config::MAC_RTS || header.type == Config::MAC_CTS); };
+        IPType local = router ? router->address() : 0;
+        for (int i = 0; i < nLanes; ++i)
+            lanes.push_back(std::make_unique<Lane>(i, [this, i](FrameType &frame) { onFrame(i, frame); }, filter, local, sampleRate, band));
+        if (nLanes > 1) flusher = std::make_unique<Executor>();
+        for (auto &lane: lanes) lane->start();
+    }
+
+    BondedLink(const BondedLink &) = delete;
+
+    // stop the flushes and the lane threads before the reorder state they call into goes away
+    ~BondedLink() {
+        if (flusher) flusher->stop();
+        lanes.clear();
+    }
+
+    [[nodiscard]] int laneCount() const { return (int) lanes.size(); }
+
+    [[nodiscard]] int maxBodyLength() const { return lanes.size() == 1 ? MAX_LENGTH_BODY : MAX_LENGTH_BONDED_BODY; }
+
+    // seconds on air for `bytes` of BODY cut into frames of `perFrame` bytes, without medium access
+    [[nodiscard]] double airtime(size_t bytes, size_t perFrame) const {
+        size_t frames = (bytes + perFrame - 1) / perFrame;
+        size_t overhead = LENGTH_PREAMBLE + LENGTH_HEADER + LENGTH_CRC + (lanes.size() > 1 ? LENGTH_SEQ : 0);
+        return (double) (bytes + frames * overhead) * 8 * bitSeconds / (double) lanes.size();
+    }
+
+    void send(const FrameType &frame) { sendBurst({frame}); }
+
+    /* Frames that belong together, e.g. the chunks of one response. With one
+     * lane they share a single medium reservation and are sent gapMs apart;
+     * with several lanes they are striped like separate frames.
+     */
+    void sendBurst(std::vector<FrameType> frames, int gapMs = 0) {
+        if (router)
+            for (auto &frame: frames)
+                if (frame.src == 0) frame.src = router->address();
+        if (lanes.size() == 1) {
+            lanes[0]->enqueue({std::move(frames), gapMs, {}});
+            return;
+        }
+        std::lock_guard<std::mutex> lock(sendLock);
+        updateHealth();
+        for (auto &frame: frames) {
+            auto body = BodyPool::take(LENGTH_SEQ + frame.body.size());
+            body += inString(nextSendSeq[frame.ip]++);
+            body += frame.body;
+            BodyPool::give(std::move(frame.body));
+            auto &lane = *lanes[nextLane()];
+            auto burst = lane.spareBurst();
+            burst.frames.emplace_back(frame.type, frame.ip, frame.port, std::move(body));
+            burst.frames.back().src = frame.src;
+            lane.enqueue(std::move(burst));
+        }
+    }
+
+    // tee every sample going in and out of the lanes into a capture file
+    void setCapture(std::shared_ptr<SampleCapture> sampleCapture) { capture = std::move(sampleCapture); }
+
+    // samples waiting for the lane's Reader
+    [[nodiscard]] size_t pendingSamples(int lane) const {
+        auto &l = *lanes[lane];
+        l.inputLock.enter();
+        size_t n = l.input.size();
+        l.inputLock.exit();
+        return n;
+    }
+
+    // audio callback side
+    void pushInput(int lane, const float *data, int n) {
+        TRACE_SPAN("audio.input", lane);
+        if (capture) capture->append(lane, CaptureDirection::INPUT, data, n);
+        auto &l = *lanes[lane];
+        if (l.mac) l.mac->feed(data, n);
+        l.inputLock.enter();
+        if (l.modem) l.modem->demodulate(data, n, l.input);
+        else
+            for (int i = 0; i < n; ++i) l.input.push(data[i]);
+        auto backlog = (int64_t) l.input.size();
+        l.inputLock.exit();
+        samplesIn.add((uint64_t) n);
+        inputBacklog.set(backlog);
+    }
+
+    void pullOutput(int lane, float *data, int n) {
+        TRACE_SPAN("audio.output", lane);
+        auto &l = *lanes[lane];
+        l.outputLock.enter();
+        if (l.modem) l.modem->modulate(l.output, data, n);
+        else
+            for (int i = 0; i < n; ++i) {
+                data[i] = l.output.empty() ? 0.0f : l.output.front();
+                if (!l.output.empty()) l.output.pop();
+            }
+        l.outputLock.exit();
+        if (capture) capture->append(lane, CaptureDirection::OUTPUT, data, n);
+    }
+
+    // a whole audio block, e.g. from an AudioIO callback; input and output may be the same buffers
+    void processBlock(const float *const *input, float *const *output, int channels, int n) {
+        channels = (std::min)(channels, laneCount());
+        for (int ch = 0; ch < channels; ++ch) pushInput(ch, input[ch], n);
+        for (int ch = 0; ch < channels; ++ch) pullOutput(ch, output[ch], n);
+    }
+
+    void dropLane(int lane) {
+        std::lock_guard<std::mutex> lock(sendLock);
+        lanes[lane]->enabled = false;
+        lanes[lane]->onProbation = false;
+    }
+
+    void restoreLane(int lane) {
+        std::lock_guard<std::mutex> lock(sendLock);
+        lanes[lane]->enabled = true;
+        lanes[lane]->onProbation = false;
+    }
+
+    // one line per lane: sent/received/discarded frames and state
+    [[nodiscard]] std::string report() {
+        std::lock_guard<std::mutex> lock(sendLock);
+        std::ostringstream out;
+        for (auto &lane: lanes) {
+            lane->updateErrorRate();
+            auto &s = lane->reader->stats();
+            out << "lane " << lane->index << ": sent " << lane->framesSent << ", received " << s.frames << ", recovered " << s.recovered
+                << ", rephased " << s.rephased << ", len err " << s.lengthDiscards << ", crc err " << s.crcDiscards << ", not for us " << s.addressDrops << ", error rate " << lane->errorRate();
+            if (lane->mac) {
+                auto &m = lane->mac->stats();
+                out << ", deferrals " << m.deferrals << ", collisions " << m.collisions << ", mac drops " << m.drops;
+            }
+            out << (lane->enabled ? "" : " [dropped]") << "\n";
+        }
+        return out.str();
+    }
+
+private:
+    /* A lane whose receive side loses most frames is assumed to be just as bad
+     * in the other direction and is taken out of the striping rotation. It
+     * comes back once what it still receives is good again, or after
+     * LANE_PROBATION, when the peer may have stopped sending on it as well.
+     * Called with sendLock held.
+     */
+    void updateHealth() {
+        int healthy = 0;
+        for (auto &lane: lanes) {
+            lane->updateErrorRate();
+            healthy += lane->enabled;
+        }
+        for (auto &lane: lanes) {
+            if (lane->enabled && healthy > 1 && lane->errorRate() > LANE_MAX_ERROR_RATE) {
+                LOG(Warn, LINK, "Lane %d dropped, error rate %.2f", lane->index, lane->errorRate());
+                lane->enabled = false;
+                lane->onProbation = true;
+                lane->dropped.restart();
+                --healthy;
+            } else if (lane->onProbation && (lane->errorRate() < LANE_RESTORE_ERROR_RATE || lane->dropped.duration() > LANE_PROBATION)) {
+                LOG(Info, LINK, "Lane %d restored, error rate %.2f", lane->index, lane->errorRate());
+                if (lane->errorRate() >= LANE_RESTORE_ERROR_RATE) lane->forgetErrors();
+                lane->enabled = true;
+                lane->onProbation = false;
+                ++healthy;
+            }
+        }
+    }
+
+    int nextLane() {
+        for (size_t tried = 0; tried < lanes.size(); ++tried) {
+            roundRobin = (roundRobin + 1) % lanes.size();
+            if (lanes[roundRobin]->enabled) return (int) roundRobin;
+        }
+        return (int) roundRobin;// all dropped: keep trying anyway
+    }
+
+    void onFrame(int lane, FrameType &frame) {
+        // RTS/CTS are per lane and never striped; handle them before anything can block
+        if (lanes[lane]->mac && lanes[lane]->mac->onControl(frame)) return;
+        if (router && !router->isLocal(frame.ip)) {
+            // we are a hop on the way: pass it on unchanged (SEQ included)
+            if (router->shouldForward(frame)) {
+                auto burst = lanes[lane]->spareBurst();
+                burst.frames.push_back(std::move(frame));// the body goes with it, back to the pool once sent
+                lanes[lane]->enqueue(std::move(burst));
+            }
+            return;
+        }
+        std::lock_guard<std::mutex> lock(reorderLock);
+        if (lanes.size() == 1) {
+            deliverUp(frame);
+            return;
+        }
+        if (frame.body.size() < LENGTH_SEQ) return;
+        TRACE_INSTANT("link.reorder", frame.src);
+        SEQType seq;
+        std::copy(frame.body.begin(), frame.body.begin() + LENGTH_SEQ, (char *) &seq);
+        frame.body.erase(0, LENGTH_SEQ);
+        frame.len = (LENType) frame.body.size();
+
+        // every source numbers its frames on its own
+        auto &peer = peers[frame.src];
+        auto distance = (short) (SEQType) (seq - peer.expectedSeq);
+        if (!peer.synced || distance < -REORDER_WINDOW || distance >= 4 * REORDER_WINDOW) {
+            // first frame or the peer restarted its numbering. That starts at 0, and the frames
+            // before this one may still be on a slower lane: wait for them rather than skip them
+            for (auto &slot: peer.slots)
+                if (slot.used) release(peer, slot);
+            peer.expectedSeq = seq < REORDER_WINDOW ? 0 : seq;
+            peer.synced = true;
+            distance = (short) (SEQType) (seq - peer.expectedSeq);
+        } else if (distance < 0) {
+            return;// late duplicate of something already delivered or skipped
+        }
+        // too far ahead for the window: the gaps in front are given up
+        for (; distance >= REORDER_WINDOW; --distance) advance(peer);
+        auto &slot = peer.slots[seq % REORDER_WINDOW];
+        if (slot.used) return;// duplicate
+        slot.used = true;
+        slot.frame = std::move(frame);// with its pooled body, given back after delivery
+        slot.since.restart();
+        ++peer.held;
+        deliver(peer);
+        if (peer.held > 0 && !flushing) {
+            flushing = true;
+            flusher->after(REORDER_FLUSH, [this]() { flush(); });
+        }
+    }
+
+    // flusher thread: frames held behind a gap go up once it timed out, also when nothing else arrives
+    void flush() {
+        std::lock_guard<std::mutex> lock(reorderLock);
+        bool held = false;
+        for (auto &[src, peer]: peers) {
+            deliver(peer);
+            held = held || peer.held > 0;
+        }
+        flushing = held;
+        if (held) flusher->after(REORDER_FLUSH, [this]() { flush(); });
+    }
+
+    struct Held {
+        bool used = false;
+        FrameType frame;
+        MyTimer since;
+    };
+
+    // frames of one source by SEQ modulo REORDER_WINDOW, so holding one back allocates nothing
+    struct Reorder {
+        std::array<Held, REORDER_WINDOW> slots;
+        int held = 0;
+        SEQType expectedSeq = 0;
+        bool synced = false;
+    };
+
+    void release(Reorder &peer, Held &slot) {
+        BodyPool::give(std::move(slot.frame.body));
+        slot.used = false;
+        --peer.held;
+    }
+
+    // past expectedSeq: deliver what is there, or skip the gap
+    void advance(Reorder &peer) {
+        auto &slot = peer.slots[peer.expectedSeq % REORDER_WINDOW];
+        if (slot.used) {
+            deliverUp(slot.frame);
+            release(peer, slot);
+        }
+        ++peer.expectedSeq;
+    }
+
+    void deliver(Reorder &peer) {
+        while (peer.held > 0) {
+            if (peer.slots[peer.expectedSeq % REORDER_WINDOW].used) {
+                advance(peer);
+                continue;
+            }
+            // gap: give up on it once something behind it waited too long
+            bool stale = false;
+            for (auto &slot: peer.slots) stale = stale || (slot.used && slot.since.duration() > REORDER_TIMEOUT);
+            if (!stale) break;
+            ++peer.expectedSeq;
+        }
+    }
+
+    // every frame handed to the upper layer goes through here
+    void deliverUp(FrameType &frame) {
+        framesDelivered.add();
+        goodput.add(frame.body.size());
+        if (frame.type == Config::ICMP_ECHO) {// answered right here, without waiting for the node's handlers
+            echoReplies.add();
+            std::vector<FrameType> reply;
+            reply.emplace_back(Config::ICMP_REPLY, frame.src, frame.port, std::move(frame.body));// the echo's buffer, no copy
+            sendBurst(std::move(reply));
+            return;
+        }
+        process(frame);
+    }
+
+    Counter &samplesIn = Metrics::counter("phy.samples_in");
+    Gauge &inputBacklog = Metrics::gauge("phy.input_backlog");
+    Counter &framesDelivered = Metrics::counter("link.frames_delivered");
+    Counter &echoReplies = Metrics::counter("link.echo_replies");
+    Counter &goodput = Metrics::counter("link.goodput_bytes");
+    ProcessorType process;
+    std::shared_ptr<Router> router;
+    std::shared_ptr<SampleCapture> capture;
+    double bitSeconds;
+    std::vector<std::unique_ptr<Lane>> lanes;
+    std::mutex sendLock;
+    size_t roundRobin = 0;
+    std::map<IPType, SEQType> nextSendSeq;// per destination
+    std::mutex reorderLock;
+    std::map<IPType, Reorder> peers;     // per source
+    bool flushing = false;               // a flush is scheduled
+    std::unique_ptr<Executor> flusher;   // with more than one lane
+};
+
+// the link of one node as config.txt describes it: lanes, band, routes and capture
+inline std::unique_ptr<BondedLink> makeNodeLink(Config::Node node, ProcessorType processFunc, double sampleRate) {
+    auto config = GlobalConfig::current();
+    PassbandConfig band = node == Config::NODE1 ? PassbandConfig{config->carrier1, config->carrier2, sampleRate} : PassbandConfig{config->carrier2, config->carrier1, sampleRate};
+    auto router = std::make_shared<Router>(Str2IPType(config->get(node).ip), config->routingTable());
+    // config.txt is checked against DEFAULT_SAMPLE_RATE, the sound card may run slower
+    bool passband = config->passband && std::max(config->carrier1, config->carrier2) < sampleRate / 2;
+    if (config->passband && !passband) LOG(Error, PHY, "Carriers must be below %.0f Hz at this sample rate, using baseband", sampleRate / 2);
+    auto link = std::make_unique<BondedLink>(config->lanes, std::move(processFunc), sampleRate, passband ? &band : nullptr, router);
+    if (!config->capture.empty()) {
+        auto capture = std::make_shared<SampleCapture>();
+        if (capture->open(config->capture, config->lanes, sampleRate, config->captureBytes)) link->setCapture(capture);
+    }
+    return link;
+}
+
+#endif//BOND_H
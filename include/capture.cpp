@@ -0,0 +1,195 @@
+#include "capture.h"
+#include "log.h"
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+
+bool MappedFile::openRead(const std::string &path) {
+    close();
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return file = nullptr, false;
+    LARGE_INTEGER size;
+    GetFileSizeEx(file, &size);
+    length = (size_t) size.QuadPart;
+    return map(false);
+}
+
+bool MappedFile::create(const std::string &path, size_t size) {
+    close();
+    file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return file = nullptr, false;
+    return resize(size);
+}
+
+bool MappedFile::openWrite(const std::string &path, size_t size) {
+    close();
+    file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return file = nullptr, false;
+    return resize(size);
+}
+
+void MappedFile::flush() {
+    if (base) FlushViewOfFile(base, 0);
+    if (file) FlushFileBuffers(file);
+}
+
+bool MappedFile::resize(size_t size) {
+    unmap();
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG) size;
+    if (!SetFilePointerEx(file, end, nullptr, FILE_BEGIN) || !SetEndOfFile(file)) return false;
+    length = size;
+    return map(true);
+}
+
+bool MappedFile::map(bool write) {
+    if (length == 0) return true;
+    mapping = CreateFileMappingA(file, nullptr, write ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) return false;
+    base = (char *) MapViewOfFile(mapping, write ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, length);
+    return base != nullptr;
+}
+
+void MappedFile::unmap() {
+    if (base) UnmapViewOfFile(base);
+    if (mapping) CloseHandle(mapping);
+    base = nullptr, mapping = nullptr;
+}
+
+void MappedFile::close() {
+    unmap();
+    if (file) CloseHandle(file);
+    file = nullptr, length = 0;
+}
+
+#else
+
+bool MappedFile::openRead(const std::string &path) {
+    close();
+    fd = ::open(path.c_str(), O_RDONLY);
+    struct stat info {};
+    if (fd < 0 || fstat(fd, &info) != 0) return false;
+    length = (size_t) info.st_size;
+    return map(false);
+}
+
+bool MappedFile::create(const std::string &path, size_t size) {
+    close();
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    return resize(size);
+}
+
+bool MappedFile::openWrite(const std::string &path, size_t size) {
+    close();
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return false;
+#if defined(__linux__)
+    // the blocks are taken now: a write into the mapping beyond what the disk holds would be SIGBUS
+    if (size && posix_fallocate(fd, 0, (off_t) size) != 0) return close(), false;
+#endif
+    return resize(size);
+}
+
+void MappedFile::flush() {
+    if (base) msync(base, length, MS_SYNC);
+}
+
+bool MappedFile::resize(size_t size) {
+    unmap();
+    if (ftruncate(fd, (off_t) size) != 0) return false;
+    length = size;
+    return map(true);
+}
+
+bool MappedFile::map(bool write) {
+    if (length == 0) return true;
+    void *p = mmap(nullptr, length, write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) return false;
+    base = (char *) p;
+    // replay walks the file front to back
+    if (!write) madvise(base, length, MADV_SEQUENTIAL);
+    return true;
+}
+
+void MappedFile::unmap() {
+    if (base) munmap(base, length);
+    base = nullptr;
+}
+
+void MappedFile::close() {
+    unmap();
+    if (fd >= 0) ::close(fd);
+    fd = -1, length = 0;
+}
+
+#endif
+
+bool SampleCapture::open(const std::string &path, int lanes, double sampleRate, size_t capacity) {
+    close();
+    std::lock_guard<std::mutex> guard(lock);
+    if (!file.create(path, std::max(capacity, sizeof(CaptureHeader)))) {
+        LOG(Error, PHY, "Cannot create capture file %s", path.c_str());
+        file.close();
+        return false;
+    }
+    CaptureHeader header{};
+    std::copy(CAPTURE_MAGIC, CAPTURE_MAGIC + sizeof(CAPTURE_MAGIC), header.magic);
+    header.lanes = (uint32_t) lanes;
+    header.sampleRate = sampleRate;
+    header.startUnixNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    memcpy(file.data(), &header, sizeof(header));
+    used = sizeof(header);
+    full = false;
+    startNs = Trace::nanoseconds();
+    recording = true;
+    LOG(Info, PHY, "Capturing samples to %s", path.c_str());
+    return true;
+}
+
+void SampleCapture::append(int lane, CaptureDirection direction, const float *data, int n) {
+    if (n <= 0 || !recording) return;
+    ++writing;
+    if (recording) {// not closed in between
+        size_t bytes = sizeof(CaptureBlock) + (size_t) n * sizeof(float);
+        size_t at = used.load(std::memory_order_relaxed);
+        while (at + bytes <= file.size() && !used.compare_exchange_weak(at, at + bytes, std::memory_order_relaxed));
+        if (at + bytes <= file.size()) {
+            CaptureBlock block{Trace::nanoseconds() - startNs, (uint32_t) n, (uint16_t) lane, direction, 0};
+            memcpy(file.data() + at, &block, sizeof(block));
+            memcpy(file.data() + at + sizeof(block), data, (size_t) n * sizeof(float));
+        } else if (!full.exchange(true)) {
+            LOG(Warn, PHY, "Capture file full, later samples are not recorded");
+        }
+    }
+    --writing;
+}
+
+void SampleCapture::close() {
+    std::lock_guard<std::mutex> guard(lock);
+    recording = false;
+    while (writing > 0) std::this_thread::yield();
+    if (file.data()) file.resize(used);
+    file.close();
+}
+
+bool CaptureFile::open(const std::string &path) {
+    if (!file.openRead(path) || file.size() < sizeof(CaptureHeader) || memcmp(file.data(), CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0) {
+        file.close();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,132 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+constexpr char CAPTURE_MAGIC[8] = {'A', 'E', 'C', 'A', 'P', 'T', 'R', '1'};
+
+enum class CaptureDirection : uint8_t { INPUT = 0, OUTPUT = 1 };
+
+/* Sample file layout (native byte order):
+ * CaptureHeader, then blocks of {CaptureBlock, float samples[count]},
+ * one block per pushInput()/pullOutput() call.
+ */
+struct CaptureHeader {
+    char magic[8];
+    uint32_t lanes;
+    uint32_t reserved;
+    double sampleRate;
+    int64_t startUnixNs;// wall clock when the capture was opened
+};
+static_assert(sizeof(CaptureHeader) == 32, "CaptureHeader is written to disk as is");
+
+struct CaptureBlock {
+    uint64_t ns;// since the capture was opened (steady clock)
+    uint32_t count;
+    uint16_t lane;
+    CaptureDirection direction;
+    uint8_t reserved;
+};
+static_assert(sizeof(CaptureBlock) == 16, "CaptureBlock is written to disk as is");
+
+// a file mapped into memory, read-only or writable and growable
+class MappedFile {
+public:
+    MappedFile() = default;
+
+    MappedFile(const MappedFile &) = delete;
+
+    ~MappedFile() { close(); }
+
+    // map an existing file read-only
+    bool openRead(const std::string &path);
+
+    // create (truncate) a file of the given size and map it writable
+    bool create(const std::string &path, size_t size);
+
+    // like create(), but what the file already holds is kept; false if the disk cannot hold size bytes
+    bool openWrite(const std::string &path, size_t size);
+
+    // grow or shrink a writable mapping; data() may move
+    bool resize(size_t size);
+
+    // written pages to disk
+    void flush();
+
+    void close();
+
+    [[nodiscard]] char *data() const { return base; }
+
+    [[nodiscard]] size_t size() const { return length; }
+
+private:
+    bool map(bool writable);
+
+    void unmap();
+
+    char *base = nullptr;
+    size_t length = 0;
+#if defined(_WIN32)
+    void *file = nullptr;// HANDLE
+    void *mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+};
+
+/* Tee of the sample streams into a mapped file. The file is created at its
+ * full size (sparse where the file system allows) and never grows, so
+ * append(), called from the audio callbacks, takes no lock and makes no
+ * system call: it claims its space with a compare-and-swap and copies.
+ * Blocks that do not fit any more are dropped.
+ */
+class SampleCapture {
+public:
+    bool open(const std::string &path, int lanes, double sampleRate, size_t capacity);
+
+    void append(int lane, CaptureDirection direction, const float *data, int n);
+
+    // cut the file to what was written
+    void close();
+
+    ~SampleCapture() { close(); }
+
+private:
+    std::mutex lock;// open() vs. close()
+    MappedFile file;
+    std::atomic<bool> recording{false};
+    std::atomic<int> writing{0};// append() calls copying into the mapping
+    std::atomic<size_t> used{0};
+    std::atomic<bool> full{false};
+    uint64_t startNs = 0;
+};
+
+// zero-copy reader: the samples handed out point into the mapping
+class CaptureFile {
+public:
+    bool open(const std::string &path);
+
+    [[nodiscard]] const CaptureHeader &header() const { return *(const CaptureHeader *) file.data(); }
+
+    // visit(const CaptureBlock &, const float *samples) for every complete block, in file order
+    template<class Visitor>
+    void forEach(Visitor &&visit) const {
+        size_t offset = sizeof(CaptureHeader);
+        while (offset + sizeof(CaptureBlock) <= file.size()) {
+            auto &block = *(const CaptureBlock *) (file.data() + offset);
+            size_t bytes = sizeof(CaptureBlock) + (size_t) block.count * sizeof(float);
+            if (block.count == 0 || offset + bytes > file.size()) break;// end of data or torn tail
+            visit(block, (const float *) (file.data() + offset + sizeof(CaptureBlock)));
+            offset += bytes;
+        }
+    }
+
+private:
+    MappedFile file;
+};
+
+#endif//CAPTURE_H
@@ -0,0 +1,358 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include "bond.h"
+#include "compress.h"
+#include "config.h"
+#include "dedup.h"
+#include "executor.h"
+#include "http.h"
+#include "log.h"
+#include "ping.h"
+#include "proxy.h"
+#include "reassembly.h"
+#include "trace.h"
+#include "transfer.h"
+#include "tunnel.h"
+#include "utils.h"
+#include <atomic>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+
+enum class RequestStatus { OK, FAILED, INCOMPLETE, TIMEOUT, CANCELLED };
+
+inline const char *statusName(RequestStatus status) {
+    switch (status) {
+        case RequestStatus::OK: return "ok";
+        case RequestStatus::FAILED: return "failed";
+        case RequestStatus::INCOMPLETE: return "incomplete";
+        case RequestStatus::TIMEOUT: return "timeout";
+        case RequestStatus::CANCELLED: return "cancelled";
+    }
+    return "unknown";
+}
+
+struct RequestOptions {
+    double attemptTimeout = 5.0;// seconds without an answer before a step is sent again
+    int retries = 3;            // sends of a step after the first
+    double deadline = 0.0;      // seconds for the whole request, 0: none
+};
+
+struct DnsReply {
+    RequestId id = 0;
+    RequestStatus status = RequestStatus::OK;
+    std::string ip;// FAILED: the gateway could not resolve the name
+};
+
+struct HttpReply {
+    RequestId id = 0;
+    RequestStatus status = RequestStatus::OK;
+    Reassembler::Result result;// what arrived; INCOMPLETE: the response stalled
+};
+
+// a request in flight: its number, for cancel(), and the reply to come
+template<class Reply>
+struct Call {
+    RequestId id;
+    std::future<Reply> reply;
+};
+
+/* Node1 without the GUI: sends DNS lookups and page requests to the gateway
+ * and hands the answers to the callbacks or futures.
+ * With PROXY set it also tunnels local applications' connections.
+ * Chunks of deduplicated responses are kept in CHUNK_DIR, within CACHE.
+ *
+ * Every request gets a number that goes out in PORT and comes back in the
+ * gateway's answers, so any number of them can be in flight at once. Their
+ * state lives on the executor thread: Reader callbacks only post what
+ * arrived, retries and deadlines are delayed tasks. A step that stays
+ * unanswered is sent again up to `retries` times, except an HTTP_REQ the
+ * gateway acknowledged: its response then gets HTTP_ACCEPTED_TIMEOUT to
+ * start. Once a response is coming in, the Reassembler decides whether it
+ * stalled. Completion
+ * callbacks run on the executor thread too.
+ */
+class Client {
+public:
+    struct Callbacks {
+        std::function<void(const std::string &ip)> dnsResult;
+        std::function<void(const Reassembler::Result &)> httpDone;// once per response
+    };
+
+    Client(double sampleRate, Callbacks handlers)
+        : callbacks(std::move(handlers)), chunks(GlobalConfig::current()->cacheBytes, GlobalConfig::current()->cacheBytes ? GlobalConfig::current()->chunkDir : ""),
+          responses([this](const Reassembler::Result &result) { executor.post([this, result]() { responseDone(result); }); }, &chunks,
+                    [this](const std::vector<Fingerprint> &fps) { requestChunks(fps); }) {
+        link = makeNodeLink(Config::NODE1, [this](FrameType &frame) { process(frame); }, sampleRate);
+        tunnel.attach(*link);
+        pinger.attach(*link);
+        transfers.attach(*link);
+        auto config = GlobalConfig::current();
+        if (config->proxyPort > 0)
+            proxy = std::make_unique<ProxyServer>((unsigned short) config->proxyPort, tunnel, Str2IPType(config->get(Config::NODE2).ip));
+    }
+
+    Client(const Client &) = delete;
+
+    // tunnelled connections still send, so they end before the link does;
+    // requests still in flight are cancelled
+    ~Client() {
+        executor.stop();
+        for (auto &[id, request]: pending) {
+            if (request.kind == Pending::DNS) request.dns.set_value(DnsReply{id, RequestStatus::CANCELLED, ""});
+            else
+                request.http.set_value(HttpReply{id, RequestStatus::CANCELLED, emptyResult(id, request.path)});
+        }
+        tunnel.shutdown();
+        transfers.shutdown();
+        proxy = nullptr;
+    }
+
+    [[nodiscard]] BondedLink &bondedLink() { return *link; }
+
+    // echoes to the gateway; blocks until done
+    std::vector<PingStats> ping(PingOptions options) {
+        options.target = Str2IPType(GlobalConfig::current()->get(Config::NODE2).ip);
+        return pinger.run(options);
+    }
+
+    // the file to the gateway's INBOX; blocks until it was verified there or the gateway gave up
+    FileTransfer::Result sendFile(const std::string &path) { return transfers.send(Str2IPType(GlobalConfig::current()->get(Config::NODE2).ip), path); }
+
+    // report responses that stalled; call periodically
+    void poll() { responses.poll(); }
+
+    Call<DnsReply> resolve(const std::string &domain, RequestOptions options = {}, std::function<void(const DnsReply &)> then = nullptr) {
+        Pending request;
+        request.kind = Pending::DNS;
+        request.stage = Pending::QUERY;
+        request.target = domain;
+        request.options = options;
+        request.dnsThen = std::move(then);
+        Call<DnsReply> call{newId(), request.dns.get_future()};
+        start(call.id, std::move(request));
+        return call;
+    }
+
+    // SYN first; the request itself goes out when the gateway's ACK arrives.
+    // The url is host[:port][/path], "http://" may be in front. The body of
+    // the response is streamed to the file as it comes in ("-" for stdout).
+    Call<HttpReply> request(const std::string &method, const std::string &url, const std::string &path = "-", RequestOptions options = {},
+                            std::function<void(const HttpReply &)> then = nullptr) {
+        Pending request;
+        request.kind = Pending::HTTP;
+        request.stage = Pending::SYN;
+        request.target = method + " " + url;
+        request.path = path;
+        request.options = options;
+        request.httpThen = std::move(then);
+        Call<HttpReply> call{newId(), request.http.get_future()};
+        start(call.id, std::move(request));
+        return call;
+    }
+
+    Call<HttpReply> get(const std::string &url, const std::string &path = "-", RequestOptions options = {},
+                        std::function<void(const HttpReply &)> then = nullptr) {
+        return request("GET", url, path, options, std::move(then));
+    }
+
+    // the reply becomes CANCELLED unless it is already there
+    void cancel(RequestId id) {
+        executor.post([this, id]() { finish(id, RequestStatus::CANCELLED); });
+    }
+
+    // callback style: the answer goes to Callbacks::dnsResult
+    void dnsLookup(const std::string &domain) {
+        resolve(domain, {}, [this](const DnsReply &reply) {
+            if (reply.status == RequestStatus::OK && callbacks.dnsResult) callbacks.dnsResult(reply.ip);
+        });
+    }
+
+    // callback style: the result goes to Callbacks::httpDone
+    void httpGet(const std::string &url, const std::string &path = "-") { httpRequest("GET", url, path); }
+
+    void httpRequest(const std::string &method, const std::string &url, const std::string &path = "-") {
+        request(method, url, path, {}, [this](const HttpReply &reply) {
+            if (callbacks.httpDone) callbacks.httpDone(reply.result);
+        });
+    }
+
+private:
+    struct Pending {
+        enum Kind { DNS, HTTP } kind = DNS;
+        enum Stage { QUERY, SYN, REQUEST } stage = QUERY;// DNS: QUERY; HTTP: SYN, then REQUEST
+        std::string target;                             // the domain, or "METHOD url"
+        std::string path;
+        RequestOptions options;
+        int attempt = 0;  // sends of the current step
+        unsigned sent = 0;// sends of any step and HTTP_ACK, tells a retry timer whether it is stale
+        bool accepted = false;// HTTP_ACK arrived: the HTTP_REQ is not sent again
+        std::promise<DnsReply> dns;
+        std::function<void(const DnsReply &)> dnsThen;
+        std::promise<HttpReply> http;
+        std::function<void(const HttpReply &)> httpThen;
+    };
+
+    RequestId newId() {
+        RequestId id = nextId++;
+        return id ? id : nextId++;// 0 is what old peers answer with
+    }
+
+    // from any thread
+    void start(RequestId id, Pending request) {
+        auto shared = std::make_shared<Pending>(std::move(request));
+        executor.post([this, id, shared]() {
+            auto &request = pending.emplace(id, std::move(*shared)).first->second;
+            if (request.options.deadline > 0) executor.after(request.options.deadline, [this, id]() { finish(id, RequestStatus::TIMEOUT); });
+            requestsStarted.add();
+            send(id, request);
+        });
+    }
+
+    // executor thread from here on
+    void send(RequestId id, Pending &request) {
+        auto gateway = Str2IPType(GlobalConfig::current()->get(Config::NODE2).ip);
+        ++request.attempt;
+        unsigned sent = ++request.sent;
+        double wait = request.options.attemptTimeout;
+        if (request.stage == Pending::QUERY) {
+            FrameType frame{Config::DNS_REQ, gateway, id, request.target};
+            std::string packed;
+            if (GlobalConfig::current()->compress && lzCompress(request.target, packed)) frame = FrameType{Config::DNS_REQ | TYPE_COMPRESSED, gateway, id, packed};
+            TRACE_INSTANT("client.dns_request");
+            link->send(frame);
+            LOG(Info, CLIENT, "[Sent] DNS Request %u for %s sent.", id, request.target.c_str());
+        } else if (request.stage == Pending::SYN) {
+            TRACE_INSTANT("client.http_request");
+            link->send(FrameType{Config::TCP_SYN, gateway, id, "SEQ:0x12345678"});
+            LOG(Info, CLIENT, "[TCP] SYN %u Sent for %s", id, request.target.c_str());
+        } else {
+            responses.expect(id, request.path);
+            link->send(FrameType{Config::HTTP_REQ, gateway, id, request.target});
+            wait += HTTP_READ_TIMEOUT_MS / 1000.0;// the gateway may wait that long for upstream before answering
+        }
+        if (request.attempt > 1) retries.add();
+        executor.after(wait, [this, id, sent]() { retry(id, sent); });
+    }
+
+    void retry(RequestId id, unsigned sent) {
+        auto it = pending.find(id);
+        if (it == pending.end() || it->second.sent != sent) return;// answered, or a later step is under way
+        auto &request = it->second;
+        if (request.stage == Pending::REQUEST && responses.started(id)) return;// the Reassembler reports it
+        if (request.accepted || request.attempt > request.options.retries) finish(id, RequestStatus::TIMEOUT);
+        else
+            send(id, request);
+    }
+
+    void dnsAnswer(RequestId id, const std::string &ip) {
+        auto it = pending.find(id);
+        if (it == pending.end() || it->second.kind != Pending::DNS) return;
+        LOG(Info, CLIENT, "[DNS Result] %u Resolved IP: %s", id, ip.empty() ? "(none)" : ip.c_str());
+        finish(id, ip.empty() ? RequestStatus::FAILED : RequestStatus::OK, ip);
+    }
+
+    void acknowledged(RequestId id) {
+        auto it = pending.find(id);
+        if (it == pending.end() || it->second.stage != Pending::SYN) return;// a duplicate ACK
+        it->second.stage = Pending::REQUEST;
+        it->second.attempt = 0;
+        send(id, it->second);
+    }
+
+    void accepted(RequestId id) {
+        auto it = pending.find(id);
+        if (it == pending.end() || it->second.stage != Pending::REQUEST || it->second.accepted) return;// a duplicate HTTP_ACK
+        it->second.accepted = true;
+        unsigned sent = ++it->second.sent;// the HTTP_REQ's retry timer is stale now
+        executor.after(HTTP_ACCEPTED_TIMEOUT, [this, id, sent]() { retry(id, sent); });
+    }
+
+    void responseDone(const Reassembler::Result &result) {
+        LOG(Info, CLIENT, "[HTTP] Response %u (stream %u) %s: status %u %s, %zu bytes to %s (%zu of %zu on air)", result.request, result.stream,
+            result.complete ? "complete" : "incomplete", result.envelope.status, result.envelope.get(HttpEnvelope::CONTENT_TYPE).c_str(), result.bytes,
+            result.path.c_str(), result.received, result.total);
+        finish(result.request, result.complete ? RequestStatus::OK : RequestStatus::INCOMPLETE, "", &result);
+    }
+
+    void finish(RequestId id, RequestStatus status, const std::string &ip = "", const Reassembler::Result *result = nullptr) {
+        auto it = pending.find(id);
+        if (it == pending.end()) return;
+        Pending request = std::move(it->second);
+        pending.erase(it);
+        if (status == RequestStatus::TIMEOUT || status == RequestStatus::CANCELLED) {
+            LOG(Warn, CLIENT, "Request %u for %s: %s", id, request.target.c_str(), statusName(status));
+            if (request.kind == Pending::HTTP) responses.forget(id);
+        }
+        if (request.kind == Pending::DNS) {
+            DnsReply reply{id, status, ip};
+            request.dns.set_value(reply);
+            if (request.dnsThen) request.dnsThen(reply);
+        } else {
+            HttpReply reply{id, status, result ? *result : emptyResult(id, request.path)};
+            request.http.set_value(reply);
+            if (request.httpThen) request.httpThen(reply);
+        }
+    }
+
+    static Reassembler::Result emptyResult(RequestId id, const std::string &path) { return {id, 0, path, 0, 0, 0, false, HttpEnvelope()}; }
+
+    // Reader threads: hand what arrived to the executor
+    void process(FrameType &frame) {
+        if (frame.type & TYPE_COMPRESSED) {
+            if (!lzExpand(frame.body, frame.body)) return;
+            frame.type &= ~TYPE_COMPRESSED;
+        }
+        TRACE_SPAN("client.process", frame.type);
+        RequestId id = frame.port;
+        if (frame.type == Config::DNS_RSP) {
+            executor.post([this, id, ip = frame.body]() { dnsAnswer(id, ip); });
+        } else if (frame.type == Config::TCP_ACK) {
+            executor.post([this, id]() { acknowledged(id); });
+        } else if (frame.type == Config::HTTP_ACK) {
+            executor.post([this, id]() { accepted(id); });
+        } else if (frame.type == Config::HTTP_RSP) {
+            responses.add(frame.body, id);
+        } else if (frame.type == Config::CHUNK_RSP) {
+            responses.addChunk(frame.body);
+        } else if (frame.type == Config::ICMP_REPLY) {
+            pinger.onReply(frame);
+        } else if (frame.type >= Config::FILE_OFFER && frame.type <= Config::FILE_DONE) {
+            transfers.onFrame(frame);
+        } else if (frame.type >= Config::TUNNEL_OPEN && frame.type <= Config::TUNNEL_RESET) {
+            tunnel.onFrame(frame);
+        }
+    }
+
+    // chunks a response refers to but the store does not have
+    void requestChunks(const std::vector<Fingerprint> &fps) {
+        auto conf2 = GlobalConfig::current()->get(Config::NODE2);
+        size_t perFrame = (std::max)(1, link->maxBodyLength() / LENGTH_FINGERPRINT);
+        for (size_t i = 0; i < fps.size(); i += perFrame) {
+            std::string body;
+            for (size_t j = i; j < fps.size() && j < i + perFrame; ++j) body += inString(fps[j]);
+            FrameType frame{Config::CHUNK_REQ, Str2IPType(conf2.ip), 80, body};
+            link->send(frame);
+        }
+        LOG(Info, CLIENT, "[HTTP] Asked for %zu missing chunks", fps.size());
+    }
+
+    Callbacks callbacks;
+    ChunkStore chunks;
+    Reassembler responses;
+    Tunnel tunnel;
+    Pinger pinger;
+    FileTransfer transfers;
+    Executor executor;// stopped first, so it never sees the link go
+    std::unique_ptr<BondedLink> link;
+    std::unique_ptr<ProxyServer> proxy;
+    std::atomic<RequestId> nextId{1};
+    std::map<RequestId, Pending> pending;// executor thread only
+    Counter &requestsStarted = Metrics::counter("client.requests");
+    Counter &retries = Metrics::counter("client.retries");
+};
+
+#endif//CLIENT_H
@@ -0,0 +1,191 @@
+#include "compress.h"
+#include "varint.h"
+#include <cstring>
+
+constexpr int LZ_HASH_BITS = 12;
+constexpr size_t LZ_MIN_MATCH = 4;
+
+/* Text that starts most pages and their envelopes, most common last so
+ * that it is closest to the data. Both nodes must be built with the same
+ * dictionary: changing it breaks compressed streams between versions.
+ */
+static const char LZ_DICTIONARY[] =
+        "application/json; charset=utf-8application/javascriptapplication/xmlimage/pngimage/jpegimage/svg+xmlimage/gifimage/x-icon"
+        "text/css; charset=utf-8text/plain; charset=utf-8text/html; charset=UTF-8text/html; charset=iso-8859-1"
+        "max-age=0, no-cache, no-store, must-revalidatepublic, max-age=3600private, max-age=0Thu, Fri, Sat, Sun, Mon, Tue, Wed,"
+        " Jan 2025 Feb 2025 Mar 2025 Apr 2025 May 2025 Jun 2025 Jul 2025 Aug 2025 Sep 2025 Oct 2025 Nov 2025 Dec 2025 GMT"
+        "https://www.http://www..com/.org/.net/.edu.cn/index.html"
+        "<!-- --><![CDATA[ ]]>&nbsp;&amp;&lt;&gt;&quot;&copy;"
+        "<table><tr><td></td></tr></table><form action=\"\" method=\"post\"><input type=\"hidden\" name=\"\" value=\"\" />"
+        "<select><option value=\"\"></option></select><textarea></textarea><button type=\"submit\"></button><label for=\"\"></label>"
+        "<ul><li><a href=\"/\"></a></li></ul><ol></ol><h1></h1><h2></h2><h3></h3><h4></h4><strong></strong><em></em><br /><hr />"
+        "<img src=\"\" alt=\"\" width=\"\" height=\"\" /><span class=\"\"></span><p class=\"\"></p><nav></nav><footer></footer><header></header>"
+        "<script type=\"text/javascript\" src=\"\"></script><script>function(){var document.getElementById(window.location.return false;}</script>"
+        "<link rel=\"stylesheet\" type=\"text/css\" href=\"\" /><link rel=\"icon\" href=\"/favicon.ico\" />"
+        "<style type=\"text/css\">body{margin:0;padding:0;font-family:Arial, Helvetica, sans-serif;color:#000;background-color:#fff;}</style>"
+        "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1\" /><meta name=\"description\" content=\"\" />"
+        "<meta http-equiv=\"Content-Type\" content=\"text/html; charset=utf-8\" /><meta charset=\"utf-8\" />"
+        "<div id=\"\" class=\"\" style=\"\"></div></div></div>\n<a href=\"https://\" target=\"_blank\"></a>"
+        "<!DOCTYPE html>\n<html lang=\"en\">\n<head>\n<title></title>\n</head>\n<body>\n</body>\n</html>\n"
+        "<!doctype html><html><head><title></title></head><body></body></html>"
+        "text/html; charset=utf-8text/html";
+
+static uint32_t read32(const std::string &s, size_t at) {
+    uint32_t value;
+    memcpy(&value, s.data() + at, sizeof(value));
+    return value;
+}
+
+static size_t hash(uint32_t sequence) { return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS); }
+
+static void putLength(std::string &out, size_t n) {
+    for (; n >= 255; n -= 255) out += (char) 255;
+    out += (char) n;
+}
+
+// false if there were not enough bytes
+static bool getLength(const char *&p, const char *end, size_t &n) {
+    for (uint8_t byte = 255; byte == 255; n += byte) {
+        if (p == end) return false;
+        byte = (uint8_t) *p++;
+    }
+    return true;
+}
+
+LzEncoder::LzEncoder() : history(LZ_DICTIONARY, sizeof(LZ_DICTIONARY) - 1), table((size_t) 1 << LZ_HASH_BITS, 0) {
+    for (size_t i = 0; i + LZ_MIN_MATCH <= history.size(); ++i) table[hash(read32(history, i))] = (uint32_t) (i + 1);
+}
+
+void LzEncoder::encode(const char *data, size_t n, std::string &out) {
+    for (size_t done = 0; done < n;) {
+        size_t take = (std::min)(LZ_BLOCK, n - done);
+        size_t from = history.size();
+        history.append(data + done, take);
+        block(from, history.size(), out);
+        trim();
+        done += take;
+    }
+}
+
+void LzEncoder::block(size_t from, size_t to, std::string &out) {
+    std::string payload;
+    size_t pos = from, anchor = from;
+    while (pos + LZ_MIN_MATCH <= to) {
+        uint32_t sequence = read32(history, pos);
+        uint32_t &slot = table[hash(sequence)];
+        size_t candidate = slot;// stream position + 1
+        slot = (uint32_t) (base + pos + 1);
+        if (candidate > base) {
+            size_t match = candidate - 1 - base;
+            size_t distance = pos - match;
+            if (distance <= 0xffff && read32(history, match) == sequence) {
+                size_t length = LZ_MIN_MATCH;
+                while (pos + length < to && history[match + length] == history[pos + length]) ++length;
+                size_t literals = pos - anchor, extra = length - LZ_MIN_MATCH;
+                payload += (char) ((std::min)(literals, (size_t) 15) << 4 | (std::min)(extra, (size_t) 15));
+                if (literals >= 15) putLength(payload, literals - 15);
+                payload.append(history, anchor, literals);
+                payload += (char) (distance & 0xff);
+                payload += (char) (distance >> 8);
+                if (extra >= 15) putLength(payload, extra - 15);
+                pos += length;
+                anchor = pos;
+                continue;
+            }
+        }
+        ++pos;
+    }
+    size_t literals = to - anchor;
+    payload += (char) ((std::min)(literals, (size_t) 15) << 4);
+    if (literals >= 15) putLength(payload, literals - 15);
+    payload.append(history, anchor, literals);
+
+    if (payload.size() < to - from) {
+        putVarint(out, payload.size() << 1 | 1);
+        out += payload;
+    } else {
+        putVarint(out, (to - from) << 1);
+        out.append(history, from, to - from);
+    }
+}
+
+// keep one window; shifting only every other window keeps it cheap
+void LzEncoder::trim() {
+    if (history.size() < 2 * LZ_WINDOW) return;
+    size_t drop = history.size() - LZ_WINDOW;
+    history.erase(0, drop);
+    base += drop;
+}
+
+LzDecoder::LzDecoder() : history(LZ_DICTIONARY, sizeof(LZ_DICTIONARY) - 1) {}
+
+bool LzDecoder::decode(const char *data, size_t n, std::string &out) {
+    input.append(data, n);
+    size_t at = 0;
+    while (at < input.size()) {
+        size_t header;
+        int used = getVarint(input.data() + at, input.size() - at, header);
+        if (used < 0) return false;
+        if (used == 0) break;
+        size_t length = header >> 1;
+        if (length > LZ_BLOCK) return false;
+        if (input.size() - at - used < length) break;
+        const char *payload = input.data() + at + used;
+        if (header & 1) {
+            if (!block(payload, length, out)) return false;
+        } else {
+            history.append(payload, length);
+            out.append(payload, length);
+        }
+        at += used + length;
+        if (history.size() >= 2 * LZ_WINDOW) history.erase(0, history.size() - LZ_WINDOW);
+    }
+    input.erase(0, at);
+    return true;
+}
+
+bool LzDecoder::block(const char *p, size_t length, std::string &out) {
+    const char *end = p + length;
+    size_t start = history.size();
+    while (p < end) {
+        auto token = (uint8_t) *p++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !getLength(p, end, literals)) return false;
+        if ((size_t) (end - p) < literals || history.size() - start + literals > LZ_BLOCK) return false;
+        history.append(p, literals);
+        p += literals;
+        if (p == end) break;// the last sequence has no match
+        if (end - p < 2) return false;
+        size_t distance = (uint8_t) p[0] | (size_t) (uint8_t) p[1] << 8;
+        p += 2;
+        size_t extra = token & 15;
+        if (extra == 15 && !getLength(p, end, extra)) return false;
+        size_t matchLength = extra + LZ_MIN_MATCH;
+        if (distance == 0 || distance > history.size() || history.size() - start + matchLength > LZ_BLOCK) return false;
+        for (size_t i = 0, from = history.size() - distance; i < matchLength; ++i) {
+            char c = history[from + i];// may overlap what this match writes
+            history += c;
+        }
+    }
+    out.append(history, start, history.size() - start);
+    return true;
+}
+
+bool LzDecoder::idle() const { return input.empty(); }
+
+bool lzCompress(const std::string &body, std::string &out) {
+    LzEncoder encoder;
+    std::string encoded;
+    encoder.encode(body.data(), body.size(), encoded);
+    if (encoded.empty() || !(encoded[0] & 1) || encoded.size() >= body.size()) return false;
+    out = std::move(encoded);
+    return true;
+}
+
+bool lzExpand(const std::string &body, std::string &out) {
+    LzDecoder decoder;
+    std::string decoded;
+    if (!decoder.decode(body.data(), body.size(), decoded) || !decoder.idle()) return false;
+    out = std::move(decoded);
+    return true;
+}
@@ -0,0 +1,63 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "utils.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+constexpr size_t LZ_WINDOW = (size_t) 64 << 10;// how far back a match may reach, dictionary included
+constexpr size_t LZ_BLOCK = 4096;              // input bytes per block
+constexpr TYPEType TYPE_COMPRESSED = 0x80;     // in TYPE: BODY is one block against the dictionary alone
+
+/* LZ77 in the style of LZ4, with the history primed by a dictionary of
+ * HTML and HTTP text that both nodes are built with. A stream is a row of
+ * blocks, each
+ * HEADER   varint, LENGTH << 1 | COMPRESSED
+ * PAYLOAD  LENGTH bytes: the input as it is, or sequences of
+ *          {TOKEN literals:4 match-4:4, [more literal length], literals,
+ *           OFFSET 2 bytes, [more match length]}, the last one without a match
+ * A block that does not get smaller is stored raw; matches may reach into
+ * earlier blocks of the same stream.
+ */
+class LzEncoder {
+public:
+    LzEncoder();
+
+    // append the blocks for the next n bytes of the stream to out
+    void encode(const char *data, size_t n, std::string &out);
+
+private:
+    void block(size_t from, size_t to, std::string &out);
+
+    void trim();
+
+    std::string history;// dictionary, then the stream, the front dropped beyond the window
+    size_t base = 0;    // stream position of history[0]
+    std::vector<uint32_t> table;
+};
+
+class LzDecoder {
+public:
+    LzDecoder();
+
+    // decode the whole blocks in what was fed so far; false if the stream is corrupt
+    bool decode(const char *data, size_t n, std::string &out);
+
+    // no partial block is waiting for more input
+    [[nodiscard]] bool idle() const;
+
+private:
+    bool block(const char *payload, size_t length, std::string &out);
+
+    std::string history;
+    std::string input;// start of a block that has not fully arrived
+};
+
+// one frame BODY on its own; false if the block does not get smaller
+bool lzCompress(const std::string &body, std::string &out);
+
+bool lzExpand(const std::string &body, std::string &out);
+
+#endif//COMPRESS_H
@@ -1,37 +1,186 @@
 #include "config.h"
+#include "log.h"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <sstream>
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
 
 using namespace std::chrono_literals;
 
-GlobalConfig::GlobalConfig() {
-    std::ifstream configFile("./config.txt", std::ios::in);
-    while (!configFile.is_open()) {
-        fprintf(stderr, "Failed to open config.txt! Retry after 1s.\n");
-        std::this_thread::sleep_for(1000ms);
-    }
-    while (!configFile.eof()) {
-        std::string node;
-        while (true) {
-            configFile >> node;
-            Config config;
-            if (node == "NODE1") {
-                config.node = Config::Node::NODE1;
-                configFile >> config.ip;
-            } else if (node == "NODE2") {
-                config.node = Config::Node::NODE2;
-                configFile >> config.port;
-            } else if (node == "###") {
-                break;
+static const char *CONFIG_PATH = "./config.txt";
+
+// dotted quad, same byte order as Str2IPType
+static IPType parseIP(const std::string &text) {
+    unsigned a, b, c, d;
+    char tail;
+    if (sscanf(text.c_str(), "%u.%u.%u.%u%c", &a, &b, &c, &d, &tail) != 4 || a > 255 || b > 255 || c > 255 || d > 255)
+        throw ConfigError("bad address '" + text + "'");
+    return a << 24 | b << 16 | c << 8 | d;
+}
+
+template<class T>
+static T readValue(std::istringstream &line, const std::string &key, T min, T max) {
+    T value;
+    if (!(line >> value)) throw ConfigError(key + " expects a value");
+    if (value < min || value > max) throw ConfigError(key + " out of range");
+    return value;
+}
+
+// below the Nyquist frequency of the sound card, which runs at DEFAULT_SAMPLE_RATE
+static double readCarrier(std::istringstream &line, const std::string &key) {
+    double carrier = readValue(line, key, 100.0, DEFAULT_SAMPLE_RATE);
+    if (carrier >= DEFAULT_SAMPLE_RATE / 2) throw ConfigError(key + " must be below half the sample rate");
+    return carrier;
+}
+
+const Config &ConfigSnapshot::get(Config::Node node) const {
+    for (auto &config: nodes)
+        if (config.node == node) return config;
+    throw ConfigError("NODE" + std::to_string(node) + " is not configured");
+}
+
+std::shared_ptr<const ConfigSnapshot> ConfigSnapshot::parse(std::istream &in) {
+    auto snapshot = std::make_shared<ConfigSnapshot>();
+    std::string text;
+    for (int lineNo = 1; std::getline(in, text); ++lineNo) {
+        std::istringstream line(text);
+        std::string key;
+        if (!(line >> key)) continue;
+        if (key == "###") break;
+        if (key[0] == '#') continue;
+        try {
+            if (key == "NODE1" || key == "NODE2") {
+                Config config;
+                config.node = key == "NODE1" ? Config::NODE1 : Config::NODE2;
+                if (!(line >> config.ip)) throw ConfigError(key + " expects an address");
+                parseIP(config.ip);
+                if (config.node == Config::NODE2) config.port = readValue(line, key, 1, 65535);
+                snapshot->nodes.push_back(config);
+            } else if (key == "ROUTE") {
+                std::string prefix, nextHop;
+                Route route;
+                if (!(line >> prefix)) throw ConfigError("ROUTE expects <prefix> <length> <next hop>");
+                route.prefix = parseIP(prefix);
+                route.length = readValue(line, key, 0, 32);
+                if (!(line >> nextHop)) throw ConfigError("ROUTE expects <prefix> <length> <next hop>");
+                route.nextHop = parseIP(nextHop);
+                snapshot->routes.push_back(route);
+            } else if (key == "LANES") {
+                snapshot->lanes = readValue(line, key, 1, 32);
+            } else if (key == "PASSBAND") {
+                snapshot->passband = readValue(line, key, 0, 1) == 1;
+            } else if (key == "CARRIER1") {
+                snapshot->carrier1 = readCarrier(line, key);
+            } else if (key == "CARRIER2") {
+                snapshot->carrier2 = readCarrier(line, key);
+            } else if (key == "MTU") {
+                snapshot->mtu = readValue(line, key, 1, MAX_LENGTH_BODY);
+            } else if (key == "CHUNK_GAP") {
+                snapshot->chunkGapMs = readValue(line, key, 0, 10000);
+            } else if (key == "CACHE") {
+                snapshot->cacheBytes = readValue<size_t>(line, key, 0, (size_t) 1 << 34);
+            } else if (key == "PREFETCH") {
+                snapshot->prefetchBytes = readValue<size_t>(line, key, 0, (size_t) 1 << 34);
+            } else if (key == "THREADS") {
+                snapshot->threads = readValue(line, key, 1, 256);
+            } else if (key == "PROXY") {
+                snapshot->proxyPort = readValue(line, key, 0, 65535);
+            } else if (key == "COMPRESS") {
+                snapshot->compress = readValue(line, key, 0, 1) == 1;
+            } else if (key == "CHUNK_DIR") {
+                if (!(line >> snapshot->chunkDir)) throw ConfigError("CHUNK_DIR expects a directory");
+            } else if (key == "INBOX") {
+                if (!(line >> snapshot->inbox)) throw ConfigError("INBOX expects a directory");
+            } else if (key == "CAPTURE") {
+                if (!(line >> snapshot->capture)) throw ConfigError("CAPTURE expects a file name");
+            } else if (key == "CAPTURE_SIZE") {
+                snapshot->captureBytes = readValue<size_t>(line, key, (size_t) 1 << 20, (size_t) 1 << 40);
             } else {
-                NOT_REACHED
+                throw ConfigError("unknown key " + key);
             }
-            _config.push_back(config);
+        } catch (const ConfigError &e) {
+            throw ConfigError("config.txt:" + std::to_string(lineNo) + ": " + e.what());
         }
     }
+    // every node looks both up, a snapshot without one would throw at them later
+    for (auto node: {Config::NODE1, Config::NODE2})
+        if (std::none_of(snapshot->nodes.begin(), snapshot->nodes.end(), [node](const Config &config) { return config.node == node; }))
+            throw ConfigError("config.txt: NODE" + std::to_string(node) + " is missing");
+    return snapshot;
+}
+
+std::shared_ptr<const ConfigSnapshot> ConfigSnapshot::defaults() {
+    std::istringstream in("NODE1 10.0.0.1\nNODE2 10.0.0.2 1234\n");
+    return parse(in);
+}
+
+GlobalConfig &GlobalConfig::instance() {
+    static GlobalConfig config;
+    return config;
 }
 
-Config GlobalConfig::get(Config::Node node) {
-    for (auto _i: _config) {
-        if (_i.node == node) { return _i; }
+GlobalConfig::GlobalConfig() : snapshot(ConfigSnapshot::defaults()) {
+    if (!reload()) LOG(Warn, CONFIG, "Using default configuration until config.txt is fixed.");
+    watcher = std::thread([this]() { watch(); });
+}
+
+GlobalConfig::~GlobalConfig() {
+    stop = true;
+    if (watcher.joinable()) watcher.join();
+}
+
+bool GlobalConfig::reload() {
+    std::ifstream configFile(CONFIG_PATH, std::ios::in);
+    if (!configFile.is_open()) {
+        LOG(Error, CONFIG, "Failed to open config.txt!");
+        return false;
     }
-    NOT_REACHED
-}
\ No newline at end of file
+    try {
+        std::atomic_store(&snapshot, ConfigSnapshot::parse(configFile));
+        return true;
+    } catch (const ConfigError &e) {
+        LOG(Error, CONFIG, "%s", e.what());
+        return false;
+    }
+}
+
+void GlobalConfig::watch() {
+#if defined(__linux__)
+    // watch the directory: editors usually replace the file instead of writing it in place
+    int fd = inotify_init1(IN_NONBLOCK);
+    if (fd >= 0 && inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) >= 0) {
+        char events[4096];
+        while (!stop) {
+            pollfd pfd{fd, POLLIN, 0};
+            if (poll(&pfd, 1, 500) <= 0) continue;
+            bool changed = false;
+            for (ssize_t n; (n = read(fd, events, sizeof(events))) > 0;) {
+                for (char *p = events; p < events + n;) {
+                    auto *event = (inotify_event *) p;
+                    changed = changed || (event->len > 0 && std::string(event->name) == "config.txt");
+                    p += sizeof(inotify_event) + event->len;
+                }
+            }
+            if (changed) reload();
+        }
+        close(fd);
+        return;
+    }
+    if (fd >= 0) close(fd);
+#endif
+    std::error_code error;
+    auto lastWrite = std::filesystem::last_write_time(CONFIG_PATH, error);
+    while (!stop) {
+        std::this_thread::sleep_for(500ms);
+        auto now = std::filesystem::last_write_time(CONFIG_PATH, error);
+        if (!error && now != lastWrite) {
+            lastWrite = now;
+            reload();
+        }
+    }
+}
@@ -1,9 +1,14 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include "passband.h"
+#include "route.h"
 #include "utils.h"
+#include <atomic>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
@@ -13,26 +18,121 @@ public:
     enum Node { NODE1 = 1, NODE2 = 2 };
     // Project 4 核心协议类型
     enum Type { 
+        MAC_RTS = 10,
+        MAC_CTS = 11,
         DNS_REQ = 20, 
         DNS_RSP = 21, 
         TCP_SYN = 30, 
         TCP_ACK = 31, 
         TCP_DATA = 32,
         HTTP_REQ = 40,
-        HTTP_RSP = 41
+        HTTP_RSP = 41,
+        HTTP_ACK = 42,// the gateway took HTTP_REQ: Node1 stops sending it and waits for HTTP_RSP
+        TUNNEL_OPEN = 50,
+        TUNNEL_OPENED = 51,
+        TUNNEL_DATA = 52,
+        TUNNEL_ACK = 53,
+        TUNNEL_CLOSE = 54,
+        TUNNEL_RESET = 55,
+        CHUNK_REQ = 60,
+        CHUNK_RSP = 61,
+        ICMP_ECHO = 70,
+        ICMP_REPLY = 71,
+        FILE_OFFER = 80,
+        FILE_REQ = 81,
+        FILE_DATA = 82,
+        FILE_DONE = 83
     };
 
     std::string ip;
-    int port;
-    Node node;
+    int port = 0;
+    Node node = NODE1;
 };
 
+class ConfigError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/* Everything read from config.txt, parsed and validated once.
+ *
+ * NODE1 <ip>                    client address, required
+ * NODE2 <ip> <port>             gateway address, required
+ * ROUTE <prefix> <length> <ip>  destinations reached through another node
+ * LANES <n>                     audio channels bonded into one link
+ * PASSBAND <0|1>                FDD passband modem instead of baseband
+ * CARRIER1 <Hz> / CARRIER2 <Hz> carrier of Node1 / Node2 in passband mode, below half the sample rate
+ * MTU <bytes>                   largest BODY the gateway puts in one frame
+ * CHUNK_GAP <ms>                pause between the frames of one response
+ * CACHE <bytes>                 budget of each gateway / client cache
+ * PREFETCH <bytes>              budget of the gateway's cache of prefetched page resources (0: off)
+ * THREADS <n>                   gateway worker threads
+ * CAPTURE <file>                record all audio samples to this file
+ * CAPTURE_SIZE <bytes>          size the capture file is created with; what does not fit is dropped
+ * PROXY <port>                  Node1 HTTP / SOCKS5 proxy on 127.0.0.1 (0: off)
+ * COMPRESS <0|1>                LZ compression of responses and DNS names
+ * CHUNK_DIR <dir>               Node1 store of deduplicated response chunks (CACHE 0: no dedup)
+ * INBOX <dir>                   where files sent by the other node are put
+ * ###                           end of file (optional)
+ * Lines starting with '#' are comments.
+ */
+class ConfigSnapshot {
+public:
+    std::vector<Config> nodes;
+    std::vector<Route> routes;
+    int lanes = 1;
+    bool passband = false;
+    double carrier1 = NODE1_CARRIER;
+    double carrier2 = NODE2_CARRIER;
+    int mtu = 100;
+    int chunkGapMs = 400;
+    size_t cacheBytes = 1 << 20;
+    size_t prefetchBytes = 1 << 20;
+    int threads = 4;
+    std::string capture;// empty: no capture
+    size_t captureBytes = (size_t) 1 << 30;
+    int proxyPort = 0;
+    bool compress = true;
+    std::string chunkDir = "chunks";
+    std::string inbox = "received";
+
+    // throws ConfigError if the node is not configured, which a parsed snapshot always is
+    [[nodiscard]] const Config &get(Config::Node node) const;
+
+    [[nodiscard]] RoutingTable routingTable() const { return RoutingTable(routes); }
+
+    // throws ConfigError with the offending line
+    static std::shared_ptr<const ConfigSnapshot> parse(std::istream &in);
+
+    static std::shared_ptr<const ConfigSnapshot> defaults();
+};
+
+/* Process-wide configuration.
+ * The file is read once and then only again when it changes on disk; a
+ * watcher thread (inotify on Linux, polling elsewhere) swaps in the new
+ * snapshot atomically. Handlers call current() on the hot path, which never
+ * touches the file. A broken file keeps the previous snapshot in place.
+ */
 class GlobalConfig {
 public:
-    GlobalConfig();
-    Config get(Config::Node node);
+    static std::shared_ptr<const ConfigSnapshot> current() { return std::atomic_load(&instance().snapshot); }
+
+    GlobalConfig(const GlobalConfig &) = delete;
+
+    ~GlobalConfig();
+
 private:
-    std::vector<Config> _config;
+    GlobalConfig();
+
+    static GlobalConfig &instance();
+
+    bool reload();
+
+    void watch();
+
+    std::shared_ptr<const ConfigSnapshot> snapshot;
+    std::atomic<bool> stop{false};
+    std::thread watcher;
 };
 
-#endif
\ No newline at end of file
+#endif
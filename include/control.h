@@ -0,0 +1,79 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include "log.h"
+#include "socket.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+constexpr int CONTROL_POLL_MS = 500;   // how often blocked socket calls look at the stop flag
+constexpr size_t CONTROL_MAX_LINE = 4096;
+
+/* Line-based control socket of the headless nodes, bound to 127.0.0.1.
+ * Every line received is passed to the handler and its answer is written
+ * back; connections are served one after another on the server's thread.
+ *
+ *     $ nc 127.0.0.1 7000
+ *     stats
+ */
+class ControlServer {
+public:
+    using Handler = std::function<std::string(const std::string &line)>;
+
+    ControlServer(unsigned short port, Handler commandHandler) : handler(std::move(commandHandler)) {
+        server = std::make_unique<tcp_server_t>(port, true);
+        LOG(Info, SOCKET, "Control socket listening on 127.0.0.1:%u", port);
+        thread = std::thread([this]() { serve(); });
+    }
+
+    ControlServer(const ControlServer &) = delete;
+
+    ~ControlServer() {
+        stop = true;
+        if (thread.joinable()) thread.join();
+        server->close();
+    }
+
+private:
+    void serve() {
+        while (!stop) {
+            if (server->wait_readable(CONTROL_POLL_MS) <= 0) continue;
+            socket_t connection = server->accept();
+            session(connection);
+            connection.close();
+        }
+    }
+
+    void session(socket_t &connection) {
+        std::string pending;
+        char buf[512];
+        while (!stop) {
+            int ready = connection.wait_readable(CONTROL_POLL_MS);
+            if (ready < 0) return;
+            if (ready == 0) continue;
+            int n = connection.read_some(buf, sizeof(buf));
+            if (n <= 0) return;
+            pending.append(buf, n);
+            for (size_t end; (end = pending.find('\n')) != std::string::npos;) {
+                std::string line = pending.substr(0, end);
+                pending.erase(0, end + 1);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (line.empty()) continue;
+                std::string answer = handler(line);
+                if (answer.empty() || answer.back() != '\n') answer += '\n';
+                if (connection.write_all(answer.data(), (int) answer.size()) < 0) return;
+            }
+            if (pending.size() > CONTROL_MAX_LINE) return;
+        }
+    }
+
+    Handler handler;
+    std::unique_ptr<tcp_server_t> server;
+    std::atomic<bool> stop{false};
+    std::thread thread;
+};
+
+#endif//CONTROL_H
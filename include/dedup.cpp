@@ -0,0 +1,202 @@
+#include "dedup.h"
+#include "varint.h"
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <filesystem>
+#include <system_error>
+
+namespace fs = std::filesystem;
+
+// the same pseudo-random table on both nodes, so both cut the same chunks
+static const std::array<uint64_t, 256> GEAR = [] {
+    std::array<uint64_t, 256> table{};
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    for (auto &entry: table) {
+        uint64_t z = state += 0x9e3779b97f4a7c15ull;// splitmix64
+        z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ z >> 27) * 0x94d049bb133111ebull;
+        entry = z ^ z >> 31;
+    }
+    return table;
+}();
+
+std::vector<size_t> chunkBoundaries(const char *data, size_t n) {
+    std::vector<size_t> lengths;
+    for (size_t start = 0; start < n;) {
+        size_t end = (std::min)(start + CHUNK_MAX, n), at = (std::min)(start + CHUNK_MIN, end);
+        uint64_t h = 0;
+        for (; at < end; ++at) {
+            h = (h << 1) + GEAR[(uint8_t) data[at]];
+            if (!(h & CHUNK_MASK << 40)) break;// the high bits have seen the most input
+        }
+        if (at < end) ++at;
+        lengths.push_back(at - start);
+        start = at;
+    }
+    return lengths;
+}
+
+Fingerprint fingerprint(const char *data, size_t n) {
+    uint64_t h = 0xcbf29ce484222325ull;// FNV-1a, then mixed so that short chunks spread too
+    for (size_t i = 0; i < n; ++i) h = (h ^ (uint8_t) data[i]) * 0x100000001b3ull;
+    h = (h ^ h >> 33) * 0xff51afd7ed558ccdull;
+    h = (h ^ h >> 33) * 0xc4ceb9fe1a85ec53ull;
+    return h ^ h >> 33;
+}
+
+std::string fingerprintHex(Fingerprint fp) {
+    char text[17];
+    snprintf(text, sizeof(text), "%016llx", (unsigned long long) fp);
+    return text;
+}
+
+ChunkStore::ChunkStore(size_t budgetBytes, std::string directory) : budget(budgetBytes), dir(std::move(directory)) {
+    if (dir.empty()) return;
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    std::vector<std::pair<fs::file_time_type, Fingerprint>> found;
+    for (auto &entry: fs::directory_iterator(dir, ec)) {
+        auto name = entry.path().filename().string();
+        char *end;
+        Fingerprint fp = strtoull(name.c_str(), &end, 16);
+        if (name.size() != 16 || *end || !entry.is_regular_file(ec)) continue;
+        found.emplace_back(entry.last_write_time(ec), fp);
+        index[fp] = {(size_t) entry.file_size(ec), {}, {}};
+    }
+    std::sort(found.begin(), found.end());// oldest first, so the newest ends up in front
+    for (auto &[time, fp]: found) {
+        lru.push_front(fp);
+        index[fp].age = lru.begin();
+        used += index[fp].size;
+    }
+    evict();
+}
+
+bool ChunkStore::get(Fingerprint fp, std::string &data) {
+    std::lock_guard guard(lock);
+    auto it = index.find(fp);
+    if (it == index.end()) return false;
+    if (dir.empty()) data = it->second.data;
+    else {
+        FILE *file = fopen(pathOf(fp).c_str(), "rb");
+        data.resize(it->second.size);
+        bool ok = file && fread(data.data(), 1, data.size(), file) == data.size();
+        if (file) fclose(file);
+        if (!ok || fingerprint(data.data(), data.size()) != fp) {// gone or damaged behind our back
+            used -= it->second.size;
+            lru.erase(it->second.age);
+            index.erase(it);
+            return false;
+        }
+    }
+    lru.splice(lru.begin(), lru, it->second.age);
+    return true;
+}
+
+bool ChunkStore::contains(Fingerprint fp) {
+    std::lock_guard guard(lock);
+    auto it = index.find(fp);
+    if (it == index.end()) return false;
+    lru.splice(lru.begin(), lru, it->second.age);
+    return true;
+}
+
+void ChunkStore::put(Fingerprint fp, const std::string &data) {
+    std::lock_guard guard(lock);
+    if (data.size() > budget) return;
+    auto it = index.find(fp);
+    if (it != index.end()) {
+        lru.splice(lru.begin(), lru, it->second.age);
+        return;
+    }
+    if (!dir.empty()) {
+        auto path = pathOf(fp), temporary = path + ".tmp";// a crash leaves no half chunk under the real name
+        FILE *file = fopen(temporary.c_str(), "wb");
+        if (!file) return;
+        bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+        ok = fclose(file) == 0 && ok;
+        std::error_code ec;
+        if (ok) fs::rename(temporary, path, ec);
+        if (!ok || ec) {
+            fs::remove(temporary, ec);
+            return;
+        }
+    }
+    lru.push_front(fp);
+    index[fp] = {data.size(), lru.begin(), dir.empty() ? data : std::string()};
+    used += data.size();
+    evict();
+}
+
+size_t ChunkStore::bytes() {
+    std::lock_guard guard(lock);
+    return used;
+}
+
+void ChunkStore::evict() {
+    while (used > budget && !lru.empty()) {
+        Fingerprint fp = lru.back();
+        lru.pop_back();
+        used -= index[fp].size;
+        index.erase(fp);
+        if (!dir.empty()) {
+            std::error_code ec;
+            fs::remove(pathOf(fp), ec);
+        }
+    }
+}
+
+std::string ChunkStore::pathOf(Fingerprint fp) const { return (fs::path(dir) / fingerprintHex(fp)).string(); }
+
+std::string dedupEncode(const std::string &body, ChunkStore &peer) {
+    std::string out;
+    size_t at = 0;
+    for (size_t length: chunkBoundaries(body.data(), body.size())) {
+        Fingerprint fp = fingerprint(body.data() + at, length);
+        if (peer.contains(fp)) {
+            out += (char) DEDUP_REFERENCE;
+            for (int i = 0; i < LENGTH_FINGERPRINT; ++i) out += (char) (fp >> 8 * i);
+            putVarint(out, length);
+        } else {
+            out += (char) DEDUP_LITERAL;
+            putVarint(out, length);
+            out.append(body, at, length);
+            peer.put(fp, body.substr(at, length));
+        }
+        at += length;
+    }
+    return out;
+}
+
+bool DedupDecoder::feed(const char *data, size_t n) {
+    input.append(data, n);
+    size_t at = 0;
+    while (at < input.size()) {
+        auto tag = (uint8_t) input[at];
+        if (tag != DEDUP_LITERAL && tag != DEDUP_REFERENCE) return false;
+        size_t p = at + 1;
+        Fingerprint fp = 0;
+        if (tag == DEDUP_REFERENCE) {
+            if (input.size() - p < LENGTH_FINGERPRINT) break;
+            for (int i = 0; i < LENGTH_FINGERPRINT; ++i) fp |= (Fingerprint) (uint8_t) input[p + i] << 8 * i;
+            p += LENGTH_FINGERPRINT;
+        }
+        size_t length;
+        int used = getVarint(input.data() + p, input.size() - p, length);
+        if (used < 0) return false;
+        if (used == 0) break;
+        p += used;
+        if (length == 0 || length > CHUNK_MAX) return false;
+        if (tag == DEDUP_REFERENCE) reference(fp, length);
+        else {
+            if (input.size() - p < length) break;
+            std::string chunk = input.substr(p, length);
+            literal(fingerprint(chunk.data(), chunk.size()), chunk);
+            p += length;
+        }
+        at = p;
+    }
+    input.erase(0, at);
+    return true;
+}
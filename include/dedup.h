@@ -0,0 +1,96 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using Fingerprint = uint64_t;
+
+constexpr size_t CHUNK_MIN = 512;      // content-defined chunk sizes
+constexpr size_t CHUNK_MAX = 8192;
+constexpr uint64_t CHUNK_MASK = 0x7ff; // boundary when the rolling hash has these bits clear: about 2 KiB on average
+constexpr int LENGTH_FINGERPRINT = sizeof(Fingerprint);
+
+/* Content-defined chunking with a Gear rolling hash: a boundary depends
+ * only on the bytes just before it, so an edit moves the boundaries around
+ * it and leaves the chunks elsewhere, and their fingerprints, unchanged.
+ * Returns the chunk lengths, which add up to n.
+ */
+std::vector<size_t> chunkBoundaries(const char *data, size_t n);
+
+Fingerprint fingerprint(const char *data, size_t n);
+
+std::string fingerprintHex(Fingerprint fp);
+
+/* Chunks by fingerprint, least recently used dropped beyond the budget.
+ * With a directory each chunk is a file named by its fingerprint and the
+ * store outlives the process; without one it is kept in memory.
+ */
+class ChunkStore {
+public:
+    explicit ChunkStore(size_t budgetBytes, std::string directory = "");
+
+    ChunkStore(const ChunkStore &) = delete;
+
+    bool get(Fingerprint fp, std::string &data);
+
+    [[nodiscard]] bool contains(Fingerprint fp);
+
+    void put(Fingerprint fp, const std::string &data);
+
+    [[nodiscard]] size_t bytes();
+
+private:
+    struct Entry {
+        size_t size;
+        std::list<Fingerprint>::iterator age;
+        std::string data;// in memory only
+    };
+
+    void evict();
+
+    [[nodiscard]] std::string pathOf(Fingerprint fp) const;
+
+    size_t budget;
+    std::string dir;
+    std::mutex lock;
+    std::list<Fingerprint> lru;// most recent first
+    std::unordered_map<Fingerprint, Entry> index;
+    size_t used = 0;
+};
+
+/* A deduplicated body is a row of records:
+ *   0x00 LENGTH(varint) bytes        a chunk the receiver should keep
+ *   0x01 FINGERPRINT LENGTH(varint)  a chunk the receiver should have
+ */
+enum DedupRecord : uint8_t { DEDUP_LITERAL = 0, DEDUP_REFERENCE = 1 };
+
+// gateway: `peer` is what it believes the receiver holds; literal chunks are added to it
+std::string dedupEncode(const std::string &body, ChunkStore &peer);
+
+/* Receiver side, fed the record stream in order and in any pieces.
+ * Literal chunks go to `literal`, references to `reference`; false once
+ * the stream is corrupt.
+ */
+class DedupDecoder {
+public:
+    using Literal = std::function<void(Fingerprint fp, const std::string &data)>;
+    using Reference = std::function<void(Fingerprint fp, size_t length)>;
+
+    DedupDecoder(Literal onLiteral, Reference onReference) : literal(std::move(onLiteral)), reference(std::move(onReference)) {}
+
+    bool feed(const char *data, size_t n);
+
+private:
+    Literal literal;
+    Reference reference;
+    std::string input;// start of a record that has not fully arrived
+};
+
+#endif//DEDUP_H
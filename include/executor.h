@@ -0,0 +1,135 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include "thread.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* One thread that runs tasks one after the other: posted ones in order,
+ * delayed ones once they are due. Whatever only the executor touches needs
+ * no lock, so Reader callbacks post their events here instead of sharing
+ * state with the threads that start requests.
+ */
+class Executor : public aether::Thread {
+public:
+    using Task = std::function<void()>;
+
+    Executor() : Thread("Executor") { startThread(); }
+
+    // tasks not run yet are dropped
+    ~Executor() override { stop(); }
+
+    void post(Task task) { after(0.0, std::move(task)); }
+
+    void after(double seconds, Task task) {
+        auto due = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+        std::lock_guard<std::mutex> guard(lock);
+        if (stopped) return;
+        tasks.emplace(due, std::move(task));// after the ones due at the same time
+        changed.notify_one();
+    }
+
+    // waits for the running task; later posts are ignored
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopped = true;
+            tasks.clear();
+            changed.notify_one();
+        }
+        stopThread(-1);
+    }
+
+    void run() override {
+        std::unique_lock<std::mutex> guard(lock);
+        while (!stopped) {
+            if (tasks.empty()) {
+                changed.wait(guard);
+                continue;
+            }
+            auto first = tasks.begin();
+            if (first->first > std::chrono::steady_clock::now()) {
+                changed.wait_until(guard, first->first);
+                continue;
+            }
+            Task task = std::move(first->second);
+            tasks.erase(first);
+            guard.unlock();
+            task();
+            guard.lock();
+        }
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable changed;
+    std::multimap<std::chrono::steady_clock::time_point, Task> tasks;
+    bool stopped = false;
+};
+
+/* Several threads taking posted tasks in order, each running whichever
+ * comes next, so one task that blocks (on the network, say) does not hold
+ * up the others. Tasks must not rely on running one after the other.
+ */
+class WorkerPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkerPool(int threads) {
+        for (int i = 0; i < (std::max)(1, threads); ++i) workers.emplace_back([this]() { work(); });
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+
+    // tasks not run yet are dropped
+    ~WorkerPool() { stop(); }
+
+    void post(Task task) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (stopped) return;
+        tasks.push_back(std::move(task));
+        changed.notify_one();
+    }
+
+    // waits for the running tasks; later posts are ignored
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopped = true;
+            tasks.clear();
+            changed.notify_all();
+        }
+        for (auto &worker: workers)
+            if (worker.joinable()) worker.join();
+        workers.clear();
+    }
+
+private:
+    void work() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            changed.wait(guard, [this]() { return stopped || !tasks.empty(); });
+            if (stopped) return;
+            Task task = std::move(tasks.front());
+            tasks.pop_front();
+            guard.unlock();
+            task();
+            guard.lock();
+        }
+    }
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<Task> tasks;
+    bool stopped = false;
+    std::vector<std::thread> workers;
+};
+
+#endif//EXECUTOR_H
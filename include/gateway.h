@@ -0,0 +1,346 @@
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include "bond.h"
+#include "compress.h"
+#include "config.h"
+#include "dedup.h"
+#include "executor.h"
+#include "http.h"
+#include "log.h"
+#include "metrics.h"
+#include "ping.h"
+#include "pool.h"
+#include "prefetch.h"
+#include "reassembly.h"
+#include "socket.h"
+#include "trace.h"
+#include "transfer.h"
+#include "tunnel.h"
+#include "utils.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Node2 without the GUI: answers DNS, TCP and HTTP requests arriving over
+ * the link by doing them on the real network. DNS and HTTP requests go to
+ * THREADS workers, so a slow upstream holds up neither the Reader thread
+ * that decoded them nor other requests; tunnelled connections get threads
+ * of their own. An HTTP_REQ is answered with HTTP_ACK straight away; the
+ * same request again (SRC, PORT and BODY) within HTTP_REQ_MEMORY only gets
+ * another HTTP_ACK, so retries are not fetched and queued twice. For every client it keeps, within CACHE, the chunks it sent
+ * in full, which stand for what that client holds: repeated content goes
+ * out as fingerprints, and the chunks themselves if the client asks again.
+ * What an HTML page links to is prefetched while the page is on air.
+ */
+class Gateway {
+public:
+    explicit Gateway(double sampleRate)
+        : workers(GlobalConfig::current()->threads), prefetcher([this](const HttpRequest &request) { return upstream(request); }, [](const std::string &host, std::string &ip) { return resolveName(host, ip); }) {
+        link = makeNodeLink(Config::NODE2, [this](FrameType &frame) { process(frame); }, sampleRate);
+        tunnel.attach(*link);
+        pinger.attach(*link);
+        transfers.attach(*link);
+    }
+
+    Gateway(const Gateway &) = delete;
+
+    // tunnelled connections still send, so they end before the link does; the link goes before
+    // the members, its Reader threads call process() until then
+    ~Gateway() {
+        workers.stop();
+        tunnel.shutdown();
+        transfers.shutdown();
+        prefetcher.shutdown();
+        link.reset();
+    }
+
+    [[nodiscard]] BondedLink &bondedLink() { return *link; }
+
+    // echoes to Node1; blocks until done
+    std::vector<PingStats> ping(PingOptions options) {
+        options.target = Str2IPType(GlobalConfig::current()->get(Config::NODE1).ip);
+        return pinger.run(options);
+    }
+
+    // the file to Node1's INBOX; blocks until it was verified there or Node1 gave up
+    FileTransfer::Result sendFile(const std::string &path) { return transfers.send(Str2IPType(GlobalConfig::current()->get(Config::NODE1).ip), path); }
+
+private:
+    void process(FrameType &frame) {
+        if (frame.type >= Config::TUNNEL_OPEN && frame.type <= Config::TUNNEL_RESET) {
+            tunnel.onFrame(frame);
+            return;
+        }
+        if (frame.type == Config::ICMP_REPLY) {
+            pinger.onReply(frame);
+            return;
+        }
+        if (frame.type >= Config::FILE_OFFER && frame.type <= Config::FILE_DONE) {
+            transfers.onFrame(frame);// 大文件不压缩，也不走请求处理
+            return;
+        }
+        if (frame.type & TYPE_COMPRESSED) {
+            if (!lzExpand(frame.body, frame.body)) return;
+            frame.type &= ~TYPE_COMPRESSED;
+        }
+        // 回复一律发回给请求方 (frame.src)，网关可以同时服务多个客户端；
+        // PORT 里是客户端的请求号，原样带回去
+
+        // --- 逻辑 1: 处理 DNS 请求 ---
+        // 查询和抓取可能要等上游好几秒，交给工作线程，Reader 线程接着解码
+        if (frame.type == Config::DNS_REQ) {
+            workers.post([this, request = std::move(frame)]() { dnsRequest(request); });
+        }
+        // --- 逻辑 2: 处理 TCP SYN (握手第一步) ---
+        else if (frame.type == Config::TCP_SYN) {
+            LOG(Info, GATEWAY, "TCP SYN Received (Handshake Part 1): %s", frame.body.c_str());
+            // 回复一个 ACK，告诉 Node 1 可以发 HTTP 请求了
+            FrameType ack{ Config::TCP_ACK, frame.src, frame.port, "ACK:OK" };
+            link->send(ack);
+            LOG(Info, GATEWAY, "TCP ACK Sent to %s.", IPType2Str(frame.src).c_str());
+        }
+        // --- 逻辑 3: 处理 HTTP 请求 (抓取网页) ---
+        // Node2/Node.h 里的 HTTP 处理部分
+        else if (frame.type == Config::HTTP_REQ) {
+            // 客户端没收到 HTTP_ACK 才会重发：只再回一次 ACK，不再抓取、排队
+            bool repeated = !take(frame);
+            link->send(FrameType{ Config::HTTP_ACK, frame.src, frame.port, "" });
+            if (repeated) LOG(Info, GATEWAY, "HTTP Request %u from %s repeated, acknowledged again", frame.port, IPType2Str(frame.src).c_str());
+            else
+                workers.post([this, request = std::move(frame)]() { httpRequest(request); });
+        }
+        // --- 逻辑 4: 客户端缺块，重发整块 ---
+        else if (frame.type == Config::CHUNK_REQ) {
+            auto config = GlobalConfig::current();
+            auto &chunks = peer(frame.src);
+            int pieceSize = (std::max)(1, (std::min)(config->mtu, link->maxBodyLength()) - LENGTH_CHUNK_HEADER);
+            std::vector<FrameType> pieces;
+            for (size_t at = 0; at + LENGTH_FINGERPRINT <= frame.body.size(); at += LENGTH_FINGERPRINT) {
+                ChunkHeader header;
+                std::copy(frame.body.data() + at, frame.body.data() + at + LENGTH_FINGERPRINT, (char *)&header.fp);
+                std::string chunk;
+                if (!chunks.get(header.fp, chunk)) {
+                    LOG(Warn, GATEWAY, "Chunk %s asked for by %s is gone", fingerprintHex(header.fp).c_str(), IPType2Str(frame.src).c_str());
+                    pieces.push_back(FrameType{ Config::CHUNK_RSP, frame.src, 80, header.inString() });// TOTAL 0
+                    continue;
+                }
+                // 整块压成一个流再切片，比逐片压缩省得多
+                std::string packed;
+                if (config->compress) LzEncoder().encode(chunk.data(), chunk.size(), packed);
+                if (!packed.empty() && packed.size() < chunk.size()) {
+                    chunk = std::move(packed);
+                    header.compressed = true;
+                }
+                header.total = (unsigned short)chunk.size();
+                for (size_t i = 0; i < chunk.size(); i += pieceSize) {
+                    header.offset = (unsigned short)i;
+                    std::string piece = BodyPool::take(LENGTH_CHUNK_HEADER + pieceSize);
+                    piece += header.inString();
+                    piece.append(chunk, i, pieceSize);
+                    pieces.emplace_back(Config::CHUNK_RSP, frame.src, 80, std::move(piece));
+                }
+            }
+            LOG(Info, GATEWAY, "Resending %zu chunk pieces to %s", pieces.size(), IPType2Str(frame.src).c_str());
+            link->sendBurst(std::move(pieces), config->chunkGapMs);
+        }
+    }
+
+    // DNS_REQ, on a worker
+    void dnsRequest(const FrameType &frame) {
+        static auto& dnsLatency = Metrics::histogram("gateway.dns_us");
+        MyTimer timer;
+        LOG(Info, GATEWAY, "DNS Query Received: %s", frame.body.c_str());
+        std::string ip;
+        bool resolved = lookup(frame.body, ip);
+        if (resolved) LOG(Info, GATEWAY, "Resolved: %s -> %s", frame.body.c_str(), ip.c_str());
+        else
+            LOG(Warn, GATEWAY, "Cannot resolve %s", frame.body.c_str());
+        // 解析失败回空 BODY，客户端不必等到超时
+        FrameType resp{ Config::DNS_RSP, frame.src, frame.port, resolved ? ip : std::string() };
+        link->send(resp);
+        dnsLatency.record((uint64_t)(timer.duration() * 1e6));
+    }
+
+    // HTTP_REQ, on a worker: from the prefetch cache or the real network
+    void httpRequest(const FrameType &frame) {
+        static auto& httpLatency = Metrics::histogram("gateway.http_us");
+        MyTimer timer;
+        LOG(Info, GATEWAY, "HTTP Request Received for: %s", frame.body.c_str());
+        HttpRequest request;
+        if (!HttpRequest::parse(frame.body, request)) {
+            LOG(Warn, GATEWAY, "Bad HTTP request: %s", frame.body.c_str());
+            HttpEnvelope badRequest;
+            badRequest.status = 400;
+            sendStream(frame, badRequest.encode(), false, 0);
+            return;
+        }
+
+        // 预取过的直接发，不用再等上游
+        std::string raw;
+        if (prefetcher.take(request, raw)) LOG(Info, GATEWAY, "Serving %s%s from prefetch", request.host.c_str(), request.path.c_str());
+        else
+            raw = upstream(request);
+        if (raw.empty()) {
+            // 上游不可达：回一个 502，客户端不必等到超时
+            LOG(Warn, GATEWAY, "No response from %s:%u", request.host.c_str(), request.port);
+            HttpEnvelope badGateway;
+            badGateway.status = 502;
+            sendStream(frame, badGateway.encode(), false, 0);
+        } else {
+            // 只把状态码和几个有用的头发过去，其余的头在声学链路上太贵了
+            static auto& headerSaved = Metrics::counter("gateway.http_header_bytes_saved");
+            HttpResponse response;
+            std::string stream;
+            bool deduplicated = false;
+            if (HttpResponse::parse(raw, response)) {
+                // 页面在声学链路上慢慢发的同时，把它引用的资源先取回来
+                prefetcher.learn(request, response);
+                stream = HttpEnvelope::from(response).encode();
+                if (raw.size() > stream.size() + response.body.size()) headerSaved.add(raw.size() - stream.size() - response.body.size());
+                // 客户端已有的块只发指纹 (先去重再压缩，字面量块仍然能被压缩)
+                if (GlobalConfig::current()->cacheBytes > 0) {
+                    static auto& dedupSaved = Metrics::counter("gateway.dedup_bytes_saved");
+                    std::string records = dedupEncode(response.body, peer(frame.src));
+                    if (response.body.size() > records.size()) dedupSaved.add(response.body.size() - records.size());
+                    stream += records;
+                    deduplicated = true;
+                } else
+                    stream += response.body;
+            } else
+                stream = HttpEnvelope().encode() + raw;// status 0: not HTTP, pass it on as it is
+            sendStream(frame, std::move(stream), deduplicated, raw.size());
+        }
+        httpLatency.record((uint64_t)(timer.duration() * 1e6));
+    }
+
+    // one response to the request in `to`: compressed if that helps, then cut into HTTP_RSP segments
+    void sendStream(const FrameType &to, std::string stream, bool deduplicated, size_t upstreamBytes) {
+        auto config = GlobalConfig::current();
+        // 整个响应压成一个流，跨分片共享上下文；压不小就发原文
+        bool compressed = false;
+        if (config->compress) {
+            static auto& compressLatency = Metrics::histogram("gateway.compress_us");
+            static auto& compressSaved = Metrics::counter("gateway.compressed_bytes_saved");
+            MyTimer compressTimer;
+            std::string packed;
+            LzEncoder().encode(stream.data(), stream.size(), packed);
+            compressLatency.record((uint64_t)(compressTimer.duration() * 1e6));
+            if (packed.size() < stream.size()) {
+                compressSaved.add(stream.size() - packed.size());
+                stream = std::move(packed);
+                compressed = true;
+            }
+        }
+        LOG(Info, GATEWAY, "Total: %zu bytes from upstream, %zu on air%s%s. Starting segmentation...", upstreamBytes, stream.size(),
+            deduplicated ? " deduplicated" : "", compressed ? " compressed" : "");
+
+        // --- 关键修改：按配置的 MTU 切片 (默认每 100 字节一刀) ---
+        int chunkSize = (std::max)(1, (std::min)(config->mtu, link->maxBodyLength()) - LENGTH_SEGMENT_HEADER);
+        std::vector<FrameType> chunks;
+        chunks.reserve((stream.size() + chunkSize - 1) / chunkSize);
+        SegmentHeader segment{ nextStream++, 0, (unsigned int)stream.size(), compressed, deduplicated };
+        for (size_t i = 0; i < stream.size(); i += chunkSize) {
+            segment.offset = (unsigned int)i;
+            // 分片放进池里的缓冲区，发完由链路还回去，不再每片新建字符串
+            std::string chunkBody = BodyPool::take(LENGTH_SEGMENT_HEADER + chunkSize);
+            chunkBody += segment.inString();
+            chunkBody.append(stream, i, chunkSize);
+
+            // 构造小包发送，目的地址是请求方，其他客户端在读 BODY 前就会丢弃
+            chunks.emplace_back(Config::HTTP_RSP, to.src, to.port, std::move(chunkBody));
+        }
+        // 整个响应只抢占一次信道 (大于 MAC_RTS_THRESHOLD 时走 RTS/CTS)；
+        // 物理层间隔：每段之间停 CHUNK_GAP (默认 400ms)，让笔记本喘口气
+        link->sendBurst(std::move(chunks), config->chunkGapMs);
+        LOG(Info, GATEWAY, "All segments sent successfully.");
+    }
+
+    // false if the same request was taken within HTTP_REQ_MEMORY
+    bool take(const FrameType &frame) {
+        std::lock_guard<std::mutex> guard(takenLock);
+        for (auto it = taken.begin(); it != taken.end();) {
+            if (it->second.second.duration() > HTTP_REQ_MEMORY) it = taken.erase(it);
+            else
+                ++it;
+        }
+        // 请求号在客户端重启后从头再来，所以 BODY 也要一样
+        auto key = std::make_pair(frame.src, (RequestId)frame.port);
+        auto it = taken.find(key);
+        if (it != taken.end() && it->second.first == frame.body) return false;
+        taken[key] = { frame.body, MyTimer() };
+        return true;
+    }
+
+    // what the gateway believes this client holds
+    ChunkStore &peer(IPType client) {
+        std::lock_guard<std::mutex> guard(peersLock);
+        auto &chunks = peers[client];
+        if (!chunks) chunks = std::make_unique<ChunkStore>(GlobalConfig::current()->cacheBytes);
+        return *chunks;
+    }
+
+    // a prefetched address, else getaddrinfo
+    bool lookup(const std::string &host, std::string &ip) { return prefetcher.address(host, ip) || resolveName(host, ip); }
+
+    static bool resolveName(const std::string &host, std::string &ip) {
+        char address[100] = { 0 };
+        socket_t tool;
+#if defined (_MSC_VER)
+        WSADATA wsaData; WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+        TRACE_BEGIN("gateway.getaddrinfo");
+        int resolved = tool.hostname_to_ip(host.c_str(), address);
+        TRACE_END("gateway.getaddrinfo");
+        if (resolved != 0) return false;
+        ip = address;
+        return true;
+    }
+
+    // the raw response to request from the real network, empty if there is none; also on prefetch workers
+    std::string upstream(const HttpRequest &request) {
+        std::string ip, raw;
+        if (!lookup(request.host, ip)) return raw;
+        tcp_client_t client;
+        TRACE_BEGIN("gateway.connect");
+        int connected = client.connect(ip.c_str(), request.port);
+        TRACE_END("gateway.connect");
+        if (connected == 0) {
+            TRACE_BEGIN("gateway.http_fetch");
+            std::string httpRequest = request.wire();
+            client.write_all(httpRequest.c_str(), (int)httpRequest.size());
+            raw = fetch(client);
+            client.close();
+            TRACE_END("gateway.http_fetch");
+        }
+        return raw;
+    }
+
+    // the whole upstream response, until the server closes, goes quiet or sends too much
+    static std::string fetch(socket_t &upstream) {
+        std::string raw;
+        char buf[4096];
+        while (raw.size() < HTTP_MAX_RESPONSE && upstream.wait_readable(HTTP_READ_TIMEOUT_MS) > 0) {
+            int n = upstream.read_some(buf, (int)(std::min)(sizeof(buf), HTTP_MAX_RESPONSE - raw.size()));
+            if (n <= 0) break;
+            raw.append(buf, n);
+        }
+        return raw;
+    }
+
+    Tunnel tunnel;
+    Pinger pinger;
+    FileTransfer transfers;
+    WorkerPool workers;// stopped first: what Reader threads post after that is dropped
+    std::atomic<StreamType> nextStream{0};
+    std::mutex takenLock;
+    std::map<std::pair<IPType, RequestId>, std::pair<std::string, MyTimer>> taken;// HTTP_REQ bodies by SRC and PORT, and since when
+    std::mutex peersLock;
+    std::map<IPType, std::unique_ptr<ChunkStore>> peers;
+    std::unique_ptr<BondedLink> link;// after what process() uses
+    Prefetcher prefetcher;// last: gone first, its workers call back into upstream()
+};
+
+#endif//GATEWAY_H
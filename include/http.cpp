@@ -0,0 +1,152 @@
+#include "http.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+static std::string lower(std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return (char) std::tolower(c); });
+    return text;
+}
+
+static std::string trim(const std::string &text) {
+    size_t begin = text.find_first_not_of(" \t"), end = text.find_last_not_of(" \t");
+    return begin == std::string::npos ? std::string() : text.substr(begin, end - begin + 1);
+}
+
+bool HttpRequest::parse(const std::string &text, HttpRequest &request) {
+    std::string url = trim(text);
+    auto space = url.find(' ');
+    if (space != std::string::npos) {
+        request.method = url.substr(0, space);
+        url = trim(url.substr(space + 1));
+    }
+    if (lower(url.substr(0, 7)) == "http://") url.erase(0, 7);
+    auto slash = url.find('/');
+    std::string authority = url.substr(0, slash);
+    request.path = slash == std::string::npos ? "/" : url.substr(slash);
+    auto colon = authority.rfind(':');
+    if (colon != std::string::npos) {
+        int port = atoi(authority.c_str() + colon + 1);
+        if (port <= 0 || port > 65535) return false;
+        request.port = (unsigned short) port;
+        authority.erase(colon);
+    }
+    request.host = authority;
+    return !request.host.empty() && !request.method.empty();
+}
+
+std::string HttpRequest::wire() const {
+    std::string hostHeader = port == 80 ? host : host + ":" + std::to_string(port);
+    // identity: the link carries the body as it is, Node1 does not inflate
+    return method + " " + path + " HTTP/1.1\r\nHost: " + hostHeader + "\r\nAccept-Encoding: identity\r\nConnection: close\r\n\r\n";
+}
+
+bool HttpResponse::parse(const std::string &raw, HttpResponse &response) {
+    auto headerEnd = raw.find("\r\n\r\n");
+    if (raw.compare(0, 5, "HTTP/") != 0 || headerEnd == std::string::npos) return false;
+    auto lineEnd = raw.find("\r\n");
+    auto space = raw.find(' ');
+    if (space == std::string::npos || space > lineEnd) return false;
+    response.status = atoi(raw.c_str() + space + 1);
+    if (response.status < 100 || response.status > 999) return false;
+    response.headers.clear();
+    for (size_t at = lineEnd + 2; at < headerEnd;) {
+        auto next = raw.find("\r\n", at);
+        auto colon = raw.find(':', at);
+        if (colon != std::string::npos && colon < next)
+            response.headers.emplace_back(lower(trim(raw.substr(at, colon - at))), trim(raw.substr(colon + 1, next - colon - 1)));
+        at = next + 2;
+    }
+    std::string body = raw.substr(headerEnd + 4);
+    auto *encoding = response.header("transfer-encoding");
+    auto *length = response.header("content-length");
+    if (encoding && lower(*encoding).find("chunked") != std::string::npos) body = decodeChunked(body);
+    else if (length) {
+        auto n = (size_t) strtoull(length->c_str(), nullptr, 10);
+        if (n < body.size()) body.resize(n);
+    }
+    response.body = std::move(body);
+    return true;
+}
+
+const std::string *HttpResponse::header(const std::string &name) const {
+    for (auto &field: headers)
+        if (field.first == name) return &field.second;
+    return nullptr;
+}
+
+std::string decodeChunked(const std::string &data) {
+    std::string body;
+    size_t at = 0;
+    while (at < data.size()) {
+        auto lineEnd = data.find("\r\n", at);
+        if (lineEnd == std::string::npos) break;
+        char *end;
+        auto size = (size_t) strtoull(data.c_str() + at, &end, 16);// chunk extensions after ';' are ignored
+        if (end == data.c_str() + at || size == 0) break;
+        at = lineEnd + 2;
+        size_t available = (std::min)(size, data.size() - at);
+        body.append(data, at, available);
+        if (available < size) break;
+        at += size + 2;
+    }
+    return body;
+}
+
+static const struct {
+    HttpEnvelope::Field field;
+    const char *header;
+} ENVELOPE_FIELDS[] = {
+        {HttpEnvelope::CONTENT_TYPE, "content-type"},   {HttpEnvelope::LOCATION, "location"}, {HttpEnvelope::CONTENT_ENCODING, "content-encoding"},
+        {HttpEnvelope::LAST_MODIFIED, "last-modified"}, {HttpEnvelope::ETAG, "etag"},         {HttpEnvelope::CACHE_CONTROL, "cache-control"},
+        {HttpEnvelope::SET_COOKIE, "set-cookie"},
+};
+
+HttpEnvelope HttpEnvelope::from(const HttpResponse &response) {
+    HttpEnvelope envelope;
+    envelope.status = (uint16_t) response.status;
+    for (auto &header: response.headers)
+        for (auto &known: ENVELOPE_FIELDS)
+            if (header.first == known.header && envelope.fields.size() < 255) envelope.fields.emplace_back(known.field, header.second.substr(0, 255));
+    return envelope;
+}
+
+std::string HttpEnvelope::encode() const {
+    std::string out;
+    out += (char) (status & 0xff);
+    out += (char) (status >> 8);
+    out += (char) fields.size();
+    for (auto &field: fields) {
+        out += (char) field.first;
+        out += (char) field.second.size();
+        out += field.second;
+    }
+    return out;
+}
+
+size_t HttpEnvelope::decode(const std::string &data) {
+    if (data.size() < 3) return 0;
+    auto byte = [&data](size_t i) { return (uint8_t) data[i]; };
+    status = (uint16_t) (byte(0) | byte(1) << 8);
+    size_t count = byte(2), at = 3;
+    fields.clear();
+    for (size_t i = 0; i < count; ++i) {
+        if (at + 2 > data.size() || at + 2 + byte(at + 1) > data.size()) return 0;
+        fields.emplace_back((Field) byte(at), data.substr(at + 2, byte(at + 1)));
+        at += 2 + byte(at + 1);
+    }
+    return at;
+}
+
+std::string HttpEnvelope::get(Field field) const {
+    for (auto &f: fields)
+        if (f.first == field) return f.second;
+    return "";
+}
+
+const char *HttpEnvelope::name(Field field) {
+    for (auto &known: ENVELOPE_FIELDS)
+        if (known.field == field) return known.header;
+    return "unknown";
+}
@@ -0,0 +1,75 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+constexpr size_t HTTP_MAX_RESPONSE = (size_t) 128 << 10;// the gateway stops reading upstream after this: about 90 s on air at 12 kbit/s before compression
+constexpr int HTTP_READ_TIMEOUT_MS = 10000;              // silence from upstream before the response is cut short
+constexpr double HTTP_ACCEPTED_TIMEOUT = 180.0;          // seconds Node1 waits for a response after HTTP_ACK: upstream, then what is on air ahead of it
+constexpr double HTTP_REQ_MEMORY = 120.0;                // seconds the gateway takes a repeated HTTP_REQ for the one it has
+
+/* What Node1 asks for in HTTP_REQ: "[METHOD ]URL", e.g.
+ *   example.com                      GET /
+ *   HEAD http://example.com:8080/a?b
+ */
+struct HttpRequest {
+    std::string method = "GET";
+    std::string host;
+    unsigned short port = 80;
+    std::string path = "/";
+
+    // false if there is no host or the port is bad
+    static bool parse(const std::string &text, HttpRequest &request);
+
+    // what the gateway sends upstream
+    [[nodiscard]] std::string wire() const;
+};
+
+/* An upstream response split into its parts. Header names are lower case,
+ * the body is already de-chunked.
+ */
+struct HttpResponse {
+    int status = 0;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+
+    // false if raw does not start with a status line and a complete header
+    static bool parse(const std::string &raw, HttpResponse &response);
+
+    [[nodiscard]] const std::string *header(const std::string &name) const;
+};
+
+// Transfer-Encoding: chunked; whatever decoded before a malformed chunk
+std::string decodeChunked(const std::string &data);
+
+/* What goes on air in front of the body instead of the response header:
+ * STATUS   2 bytes, 0 if the gateway could not parse the response (the
+ *          body is then the raw upstream bytes)
+ * COUNT    1 byte
+ * COUNT x {FIELD 1 byte, LENGTH 1 byte, value}
+ * Only the fields below are kept; everything else is dropped.
+ */
+struct HttpEnvelope {
+    enum Field : uint8_t { CONTENT_TYPE = 1, LOCATION, CONTENT_ENCODING, LAST_MODIFIED, ETAG, CACHE_CONTROL, SET_COOKIE };
+
+    uint16_t status = 0;
+    std::vector<std::pair<Field, std::string>> fields;
+
+    // keeps the fields above, values longer than 255 bytes are cut
+    static HttpEnvelope from(const HttpResponse &response);
+
+    [[nodiscard]] std::string encode() const;
+
+    // bytes used, 0 while data does not hold a whole envelope yet
+    size_t decode(const std::string &data);
+
+    [[nodiscard]] std::string get(Field field) const;
+
+    static const char *name(Field field);
+};
+
+#endif//HTTP_H
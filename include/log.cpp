@@ -0,0 +1,468 @@
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include <array>
+#include <cctype>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+using namespace std::chrono_literals;
+
+std::atomic<LogLevel> Log::minLevel{LogLevel::Info};
+std::atomic<bool> Log::hexBodies{false};
+
+static const char *LEVEL_NAMES[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+static const char *CATEGORY_NAMES[] = {"phy", "link", "mac", "gateway", "client", "tunnel", "socket", "config", "xfer"};
+static_assert(sizeof(CATEGORY_NAMES) / sizeof(*CATEGORY_NAMES) == (size_t) LogCategory::COUNT, "one name per category");
+
+constexpr int LOG_HEX_BYTES = LOG_RECORD_TEXT / 16 * 16;// body bytes per hex dump record
+
+namespace {
+
+struct LogRecord {
+    std::atomic<uint64_t> sequence{0};
+    uint64_t ns = 0;
+    LogLevel level = LogLevel::Info;
+    LogCategory category = LogCategory::PHY;
+    bool continued = false;// further part of a message split by Log::text()
+    enum Kind : uint8_t { TEXT, FORMAT, FRAME, HEX } kind = TEXT;// FORMAT, FRAME, HEX: text holds raw bytes the writer formats
+    struct {
+        TYPEType type;
+        IPType ip, src;
+        PORTType port;
+        LENType len;
+        uint8_t what;   // FRAME: text is the caption, then the body preview
+        bool preview;   // FRAME: no hex dump follows
+        bool cut;       // FRAME: the body goes on beyond the preview
+        uint16_t offset;// HEX: of text in the body
+    } frame{};
+    uint16_t length = 0;
+    char text[LOG_RECORD_TEXT]{};
+};
+
+/* One conversion of a printf format. Log::write packs the arguments with
+ * it, the writer thread walks the same format again to unpack and print
+ * them. Anything it does not know (%n, %ls, long double) is formatted by
+ * the caller as before.
+ */
+struct Conversion {
+    enum Kind : uint8_t { END, SIGNED, UNSIGNED, CHAR, DOUBLE, STRING, POINTER, UNKNOWN } kind;
+    enum Size : uint8_t { INT, LONG, LONG_LONG, SIZE, INTMAX, PTRDIFF } size;
+    const char *literal;// the plain text before it, "%%" still escaped
+    const char *percent;// the '%', or the end of the format
+    const char *length; // where its length modifier would go: the spec up to here and the conversion are kept
+    const char *next;   // just after it
+    int stars;          // '*' for the width and precision, each an int argument ahead of the value
+    char conversion;
+};
+
+Conversion nextConversion(const char *at) {
+    Conversion c{};
+    c.literal = at;
+    while (*at && !(at[0] == '%' && at[1] != '%')) at += at[0] == '%' ? 2 : 1;
+    c.percent = c.next = at;
+    if (!*at) return c;
+    ++at;
+    while (*at && strchr("-+ #0", *at)) ++at;
+    if (*at == '*') ++c.stars, ++at;
+    while (isdigit((unsigned char) *at)) ++at;
+    if (*at == '.') {
+        ++at;
+        if (*at == '*') ++c.stars, ++at;
+        while (isdigit((unsigned char) *at)) ++at;
+    }
+    c.length = at;
+    bool longDouble = false;
+    for (; *at && strchr("hlzjtL", *at); ++at) {
+        if (*at == 'l') c.size = c.size == Conversion::LONG ? Conversion::LONG_LONG : Conversion::LONG;
+        else if (*at == 'z') c.size = Conversion::SIZE;
+        else if (*at == 'j') c.size = Conversion::INTMAX;
+        else if (*at == 't') c.size = Conversion::PTRDIFF;
+        else if (*at == 'L') longDouble = true;
+    }
+    c.conversion = *at;
+    c.next = *at ? at + 1 : at;
+    if (*at && strchr("di", *at)) c.kind = Conversion::SIGNED;
+    else if (*at && strchr("uoxX", *at)) c.kind = Conversion::UNSIGNED;
+    else if (*at == 'c' && c.size == Conversion::INT) c.kind = Conversion::CHAR;
+    else if (*at && strchr("fFeEgGaA", *at) && !longDouble) c.kind = Conversion::DOUBLE;
+    else if (*at == 's' && c.size == Conversion::INT) c.kind = Conversion::STRING;
+    else if (*at == 'p') c.kind = Conversion::POINTER;
+    else c.kind = Conversion::UNKNOWN;
+    return c;
+}
+
+// every integer goes in as 8 bytes and is printed with "ll"
+long long signedArgument(va_list *args, Conversion::Size size) {
+    switch (size) {
+        case Conversion::LONG: return va_arg(*args, long);
+        case Conversion::LONG_LONG: return va_arg(*args, long long);
+        case Conversion::SIZE: return (long long) va_arg(*args, size_t);
+        case Conversion::INTMAX: return (long long) va_arg(*args, intmax_t);
+        case Conversion::PTRDIFF: return va_arg(*args, ptrdiff_t);
+        default: return va_arg(*args, int);
+    }
+}
+
+unsigned long long unsignedArgument(va_list *args, Conversion::Size size) {
+    switch (size) {
+        case Conversion::LONG: return va_arg(*args, unsigned long);
+        case Conversion::LONG_LONG: return va_arg(*args, unsigned long long);
+        case Conversion::SIZE: return va_arg(*args, size_t);
+        case Conversion::INTMAX: return (unsigned long long) va_arg(*args, uintmax_t);
+        case Conversion::PTRDIFF: return (unsigned long long) va_arg(*args, ptrdiff_t);
+        default: return va_arg(*args, unsigned);
+    }
+}
+
+/* The format pointer and then the arguments, as they are: 8 bytes for a
+ * number, a string as its length (2 bytes) and its bytes with the NUL.
+ * False if a conversion is not known or they do not fit.
+ */
+bool packArguments(const char *format, va_list *args, char *out, uint16_t &length) {
+    char *at = out, *end = out + LOG_RECORD_TEXT;
+    auto put = [&at, end](const void *data, size_t n) {
+        if ((size_t) (end - at) < n) return false;
+        memcpy(at, data, n);
+        at += n;
+        return true;
+    };
+    if (!put(&format, sizeof(format))) return false;
+    for (auto c = nextConversion(format); c.kind != Conversion::END; c = nextConversion(c.next)) {
+        if (c.kind == Conversion::UNKNOWN) return false;
+        for (int i = 0; i < c.stars; ++i) {
+            long long star = va_arg(*args, int);
+            if (!put(&star, sizeof(star))) return false;
+        }
+        bool fits = true;
+        if (c.kind == Conversion::SIGNED || c.kind == Conversion::CHAR) {
+            long long value = c.kind == Conversion::CHAR ? va_arg(*args, int) : signedArgument(args, c.size);
+            fits = put(&value, sizeof(value));
+        } else if (c.kind == Conversion::UNSIGNED) {
+            unsigned long long value = unsignedArgument(args, c.size);
+            fits = put(&value, sizeof(value));
+        } else if (c.kind == Conversion::DOUBLE) {
+            double value = va_arg(*args, double);
+            fits = put(&value, sizeof(value));
+        } else if (c.kind == Conversion::POINTER) {
+            void *value = va_arg(*args, void *);
+            fits = put(&value, sizeof(value));
+        } else {
+            const char *value = va_arg(*args, const char *);
+            if (!value) value = "(null)";
+            size_t n = strlen(value) + 1;
+            if (n > UINT16_MAX) return false;
+            auto stored = (uint16_t) n;
+            fits = put(&stored, sizeof(stored)) && put(value, n);
+        }
+        if (!fits) return false;
+    }
+    length = (uint16_t) (at - out);
+    return true;
+}
+
+/* Bounded MPSC queue (Vyukov): each slot carries a sequence number telling
+ * whether it is free for the producer holding ticket n (sequence == n) or
+ * filled for the consumer (sequence == n + 1).
+ */
+class Logger {
+public:
+    static Logger &instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    bool push(const LogRecord &record) {
+        uint64_t ticket = head.load(std::memory_order_relaxed);
+        for (;;) {
+            auto &slot = slots[ticket & (LOG_QUEUE_RECORDS - 1)];
+            uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence == ticket) {
+                if (head.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed)) {
+                    slot.ns = record.ns;
+                    slot.level = record.level;
+                    slot.category = record.category;
+                    slot.continued = record.continued;
+                    slot.kind = record.kind;
+                    slot.frame = record.frame;
+                    slot.length = record.length;
+                    std::copy(record.text, record.text + record.length, slot.text);
+                    slot.sequence.store(ticket + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (sequence < ticket) {
+                droppedRecords.fetch_add(1, std::memory_order_relaxed);
+                return false;// full
+            } else {
+                ticket = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool open(const std::string &path) {
+        FILE *file = fopen(path.c_str(), "a");
+        if (!file) return false;
+        std::lock_guard<std::mutex> guard(outputLock);
+        if (output != stderr) fclose(output);
+        output = file;
+        return true;
+    }
+
+    void flush() {
+        uint64_t target = head.load(std::memory_order_acquire);
+        while (written.load(std::memory_order_acquire) < target && running) std::this_thread::sleep_for(1ms);
+    }
+
+    std::atomic<uint64_t> droppedRecords{0};
+
+private:
+    Logger() {
+        for (uint64_t i = 0; i < LOG_QUEUE_RECORDS; ++i) slots[i].sequence.store(i, std::memory_order_relaxed);
+#if !defined(_WIN32)
+        // only the forking thread survives fork(): hold the output across it and give the child its own writer
+        pthread_atfork([]() { instance().outputLock.lock(); }, []() { instance().outputLock.unlock(); },
+                       []() {
+                           instance().outputLock.unlock();
+                           instance().startWriter();
+                       });
+#endif
+        startWriter();
+    }
+
+    ~Logger() {
+        stop = true;
+        while (running) std::this_thread::sleep_for(1ms);
+        if (output != stderr) fclose(output);
+    }
+
+    // detached, so that a child after fork() can simply start another one
+    void startWriter() {
+        running = true;
+        std::thread([this]() {
+            drain();
+            running = false;
+        }).detach();
+    }
+
+    void drain() {
+        uint64_t reportedDrops = 0;
+        for (;;) {
+            bool any = false;
+            {
+                std::lock_guard<std::mutex> guard(outputLock);
+                for (;; ++tail) {
+                    auto &slot = slots[tail & (LOG_QUEUE_RECORDS - 1)];
+                    if (slot.sequence.load(std::memory_order_acquire) != tail + 1) break;
+                    writeRecord(slot);
+                    slot.sequence.store(tail + LOG_QUEUE_RECORDS, std::memory_order_release);
+                    written.store(tail + 1, std::memory_order_release);
+                    any = true;
+                }
+                if (any) fflush(output);
+            }
+            uint64_t drops = droppedRecords.load(std::memory_order_relaxed);
+            if (drops != reportedDrops) droppedMetric.add(drops - reportedDrops), reportedDrops = drops;
+            if (!any) {
+                if (stop) return;
+                std::this_thread::sleep_for(2ms);
+            }
+        }
+    }
+
+    void writeRecord(const LogRecord &record) {
+        if (record.kind == LogRecord::TEXT) return writeLine(record, record.continued, record.text, record.length);
+        if (record.kind == LogRecord::FORMAT) return writeFormatted(record);
+        auto &f = record.frame;
+        if (record.kind == LogRecord::FRAME) {
+            char header[96];
+            int n = snprintf(header, sizeof(header), " type %d %s <- %s port %d len %d", f.type, IPType2Str(f.ip).c_str(), IPType2Str(f.src).c_str(), f.port, f.len);
+            std::string line(record.text, f.what);
+            line.append(header, std::min((size_t) std::max(n, 0), sizeof(header) - 1));
+            if (f.preview) {
+                line += " \"";
+                for (int i = f.what; i < record.length; ++i) {
+                    auto c = (unsigned char) record.text[i];
+                    line += c >= 0x20 && c < 0x7f ? (char) c : '.';
+                }
+                line += f.cut ? "...\"" : "\"";
+            }
+            return writeLine(record, false, line.data(), line.size());
+        }
+        static const char digits[] = "0123456789abcdef";
+        for (int at = 0; at < record.length; at += 16) {
+            char line[16 * 3 + 8];
+            int n = snprintf(line, sizeof(line), "%04x ", f.offset + at);
+            for (int i = at; i < std::min(at + 16, (int) record.length); ++i) {
+                auto c = (unsigned char) record.text[i];
+                line[n++] = ' ', line[n++] = digits[c >> 4], line[n++] = digits[c & 15];
+            }
+            writeLine(record, false, line, n);
+        }
+    }
+
+    // Log::write's format, its arguments taken back out of the record in the order packArguments put them in
+    void writeFormatted(const LogRecord &record) {
+        const char *format, *at = record.text + sizeof(format);
+        memcpy(&format, record.text, sizeof(format));
+        auto take = [&at](void *data, size_t n) {
+            memcpy(data, at, n);
+            at += n;
+        };
+        std::string line;
+        for (auto c = nextConversion(format);; c = nextConversion(c.next)) {
+            for (const char *p = c.literal; p < c.percent; ++p) {
+                line += *p;
+                if (*p == '%') ++p;// "%%"
+            }
+            if (c.kind == Conversion::END) break;
+            int stars[2] = {0, 0};
+            for (int i = 0; i < c.stars; ++i) {
+                long long star;
+                take(&star, sizeof(star));
+                stars[i] = (int) star;
+            }
+            std::string spec(c.percent, c.length);
+            if (c.kind == Conversion::SIGNED || c.kind == Conversion::UNSIGNED) spec += "ll";
+            spec += c.conversion;
+            if (c.kind == Conversion::SIGNED || c.kind == Conversion::UNSIGNED || c.kind == Conversion::DOUBLE || c.kind == Conversion::POINTER) {
+                union {
+                    long long i;
+                    unsigned long long u;
+                    double d;
+                    void *p;
+                } value;
+                take(&value, sizeof(value.i));
+                if (c.kind == Conversion::SIGNED) appendConversion(line, spec, c.stars, stars, value.i);
+                else if (c.kind == Conversion::UNSIGNED) appendConversion(line, spec, c.stars, stars, value.u);
+                else if (c.kind == Conversion::DOUBLE) appendConversion(line, spec, c.stars, stars, value.d);
+                else appendConversion(line, spec, c.stars, stars, value.p);
+            } else if (c.kind == Conversion::CHAR) {
+                long long value;
+                take(&value, sizeof(value));
+                appendConversion(line, spec, c.stars, stars, (int) value);
+            } else {
+                uint16_t n;
+                take(&n, sizeof(n));
+                appendConversion(line, spec, c.stars, stars, at);
+                at += n;
+            }
+        }
+        writeLine(record, false, line.data(), line.size());
+    }
+
+    template<typename T>
+    static void appendConversion(std::string &line, const std::string &spec, int stars, const int *star, T value) {
+        char out[LOG_RECORD_TEXT];
+        int n = stars == 0 ? snprintf(out, sizeof(out), spec.c_str(), value)
+                : stars == 1 ? snprintf(out, sizeof(out), spec.c_str(), star[0], value)
+                             : snprintf(out, sizeof(out), spec.c_str(), star[0], star[1], value);
+        if (n > 0) line.append(out, std::min((size_t) n, sizeof(out) - 1));
+    }
+
+    void writeLine(const LogRecord &record, bool continued, const char *text, size_t length) {
+        fprintf(output, "[%10.6f] %-5s %-7s%c %.*s\n", (double) record.ns * 1e-9, LEVEL_NAMES[(int) record.level], CATEGORY_NAMES[(int) record.category],
+                continued ? '|' : ':', (int) length, text);
+    }
+
+    Counter &droppedMetric = Metrics::counter("log.dropped");// looked up first so the registry outlives us
+    std::array<LogRecord, LOG_QUEUE_RECORDS> slots;
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> written{0};
+    uint64_t tail = 0;
+    std::mutex outputLock;// the writer thread vs. open()
+    FILE *output = stderr;
+    std::atomic<bool> stop{false}, running{false};
+};
+
+}// namespace
+
+static_assert((LOG_QUEUE_RECORDS & (LOG_QUEUE_RECORDS - 1)) == 0, "LOG_QUEUE_RECORDS must be a power of two");
+
+void Log::push(LogLevel level, LogCategory category, const char *text, size_t length) {
+    LogRecord record;
+    record.ns = Trace::nanoseconds();
+    record.level = level;
+    record.category = category;
+    for (bool first = true; first || length > 0; first = false) {
+        size_t n = std::min(length, (size_t) LOG_RECORD_TEXT);
+        record.continued = !first;
+        record.length = (uint16_t) n;
+        std::copy(text, text + n, record.text);
+        if (!Logger::instance().push(record)) return;
+        text += n, length -= n;
+    }
+}
+
+// only copies the arguments: the writer thread formats them, unless they do not fit a record
+void Log::write(LogLevel level, LogCategory category, const char *format, ...) {
+    if (!enabled(level)) return;
+    LogRecord record;
+    record.ns = Trace::nanoseconds();
+    record.level = level;
+    record.category = category;
+    record.kind = LogRecord::FORMAT;
+    va_list args, again;
+    va_start(args, format);
+    va_copy(again, args);
+    bool packed = packArguments(format, &args, record.text, record.length);
+    va_end(args);
+    if (packed) {
+        va_end(again);
+        Logger::instance().push(record);
+        return;
+    }
+    char text[LOG_RECORD_TEXT];
+    int n = vsnprintf(text, sizeof(text), format, again);
+    va_end(again);
+    if (n < 0) return;
+    push(level, category, text, std::min((size_t) n, sizeof(text) - 1));
+}
+
+void Log::text(LogLevel level, LogCategory category, const std::string &message) {
+    if (!enabled(level)) return;
+    push(level, category, message.data(), message.size());
+}
+
+// only copies: the addresses, the preview and the hex dump are formatted on the writer thread
+void Log::frame(LogLevel level, LogCategory category, const char *what, const FrameType &frame) {
+    if (!enabled(level)) return;
+    bool hex = hexBodies.load(std::memory_order_relaxed);
+    LogRecord record;
+    record.ns = Trace::nanoseconds();
+    record.level = level;
+    record.category = category;
+    record.kind = LogRecord::FRAME;
+    record.frame.type = frame.type;
+    record.frame.ip = frame.ip;
+    record.frame.src = frame.src;
+    record.frame.port = frame.port;
+    record.frame.len = frame.len;
+    record.frame.what = (uint8_t) std::min(strlen(what), (size_t) (LOG_RECORD_TEXT - LOG_BODY_PREVIEW));
+    record.frame.preview = !hex;
+    record.frame.cut = !hex && frame.body.size() > (size_t) LOG_BODY_PREVIEW;
+    size_t shown = hex ? 0 : std::min(frame.body.size(), (size_t) LOG_BODY_PREVIEW);
+    std::copy(what, what + record.frame.what, record.text);
+    std::copy(frame.body.data(), frame.body.data() + shown, record.text + record.frame.what);
+    record.length = (uint16_t) (record.frame.what + shown);
+    if (!Logger::instance().push(record) || !hex) return;
+    record.kind = LogRecord::HEX;
+    for (size_t offset = 0; offset < frame.body.size(); offset += LOG_HEX_BYTES) {
+        size_t n = std::min(frame.body.size() - offset, (size_t) LOG_HEX_BYTES);
+        record.frame.offset = (uint16_t) offset;
+        record.length = (uint16_t) n;
+        std::copy(frame.body.data() + offset, frame.body.data() + offset + n, record.text);
+        if (!Logger::instance().push(record)) return;
+    }
+}
+
+bool Log::open(const std::string &path) { return Logger::instance().open(path); }
+
+void Log::flush() { Logger::instance().flush(); }
+
+uint64_t Log::dropped() { return Logger::instance().droppedRecords.load(std::memory_order_relaxed); }
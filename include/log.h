@@ -0,0 +1,65 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "utils.h"
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
+#include <string>
+
+enum class LogLevel : uint8_t { Debug = 0, Info = 1, Warn = 2, Error = 3 };// not DEBUG / ERROR: builds define those as macros
+enum class LogCategory : uint8_t { PHY, LINK, MAC, GATEWAY, CLIENT, TUNNEL, SOCKET, CONFIG, TRANSFER, COUNT };
+
+constexpr int LOG_QUEUE_RECORDS = 4096;// power of two
+constexpr int LOG_RECORD_TEXT = 232;   // longer messages continue in further records
+constexpr int LOG_BODY_PREVIEW = 48;   // bytes of a frame body shown unless hex dumps are on
+
+/* Asynchronous logger.
+ * Callers copy the format and its arguments, or a frame, raw into fixed-size
+ * records that go through a bounded lock-free MPSC queue; a background
+ * thread formats them, adds time, level and category and does the actual
+ * (buffered) writes. Nothing on the caller's side blocks or touches a file.
+ * When the queue is full the record is dropped and counted.
+ */
+class Log {
+public:
+    // format is read after the call returns: a string literal, as LOG() passes
+#if defined(__GNUC__)
+    __attribute__((format(printf, 3, 4)))
+#endif
+    static void write(LogLevel level, LogCategory category, const char *format, ...);
+
+    // arbitrary text, split over as many records as needed
+    static void text(LogLevel level, LogCategory category, const std::string &message);
+
+    // "TYPE ip <- src port len" plus the body: a printable preview, or a hex dump if enabled
+    static void frame(LogLevel level, LogCategory category, const char *what, const FrameType &frame);
+
+    static bool enabled(LogLevel level) { return level >= minLevel.load(std::memory_order_relaxed); }
+
+    static void setLevel(LogLevel level) { minLevel = level; }
+
+    static void setHexBodies(bool on) { hexBodies = on; }
+
+    // log to this file instead of stderr
+    static bool open(const std::string &path);
+
+    // wait until everything queued so far is written
+    static void flush();
+
+    static uint64_t dropped();
+
+private:
+    static void push(LogLevel level, LogCategory category, const char *text, size_t length);
+
+    static std::atomic<LogLevel> minLevel;
+    static std::atomic<bool> hexBodies;
+};
+
+// LOG(Info, PHY, "len = %u", frame.len); arguments are not evaluated when the level is off
+#define LOG(level, category, ...)                                                                                                                                                  \
+    do {                                                                                                                                                                           \
+        if (Log::enabled(LogLevel::level)) Log::write(LogLevel::level, LogCategory::category, __VA_ARGS__);                                                                      \
+    } while (false)
+
+#endif//LOG_H
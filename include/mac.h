@@ -0,0 +1,183 @@
+#ifndef MAC_H
+#define MAC_H
+
+#include "config.h"
+#include "reader.h"
+#include "route.h"
+#include "utils.h"
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <vector>
+
+constexpr bool LINK_MAC = true;           // carrier sense before every transmission (baseband only)
+constexpr float CS_ENERGY_THRESHOLD = 0.01f;// mean square of the input above which the medium is busy
+constexpr float CS_ENERGY_ALPHA = 0.01f;  // per-sample smoothing of the energy estimate
+constexpr double MAC_SLOT = 0.01;         // seconds, about one audio block
+constexpr int MAC_DIFS_SLOTS = 2;
+constexpr int MAC_CW_MIN = 4;
+constexpr int MAC_CW_MAX = 64;
+constexpr int MAC_MAX_RETRIES = 6;
+constexpr size_t MAC_RTS_THRESHOLD = 512; // bytes in a burst before RTS/CTS is used
+constexpr double MAC_CTS_TIMEOUT = 0.3;   // seconds
+constexpr double MAC_BUSY_TIMEOUT = 1.0;  // seconds of busy medium before an attempt is given up
+
+using MacControlSender = std::function<void(const FrameType &)>;
+
+struct MacStats {
+    std::atomic<unsigned> transmissions{0};
+    std::atomic<unsigned> deferrals{0}; // backoff frozen because the medium became busy, or busy for MAC_BUSY_TIMEOUT
+    std::atomic<unsigned> collisions{0};// RTS without CTS
+    std::atomic<unsigned> drops{0};     // gave up after MAC_MAX_RETRIES
+    std::atomic<unsigned> rtsSent{0};
+    std::atomic<unsigned> ctsSent{0};
+};
+
+/* CSMA/CA for one lane.
+ * The medium is busy while the input energy is above CS_ENERGY_THRESHOLD,
+ * while the Reader is inside a frame, or while a reservation (NAV) heard in
+ * an RTS/CTS is running. acquire() waits for DIFS of idle medium plus a random
+ * backoff that only counts down while idle; bursts of MAC_RTS_THRESHOLD bytes
+ * or more additionally reserve the medium with RTS/CTS. A missing CTS counts
+ * as a collision and doubles the contention window; a medium that stays busy
+ * for MAC_BUSY_TIMEOUT costs an attempt as well. CTS replies are queued by the
+ * Reader thread and sent by the lane thread, between slots while it contends.
+ */
+class Mac {
+public:
+    // controlSender runs on the lane thread, wakeSender on the Reader thread when a reply is queued
+    Mac(const Reader &laneReader, MacControlSender controlSender, std::function<void()> wakeSender, IPType localAddress)
+        : reader(laneReader), sendControl(std::move(controlSender)), wake(std::move(wakeSender)), local(localAddress), random(std::random_device()()) {}
+
+    // Reader input path: audio samples as they arrive
+    void feed(const float *data, int n) {
+        float e = energy;
+        for (int i = 0; i < n; ++i) e += CS_ENERGY_ALPHA * (data[i] * data[i] - e);
+        energy = e;
+    }
+
+    [[nodiscard]] bool busy() const { return energy > CS_ENERGY_THRESHOLD || reader.isReceiving() || steady_clock::now() < navUntil(); }
+
+    // returns false if the medium could not be reserved within MAC_MAX_RETRIES, or the lane thread should exit
+    bool acquire(size_t burstBytes, double burstSeconds, IPType dst) {
+        int cw = MAC_CW_MIN;
+        for (int attempt = 0; attempt <= MAC_MAX_RETRIES; ++attempt) {
+            bool idle = waitIdle();
+            for (int slots = std::uniform_int_distribution<int>(0, cw - 1)(random); idle && slots > 0;) {
+                slot();
+                if (busy()) {
+                    ++statistics.deferrals;
+                    idle = waitIdle();
+                } else {
+                    --slots;
+                }
+            }
+            if (aether::Thread::currentThreadShouldExit()) return false;
+            if (!idle) {
+                ++statistics.deferrals;
+                continue;
+            }
+            if (burstBytes < MAC_RTS_THRESHOLD || reserve(burstSeconds, dst)) {
+                ++statistics.transmissions;
+                return true;
+            }
+            ++statistics.collisions;
+            cw = std::min(2 * cw, MAC_CW_MAX);
+        }
+        ++statistics.drops;
+        return false;
+    }
+
+    // MAC_RTS / MAC_CTS frames heard on this lane; true if the frame was consumed
+    bool onControl(const FrameType &frame) {
+        if (frame.type != Config::MAC_RTS && frame.type != Config::MAC_CTS) return false;
+        if (local != 0 && frame.src == local) return true;// echo of our own control frame
+        unsigned short ms = 0;
+        if (frame.body.size() >= sizeof(ms)) std::copy(frame.body.begin(), frame.body.begin() + sizeof(ms), (char *) &ms);
+        bool forUs = frame.ip == local || frame.ip == BROADCAST_IP;
+        if (frame.type == Config::MAC_CTS && forUs) {
+            if (waitingForCts) ctsReceived.signal();
+            return true;
+        }
+        // contending RTS, or (without addresses) the echo of our own one
+        if (waitingForCts) return true;
+        // somebody else holds the medium for the announced time; that includes
+        // the peer whose RTS we answer, so we stay quiet between its frames
+        setNav(ms / 1000.0);
+        if (frame.type == Config::MAC_RTS && forUs) {
+            {
+                std::lock_guard<std::mutex> lock(repliesLock);
+                replies.push_back(FrameType{Config::MAC_CTS, frame.src, frame.port, frame.body});
+            }
+            wake();
+        }
+        return true;
+    }
+
+    // lane thread: send the CTS replies queued by onControl()
+    void sendReplies() {
+        std::vector<FrameType> out;
+        {
+            std::lock_guard<std::mutex> lock(repliesLock);
+            if (replies.empty()) return;
+            out.swap(replies);
+        }
+        for (auto &frame: out) {
+            sendControl(frame);
+            ++statistics.ctsSent;
+        }
+    }
+
+    [[nodiscard]] const MacStats &stats() const { return statistics; }
+
+private:
+    // false if the medium stayed busy for MAC_BUSY_TIMEOUT or the lane thread should exit
+    bool waitIdle() {
+        MyTimer timer;
+        for (int idle = 0; idle < MAC_DIFS_SLOTS;) {
+            if (timer.duration() > MAC_BUSY_TIMEOUT || aether::Thread::currentThreadShouldExit()) return false;
+            slot();
+            idle = busy() ? 0 : idle + 1;
+        }
+        return true;
+    }
+
+    // one slot of waiting, answering RTS meanwhile
+    void slot() {
+        sendReplies();
+        aether::Thread::sleep((int) (MAC_SLOT * 1000));
+    }
+
+    bool reserve(double burstSeconds, IPType dst) {
+        auto ms = (unsigned short) std::min(65535.0, (burstSeconds + MAC_CTS_TIMEOUT) * 1000);
+        ctsReceived.reset();
+        waitingForCts = true;
+        sendControl(FrameType{Config::MAC_RTS, dst, 0, inString(ms)});
+        ++statistics.rtsSent;
+        bool ok = ctsReceived.wait((int) (MAC_CTS_TIMEOUT * 1000));
+        waitingForCts = false;
+        return ok;
+    }
+
+    void setNav(double seconds) {
+        auto until = (steady_clock::now() + std::chrono::duration_cast<steady_clock::duration>(std::chrono::duration<double>(seconds))).time_since_epoch().count();
+        if (until > nav) nav = until;
+    }
+
+    [[nodiscard]] std::chrono::time_point<steady_clock> navUntil() const { return std::chrono::time_point<steady_clock>(steady_clock::duration(nav.load())); }
+
+    const Reader &reader;
+    MacControlSender sendControl;
+    std::function<void()> wake;
+    std::mutex repliesLock;
+    std::vector<FrameType> replies;
+    const IPType local;
+    std::mt19937 random;
+    std::atomic<float> energy{0};
+    std::atomic<steady_clock::rep> nav{0};
+    std::atomic<bool> waitingForCts{false};
+    aether::WaitableEvent ctsReceived;
+    MacStats statistics;
+};
+
+#endif//MAC_H
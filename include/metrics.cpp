@@ -0,0 +1,140 @@
+#include "metrics.h"
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <vector>
+
+int metricShard() {
+    static std::atomic<int> nextShard{0};
+    thread_local int shard = nextShard.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS;
+    return shard;
+}
+
+Histogram::Summary Histogram::summary() const {
+    std::vector<uint64_t> merged(HISTOGRAM_BUCKETS, 0);
+    Summary s;
+    for (int i = 0; i < METRIC_SHARDS; ++i) {
+        for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) merged[b] += shards[i].counts[b].load(std::memory_order_relaxed);
+        s.sum += shards[i].sum.load(std::memory_order_relaxed);
+    }
+    for (auto c: merged) s.count += c;
+    if (s.count == 0) return s;
+    uint64_t seen = 0;
+    uint64_t p50 = (s.count + 1) / 2, p90 = (s.count * 9 + 9) / 10, p99 = (s.count * 99 + 99) / 100;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+        if (merged[b] == 0) continue;
+        seen += merged[b];
+        if (s.p50 == 0 && seen >= p50) s.p50 = lowerBound(b);
+        if (s.p90 == 0 && seen >= p90) s.p90 = lowerBound(b);
+        if (s.p99 == 0 && seen >= p99) s.p99 = lowerBound(b);
+        s.max = lowerBound(b);
+    }
+    return s;
+}
+
+Metrics &Metrics::instance() {
+    static Metrics metrics;
+    return metrics;
+}
+
+Metrics::~Metrics() {
+    stop = true;
+    if (reporter.joinable()) reporter.join();
+}
+
+Counter &Metrics::counter(const std::string &name) {
+    auto &m = instance();
+    std::lock_guard<std::mutex> lock(m.registryLock);
+    auto &slot = m.counters[name];
+    if (!slot) slot = std::make_unique<Counter>();
+    return *slot;
+}
+
+Gauge &Metrics::gauge(const std::string &name) {
+    auto &m = instance();
+    std::lock_guard<std::mutex> lock(m.registryLock);
+    auto &slot = m.gauges[name];
+    if (!slot) slot = std::make_unique<Gauge>();
+    return *slot;
+}
+
+Histogram &Metrics::histogram(const std::string &name) {
+    auto &m = instance();
+    std::lock_guard<std::mutex> lock(m.registryLock);
+    auto &slot = m.histograms[name];
+    if (!slot) slot = std::make_unique<Histogram>();
+    return *slot;
+}
+
+std::string Metrics::text() {
+    auto &m = instance();
+    std::lock_guard<std::mutex> lock(m.snapshotLock);
+    return m.lastText;
+}
+
+std::string Metrics::json() {
+    auto &m = instance();
+    std::lock_guard<std::mutex> lock(m.snapshotLock);
+    return m.lastJson;
+}
+
+void Metrics::startReporter(const std::string &path) {
+    auto &m = instance();
+    std::lock_guard<std::mutex> lock(m.registryLock);
+    if (m.reporter.joinable()) return;
+    m.reportPath = path;
+    m.reporter = std::thread([&m]() {
+        while (!m.stop) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(METRICS_PERIOD_MS));
+            m.report();
+        }
+    });
+}
+
+void Metrics::report() {
+    std::ostringstream text, json;
+    json << "{\"counters\":{";
+    {
+        std::lock_guard<std::mutex> lock(registryLock);
+        bool first = true;
+        for (auto &[name, counter]: counters) {
+            uint64_t value = counter->value(), &last = lastValues[name];
+            double rate = (double) (value - last) * 1000 / METRICS_PERIOD_MS;
+            last = value;
+            text << name << " " << value << " (" << rate << "/s)\n";
+            json << (first ? "" : ",") << "\"" << name << "\":{\"value\":" << value << ",\"rate\":" << rate << "}";
+            first = false;
+        }
+        json << "},\"gauges\":{";
+        first = true;
+        for (auto &[name, gauge]: gauges) {
+            text << name << " " << gauge->value() << "\n";
+            json << (first ? "" : ",") << "\"" << name << "\":" << gauge->value();
+            first = false;
+        }
+        json << "},\"histograms\":{";
+        first = true;
+        for (auto &[name, histogram]: histograms) {
+            auto s = histogram->summary();
+            text << name << " n=" << s.count << " p50=" << s.p50 << " p90=" << s.p90 << " p99=" << s.p99 << " max=" << s.max << "\n";
+            json << (first ? "" : ",") << "\"" << name << "\":{\"count\":" << s.count << ",\"sum\":" << s.sum << ",\"p50\":" << s.p50
+                 << ",\"p90\":" << s.p90 << ",\"p99\":" << s.p99 << ",\"max\":" << s.max << "}";
+            first = false;
+        }
+        json << "}}";
+    }
+    {
+        std::lock_guard<std::mutex> lock(snapshotLock);
+        lastText = text.str();
+        lastJson = json.str();
+    }
+    if (reportPath.empty()) return;
+    // write aside and rename so readers never see half a file
+    std::string tmp = reportPath + ".tmp";
+    if (FILE *file = fopen(tmp.c_str(), "w")) {
+        fputs(json.str().c_str(), file);
+        fclose(file);
+        std::remove(reportPath.c_str());
+        std::rename(tmp.c_str(), reportPath.c_str());
+    }
+}
@@ -0,0 +1,142 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+constexpr int METRIC_SHARDS = 8;        // writers spread over this many cache lines
+constexpr int HISTOGRAM_SUB_BITS = 3;   // 8 linear sub-buckets per power of two, <= 12.5% error
+constexpr int HISTOGRAM_BUCKETS = (64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS;
+constexpr int METRICS_PERIOD_MS = 1000; // snapshot interval of the reporter
+
+// index of the calling thread's shard, fixed for the thread's lifetime
+int metricShard();
+
+// monotonically increasing, written without locks from any thread
+class Counter {
+public:
+    void add(uint64_t n = 1) { shards[metricShard()].value.fetch_add(n, std::memory_order_relaxed); }
+
+    [[nodiscard]] uint64_t value() const {
+        uint64_t sum = 0;
+        for (auto &shard: shards) sum += shard.value.load(std::memory_order_relaxed);
+        return sum;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> value{0};
+    };
+    std::array<Shard, METRIC_SHARDS> shards;
+};
+
+// last written value, e.g. a queue depth
+class Gauge {
+public:
+    void set(int64_t n) { current.store(n, std::memory_order_relaxed); }
+
+    [[nodiscard]] int64_t value() const { return current.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> current{0};
+};
+
+/* Log-linear (HDR style) histogram of non-negative integers, e.g. latencies
+ * in microseconds. Values below 2^HISTOGRAM_SUB_BITS get exact buckets,
+ * larger ones keep their top HISTOGRAM_SUB_BITS + 1 significant bits.
+ */
+class Histogram {
+public:
+    static int bucketOf(uint64_t v) {
+        if (v < (1u << HISTOGRAM_SUB_BITS)) return (int) v;
+#if defined(_MSC_VER)
+        unsigned long msb;
+        _BitScanReverse64(&msb, v);
+#else
+        int msb = 63 - __builtin_clzll(v);
+#endif
+        int shift = (int) msb - HISTOGRAM_SUB_BITS;
+        return ((shift + 1) << HISTOGRAM_SUB_BITS) + (int) ((v >> shift) & ((1u << HISTOGRAM_SUB_BITS) - 1));
+    }
+
+    // smallest value that lands in the bucket
+    static uint64_t lowerBound(int bucket) {
+        if (bucket < (1 << HISTOGRAM_SUB_BITS)) return bucket;
+        int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+        return (uint64_t) ((1 << HISTOGRAM_SUB_BITS) | (bucket & ((1 << HISTOGRAM_SUB_BITS) - 1))) << shift;
+    }
+
+    void record(uint64_t v) {
+        auto &shard = shards[metricShard()];
+        shard.counts[bucketOf(v)].fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(v, std::memory_order_relaxed);
+    }
+
+    struct Summary {
+        uint64_t count = 0, sum = 0, p50 = 0, p90 = 0, p99 = 0, max = 0;
+    };
+
+    [[nodiscard]] Summary summary() const;
+
+private:
+    struct alignas(64) Shard {
+        std::array<std::atomic<uint64_t>, HISTOGRAM_BUCKETS> counts{};
+        std::atomic<uint64_t> sum{0};
+    };
+    std::unique_ptr<Shard[]> shards{new Shard[METRIC_SHARDS]};
+};
+
+/* Named metrics of the whole process.
+ * Lookup takes a lock, so call sites keep the reference, typically in a
+ * function-local static:  static auto &frames = Metrics::counter("link.frames_rx");
+ * A reporter thread takes a snapshot every METRICS_PERIOD_MS, derives
+ * per-second rates for the counters and writes it as JSON to metrics.json.
+ */
+class Metrics {
+public:
+    static Counter &counter(const std::string &name);
+
+    static Gauge &gauge(const std::string &name);
+
+    static Histogram &histogram(const std::string &name);
+
+    // latest periodic snapshot
+    static std::string text();
+
+    static std::string json();
+
+    // starts the reporter thread once; path may be empty to skip the file
+    static void startReporter(const std::string &path = "metrics.json");
+
+private:
+    Metrics() = default;
+
+    ~Metrics();
+
+    static Metrics &instance();
+
+    void report();
+
+    std::mutex registryLock;
+    std::map<std::string, std::unique_ptr<Counter>> counters;
+    std::map<std::string, std::unique_ptr<Gauge>> gauges;
+    std::map<std::string, std::unique_ptr<Histogram>> histograms;
+
+    std::mutex snapshotLock;
+    std::string lastText, lastJson;
+    std::map<std::string, uint64_t> lastValues;
+    std::string reportPath;
+    std::atomic<bool> stop{false};
+    std::thread reporter;
+};
+
+#endif//METRICS_H
@@ -0,0 +1,247 @@
+#ifndef PASSBAND_H
+#define PASSBAND_H
+
+#include "pool.h"
+#include "utils.h"
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+constexpr double PI = 3.14159265358979323846;
+constexpr double DEFAULT_SAMPLE_RATE = 48000.0;
+constexpr int PASSBAND_SYMBOL = 12;          // audio samples per bit, 4000 bit/s at 48 kHz
+constexpr double PASSBAND_BANDWIDTH = 3.0;   // of the receive filter, in bit rates
+constexpr float PASSBAND_EDGE = 0.5f;        // of the way to the next bit's amplitude the carrier moves per sample
+constexpr int PASSBAND_GATE = 1;             // samples either side of the decision instant the early-late gate looks at
+constexpr int PASSBAND_DELAY = PASSBAND_SYMBOL / 2;// samples a bit is decided after its instant, time to see where a rise ends
+constexpr int PASSBAND_HISTORY = PASSBAND_SYMBOL;  // envelopes kept, > PASSBAND_DELAY + PASSBAND_GATE
+constexpr float PASSBAND_TIMING_GAIN = 0.5f; // samples the instant moves per bit at most
+constexpr int PASSBAND_RESYNC = 32;          // 0 bits in a row after which the next rise of the carrier sets the instant afresh
+constexpr float PASSBAND_MIN_SURE = 0.25f;   // smallest chip handed on: twice that is above the Reader's PREAMBLE_THRESHOLD
+constexpr double NODE1_CARRIER = 6000.0;     // defaults, see CARRIER1/CARRIER2 in config.txt; occupies about 0 - 12k Hz
+constexpr double NODE2_CARRIER = 18000.0;    // occupies about 12k - 24k Hz; 3 bit rates from NODE1_CARRIER, so each sums to nothing over the other's symbol
+constexpr float PASSBAND_NOISE_FLOOR = 0.01f;
+constexpr float PASSBAND_PEAK_DECAY = 0.999f;// per bit
+constexpr int OSCILLATOR_LANES = 8;          // carrier samples computed side by side
+
+/* Frequency-division duplex: each node transmits on its own carrier and
+ * band-pass filters its input around the carrier of the other node, so both
+ * directions can be on the air at once without hearing each other.
+ */
+struct PassbandConfig {
+    double txCarrier;
+    double rxCarrier;
+    double sampleRate = DEFAULT_SAMPLE_RATE;
+};
+
+// RBJ band-pass biquad (0 dB peak gain), transposed direct form II
+class Biquad {
+public:
+    Biquad() = default;
+
+    Biquad(double centre, double q, double sampleRate) {
+        double w0 = 2 * PI * centre / sampleRate, alpha = std::sin(w0) / (2 * q), a0 = 1 + alpha;
+        b0 = (float) (alpha / a0);
+        b2 = (float) (-alpha / a0);
+        a1 = (float) (-2 * std::cos(w0) / a0);
+        a2 = (float) ((1 - alpha) / a0);
+    }
+
+    void process(float *data, int n) {
+        float s1 = z1, s2 = z2;
+        for (int i = 0; i < n; ++i) {
+            float x = data[i], y = b0 * x + s1;
+            s1 = -a1 * y + s2;// b1 is 0 for a band-pass
+            s2 = b2 * x - a2 * y;
+            data[i] = y;
+        }
+        z1 = s1, z2 = s2;
+    }
+
+private:
+    float b0 = 1, b2 = 0, a1 = 0, a2 = 0;
+    float z1 = 0, z2 = 0;
+};
+
+/* cos and sin of a carrier. Lane k holds the phasor of the k-th sample of a
+ * group of OSCILLATOR_LANES, and all lanes turn by OSCILLATOR_LANES steps at
+ * once: the lanes do not depend on each other, so the compiler does a group
+ * as a few vector multiplies instead of calling std::cos and std::sin per
+ * sample. The phasors are put back on the unit circle after every block.
+ */
+class Oscillator {
+public:
+    explicit Oscillator(double step) {
+        for (int k = 0; k < OSCILLATOR_LANES; ++k) re[k] = (float) std::cos(k * step), im[k] = (float) std::sin(k * step);
+        turnRe = (float) std::cos(OSCILLATOR_LANES * step);
+        turnIm = (float) std::sin(OSCILLATOR_LANES * step);
+    }
+
+    // the next n samples of the carrier
+    void fill(float *cosOut, float *sinOut, int n) {
+        int i = 0;
+        for (; i < n && used < OSCILLATOR_LANES; ++i, ++used) cosOut[i] = re[used], sinOut[i] = im[used];
+        while (i < n) {
+            turn();
+            if (i + OSCILLATOR_LANES <= n) {
+                for (int k = 0; k < OSCILLATOR_LANES; ++k) cosOut[i + k] = re[k], sinOut[i + k] = im[k];
+                i += OSCILLATOR_LANES;
+            } else
+                for (used = 0; i < n; ++i, ++used) cosOut[i] = re[used], sinOut[i] = im[used];
+        }
+        for (int k = 0; k < OSCILLATOR_LANES; ++k) {
+            float gain = 1 / std::sqrt(re[k] * re[k] + im[k] * im[k]);
+            re[k] *= gain, im[k] *= gain;
+        }
+    }
+
+private:
+    void turn() {
+        for (int k = 0; k < OSCILLATOR_LANES; ++k) {
+            float r = re[k] * turnRe - im[k] * turnIm;
+            im[k] = re[k] * turnIm + im[k] * turnRe;
+            re[k] = r;
+        }
+        used = OSCILLATOR_LANES;
+    }
+
+    float re[OSCILLATOR_LANES]{}, im[OSCILLATOR_LANES]{};
+    float turnRe, turnIm;
+    int used = 0;// samples of the current group already handed out
+};
+
+/* On-off keyed carrier, one symbol of PASSBAND_SYMBOL samples per bit: the
+ * Writer's LENGTH_OF_ONE_BIT Manchester samples of a 1 are sent as carrier,
+ * of a 0 (or idle) as silence. The receiver sums the carrier over a sliding
+ * symbol window and decides each bit at the end of a symbol, against half
+ * the peak it has seen, PASSBAND_DELAY samples later. After silence,
+ * PASSBAND_RESYNC 0 bits or a jump far above that peak, the instant is put
+ * where the sum stops rising, at the end of the first 1 (a frame starts
+ * with one). From there an early-late gate keeps it: of the sums just
+ * before and just after it, the one further from the threshold pulls it
+ * that way, which follows the edges between 1 and 0 as the two sound
+ * cards' clocks drift apart. Each bit is handed on as the Writer's
+ * Manchester samples, scaled by how sure the decision was, so the Reader
+ * sees the same waveform as in baseband mode.
+ */
+class PassbandModem {
+public:
+    explicit PassbandModem(const PassbandConfig &band)
+        : txCarrier(2 * PI * band.txCarrier / band.sampleRate), rxCarrier(2 * PI * band.rxCarrier / band.sampleRate) {
+        // the same width in Hz at any carrier: alpha = sin(w0) / 2q sets it, not w0 / q
+        double w0 = 2 * PI * band.rxCarrier / band.sampleRate, q = std::sin(w0) / (2 * std::tan(PI * PASSBAND_BANDWIDTH / PASSBAND_SYMBOL));
+        for (auto &stage: filter) stage = Biquad(band.rxCarrier, q, band.sampleRate);
+    }
+
+    // fill n audio samples from the baseband bits queued by the Writer (caller holds its lock)
+    void modulate(SampleQueue &baseband, float *data, int n) {
+        if ((int) txCos.size() < n) txCos.resize(n), txSin.resize(n);
+        for (int i = 0; i < n; ++i) {
+            if (txPos == 0) {
+                // the Writer queues whole bits: +1 +1 -1 -1 for a 1
+                float first = baseband.empty() ? -1.0f : baseband.front();
+                for (int k = 0; k < LENGTH_OF_ONE_BIT && !baseband.empty(); ++k) baseband.pop();
+                txTarget = first > 0 ? 1.0f : 0.0f;
+            }
+            if (++txPos == PASSBAND_SYMBOL) txPos = 0;
+            // soft edges keep the bit's sidebands out of the other node's band
+            txAmplitude += (txTarget - txAmplitude) * PASSBAND_EDGE;
+            data[i] = txAmplitude;
+        }
+        txCarrier.fill(txCos.data(), txSin.data(), n);
+        for (int i = 0; i < n; ++i) data[i] *= txCos[i];
+    }
+
+    // filter n audio samples and append the recovered bits to baseband (caller holds its lock)
+    void demodulate(const float *input, int n, SampleQueue &baseband) {
+        if ((int) scratch.size() < n) scratch.resize(n), mixedI.resize(n), mixedQ.resize(n);
+        float *data = scratch.data();
+        std::copy(input, input + n, data);
+        // each output of a biquad needs the one before: the filter stays a loop per sample
+        for (auto &stage: filter) stage.process(data, n);
+        rxCarrier.fill(mixedI.data(), mixedQ.data(), n);
+        for (int i = 0; i < n; ++i) mixedI[i] *= data[i], mixedQ[i] *= data[i];
+        for (int i = 0; i < n; ++i) {
+            auto &oldest = window[windowAt];
+            sumI += mixedI[i] - oldest.first;
+            sumQ += mixedQ[i] - oldest.second;
+            oldest = {mixedI[i], mixedQ[i]};
+            windowAt = (windowAt + 1) % PASSBAND_SYMBOL;
+            float now = (float) (2 * std::sqrt(sumI * sumI + sumQ * sumQ) / PASSBAND_SYMBOL);
+            envelope[envelopeAt] = now;
+            envelopeAt = (envelopeAt + 1) % PASSBAND_HISTORY;
+            --untilInstant;
+            // a frame after silence, or one much louder than what was heard so far
+            if (!rising && (hunting || now > 2 * peak) && now > std::max(peak * 3 / 4, PASSBAND_NOISE_FLOOR)) rising = true, riseTop = 0;
+            if (rising) {
+                if (now > riseTop * 1.02f) riseTop = now, sinceTop = 0;// a plateau's ripple does not move the top
+                else
+                    ++sinceTop;
+                // the top ended the first 1: falling after it, or flat until its bit is due
+                if (now < riseTop * 3 / 4 || sinceTop == PASSBAND_DELAY - 1) {
+                    untilInstant = -sinceTop;
+                    peak = std::max(peak, riseTop);
+                    drift = 0;
+                    rising = hunting = false;
+                }
+            }
+            if (untilInstant > -PASSBAND_DELAY) continue;
+            decide(baseband);
+        }
+    }
+
+private:
+    // the envelope `ago` samples back
+    [[nodiscard]] float envelopeAgo(int ago) const { return envelope[(envelopeAt - 1 - ago + PASSBAND_HISTORY) % PASSBAND_HISTORY]; }
+
+    void decide(SampleQueue &baseband) {
+        float early = envelopeAgo(PASSBAND_DELAY + PASSBAND_GATE), now = envelopeAgo(PASSBAND_DELAY), late = envelopeAgo(PASSBAND_DELAY - PASSBAND_GATE);
+        peak = std::max(now, peak * PASSBAND_PEAK_DECAY);
+        untilInstant += PASSBAND_SYMBOL;
+        if (peak < PASSBAND_NOISE_FLOOR) {
+            hunting = true;
+            for (int k = 0; k < LENGTH_OF_ONE_BIT; ++k) baseband.push(0.0f);
+            return;
+        }
+        float threshold = peak / 2;
+        float sure = std::min(1.0f, std::abs(now - threshold) / threshold);
+        float chip = (now > threshold ? 1.0f : -1.0f) * std::max(sure, PASSBAND_MIN_SURE);
+        zeros = now > threshold ? 0 : zeros + 1;
+        if (zeros >= PASSBAND_RESYNC) hunting = true;// until the next rise, which also ends bits decided on its way up
+        baseband.push(chip);
+        baseband.push(chip);
+        baseband.push(-chip);
+        baseband.push(-chip);
+        // early-late gate: only an edge near the instant makes the two differ
+        drift += PASSBAND_TIMING_GAIN * (std::abs(late - threshold) - std::abs(early - threshold)) / peak;
+        if (drift > 0.5f) ++untilInstant, drift -= 1;
+        else if (drift < -0.5f)
+            --untilInstant, drift += 1;
+    }
+
+    Oscillator txCarrier;
+    std::vector<float> txCos, txSin;
+    float txAmplitude = 0, txTarget = 0;
+    int txPos = 0;
+
+    Biquad filter[2];
+    std::vector<float> scratch;
+    Oscillator rxCarrier;
+    std::vector<float> mixedI, mixedQ;// the filtered input times the carrier
+    std::pair<float, float> window[PASSBAND_SYMBOL]{};// the last symbol's mixed samples, oldest at windowAt
+    double sumI = 0, sumQ = 0;
+    int windowAt = 0;
+    float envelope[PASSBAND_HISTORY]{};// carrier amplitude over the symbol ending at each of the last samples
+    int envelopeAt = 0;
+    int untilInstant = PASSBAND_SYMBOL;// samples to the next decision instant, the decision is PASSBAND_DELAY after it
+    float drift = 0;                   // fraction of a sample the instant is to move
+    float peak = 0;
+    int zeros = 0;       // 0 bits decided in a row
+    bool hunting = true; // for the start of a frame
+    bool rising = false; // at one, looking for the top
+    float riseTop = 0;
+    int sinceTop = 0;
+};
+
+#endif//PASSBAND_H
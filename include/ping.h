@@ -0,0 +1,179 @@
+#ifndef PING_H
+#define PING_H
+
+#include "bond.h"
+#include "config.h"
+#include "log.h"
+#include "metrics.h"
+#include "utils.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* ICMP_ECHO / ICMP_REPLY carry an ICMPFrameType body,
+ * "IDENTIFIER SEQ PAYLOAD". The link answers echoes itself (see
+ * BondedLink::deliverUp), so a round trip measures the PHY, MAC and
+ * queues, not the gateway's handlers.
+ */
+struct PingOptions {
+    IPType target = 0;
+    int count = 10;              // echoes per payload size
+    std::vector<int> sizes{32};  // payload bytes, each cut to what fits in one frame
+    int intervalMs = 1000;       // between bursts
+    int burst = 1;               // echoes sent back to back with one medium reservation
+    double timeout = 5.0;        // seconds to wait for the last replies
+};
+
+struct PingStats {
+    int size = 0;
+    int sent = 0;
+    int received = 0;
+    int corrupt = 0;    // replies whose payload came back different
+    double min = 0, p50 = 0, p90 = 0, p99 = 0, max = 0, mean = 0;// RTT, ms
+    double jitter = 0;  // mean difference of consecutive RTTs, ms
+    double seconds = 0; // first echo sent to last reply
+    double throughput = 0;// payload bytes echoed back per second
+
+    [[nodiscard]] double loss() const { return sent ? 1.0 - (double) received / sent : 0.0; }
+
+    [[nodiscard]] std::string text() const {
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "%4d bytes: %d sent, %d received, %.1f%% loss%s, rtt min/p50/p90/p99/max %.1f/%.1f/%.1f/%.1f/%.1f ms, jitter %.1f ms, %.0f B/s", size,
+                 sent, received, 100.0 * loss(), corrupt ? (", " + std::to_string(corrupt) + " corrupt").c_str() : "", min, p50, p90, p99, max, jitter,
+                 throughput);
+        return line;
+    }
+};
+
+/* Echo requester: sends count echoes of every size, in bursts, and
+ * matches the replies by sequence number. One run at a time; the round
+ * trip starts when the echo is queued, so a burst shows its own queueing.
+ */
+class Pinger {
+public:
+    Pinger() = default;
+
+    Pinger(const Pinger &) = delete;
+
+    // must be called before run()
+    void attach(BondedLink &bondedLink) { link = &bondedLink; }
+
+    // blocks until every size was measured
+    std::vector<PingStats> run(const PingOptions &options) {
+        std::lock_guard<std::mutex> running(runLock);
+        std::vector<PingStats> results;
+        for (int size: options.sizes) results.push_back(measure(options, size));
+        return results;
+    }
+
+    // an ICMP_REPLY; replies that belong to no running measurement are dropped
+    void onReply(const FrameType &frame) {
+        ICMPFrameType reply;
+        reply.fromFrameType(frame);
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = outstanding.find(reply.seq);
+        if (reply.identifier != identifier || it == outstanding.end()) return;
+        auto rtt = std::chrono::duration<double, std::milli>(steady_clock::now() - it->second).count();
+        outstanding.erase(it);
+        rttHistogram.record((uint64_t) (rtt * 1e3));
+        rtts.emplace_back(reply.seq, rtt);
+        if (reply.payload != payload) ++corrupt;
+        lastReply = steady_clock::now();
+        answered.notify_all();
+    }
+
+    static std::string report(const std::vector<PingStats> &results) {
+        std::string text;
+        for (auto &stats: results) text += stats.text() + "\n";
+        return text;
+    }
+
+private:
+    PingStats measure(const PingOptions &options, int size) {
+        PingStats stats;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            identifier = std::to_string(++runs) + "." + std::to_string(steady_clock::now().time_since_epoch().count() & 0xffff);
+            // "IDENTIFIER SEQ " comes first in the body
+            int header = (int) (identifier.size() + std::to_string((std::max)(0, options.count - 1)).size()) + 2;
+            size = (std::max)(0, (std::min)(size, link->maxBodyLength() - header));
+            payload.resize(size);
+            for (int i = 0; i < size; ++i) payload[i] = (char) ('a' + i % 26);
+            outstanding.clear();
+            rtts.clear();
+            corrupt = 0;
+        }
+        stats.size = size;
+        auto begin = steady_clock::now();
+        ICMPFrameType echo{Config::ICMP_ECHO, IPType2Str(options.target), "", 0, payload};
+        for (int seq = 0; seq < options.count;) {
+            std::vector<FrameType> frames;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                echo.identifier = identifier;
+                for (int i = 0; i < (std::max)(1, options.burst) && seq < options.count; ++i, ++seq) {
+                    echo.seq = seq;
+                    frames.push_back(echo.toFrameType());
+                    outstanding[seq] = steady_clock::now();
+                }
+            }
+            link->sendBurst(frames);
+            stats.sent += (int) frames.size();
+            if (seq < options.count) std::this_thread::sleep_for(std::chrono::milliseconds(options.intervalMs));
+        }
+        std::unique_lock<std::mutex> guard(lock);
+        answered.wait_for(guard, std::chrono::duration<double>(options.timeout), [this]() { return outstanding.empty(); });
+        lost.add(outstanding.size());
+        std::string idle;
+        identifier.swap(idle);// late replies no longer count
+
+        stats.received = (int) rtts.size();
+        stats.corrupt = corrupt;
+        if (rtts.empty()) return stats;
+        std::sort(rtts.begin(), rtts.end());// by sequence number, for the jitter
+        double sum = 0, change = 0;
+        std::vector<double> sorted;
+        for (size_t i = 0; i < rtts.size(); ++i) {
+            sorted.push_back(rtts[i].second);
+            sum += rtts[i].second;
+            if (i) change += std::fabs(rtts[i].second - rtts[i - 1].second);
+        }
+        std::sort(sorted.begin(), sorted.end());
+        auto percentile = [&sorted](double p) { return sorted[(size_t) std::ceil(p * (double) sorted.size()) - 1]; };
+        stats.min = sorted.front();
+        stats.p50 = percentile(0.50);
+        stats.p90 = percentile(0.90);
+        stats.p99 = percentile(0.99);
+        stats.max = sorted.back();
+        stats.mean = sum / (double) sorted.size();
+        stats.jitter = sorted.size() > 1 ? change / (double) (sorted.size() - 1) : 0.0;
+        stats.seconds = std::chrono::duration<double>(lastReply - begin).count();
+        stats.throughput = stats.seconds > 0 ? (double) stats.received * size / stats.seconds : 0.0;
+        LOG(Info, LINK, "Ping %s: %s", IPType2Str(options.target).c_str(), stats.text().c_str());
+        return stats;
+    }
+
+    BondedLink *link = nullptr;
+    std::mutex runLock;
+    std::mutex lock;
+    std::condition_variable answered;
+    unsigned runs = 0;
+    std::string identifier;// of the running measurement, empty between them
+    std::string payload;
+    std::map<int, steady_clock::time_point> outstanding;// seq -> sent
+    std::vector<std::pair<int, double>> rtts;           // seq, ms
+    int corrupt = 0;
+    steady_clock::time_point lastReply;
+    Histogram &rttHistogram = Metrics::histogram("ping.rtt_us");
+    Counter &lost = Metrics::counter("ping.lost");
+};
+
+#endif//PING_H
@@ -0,0 +1,77 @@
+#include "pool.h"
+#include "metrics.h"
+#include <array>
+#include <mutex>
+
+namespace {
+
+struct BodyClass {
+    std::mutex lock;
+    std::vector<std::string> free;
+    Gauge *occupancy = nullptr;
+};
+
+struct Pools {
+    std::array<BodyClass, BODY_CLASS_COUNT> classes;
+    Counter &misses = Metrics::counter("pool.body_misses");
+    Counter &drops = Metrics::counter("pool.body_drops");
+
+    Pools() {
+        for (int i = 0; i < BODY_CLASS_COUNT; ++i) {
+            classes[i].free.reserve(BODY_POOL_DEPTH);// pushing back never allocates
+            classes[i].occupancy = &Metrics::gauge("pool.body" + std::to_string(BODY_CLASSES[i]) + "_free");
+        }
+    }
+};
+
+Pools &pools() {
+    static Pools instance;
+    return instance;
+}
+
+}// namespace
+
+std::string BodyPool::take(size_t bytes) {
+    auto &p = pools();
+    std::string body;
+    for (int i = 0; i < BODY_CLASS_COUNT; ++i) {
+        if (BODY_CLASSES[i] < bytes) continue;
+        auto &c = p.classes[i];
+        {
+            std::lock_guard<std::mutex> guard(c.lock);
+            if (!c.free.empty()) {
+                body = std::move(c.free.back());
+                c.free.pop_back();
+                c.occupancy->set((int64_t) c.free.size());
+                return body;
+            }
+        }
+        p.misses.add();
+        body.reserve(BODY_CLASSES[i]);
+        return body;
+    }
+    p.misses.add();// larger than any frame
+    body.reserve(bytes);
+    return body;
+}
+
+void BodyPool::give(std::string &&body) {
+    size_t capacity = body.capacity();
+    if (capacity < BODY_CLASSES[0] || capacity > 2 * BODY_CLASSES[BODY_CLASS_COUNT - 1]) {
+        std::string().swap(body);
+        return;
+    }
+    auto &p = pools();
+    int i = BODY_CLASS_COUNT - 1;
+    while (BODY_CLASSES[i] > capacity) --i;// the largest class it can stand in for
+    body.clear();
+    auto &c = p.classes[i];
+    std::lock_guard<std::mutex> guard(c.lock);
+    if (c.free.size() >= BODY_POOL_DEPTH) {
+        p.drops.add();
+        std::string().swap(body);
+        return;
+    }
+    c.free.push_back(std::move(body));
+    c.occupancy->set((int64_t) c.free.size());
+}
@@ -0,0 +1,90 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "utils.h"
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+constexpr size_t BODY_CLASSES[] = {32, 64, 128, 256};// capacities; a BODY is at most 255 bytes (LEN is one byte)
+constexpr int BODY_CLASS_COUNT = sizeof(BODY_CLASSES) / sizeof(*BODY_CLASSES);
+constexpr size_t BODY_POOL_DEPTH = 512;               // free buffers kept per class, about the largest burst
+constexpr size_t SAMPLE_QUEUE_INITIAL = 1 << 15;      // samples, a little more than the longest frame on air
+
+/* Free list of frame BODY buffers in a few size classes. take() hands out an
+ * empty string whose capacity is that of the smallest class that fits, so
+ * filling it up to that size does not allocate; give() puts the buffer back
+ * once the last owner is done with it: the Reader after the handlers
+ * returned, the reorder buffer after delivering, the lane after the Writer
+ * sent it. A frame has exactly one owner at a time (bodies move, they are
+ * not shared), so that hand-back is where a reference count would drop to
+ * zero. Buffers built elsewhere are taken in as well if their capacity fits
+ * a class. Only a class that ran dry allocates; once the pools cover the
+ * largest burst, decoding and relaying frames no longer touch the heap.
+ * Occupancy goes to the gauges pool.body<SIZE>_free, allocations and
+ * buffers let go because the class was full to pool.body_misses and
+ * pool.body_drops.
+ */
+class BodyPool {
+public:
+    // empty, capacity at least bytes
+    static std::string take(size_t bytes);
+
+    // body is left empty; buffers that fit no class are freed
+    static void give(std::string &&body);
+};
+
+// gives a frame's BODY back when the scope ends; a body a handler moved away stays with the handler
+class BodyReturn {
+public:
+    explicit BodyReturn(std::string &frameBody) : body(frameBody) {}
+
+    BodyReturn(const BodyReturn &) = delete;
+
+    ~BodyReturn() { BodyPool::give(std::move(body)); }
+
+private:
+    std::string &body;
+};
+
+/* FIFO of samples between the audio callback and a lane's Reader / Writer,
+ * with the part of the std::queue interface they use. It is a ring that
+ * only grows, by doubling when it is full, so once it has the largest
+ * backlog seen, push() and pop() never allocate; std::queue<float> gets and
+ * frees a deque block every few hundred samples, also on the audio thread.
+ */
+class SampleQueue {
+public:
+    SampleQueue() : ring(SAMPLE_QUEUE_INITIAL) {}
+
+    void push(float sample) {
+        if (count == ring.size()) grow();
+        ring[(head + count++) & (ring.size() - 1)] = sample;
+    }
+
+    [[nodiscard]] float front() const { return ring[head]; }
+
+    void pop() {
+        head = (head + 1) & (ring.size() - 1);
+        --count;
+    }
+
+    [[nodiscard]] bool empty() const { return count == 0; }
+
+    [[nodiscard]] size_t size() const { return count; }
+
+private:
+    void grow() {
+        std::vector<float> larger(2 * ring.size());
+        for (size_t i = 0; i < count; ++i) larger[i] = ring[(head + i) & (ring.size() - 1)];
+        ring.swap(larger);
+        head = 0;
+    }
+
+    std::vector<float> ring;// size is a power of two
+    size_t head = 0;
+    size_t count = 0;
+};
+
+#endif//POOL_H
@@ -0,0 +1,369 @@
+#include "prefetch.h"
+#include "config.h"
+#include "log.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <iterator>
+
+static std::string lower(std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return (char) std::tolower(c); });
+    return text;
+}
+
+static bool startsWith(const std::string &text, const char *prefix) { return lower(text.substr(0, strlen(prefix))) == prefix; }
+
+static bool isSpace(char c) { return std::isspace((unsigned char) c) != 0; }
+
+// one start tag: its name and attributes, names lower case; at is left after '>'
+struct Tag {
+    std::string name;
+    std::vector<std::pair<std::string, std::string>> attributes;
+
+    [[nodiscard]] const std::string *get(const char *attribute) const {
+        for (auto &a: attributes)
+            if (a.first == attribute) return &a.second;
+        return nullptr;
+    }
+};
+
+static bool readTag(const std::string &html, size_t &at, Tag &tag) {
+    size_t n = html.size(), i = at;
+    while (i < n && std::isalnum((unsigned char) html[i])) ++i;
+    tag.name = lower(html.substr(at, i - at));
+    tag.attributes.clear();
+    while (i < n && html[i] != '>') {
+        if (isSpace(html[i]) || html[i] == '/') {
+            ++i;
+            continue;
+        }
+        size_t nameStart = i;
+        while (i < n && !isSpace(html[i]) && html[i] != '=' && html[i] != '>' && html[i] != '/') ++i;
+        std::string name = lower(html.substr(nameStart, i - nameStart));
+        while (i < n && isSpace(html[i])) ++i;
+        std::string value;
+        if (i < n && html[i] == '=') {
+            ++i;
+            while (i < n && isSpace(html[i])) ++i;
+            if (i < n && (html[i] == '"' || html[i] == '\'')) {
+                auto close = html.find(html[i], i + 1);
+                if (close == std::string::npos) close = n;
+                value = html.substr(i + 1, close - i - 1);
+                i = (std::min)(n, close + 1);
+            } else {
+                size_t valueStart = i;
+                while (i < n && !isSpace(html[i]) && html[i] != '>') ++i;
+                value = html.substr(valueStart, i - valueStart);
+            }
+        }
+        if (!name.empty()) tag.attributes.emplace_back(std::move(name), std::move(value));
+    }
+    at = (std::min)(n, i + 1);
+    return !tag.name.empty();
+}
+
+// the attribute as a URL: &amp; undone, no white space around it
+static std::string urlOf(const std::string &value) {
+    std::string url;
+    for (size_t i = 0; i < value.size(); ++i) {
+        if (value.compare(i, 5, "&amp;") == 0) {
+            url += '&';
+            i += 4;
+        } else
+            url += value[i];
+    }
+    size_t begin = 0, end = url.size();
+    while (begin < end && isSpace(url[begin])) ++begin;
+    while (end > begin && isSpace(url[end - 1])) --end;
+    return url.substr(begin, end - begin);
+}
+
+std::vector<PrefetchLink> extractLinks(const std::string &html) {
+    std::vector<PrefetchLink> links;
+    auto add = [&links](const std::string *value, PrefetchPriority priority, bool fetch) {
+        if (value && !value->empty()) links.push_back(PrefetchLink{urlOf(*value), priority, fetch});
+    };
+    Tag tag;
+    size_t at = 0;
+    while ((at = html.find('<', at)) != std::string::npos) {
+        ++at;
+        if (html.compare(at, 3, "!--") == 0) {
+            at = html.find("-->", at);
+            if (at == std::string::npos) break;
+            continue;
+        }
+        if (!readTag(html, at, tag)) continue;
+        if (tag.name == "script") {
+            add(tag.get("src"), PrefetchPriority::BLOCKING, true);
+            at = html.find("</", at);// the script itself is no markup
+        } else if (tag.name == "style") {
+            at = html.find("</", at);
+        } else if (tag.name == "link") {
+            auto *rel = tag.get("rel");
+            std::string kind = rel ? lower(*rel) : "";
+            if (kind.find("stylesheet") != std::string::npos) add(tag.get("href"), PrefetchPriority::BLOCKING, true);
+            else if (kind.find("preload") != std::string::npos || kind.find("icon") != std::string::npos)
+                add(tag.get("href"), PrefetchPriority::OTHER, true);
+            else
+                add(tag.get("href"), PrefetchPriority::OTHER, false);
+        } else if (tag.name == "img") {
+            add(tag.get("src"), PrefetchPriority::IMAGE, true);
+        } else if (tag.name == "iframe" || tag.name == "frame") {
+            add(tag.get("src"), PrefetchPriority::OTHER, true);
+        } else if (tag.name == "a" || tag.name == "area") {
+            add(tag.get("href"), PrefetchPriority::OTHER, false);
+        } else if (tag.name == "form") {
+            add(tag.get("action"), PrefetchPriority::OTHER, false);
+        }
+        if (at == std::string::npos) break;
+    }
+    return links;
+}
+
+std::string linkHost(const std::string &url) {
+    size_t start;
+    if (startsWith(url, "http://")) start = 7;
+    else if (startsWith(url, "https://"))
+        start = 8;
+    else if (url.compare(0, 2, "//") == 0)
+        start = 2;
+    else
+        return "";
+    std::string authority = url.substr(start, url.find_first_of("/?#", start) - start);
+    auto user = authority.rfind('@');
+    if (user != std::string::npos) authority.erase(0, user + 1);
+    auto colon = authority.rfind(':');
+    if (colon != std::string::npos) authority.erase(colon);
+    return lower(authority);
+}
+
+// "." and ".." segments of an absolute path taken out
+static std::string normalizePath(const std::string &path) {
+    auto query = path.find('?');
+    std::string segments = path.substr(0, query), rest = query == std::string::npos ? "" : path.substr(query);
+    std::vector<std::string> kept;
+    size_t at = 1;
+    while (at <= segments.size()) {
+        auto slash = segments.find('/', at);
+        std::string segment = segments.substr(at, slash == std::string::npos ? std::string::npos : slash - at);
+        bool last = slash == std::string::npos;
+        if (segment == "..") {
+            if (!kept.empty()) kept.pop_back();
+            if (last) kept.emplace_back();
+        } else if (segment == ".") {
+            if (last) kept.emplace_back();
+        } else
+            kept.push_back(segment);
+        if (last) break;
+        at = slash + 1;
+    }
+    std::string normal;
+    for (auto &segment: kept) normal += "/" + segment;
+    return (normal.empty() ? "/" : normal) + rest;
+}
+
+bool resolveLink(const HttpRequest &page, const std::string &url, HttpRequest &request) {
+    std::string target = url.substr(0, url.find('#'));
+    for (size_t space; (space = target.find(' ')) != std::string::npos;) target.replace(space, 1, "%20");// HttpRequest::parse splits there
+    if (target.empty()) return false;
+    if (startsWith(target, "http://")) {
+        if (!HttpRequest::parse(target, request)) return false;
+    } else if (target.compare(0, 2, "//") == 0) {
+        if (!HttpRequest::parse(target.substr(2), request)) return false;
+    } else {
+        auto scheme = target.find(':');
+        if (scheme != std::string::npos && scheme < target.find_first_of("/?")) return false;// https:, data:, mailto:, javascript:
+        request.host = page.host;
+        request.port = page.port;
+        if (target[0] == '/') request.path = target;
+        else {
+            std::string base = page.path.substr(0, page.path.find('?'));
+            request.path = target[0] == '?' ? base + target : base.substr(0, base.rfind('/') + 1) + target;
+        }
+    }
+    request.method = "GET";
+    request.path = normalizePath(request.path);
+    return true;
+}
+
+Prefetcher::Prefetcher(Fetch fetchUpstream, Resolve resolveName) : fetch(std::move(fetchUpstream)), resolve(std::move(resolveName)) {
+    int threads = GlobalConfig::current()->threads;
+    for (int i = 0; i < threads; ++i) workers.emplace_back([this]() { work(); });
+}
+
+std::string Prefetcher::keyOf(const HttpRequest &request) { return lower(request.host) + ":" + std::to_string(request.port) + request.path; }
+
+void Prefetcher::learn(const HttpRequest &request, const HttpResponse &response) {
+    if (GlobalConfig::current()->prefetchBytes == 0 || request.method != "GET") return;
+    auto *type = response.header("content-type");
+    if (!type || lower(*type).find("text/html") == std::string::npos) return;
+    auto links = extractLinks(response.body);
+    std::lock_guard<std::mutex> guard(lock);
+    if (stopping) return;
+    for (auto it = names.begin(); it != names.end();) {
+        if (it->second.ready && it->second.age.duration() > PREFETCH_TTL) it = names.erase(it);
+        else
+            ++it;
+    }
+    int resources = 0, hosts = 0;
+    for (auto &link: links) {
+        std::string host = linkHost(link.url);
+        if (!host.empty() && host != lower(request.host) && !names.count(host) && names.size() < PREFETCH_MAX_HOSTS) {
+            names[host];
+            if (enqueue(Job{Kind::NAME, host, {}}, PrefetchPriority::OTHER)) ++hosts;
+        }
+        HttpRequest target;
+        if (!link.fetch || resources >= PREFETCH_MAX_LINKS || !resolveLink(request, link.url, target)) continue;
+        std::string key = keyOf(target);
+        auto known = entries.find(key);
+        if (known != entries.end()) {
+            if (known->second.state != Entry::READY || known->second.age.duration() <= PREFETCH_TTL) continue;
+            drop(known);
+        }
+        entries[key];
+        if (enqueue(Job{Kind::PAGE, key, target}, link.priority)) ++resources;
+    }
+    if (resources || hosts) LOG(Info, GATEWAY, "Prefetching %d resource(s) and %d name(s) linked from %s%s", resources, hosts, request.host.c_str(), request.path.c_str());
+}
+
+bool Prefetcher::enqueue(Job job, PrefetchPriority priority) {
+    if (queue.size() >= PREFETCH_QUEUE) {
+        auto last = std::prev(queue.end());
+        bool keepLast = last->first.first <= priority;
+        auto &gone = keepLast ? job : last->second;
+        if (gone.kind == Kind::NAME) names.erase(gone.key);
+        else
+            entries.erase(gone.key);
+        dropped.add();
+        if (keepLast) return false;
+        queue.erase(last);
+    }
+    queue.emplace(std::make_pair(priority, sequence++), std::move(job));
+    queued.notify_one();
+    return true;
+}
+
+void Prefetcher::work() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        queued.wait(guard, [this]() { return stopping || !queue.empty(); });
+        if (stopping) return;
+        Job job = std::move(queue.begin()->second);
+        queue.erase(queue.begin());
+        if (job.kind == Kind::NAME) {
+            guard.unlock();
+            std::string ip;
+            bool ok = resolve(job.key, ip);
+            guard.lock();
+            auto it = names.find(job.key);
+            if (it == names.end()) continue;
+            it->second.ready = true;
+            it->second.ip = ok ? ip : "";
+            it->second.age.restart();
+            continue;
+        }
+        auto it = entries.find(job.key);
+        if (it == entries.end()) continue;// taken over by a request meanwhile
+        it->second.state = Entry::FETCHING;
+        guard.unlock();
+        std::string raw = fetch(job.request);
+        guard.lock();
+        it = entries.find(job.key);
+        if (it == entries.end()) continue;
+        size_t budget = GlobalConfig::current()->prefetchBytes;
+        if (raw.empty() || raw.size() > budget) {
+            entries.erase(it);
+            done.notify_all();
+            continue;
+        }
+        fetched.add();
+        auto &entry = it->second;
+        entry.state = Entry::READY;
+        entry.raw = std::move(raw);
+        entry.age.restart();
+        lru.push_front(job.key);
+        entry.lru = lru.begin();
+        used += entry.raw.size();
+        evict(budget);
+        cached.set((int64_t) used);
+        done.notify_all();
+    }
+}
+
+bool Prefetcher::take(const HttpRequest &request, std::string &raw) {
+    if (request.method != "GET") return false;
+    std::string key = keyOf(request);
+    std::unique_lock<std::mutex> guard(lock);
+    auto it = entries.find(key);
+    if (it == entries.end()) return false;
+    if (it->second.state == Entry::QUEUED) {
+        // no worker got to it yet: the request fetches it itself
+        for (auto job = queue.begin(); job != queue.end(); ++job)
+            if (job->second.kind == Kind::PAGE && job->second.key == key) {
+                queue.erase(job);
+                break;
+            }
+        entries.erase(it);
+        return false;
+    }
+    if (it->second.state == Entry::FETCHING) {
+        done.wait_for(guard, std::chrono::duration<double>(PREFETCH_WAIT), [&]() {
+            auto i = entries.find(key);
+            return stopping || i == entries.end() || i->second.state == Entry::READY;
+        });
+        it = entries.find(key);
+        if (it == entries.end() || it->second.state != Entry::READY) return false;
+    }
+    if (it->second.age.duration() > PREFETCH_TTL) {
+        drop(it);
+        cached.set((int64_t) used);
+        return false;
+    }
+    raw = it->second.raw;// kept for a retry of the same request
+    it->second.served = true;
+    lru.splice(lru.begin(), lru, it->second.lru);
+    hits.add();
+    return true;
+}
+
+bool Prefetcher::address(const std::string &host, std::string &ip) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = names.find(lower(host));
+    if (it == names.end() || !it->second.ready || it->second.ip.empty() || it->second.age.duration() > PREFETCH_TTL) return false;
+    ip = it->second.ip;
+    nameHits.add();
+    return true;
+}
+
+void Prefetcher::shutdown() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+        queue.clear();
+        queued.notify_all();
+        done.notify_all();
+    }
+    for (auto &worker: workers)
+        if (worker.joinable()) worker.join();
+    workers.clear();
+}
+
+size_t Prefetcher::bytes() {
+    std::lock_guard<std::mutex> guard(lock);
+    return used;
+}
+
+void Prefetcher::evict(size_t budget) {
+    while (used > budget && !lru.empty()) drop(entries.find(lru.back()));
+}
+
+void Prefetcher::drop(std::unordered_map<std::string, Entry>::iterator it) {
+    auto &entry = it->second;
+    if (entry.state == Entry::READY) {
+        used -= entry.raw.size();
+        lru.erase(entry.lru);
+        if (!entry.served) unused.add();
+    }
+    entries.erase(it);
+}
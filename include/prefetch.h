@@ -0,0 +1,136 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include "http.h"
+#include "metrics.h"
+#include "utils.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+constexpr int PREFETCH_MAX_LINKS = 32;   // resources queued from one page
+constexpr int PREFETCH_QUEUE = 64;       // fetches waiting for a worker; the least important go beyond that
+constexpr int PREFETCH_MAX_HOSTS = 256;  // resolved names kept
+constexpr double PREFETCH_TTL = 60.0;    // seconds a prefetched response or address is served
+constexpr double PREFETCH_WAIT = HTTP_READ_TIMEOUT_MS / 1000.0;// a request for a resource on its way waits that long
+
+// how soon a page needs a resource: stylesheets and scripts block rendering, images do not
+enum class PrefetchPriority : uint8_t { BLOCKING, IMAGE, OTHER };
+
+struct PrefetchLink {
+    std::string url;// as written in the page
+    PrefetchPriority priority = PrefetchPriority::OTHER;
+    bool fetch = false;// a resource of the page; anchors are only resolved
+};
+
+// src / href attributes of an HTML page, in document order
+std::vector<PrefetchLink> extractLinks(const std::string &html);
+
+// url as found in page, made absolute; false for what the gateway cannot fetch (https, data:, ...)
+bool resolveLink(const HttpRequest &page, const std::string &url, HttpRequest &request);
+
+// host of an absolute or scheme-relative url, empty for relative ones
+std::string linkHost(const std::string &url);
+
+/* Speculative fetches on the gateway. After a page went out, what it
+ * links to is likely asked for next, each request a round trip over the
+ * acoustic link before the gateway starts fetching. learn() queues the
+ * page's resources by priority and resolves the names of every host it
+ * links to; THREADS workers fetch in parallel into a cache of at most
+ * PREFETCH bytes (least recently used first out, entries live PREFETCH_TTL),
+ * from which take() serves at once, or as soon as a fetch under way
+ * completes. Only GET is prefetched, and only from pages the clients asked
+ * for, not from what was prefetched.
+ */
+class Prefetcher {
+public:
+    using Fetch = std::function<std::string(const HttpRequest &request)>;// the raw upstream response, empty if none
+    using Resolve = std::function<bool(const std::string &host, std::string &ip)>;
+
+    Prefetcher(Fetch fetchUpstream, Resolve resolveName);
+
+    Prefetcher(const Prefetcher &) = delete;
+
+    ~Prefetcher() { shutdown(); }
+
+    // a response to request went to a client: prefetch what it links to
+    void learn(const HttpRequest &request, const HttpResponse &response);
+
+    // the raw response to request if it was prefetched; false: fetch it upstream
+    bool take(const HttpRequest &request, std::string &raw);
+
+    // a resolved address of host
+    bool address(const std::string &host, std::string &ip);
+
+    // waits for the fetches under way; later pages are not learned from
+    void shutdown();
+
+    [[nodiscard]] size_t bytes();
+
+private:
+    enum class Kind : uint8_t { PAGE, NAME };
+
+    struct Entry {
+        enum State : uint8_t { QUEUED, FETCHING, READY } state = QUEUED;
+        bool served = false;
+        std::string raw;
+        MyTimer age;// since it was fetched
+        std::list<std::string>::iterator lru;
+    };
+
+    struct Job {
+        Kind kind = Kind::PAGE;
+        std::string key;
+        HttpRequest request;// PAGE
+    };
+
+    struct Name {
+        bool ready = false;
+        std::string ip;// empty: the name does not resolve
+        MyTimer age;
+    };
+
+    static std::string keyOf(const HttpRequest &request);
+
+    // caller holds lock; with the queue full the least important job goes, false if that is this one
+    bool enqueue(Job job, PrefetchPriority priority);
+
+    void work();
+
+    // caller holds lock
+    void evict(size_t budget);
+
+    // caller holds lock
+    void drop(std::unordered_map<std::string, Entry>::iterator it);
+
+    Fetch fetch;
+    Resolve resolve;
+    std::mutex lock;
+    std::condition_variable queued;// a job was queued or the prefetcher stops
+    std::condition_variable done;  // a fetch completed
+    std::multimap<std::pair<PrefetchPriority, uint64_t>, Job> queue;
+    uint64_t sequence = 0;// first in, first out within a priority
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru;// ready entries, most recent first
+    size_t used = 0;
+    std::unordered_map<std::string, Name> names;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+    Counter &fetched = Metrics::counter("prefetch.fetched");
+    Counter &hits = Metrics::counter("prefetch.hits");
+    Counter &unused = Metrics::counter("prefetch.unused");// evicted or expired before anyone asked
+    Counter &dropped = Metrics::counter("prefetch.dropped");// did not fit the queue
+    Counter &nameHits = Metrics::counter("prefetch.dns_hits");
+    Gauge &cached = Metrics::gauge("prefetch.bytes");
+};
+
+#endif//PREFETCH_H
@@ -0,0 +1,230 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "log.h"
+#include "metrics.h"
+#include "socket.h"
+#include "tunnel.h"
+#include "utils.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+constexpr int PROXY_POLL_MS = 500;            // how often blocked socket calls look at the stop flag
+constexpr size_t PROXY_MAX_HEADER = 16 << 10; // largest HTTP request header accepted
+constexpr double PROXY_HANDSHAKE_TIMEOUT = 30.0;
+
+/* Node1's local proxy, bound to 127.0.0.1. Every connection accepted is
+ * carried to the gateway through the Tunnel; the first byte tells which
+ * protocol the application speaks:
+ *   0x05   SOCKS5, CONNECT only, no authentication
+ *   else   HTTP: CONNECT host:port, or a request with an absolute URI,
+ *          which is passed on with the URI cut down to its path
+ *
+ *     $ curl -x http://127.0.0.1:8080 http://example.com/
+ *     $ curl --socks5-hostname 127.0.0.1:8080 https://example.com/
+ */
+class ProxyServer {
+public:
+    ProxyServer(unsigned short port, Tunnel &connectionTunnel, IPType gatewayIP) : tunnel(connectionTunnel), gateway(gatewayIP) {
+        server = std::make_unique<tcp_server_t>(port, true);
+        LOG(Info, TUNNEL, "Proxy listening on 127.0.0.1:%u", port);
+        thread = std::thread([this]() { serve(); });
+    }
+
+    ProxyServer(const ProxyServer &) = delete;
+
+    // waits for every session, so shut the Tunnel down first
+    ~ProxyServer() {
+        stop = true;
+        if (thread.joinable()) thread.join();
+        server->close();
+        std::unique_lock<std::mutex> guard(lock);
+        idle.wait(guard, [this]() { return sessions == 0; });
+    }
+
+private:
+    // what was read from the application but not parsed yet
+    struct Input {
+        Input(socket_t &s, const std::atomic<bool> &stopFlag) : socket(s), stop(stopFlag) {}
+
+        socket_t &socket;
+        const std::atomic<bool> &stop;
+        std::string data;
+        MyTimer started;
+
+        // false once the application went away or took too long
+        bool fill(size_t n) {
+            char buf[2048];
+            while (data.size() < n) {
+                if (stop || started.duration() > PROXY_HANDSHAKE_TIMEOUT) return false;
+                int ready = socket.wait_readable(PROXY_POLL_MS);
+                if (ready < 0) return false;
+                if (ready == 0) continue;
+                int got = socket.read_some(buf, sizeof(buf));
+                if (got <= 0) return false;
+                data.append(buf, got);
+            }
+            return true;
+        }
+
+        std::string take(size_t n) {
+            std::string front = data.substr(0, n);
+            data.erase(0, n);
+            return front;
+        }
+    };
+
+    void serve() {
+        while (!stop) {
+            if (server->wait_readable(PROXY_POLL_MS) <= 0) continue;
+            socket_t connection = server->accept();
+            if (connection.m_sockfd <= 0) continue;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                ++sessions;
+            }
+            std::thread([this, connection]() mutable {
+                session(connection);
+                std::lock_guard<std::mutex> guard(lock);
+                --sessions;
+                idle.notify_all();
+            }).detach();
+        }
+    }
+
+    void session(socket_t &connection) {
+        static auto &accepted = Metrics::counter("proxy.connections");
+        accepted.add();
+        Input input{connection, stop};
+        bool handled = input.fill(1) && (input.data[0] == 0x05 ? socks5(connection, input) : http(connection, input));
+        if (!handled) connection.close();
+    }
+
+    // RFC 1928; false if the socket was not handed to the tunnel
+    bool socks5(socket_t &connection, Input &input) {
+        if (!input.fill(2) || !input.fill(2 + (unsigned char) input.data[1])) return false;
+        auto methods = input.take(2 + (unsigned char) input.data[1]);
+        if (methods.find('\0', 2) == std::string::npos) {
+            connection.write_all("\x05\xff", 2);// we only do "no authentication"
+            return false;
+        }
+        connection.write_all("\x05\x00", 2);
+
+        if (!input.fill(5)) return false;
+        unsigned char command = input.data[1], type = input.data[3];
+        size_t addressLength = type == 1 ? 4 : type == 3 ? 1 + (unsigned char) input.data[4] : type == 4 ? 16 : 0;
+        if (!input.fill(4 + addressLength + 2)) return false;
+        auto request = input.take(4 + addressLength + 2);
+        unsigned char failure = command != 1 ? 0x07 : addressLength == 0 || type == 4 ? 0x08 : 0;// IPv6 cannot cross the link
+        if (failure) {
+            socks5Reply(connection, failure);
+            return false;
+        }
+        std::string host;
+        if (type == 1) {
+            char dotted[16];
+            snprintf(dotted, sizeof(dotted), "%u.%u.%u.%u", (unsigned char) request[4], (unsigned char) request[5], (unsigned char) request[6],
+                     (unsigned char) request[7]);
+            host = dotted;
+        } else
+            host = request.substr(5, addressLength - 1);
+        unsigned short port = (unsigned short) ((unsigned char) request[4 + addressLength] << 8 | (unsigned char) request[5 + addressLength]);
+        tunnel.connect(gateway, connection, host, port, [&connection](bool ok) { socks5Reply(connection, ok ? 0x00 : 0x05); }, input.data);
+        return true;
+    }
+
+    static void socks5Reply(socket_t &connection, unsigned char status) {
+        const char reply[] = {0x05, (char) status, 0x00, 0x01, 0, 0, 0, 0, 0, 0};
+        connection.write_all(reply, sizeof(reply));
+    }
+
+    // false if the socket was not handed to the tunnel
+    bool http(socket_t &connection, Input &input) {
+        size_t end;
+        while ((end = input.data.find("\r\n\r\n")) == std::string::npos) {
+            if (input.data.size() > PROXY_MAX_HEADER || !input.fill(input.data.size() + 1)) return false;
+        }
+        std::string header = input.take(end + 4);
+        auto lineEnd = header.find("\r\n");
+        std::string method, target, version;
+        {
+            auto first = header.find(' '), second = header.find(' ', first + 1);
+            if (first == std::string::npos || second == std::string::npos || second > lineEnd) return httpError(connection, "400 Bad Request");
+            method = header.substr(0, first);
+            target = header.substr(first + 1, second - first - 1);
+            version = header.substr(second + 1, lineEnd - second - 1);
+        }
+
+        std::string authority, path;
+        unsigned short port = 80;
+        if (method == "CONNECT") {
+            authority = target;
+            port = 443;
+        } else {
+            if (target.compare(0, 7, "http://") != 0) return httpError(connection, "400 Bad Request");
+            auto slash = target.find('/', 7);
+            authority = target.substr(7, slash == std::string::npos ? std::string::npos : slash - 7);
+            path = slash == std::string::npos ? "/" : target.substr(slash);
+        }
+        std::string host = authority;
+        auto colon = authority.rfind(':');
+        if (colon != std::string::npos) {
+            host = authority.substr(0, colon);
+            int value = atoi(authority.c_str() + colon + 1);
+            if (value <= 0 || value > 65535) return httpError(connection, "400 Bad Request");
+            port = (unsigned short) value;
+        }
+        if (host.empty()) return httpError(connection, "400 Bad Request");
+
+        if (method == "CONNECT") {
+            tunnel.connect(gateway, connection, host, port, [&connection](bool ok) {
+                std::string reply = ok ? "HTTP/1.1 200 Connection established\r\n\r\n" : "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n";
+                connection.write_all(reply.data(), (int) reply.size());
+            }, input.data);
+            return true;
+        }
+        // origin form for the server, without our own hop-by-hop headers
+        std::string request = method + " " + path + " " + version + "\r\n";
+        for (size_t at = lineEnd + 2; at < header.size() - 2;) {
+            auto next = header.find("\r\n", at);
+            std::string line = header.substr(at, next - at);
+            at = next + 2;
+            if (startsWithNoCase(line, "Proxy-Connection:") || startsWithNoCase(line, "Proxy-Authorization:")) continue;
+            request += line + "\r\n";
+        }
+        request += "\r\n";
+        tunnel.connect(gateway, connection, host, port, [&connection](bool ok) {
+            if (!ok) httpError(connection, "502 Bad Gateway");
+        }, request + input.data);
+        return true;
+    }
+
+    static bool httpError(socket_t &connection, const std::string &status) {
+        std::string reply = "HTTP/1.1 " + status + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        connection.write_all(reply.data(), (int) reply.size());
+        return false;
+    }
+
+    static bool startsWithNoCase(const std::string &text, const char *prefix) {
+        size_t n = strlen(prefix);
+        if (text.size() < n) return false;
+        for (size_t i = 0; i < n; ++i)
+            if (tolower((unsigned char) text[i]) != tolower((unsigned char) prefix[i])) return false;
+        return true;
+    }
+
+    Tunnel &tunnel;
+    IPType gateway;
+    std::unique_ptr<tcp_server_t> server;
+    std::atomic<bool> stop{false};
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable idle;// sessions dropped
+    int sessions = 0;
+};
+
+#endif//PROXY_H
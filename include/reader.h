@@ -1,16 +1,36 @@
 #ifndef READER_H
 #define READER_H
 
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "soft.h"
+#include "thread.h"
+#include "trace.h"
 #include "utils.h"
-#include <JuceHeader.h>
+#include <atomic>
+#include <algorithm>
 #include <cassert>
+#include <array>
+#include <cmath>
 #include <ostream>
-#include <queue>
 #include <utility>
 
 constexpr float PREAMBLE_THRESHOLD = 0.3f;
+constexpr int PREAMBLE_SAMPLES = LENGTH_PREAMBLE * 8 * LENGTH_OF_ONE_BIT;
+constexpr int FRAME_SAMPLES = 2 * MAX_FRAME_BITS * LENGTH_OF_ONE_BIT;// recorded per frame, room for a slip every other bit
+constexpr int REPLAY_SAMPLES = 2 * FRAME_SAMPLES;
 
-class Reader : public Thread {
+struct ReaderStats {
+    std::atomic<unsigned> frames{0};
+    std::atomic<unsigned> lengthDiscards{0};
+    std::atomic<unsigned> crcDiscards{0};
+    std::atomic<unsigned> addressDrops{0};// frames for other nodes, BODY skipped
+    std::atomic<unsigned> recovered{0};
+    std::atomic<unsigned> rephased{0};// decoded in another sampling phase
+};
+
+class Reader : public aether::Thread {
     static int judgeBit(float signal1, float signal2) {
         if (signal1 - signal2 > PREAMBLE_THRESHOLD) return 1;
         else if (signal2 - signal1 > PREAMBLE_THRESHOLD)
@@ -26,9 +46,9 @@ public:
 
     Reader(const Reader &&) = delete;
 
-    explicit Reader(std::queue<float> *bufferIn, CriticalSection *lockInput, ProcessorType processFunc)
-        : Thread("Reader"), input(bufferIn), protectInput(lockInput), process(std::move(processFunc)) {
-        fprintf(stderr, "    Reader Thread Start\n");
+    explicit Reader(SampleQueue *bufferIn, aether::CriticalSection *lockInput, ProcessorType processFunc, AddressFilter addressFilter = nullptr)
+        : aether::Thread("Reader"), input(bufferIn), protectInput(lockInput), process(std::move(processFunc)), filter(std::move(addressFilter)) {
+        LOG(Info, PHY, "Reader thread start");
     }
 
     ~Reader() override { this->signalThreadShouldExit(); }
@@ -37,23 +57,17 @@ public:
         float buffer[LENGTH_OF_ONE_BIT];
         char byte = 0;
         int bufferPos = 0, bitPos = 0;
-        while (!threadShouldExit()) {
-            protectInput->enter();
-            if (input->empty()) {
-                protectInput->exit();
-                continue;
-            }
-            buffer[bufferPos] = input->front();
-            input->pop();
-            protectInput->exit();
+        while (nextSample(buffer[bufferPos])) {
             if (++bufferPos == LENGTH_OF_ONE_BIT) {
                 int bit = judgeBit(buffer[0], buffer[2]);
                 if (bit == -1) {// shift by one sample
+                    slid = true;
                     for (int i = 1; i < LENGTH_OF_ONE_BIT; ++i) buffer[i - 1] = buffer[i];
                     --bufferPos;
                     continue;
                 }
                 bufferPos = 0;
+                soft.push(SoftFrame::quantize(buffer[0], buffer[2]));
                 byte = (char) (byte | (bit << bitPos));
                 if (++bitPos == 8) break;
             }
@@ -67,20 +81,15 @@ public:
     }
 
     void waitForPreamble() {
-        auto sync = std::deque<float>(LENGTH_PREAMBLE * 8 * LENGTH_OF_ONE_BIT, 0);
-        while (!threadShouldExit()) {
-            protectInput->enter();
-            if (input->empty()) {
-                protectInput->exit();
-                continue;
-            }
-            sync.pop_front();
-            sync.push_back(input->front());
-            input->pop();
-            protectInput->exit();
+        // the last PREAMBLE_SAMPLES samples, oldest at syncHead
+        sync.fill(0);
+        int syncHead = 0;
+        while (nextSample(sync[syncHead])) {
+            syncHead = (syncHead + 1) % PREAMBLE_SAMPLES;
             bool isPreamble = true;
-            for (unsigned i = 0; isPreamble && i < 8 * LENGTH_PREAMBLE; ++i) {
-                isPreamble = (preamble[i / 8] >> (i % 8) & 1) == judgeBit(sync[i * LENGTH_OF_ONE_BIT], sync[i * LENGTH_OF_ONE_BIT + 2]);
+            for (int i = 0; isPreamble && i < 8 * LENGTH_PREAMBLE; ++i) {
+                int at = syncHead + i * LENGTH_OF_ONE_BIT;
+                isPreamble = (preamble[i / 8] >> (i % 8) & 1) == judgeBit(sync[at % PREAMBLE_SAMPLES], sync[(at + 2) % PREAMBLE_SAMPLES]);
             }
             if (isPreamble) return;
         }
@@ -91,36 +100,219 @@ public:
         assert(protectInput != nullptr);
         while (!threadShouldExit()) {
             // wait for PREAMBLE
+            receiving = false;
+            recording = false;
+            TRACE_BEGIN("reader.preamble_search");
             waitForPreamble();
+            TRACE_END("reader.preamble_search");
+            receiving = true;
+            TRACE_SPAN("reader.frame");
+            metrics.preambleHits.add();
+            soft.clear();
+            slid = false;
+            recorded = 0;
+            recording = true;
             FrameType frame;
-            // read LEN, TYPE, IP, PORT
+            // BODY goes into a pooled buffer, which goes back when the handlers are done with the frame
+            frame.body = BodyPool::take(MAX_LENGTH_BODY);
+            BodyReturn recycle(frame.body);
+            // read LEN, TYPE, IP, SRC, PORT
             readObject(frame.len);
             readObject(frame.type);
             readObject(frame.ip);
+            readObject(frame.src);
             readObject(frame.port);
             if (frame.len > MAX_LENGTH_BODY) {
-                // Too long! There must be some errors.
-                fprintf(stderr, "\tDiscarded due to wrong length. len = %u\n", frame.len);
-                continue;
-            }
-            // read BODY
-            for (int i = 0; i < frame.len; ++i) { frame.body.push_back(readByte()); }
-            // read CRC
-            unsigned int crcRead;
-            readObject(crcRead);
-            if (crcRead != frame.crc()) {
-                fprintf(stderr, "\tDiscarded due to failing CRC check. len = %u\n", frame.len);
-                continue;
+                // Too long! There must be some errors, unless the samples read in another phase make sense.
+                if (!rephase(frame)) {
+                    LOG(Debug, PHY, "Discarded due to wrong length. len = %u", frame.len);
+                    ++statistics.lengthDiscards;
+                    metrics.lengthDiscards.add();
+                    metrics.falsePreambles.add();
+                    continue;
+                }
+            } else if (filter && !filter(frame)) {
+                // not for us: go back to PREAMBLE search instead of demodulating BODY. After a slide
+                // in the header the address itself may be misread, so the other phases get a try first.
+                if (!slid || !rephase(frame)) {
+                    ++statistics.addressDrops;
+                    metrics.addressDrops.add();
+                    TRACE_INSTANT("reader.address_drop", frame.ip);
+                    continue;
+                }
+            } else {
+                for (int i = 0; i < frame.len; ++i) { frame.body.push_back(readByte()); }
+                // read CRC
+                unsigned int crcRead;
+                readObject(crcRead);
+                if (crcRead != frame.crc() && !rephase(frame) && !chaseDecode(frame)) {
+                    LOG(Debug, PHY, "Discarded due to failing CRC check. len = %u", frame.len);
+                    ++statistics.crcDiscards;
+                    metrics.crcDiscards.add();
+                    TRACE_INSTANT("reader.crc_fail", frame.len);
+                    continue;
+                }
             }
-            fprintf(stderr, "\tReceive a frame! len = %u, %u %s %u %s\n", frame.len, frame.type, IPType2Str(frame.ip).c_str(), frame.port, frame.body.c_str());
+            Log::frame(LogLevel::Info, LogCategory::PHY, "Receive a frame!", frame);
+            ++statistics.frames;
+            metrics.frames.add();
+            receiving = false;
+            TRACE_SPAN("reader.process", frame.type);
             process(frame);
         }
     }
 
+    // soft values of the frame currently (or last) being decoded
+    [[nodiscard]] const SoftFrame &softFrame() const { return soft; }
+
+    [[nodiscard]] const ReaderStats &stats() const { return statistics; }
+
+    // true between a PREAMBLE hit and the end of that frame, used for carrier sense
+    [[nodiscard]] bool isReceiving() const { return receiving; }
+
 private:
-    std::queue<float> *input;
-    CriticalSection *protectInput;
+    // the next sample, replayed ones first; recorded while a frame is read. false once the thread should exit
+    bool nextSample(float &sample) {
+        if (replayHead < replayCount) {
+            sample = replay[replayHead++];
+        } else {
+            while (true) {
+                if (threadShouldExit()) return false;
+                protectInput->enter();
+                if (!input->empty()) break;
+                protectInput->exit();
+            }
+            sample = input->front();
+            input->pop();
+            protectInput->exit();
+        }
+        if (recording) {
+            if (recorded < FRAME_SAMPLES) samples[recorded++] = sample;
+            else overflow = true;
+        }
+        return true;
+    }
+
+    // record at least n samples of the frame
+    bool recordUpTo(int n) {
+        float sample;
+        while (recorded < n)
+            if (overflow || !nextSample(sample)) return false;
+        return !overflow;
+    }
+
+    // hard decisions for the first nBits bits of the frame in every sampling phase at once; a phase never
+    // slides, an ambiguous bit goes by its sign. The phases are side by side in the inner loop, which is a
+    // subtraction of LENGTH_OF_ONE_BIT adjacent samples from the ones two further on.
+    void decodePhases(int nBits) {
+        for (auto &bytes: phaseBytes) std::fill(bytes.begin(), bytes.begin() + (nBits + 7) / 8, 0);
+        margin.fill(0);
+        for (int k = 0; k < nBits; ++k) {
+            const float *at = samples.data() + k * LENGTH_OF_ONE_BIT;
+            float d[LENGTH_OF_ONE_BIT];
+            for (int p = 0; p < LENGTH_OF_ONE_BIT; ++p) d[p] = at[p] - at[p + 2];
+            for (int p = 0; p < LENGTH_OF_ONE_BIT; ++p) {
+                phaseBytes[p][k >> 3] = (char) (phaseBytes[p][k >> 3] | (d[p] > 0) << (k & 7));
+                margin[p] += std::fabs(d[p]);
+            }
+        }
+    }
+
+    /* The decoder above follows one sampling phase and slides by a sample on
+     * an ambiguous bit, so a single bad sample can leave the rest of the
+     * frame in the wrong phase. When that decode fails, the frame's recorded
+     * samples are decoded again in each of the LENGTH_OF_ONE_BIT fixed phases,
+     * each hypothesis with its own LEN, and the first that passes the CRC
+     * (and the address filter), the one with the largest total margin first,
+     * wins. Samples read beyond the frame that was taken, or beyond where the
+     * sliding decoder stopped if none was, are replayed to the PREAMBLE search.
+     */
+    bool rephase(FrameType &frame) {
+        constexpr int HEADER_BITS = LENGTH_HEADER * 8;
+        auto primaryLen = frame.len;
+        int end = recorded;
+        bool ok = false;
+        if (recordUpTo(HEADER_BITS * LENGTH_OF_ONE_BIT + 2)) {
+            decodePhases(HEADER_BITS);
+            int nBits = 0;
+            for (auto &bytes: phaseBytes)
+                if ((uint8_t) bytes[0] <= MAX_LENGTH_BODY) nBits = std::max(nBits, (LENGTH_HEADER + (uint8_t) bytes[0] + LENGTH_CRC) * 8);
+            if (nBits > 0 && recordUpTo(nBits * LENGTH_OF_ONE_BIT + 2)) {
+                decodePhases(nBits);
+                std::array<int, LENGTH_OF_ONE_BIT> order{};
+                for (int p = 0; p < LENGTH_OF_ONE_BIT; ++p) order[p] = p;
+                std::sort(order.begin(), order.end(), [this](int a, int b) { return margin[a] > margin[b]; });
+                for (int p: order) {
+                    int len = (uint8_t) phaseBytes[p][0];
+                    if (len > MAX_LENGTH_BODY) continue;
+                    int n = LENGTH_HEADER + len + LENGTH_CRC;
+                    if (!frame.fromRawBytes(phaseBytes[p].data(), n) || (filter && !filter(frame))) continue;
+                    LOG(Debug, PHY, "Recovered in sampling phase %d. len = %u", p, frame.len);
+                    ++statistics.rephased;
+                    metrics.rephased.add();
+                    end = n * 8 * LENGTH_OF_ONE_BIT + p;
+                    ok = true;
+                    break;
+                }
+            }
+        }
+        if (!ok) frame.len = primaryLen;
+        // what was read past the end goes back in front of the input, ahead of what is still to be replayed
+        recording = false;
+        overflow = false;
+        int extra = std::max(0, recorded - end);
+        int pending = std::min(replayCount - replayHead, REPLAY_SAMPLES - extra);
+        if (extra > replayHead) std::move_backward(replay.begin() + replayHead, replay.begin() + replayHead + pending, replay.begin() + extra + pending);
+        else std::move(replay.begin() + replayHead, replay.begin() + replayHead + pending, replay.begin() + extra);
+        std::copy(samples.begin() + end, samples.begin() + end + extra, replay.begin());
+        replayHead = 0;
+        replayCount = extra + pending;
+        return ok;
+    }
+
+    // try to repair a frame that failed the CRC by flipping its least reliable bits;
+    // LEN is left untouched since it decides where BODY and CRC are.
+    bool chaseDecode(FrameType &frame) {
+        std::string raw = soft.hardBytes();
+        FrameType candidate;
+        bool ok = soft.chase(raw, LENGTH_LEN * 8, [&candidate](const std::string &bytes) { return candidate.fromRawString(bytes); });
+        if (!ok) return false;
+        LOG(Debug, PHY, "Recovered by Chase decoding. len = %u", frame.len);
+        ++statistics.recovered;
+        metrics.recovered.add();
+        frame = std::move(candidate);
+        return true;
+    }
+
+    // process-wide totals of all Readers, next to the per-Reader statistics
+    struct {
+        Counter &preambleHits = Metrics::counter("phy.preamble_hits");
+        Counter &falsePreambles = Metrics::counter("phy.preamble_false");// no plausible header after the PREAMBLE, whatever the phase
+        Counter &lengthDiscards = Metrics::counter("phy.len_discards");
+        Counter &crcDiscards = Metrics::counter("phy.crc_discards");
+        Counter &recovered = Metrics::counter("phy.chase_recovered");
+        Counter &rephased = Metrics::counter("phy.phase_recovered");
+        Counter &addressDrops = Metrics::counter("link.address_drops");
+        Counter &frames = Metrics::counter("link.frames_rx");
+    } metrics;
+
+    SoftFrame soft;
+    std::array<float, PREAMBLE_SAMPLES> sync{};
+    std::array<float, FRAME_SAMPLES> samples{};// of the current frame, from the first after PREAMBLE
+    int recorded = 0;
+    bool slid = false;// the sliding decoder shifted by a sample since PREAMBLE
+    bool recording = false;
+    bool overflow = false;// the frame ran past samples
+    std::array<float, REPLAY_SAMPLES> replay{};
+    int replayHead = 0, replayCount = 0;
+    std::array<std::array<char, MAX_FRAME_BITS / 8>, LENGTH_OF_ONE_BIT> phaseBytes{};
+    std::array<float, LENGTH_OF_ONE_BIT> margin{};
+    ReaderStats statistics;
+    std::atomic<bool> receiving{false};
+    SampleQueue *input;
+    aether::CriticalSection *protectInput;
     ProcessorType process;
+    AddressFilter filter;
 };
 
 #endif//READER_H
\ No newline at end of file
@@ -0,0 +1,479 @@
+#ifndef REASSEMBLY_H
+#define REASSEMBLY_H
+
+#include "compress.h"
+#include "dedup.h"
+#include "http.h"
+#include "log.h"
+#include "metrics.h"
+#include "utils.h"
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+using StreamType = unsigned short;
+using RequestId = PORTType;// Node1's number for a request: sent in PORT, answered in PORT
+
+/* Every HTTP_RSP BODY starts with a segment header so the receiver can put
+ * a response back together whatever order its frames arrive in:
+ * STREAM   response number, chosen by the gateway
+ * OFFSET   position of this segment in the response
+ * TOTAL    length of the whole response on air; the top bit is set when
+ *          the response is one LzEncoder stream, the next one when the body
+ *          after the envelope is deduplicated (see dedupEncode)
+ */
+constexpr unsigned int SEGMENT_COMPRESSED = 1u << 31;
+constexpr unsigned int SEGMENT_DEDUP = 1u << 30;
+
+struct SegmentHeader {
+    StreamType stream = 0;
+    unsigned int offset = 0;
+    unsigned int total = 0;
+    bool compressed = false;
+    bool deduplicated = false;
+
+    [[nodiscard]] std::string inString() const {
+        return ::inString(stream) + ::inString(offset) + ::inString(total | (compressed ? SEGMENT_COMPRESSED : 0) | (deduplicated ? SEGMENT_DEDUP : 0));
+    }
+
+    // false if the body is too short to carry a header
+    bool fromBody(const std::string &body) {
+        if (body.size() < sizeof(stream) + 2 * sizeof(unsigned int)) return false;
+        const char *p = body.data();
+        std::copy(p, p + sizeof(stream), (char *) &stream), p += sizeof(stream);
+        std::copy(p, p + sizeof(offset), (char *) &offset), p += sizeof(offset);
+        std::copy(p, p + sizeof(total), (char *) &total);
+        compressed = total & SEGMENT_COMPRESSED;
+        deduplicated = total & SEGMENT_DEDUP;
+        total &= ~(SEGMENT_COMPRESSED | SEGMENT_DEDUP);
+        return true;
+    }
+};
+
+constexpr int LENGTH_SEGMENT_HEADER = sizeof(StreamType) + 2 * sizeof(unsigned int);
+constexpr size_t REASSEMBLY_MAX_BUFFERED = (size_t) 1 << 20;// out-of-order bytes held per response
+constexpr double REASSEMBLY_TIMEOUT = 30.0;                  // seconds without progress before a response is given up
+constexpr double CHUNK_RETRY = 5.0;                          // seconds without an answer before missing chunks are asked for again
+
+/* A deduplicated response may refer to a chunk Node1 no longer has; it
+ * asks for it with CHUNK_REQ, whose BODY is a row of fingerprints, and the
+ * gateway answers with CHUNK_RSP frames, each BODY
+ * FINGERPRINT  of the chunk
+ * OFFSET       position of this piece in the chunk as sent
+ * TOTAL        length of the chunk as sent, 0 if the gateway does not have
+ *              it either; the top bit is set when it was sent as one
+ *              LzEncoder stream
+ */
+constexpr unsigned short CHUNK_COMPRESSED = 1u << 15;
+
+struct ChunkHeader {
+    Fingerprint fp = 0;
+    unsigned short offset = 0;
+    unsigned short total = 0;
+    bool compressed = false;
+
+    [[nodiscard]] std::string inString() const { return ::inString(fp) + ::inString(offset) + ::inString((unsigned short) (total | (compressed ? CHUNK_COMPRESSED : 0))); }
+
+    // false if the body is too short to carry a header
+    bool fromBody(const std::string &body) {
+        if (body.size() < sizeof(fp) + 2 * sizeof(unsigned short)) return false;
+        const char *p = body.data();
+        std::copy(p, p + sizeof(fp), (char *) &fp), p += sizeof(fp);
+        std::copy(p, p + sizeof(offset), (char *) &offset), p += sizeof(offset);
+        std::copy(p, p + sizeof(total), (char *) &total);
+        compressed = total & CHUNK_COMPRESSED;
+        total &= ~CHUNK_COMPRESSED;
+        return true;
+    }
+};
+
+constexpr int LENGTH_CHUNK_HEADER = sizeof(Fingerprint) + 2 * sizeof(unsigned short);
+
+/* Receive side of segmented responses. A compressed stream is decoded as
+ * it comes in; the stream starts with an HttpEnvelope, which is decoded
+ * into the Result, and only the body after it goes to the file. A
+ * deduplicated body is expanded from the chunk store; a chunk that is not
+ * there leaves a hole, which is filled in place once the chunk was fetched
+ * again (on stdout, everything from the first hole on waits in memory).
+ * The response is complete when it all arrived and no hole is left.
+ * Segments that arrive ahead of the next expected offset are kept as they
+ * are in an offset-ordered list; as soon as the front of the list is
+ * contiguous with what was already written it is written out and freed,
+ * so memory only grows with reordering, never with the size of the
+ * response.
+ */
+class Reassembler {
+public:
+    struct Result {
+        RequestId request;
+        StreamType stream;
+        std::string path;// where the body was written
+        size_t bytes;    // of the body, written so far
+        size_t received; // on air, in order
+        size_t total;    // on air
+        bool complete;
+        HttpEnvelope envelope;// status 0 until it arrived
+    };
+
+    using Done = std::function<void(const Result &)>;
+    using Missing = std::function<void(const std::vector<Fingerprint> &)>;// send CHUNK_REQ
+
+    explicit Reassembler(Done onDone, ChunkStore *chunkStore = nullptr, Missing onMissing = nullptr)
+        : done(std::move(onDone)), missing(std::move(onMissing)), chunks(chunkStore) {}
+
+    // the response to this request is written to the file ("-" for stdout);
+    // responses nobody expects, e.g. a second answer to a retried request, are dropped
+    void expect(RequestId request, const std::string &path) {
+        std::lock_guard<std::mutex> guard(lock);
+        expected[request] = path;
+    }
+
+    // no longer interested: the response is dropped without a result
+    void forget(RequestId request) {
+        std::lock_guard<std::mutex> guard(lock);
+        expected.erase(request);
+        for (auto it = streams.begin(); it != streams.end();) {
+            auto next = std::next(it);
+            if (it->second->request == request) finish(it);
+            it = next;
+        }
+    }
+
+    // a response to the request is coming in or already complete
+    [[nodiscard]] bool started(RequestId request) {
+        std::lock_guard<std::mutex> guard(lock);
+        return !expected.count(request);
+    }
+
+    // one HTTP_RSP body, segment header included, for the request in the frame's PORT
+    void add(const std::string &body, RequestId request) {
+        SegmentHeader header;
+        if (!header.fromBody(body)) return;
+        const char *data = body.data() + LENGTH_SEGMENT_HEADER;// written from the frame, only copied if it must wait
+        size_t n = body.size() - LENGTH_SEGMENT_HEADER;
+        if (header.offset + n > header.total) return;
+        std::vector<Result> finished;
+        std::vector<Fingerprint> ask;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            expire(finished);
+            auto it = streams.find({request, header.stream});
+            if (it == streams.end()) {
+                auto path = expected.find(request);
+                if (path == expected.end()) return;// late, duplicate or cancelled
+                auto stream = std::make_unique<Stream>(request, header.stream, header.total, header.compressed, header.deduplicated, chunks, path->second);
+                expected.erase(path);
+                it = streams.emplace(StreamKey{request, header.stream}, std::move(stream)).first;
+            }
+            auto &stream = *it->second;
+            if (!stream.file) {// nowhere to put it: failed now rather than after it was all on air
+                finished.push_back(stream.result(false));
+                finish(it);
+            } else {
+                stream.insert(header.offset, data, n);
+                ask.swap(stream.missing);
+                if (stream.finished()) {
+                    finished.push_back(stream.result(true));
+                    finish(it);
+                }
+            }
+        }
+        if (!ask.empty() && missing) missing(ask);
+        for (auto &result: finished) done(result);
+    }
+
+    // one CHUNK_RSP body, chunk header included
+    void addChunk(const std::string &body) {
+        ChunkHeader header;
+        if (!header.fromBody(body)) return;
+        std::vector<Result> finished;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!waitingFor(header.fp)) return;
+            if (header.total == 0) {// nobody has it any more
+                for (auto it = streams.begin(); it != streams.end();) {
+                    auto next = std::next(it);
+                    if (it->second->hasHole(header.fp)) {
+                        LOG(Warn, CLIENT, "Response %u incomplete: chunk %s is gone", it->second->stream, fingerprintHex(header.fp).c_str());
+                        finished.push_back(it->second->result(false));
+                        finish(it);
+                    }
+                    it = next;
+                }
+            } else {
+                size_t n = body.size() - LENGTH_CHUNK_HEADER;
+                if (header.offset + n > header.total || n == 0) return;
+                auto &repair = repairs[header.fp];
+                repair.total = header.total;
+                if (!repair.pieces.count(header.offset)) {
+                    repair.pieces.emplace(header.offset, body.substr(LENGTH_CHUNK_HEADER));
+                    repair.have += n;
+                }
+                for (auto &[id, stream]: streams)// the answer is still coming in, no need to ask again
+                    if (stream->hasHole(header.fp)) stream->asked.restart();
+                if (repair.have >= repair.total) {
+                    std::string chunk;
+                    for (auto &[offset, data]: repair.pieces)
+                        if (offset == chunk.size()) chunk += data;
+                    repairs.erase(header.fp);
+                    if (chunk.size() != header.total || (header.compressed && !lzExpand(chunk, chunk)) || fingerprint(chunk.data(), chunk.size()) != header.fp)
+                        return;// asked again on the next retry
+                    if (chunks) chunks->put(header.fp, chunk);
+                    for (auto it = streams.begin(); it != streams.end();) {
+                        auto next = std::next(it);
+                        it->second->fill(header.fp, chunk);
+                        if (it->second->finished()) {
+                            finished.push_back(it->second->result(true));
+                            finish(it);
+                        }
+                        it = next;
+                    }
+                }
+            }
+        }
+        for (auto &result: finished) done(result);
+    }
+
+    // give up on responses that stopped making progress and ask again for
+    // missing chunks; call now and then
+    void poll() {
+        std::vector<Result> finished;
+        std::vector<Fingerprint> ask;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            expire(finished);
+            for (auto &[id, stream]: streams)
+                if (!stream->holes.empty() && stream->asked.duration() > CHUNK_RETRY) {
+                    stream->asked.restart();
+                    for (auto &hole: stream->holes)
+                        if (std::find(ask.begin(), ask.end(), hole.fp) == ask.end()) ask.push_back(hole.fp);
+                }
+        }
+        if (!ask.empty() && missing) missing(ask);
+        for (auto &result: finished) done(result);
+    }
+
+private:
+    struct Stream {
+        Stream(RequestId requestId, StreamType id, size_t totalBytes, bool compressed, bool deduplicated, ChunkStore *chunkStore, const std::string &outputPath)
+            : request(requestId), stream(id), total(totalBytes), path(outputPath), chunks(chunkStore) {
+            file = path == "-" ? stdout : fopen(path.c_str(), "wb");
+            if (!file) LOG(Error, CLIENT, "Cannot write %s", path.c_str());
+            if (compressed) decoder = std::make_unique<LzDecoder>();
+            if (deduplicated && !chunks) {
+                LOG(Error, CLIENT, "Response %u is deduplicated but there is no chunk store", stream);
+                corrupt = true;
+            } else if (deduplicated)
+                dedup = std::make_unique<DedupDecoder>([this](Fingerprint fp, const std::string &chunk) { literal(fp, chunk); },
+                                                       [this](Fingerprint fp, size_t length) { reference(fp, length); });
+        }
+
+        Stream(const Stream &) = delete;
+
+        ~Stream() {
+            if (file && file != stdout) fclose(file);
+            else if (file)
+                fflush(file);
+        }
+
+        void insert(size_t offset, const char *data, size_t n) {
+            if (offset + n > total) return;// not part of this response
+            progress.restart();
+            if (offset < delivered) {// overlaps what is already out
+                if (offset + n <= delivered) return;
+                data += delivered - offset, n -= delivered - offset;
+                offset = delivered;
+            }
+            if (offset > delivered) {
+                if (pending.count(offset) || buffered + n > REASSEMBLY_MAX_BUFFERED) return;
+                buffered += n;
+                pending.emplace(offset, std::string(data, n));
+                return;
+            }
+            write(data, n);
+            // the gap may now be closed
+            for (auto it = pending.begin(); it != pending.end() && it->first <= delivered; it = pending.erase(it)) {
+                buffered -= it->second.size();
+                if (it->first + it->second.size() > delivered) write(it->second.data() + (delivered - it->first), it->first + it->second.size() - delivered);
+            }
+        }
+
+        void write(const char *data, size_t n) {
+            delivered += n;
+            bytesOut.add(n);
+            if (!decoder) {
+                consume(data, n);
+                return;
+            }
+            std::string plain;
+            if (!corrupt && !decoder->decode(data, n, plain)) {
+                LOG(Error, CLIENT, "Response %u: compressed stream is corrupt", stream);
+                corrupt = true;
+            }
+            consume(plain.data(), plain.size());
+        }
+
+        // the plain stream: envelope, then body
+        void consume(const char *data, size_t n) {
+            if (headLength == 0) {// still in the envelope
+                head.append(data, n);
+                headLength = envelope.decode(head);
+                if (headLength == 0) return;
+                body(head.data() + headLength, head.size() - headLength);
+                std::string().swap(head);
+                return;
+            }
+            body(data, n);
+        }
+
+        void body(const char *data, size_t n) {
+            if (!dedup) {
+                if (!corrupt) emit(data, n);
+            } else if (!corrupt && !dedup->feed(data, n)) {
+                LOG(Error, CLIENT, "Response %u: deduplicated body is corrupt", stream);
+                corrupt = true;
+            }
+        }
+
+        void literal(Fingerprint fp, const std::string &chunk) {
+            chunks->put(fp, chunk);
+            emit(chunk.data(), chunk.size());
+        }
+
+        void reference(Fingerprint fp, size_t length) {
+            std::string chunk;
+            if (chunks->get(fp, chunk) && chunk.size() == length) {
+                dedupHits.add(length);
+                emit(chunk.data(), chunk.size());
+                return;
+            }
+            if (!hasHole(fp)) missing.push_back(fp);
+            if (holes.empty()) {
+                heldFrom = bodyBytes;
+                asked.restart();
+            }
+            holes.push_back({fp, bodyBytes, length});
+            emit(std::string(length, '\0').data(), length);// a placeholder for now
+        }
+
+        void emit(const char *data, size_t n) {
+            if (file == stdout && !holes.empty()) held.append(data, n);
+            else if (file)
+                fwrite(data, 1, n, file);
+            bodyBytes += n;
+        }
+
+        // put a fetched chunk into the holes waiting for it
+        void fill(Fingerprint fp, const std::string &chunk) {
+            bool filled = false;
+            for (auto it = holes.begin(); it != holes.end();) {
+                if (it->fp != fp) {
+                    ++it;
+                    continue;
+                }
+                if (chunk.size() != it->length) corrupt = true;
+                else if (file == stdout)
+                    held.replace(it->offset - heldFrom, chunk.size(), chunk);
+                else if (file) {
+                    fseek(file, (long) it->offset, SEEK_SET);
+                    fwrite(chunk.data(), 1, chunk.size(), file);
+                    fseek(file, 0, SEEK_END);
+                }
+                it = holes.erase(it);
+                filled = true;
+            }
+            if (!filled) return;
+            progress.restart();
+            if (holes.empty() && !held.empty()) {
+                fwrite(held.data(), 1, held.size(), file);
+                std::string().swap(held);
+            }
+        }
+
+        [[nodiscard]] bool hasHole(Fingerprint fp) const {
+            return std::any_of(holes.begin(), holes.end(), [fp](const Hole &hole) { return hole.fp == fp; });
+        }
+
+        [[nodiscard]] bool finished() const { return delivered >= total && holes.empty(); }
+
+        [[nodiscard]] Result result(bool complete) const { return {request, stream, path, bodyBytes, delivered, total, complete && !corrupt && holes.empty(), envelope}; }
+
+        struct Hole {
+            Fingerprint fp;
+            size_t offset;// in the body
+            size_t length;
+        };
+
+        RequestId request;
+        StreamType stream;
+        size_t total;
+        std::string path;
+        FILE *file = nullptr;
+        size_t delivered = 0;
+        size_t buffered = 0;
+        std::map<size_t, std::string> pending;// offset -> segment, all beyond delivered
+        MyTimer progress;
+        std::string head;     // the envelope, until it is complete
+        size_t headLength = 0;// 0 until the envelope was decoded
+        HttpEnvelope envelope;
+        size_t bodyBytes = 0;
+        std::unique_ptr<LzDecoder> decoder;// null if the stream is not compressed
+        bool corrupt = false;
+        ChunkStore *chunks;
+        std::unique_ptr<DedupDecoder> dedup;// null if the body is not deduplicated
+        std::vector<Hole> holes;
+        std::vector<Fingerprint> missing;// not asked for yet
+        MyTimer asked;                   // since missing chunks were asked for or a piece of one came in
+        std::string held;                // stdout only: the body from the first hole on
+        size_t heldFrom = 0;
+        Counter &bytesOut = Metrics::counter("client.reassembled_bytes");
+        Counter &dedupHits = Metrics::counter("client.dedup_hit_bytes");
+    };
+
+    struct Repair {
+        size_t total = 0;
+        size_t have = 0;
+        std::map<size_t, std::string> pieces;// offset -> piece
+    };
+
+    [[nodiscard]] bool waitingFor(Fingerprint fp) const {
+        return std::any_of(streams.begin(), streams.end(), [fp](auto &entry) { return entry.second->hasHole(fp); });
+    }
+
+    // STREAM is only unique per gateway and run: a restarted or another gateway may reuse it for another request
+    using StreamKey = std::pair<RequestId, StreamType>;
+
+    void finish(std::map<StreamKey, std::unique_ptr<Stream>>::iterator it) {
+        streams.erase(it);
+        if (streams.empty()) repairs.clear();
+    }
+
+    void expire(std::vector<Result> &finished) {
+        for (auto it = streams.begin(); it != streams.end();) {
+            auto next = std::next(it);
+            if (it->second->progress.duration() > REASSEMBLY_TIMEOUT) {
+                LOG(Warn, CLIENT, "Response %u incomplete: %zu of %zu bytes, %zu chunks missing", it->second->stream, it->second->delivered, it->second->total,
+                    it->second->holes.size());
+                finished.push_back(it->second->result(false));
+                finish(it);
+            }
+            it = next;
+        }
+    }
+
+    Done done;
+    Missing missing;
+    ChunkStore *chunks;// null: deduplicated bodies cannot be expanded
+    std::mutex lock;
+    std::map<RequestId, std::string> expected;// request -> file, until its response starts
+    std::map<StreamKey, std::unique_ptr<Stream>> streams;
+    std::map<Fingerprint, Repair> repairs;// chunks coming back in pieces
+};
+
+#endif//REASSEMBLY_H
@@ -0,0 +1,84 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include "utils.h"
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+constexpr IPType BROADCAST_IP = 0xFFFFFFFF;
+constexpr size_t FORWARD_HISTORY = 64;// recently forwarded frames remembered to break loops
+
+class Route {
+public:
+    IPType prefix = 0;
+    int length = 0;// prefix length in bits
+    IPType nextHop = 0;
+
+    [[nodiscard]] bool matches(IPType ip) const {
+        IPType mask = length == 0 ? 0 : ~IPType(0) << (32 - length);
+        return (ip & mask) == (prefix & mask);
+    }
+};
+
+// longest-prefix-match table of destinations reachable through another node
+class RoutingTable {
+public:
+    RoutingTable() = default;
+
+    explicit RoutingTable(std::vector<Route> nRoutes) : routes(std::move(nRoutes)) {}
+
+    void add(const Route &route) { routes.push_back(route); }
+
+    [[nodiscard]] const Route *lookup(IPType ip) const {
+        const Route *best = nullptr;
+        for (auto &route: routes)
+            if (route.matches(ip) && (!best || route.length > best->length)) best = &route;
+        return best;
+    }
+
+    [[nodiscard]] bool empty() const { return routes.empty(); }
+
+private:
+    std::vector<Route> routes;
+};
+
+/* Link addressing for one node.
+ * accept() is the early filter the Reader applies right after the header:
+ * only frames for this node, broadcasts, MAC control frames (needed for NAV)
+ * and frames this node forwards get their BODY read.
+ */
+class Router {
+public:
+    Router(IPType localAddress, RoutingTable table) : local(localAddress), routes(std::move(table)) {}
+
+    [[nodiscard]] IPType address() const { return local; }
+
+    [[nodiscard]] bool isLocal(IPType ip) const { return ip == local || ip == BROADCAST_IP; }
+
+    [[nodiscard]] bool accept(const FrameType &header, bool control) const {
+        if (control || isLocal(header.ip)) return true;
+        auto route = routes.lookup(header.ip);
+        return route && route->nextHop != header.src && header.src != local;
+    }
+
+    // true the first time a non-local frame is seen, false for repeats (own echo, loops)
+    bool shouldForward(const FrameType &frame) {
+        if (isLocal(frame.ip) || !accept(frame, false)) return false;
+        auto key = std::make_pair(frame.src, frame.crc());
+        std::lock_guard<std::mutex> lock(historyLock);
+        if (std::find(history.begin(), history.end(), key) != history.end()) return false;
+        history.push_back(key);
+        if (history.size() > FORWARD_HISTORY) history.pop_front();
+        return true;
+    }
+
+private:
+    const IPType local;
+    const RoutingTable routes;
+    std::mutex historyLock;
+    std::deque<std::pair<IPType, unsigned int>> history;
+};
+
+#endif//ROUTE_H
@@ -1,4 +1,5 @@
 #include "socket.h"
+#include "log.h"
 
 const int MAXPENDING = 5; // maximum outstanding connection requests
 
@@ -48,27 +49,28 @@ std::string str_extract(const std::string& str_in)
 int set_daemon(const char* str_dir)
 {
 #if defined (_MSC_VER)
-  std::cout << str_dir << std::endl;
+  LOG(Info, SOCKET, "%s", str_dir);
 #else
   pid_t pid, sid;
   pid = fork();
   if (pid < 0)
   {
-    std::cout << "cannot create pid: " << pid << std::endl;
+    LOG(Error, SOCKET, "cannot create pid: %d", pid);
     exit(EXIT_FAILURE);
   }
   if (pid > 0)
   {
-    std::cout << "created pid: " << pid << std::endl;
+    LOG(Info, SOCKET, "created pid: %d", pid);
     exit(EXIT_SUCCESS);
   }
 
-  umask(0);
+  //no umask(0): the INBOX, .part files and logs must not become writable by everyone
+  umask(022);
 
   sid = setsid();
   if (sid < 0)
   {
-    std::cout << "cannot create sid: " << sid << std::endl;
+    LOG(Error, SOCKET, "cannot create sid: %d", sid);
     exit(EXIT_FAILURE);
   }
 
@@ -76,10 +78,10 @@ int set_daemon(const char* str_dir)
   {
     if ((chdir(str_dir)) < 0)
     {
-      std::cout << "cannot chdir to: " << str_dir << std::endl;
+      LOG(Error, SOCKET, "cannot chdir to: %s", str_dir);
       exit(EXIT_FAILURE);
     }
-    std::cout << "chdir to: " << str_dir << std::endl;
+    LOG(Info, SOCKET, "chdir to: %s", str_dir);
   }
 #endif
   return 0;
@@ -133,14 +135,18 @@ int socket_t::write_all(const void* _buf, int size_buf)
   const char* buf = static_cast<const char*>(_buf); // can't do pointer arithmetic on void* 
   int sent_size; // size in bytes sent or -1 on error 
   int size_left; // size in bytes left to send 
+#if defined (MSG_NOSIGNAL)
+  const int flags = MSG_NOSIGNAL; // a peer that went away is an error, not a SIGPIPE
+#else
   const int flags = 0;
+#endif
   size_left = size_buf;
   while (size_left > 0)
   {
     sent_size = ::send(m_sockfd, buf, size_left, flags);
     if (-1 == sent_size)
     {
-      std::cout << "send error: " << strerror(errno) << std::endl;
+      LOG(Error, SOCKET, "send error: %s", strerror(errno));
       return -1;
     }
     size_left -= sent_size;
@@ -172,7 +178,7 @@ int socket_t::read_all(void* _buf, int size_buf)
     recv_size = ::recv(m_sockfd, buf, size_left, flags);
     if (-1 == recv_size)
     {
-      std::cout << "recv error: " << strerror(errno) << std::endl;
+      LOG(Error, SOCKET, "recv error: %s", strerror(errno));
     }
     //everything received, exit
     if (0 == recv_size)
@@ -186,6 +192,61 @@ int socket_t::read_all(void* _buf, int size_buf)
   return total_recv_size;
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+//socket_t::read_some
+//a single ::recv, returns what is there (0 if the peer closed, -1 on error)
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int socket_t::read_some(void* buf, int size_buf)
+{
+  int recv_size = ::recv(m_sockfd, static_cast<char*>(buf), size_buf, 0);
+  if (-1 == recv_size)
+  {
+    LOG(Error, SOCKET, "recv error: %s", strerror(errno));
+  }
+  return recv_size;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+//socket_t::wait_readable
+//::poll with a timeout, so a thread blocked on a socket can still notice it should stop;
+//not ::select, which cannot take a descriptor at or above FD_SETSIZE
+//returns 1 if readable (or a connection is pending on a listening socket), 0 on timeout, -1 on error
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int socket_t::wait_readable(int timeout_ms)
+{
+  pollfd pfd;
+  pfd.fd = m_sockfd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+#if defined (_MSC_VER)
+  int ready = ::WSAPoll(&pfd, 1, timeout_ms);
+#else
+  int ready = ::poll(&pfd, 1, timeout_ms);
+#endif
+  if (ready < 0)
+  {
+    return -1;
+  }
+  //a hang-up or error reads as readable: the next read returns 0 or -1
+  return ready > 0 ? 1 : 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+//socket_t::shutdown_write
+//half close: the peer reads end of file, we can still receive
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void socket_t::shutdown_write()
+{
+#if defined (_MSC_VER)
+  ::shutdown(m_sockfd, SD_SEND);
+#else
+  ::shutdown(m_sockfd, SHUT_WR);
+#endif
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////
 //socket_t::hostname_to_ip
 //The getaddrinfo function provides protocol-independent translation from an ANSI host name 
@@ -222,7 +283,7 @@ int socket_t::hostname_to_ip(const char* host_name, char* ip)
 //tcp_server_t::tcp_server_t
 /////////////////////////////////////////////////////////////////////////////////////////////////////
 
-tcp_server_t::tcp_server_t(const unsigned short server_port)
+tcp_server_t::tcp_server_t(const unsigned short server_port, bool loopback_only)
   : socket_t()
 {
 #if defined (_MSC_VER)
@@ -237,7 +298,7 @@ tcp_server_t::tcp_server_t(const unsigned short server_port)
   // create TCP socket for incoming connections
   if ((m_sockfd = ::socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
   {
-    std::cout << "socket error: " << std::endl;
+    LOG(Error, SOCKET, "socket error:");
     exit(1);
   }
 
@@ -245,14 +306,14 @@ tcp_server_t::tcp_server_t(const unsigned short server_port)
   int on = 1;
   if (setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, (char*)&on, sizeof(on)) < 0)
   {
-    std::cout << "setsockopt error: " << std::endl;
+    LOG(Error, SOCKET, "setsockopt error:");
     exit(1);
   }
 
   // construct local address structure
   memset(&server_addr, 0, sizeof(server_addr));     // zero out structure
   server_addr.sin_family = AF_INET;                 // internet address family
-  server_addr.sin_addr.s_addr = htonl(INADDR_ANY);  // any incoming interface
+  server_addr.sin_addr.s_addr = htonl(loopback_only ? INADDR_LOOPBACK : INADDR_ANY);  // any incoming interface, or local processes only
   server_addr.sin_port = htons(server_port);        // local port
 
   // bind to the local address
@@ -260,14 +321,14 @@ tcp_server_t::tcp_server_t(const unsigned short server_port)
   {
     //bind error: Permission denied
     //probably trying to bind a port under 1024. These ports usually require root privileges to be bound.
-    std::cout << "bind error: " << std::endl;
+    LOG(Error, SOCKET, "bind error:");
     exit(1);
   }
 
   // mark the socket so it will listen for incoming connections
   if (::listen(m_sockfd, MAXPENDING) < 0)
   {
-    std::cout << "listen error: " << std::endl;
+    LOG(Error, SOCKET, "listen error:");
     exit(1);
   }
 
@@ -305,7 +366,7 @@ socket_t tcp_server_t::accept()
   // wait for a client to connect
   if ((fd = ::accept(m_sockfd, (struct sockaddr*) & addr_client, &len_addr)) < 0)
   {
-    std::cout << "accept error " << std::endl;
+    LOG(Error, SOCKET, "accept error");
   }
 
   socket_t socket(fd, addr_client);
@@ -369,7 +430,7 @@ int tcp_client_t::connect(const char* host_name, const unsigned short server_por
   // create a stream socket using TCP
   if ((m_sockfd = ::socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
   {
-    std::cout << "socket error: " << std::endl;
+    LOG(Error, SOCKET, "socket error:");
     return -1;
   }
 
@@ -378,7 +439,7 @@ int tcp_client_t::connect(const char* host_name, const unsigned short server_por
   server_addr.sin_family = AF_INET; // internet address family
   if (inet_pton(AF_INET, m_server_ip.c_str(), &server_addr.sin_addr) <= 0) // server IP address
   {
-    std::cout << "inet_pton error: " << strerror(errno) << std::endl;
+    LOG(Error, SOCKET, "inet_pton error: %s", strerror(errno));
     return -1;
   }
   server_addr.sin_port = htons(m_server_port); // server port
@@ -386,7 +447,7 @@ int tcp_client_t::connect(const char* host_name, const unsigned short server_por
   // establish the connection to the server
   if (::connect(m_sockfd, (struct sockaddr*) & server_addr, sizeof(server_addr)) < 0)
   {
-    std::cout << "connect error: " << strerror(errno) << std::endl;
+    LOG(Error, SOCKET, "connect error: %s", strerror(errno));
     return -1;
   }
   return 0;
@@ -404,7 +465,7 @@ int tcp_client_t::connect()
   // create a stream socket using TCP
   if ((m_sockfd = ::socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
   {
-    std::cout << "socket error: " << std::endl;
+    LOG(Error, SOCKET, "socket error:");
     return -1;
   }
 
@@ -413,7 +474,7 @@ int tcp_client_t::connect()
   server_addr.sin_family = AF_INET; // internet address family
   if (inet_pton(AF_INET, m_server_ip.c_str(), &server_addr.sin_addr) <= 0) // server IP address
   {
-    std::cout << "inet_pton error: " << strerror(errno) << std::endl;
+    LOG(Error, SOCKET, "inet_pton error: %s", strerror(errno));
     return -1;
   }
   server_addr.sin_port = htons(m_server_port); // server port
@@ -421,7 +482,7 @@ int tcp_client_t::connect()
   // establish the connection to the server
   if (::connect(m_sockfd, (struct sockaddr*) & server_addr, sizeof(server_addr)) < 0)
   {
-    std::cout << "connect error: " << strerror(errno) << std::endl;
+    LOG(Error, SOCKET, "connect error: %s", strerror(errno));
     return -1;
   }
   return 0;
@@ -11,6 +11,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h> //hostent
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -57,6 +58,9 @@ public:
   void close();
   int write_all(const void* buf, int size_buf);
   int read_all(void* buf, int size_buf);
+  int read_some(void* buf, int size_buf);
+  int wait_readable(int timeout_ms);
+  void shutdown_write();
   int hostname_to_ip(const char* host_name, char* ip);
 
 public:
@@ -71,7 +75,7 @@ public:
 class tcp_server_t : public socket_t
 {
 public:
-  tcp_server_t(const unsigned short server_port);
+  tcp_server_t(const unsigned short server_port, bool loopback_only = false);
   socket_t accept();
   ~tcp_server_t();
 };
@@ -0,0 +1,81 @@
+#ifndef SOFT_H
+#define SOFT_H
+
+#include "utils.h"
+#include <array>
+#include <cmath>
+#include <string>
+
+using LLRType = signed char;
+
+constexpr int MAX_FRAME_BITS = (MTU - LENGTH_PREAMBLE) * 8;
+constexpr float LLR_SCALE = 32.0f;// (signal1 - signal2) is about +-2 for a clean bit
+constexpr int CHASE_BITS = 4;     // try 2^CHASE_BITS - 1 flip patterns on CRC failure
+
+/* Soft-decision view of one frame (everything after the PREAMBLE).
+ * Every demodulated bit is stored as a quantized log-likelihood ratio:
+ * positive means "1", negative means "0", the magnitude is the reliability.
+ * The buffer is a fixed array owned by the Reader and reused for every frame.
+ */
+class SoftFrame {
+public:
+    static LLRType quantize(float signal1, float signal2) {
+        float llr = std::round((signal1 - signal2) * LLR_SCALE);
+        return (LLRType) std::max(-127.0f, std::min(127.0f, llr));
+    }
+
+    void clear() { nBits = 0; }
+
+    void push(LLRType llr) {
+        if (nBits < MAX_FRAME_BITS) llr_[nBits++] = llr;
+    }
+
+    [[nodiscard]] int size() const { return nBits; }
+
+    [[nodiscard]] const LLRType *data() const { return llr_.data(); }
+
+    [[nodiscard]] LLRType operator[](int i) const { return llr_[i]; }
+
+    // hard decisions of all complete bytes, LSB first as sent by the Writer
+    [[nodiscard]] std::string hardBytes() const {
+        std::string bytes(nBits / 8, 0);
+        for (int i = 0; i < nBits / 8 * 8; ++i)
+            if (llr_[i] > 0) bytes[i / 8] = (char) (bytes[i / 8] | 1 << (i % 8));
+        return bytes;
+    }
+
+    /* Chase decoding: flip every combination of the CHASE_BITS least reliable
+     * bits in [fromBit, size()) and stop at the first candidate accepted by check.
+     * On success bytes holds the corrected frame.
+     */
+    template<class Check>
+    bool chase(std::string &bytes, int fromBit, Check check) const {
+        int weakest[CHASE_BITS];
+        int nWeak = 0;
+        for (int i = fromBit; i < nBits / 8 * 8; ++i) {
+            // insertion into the small sorted list of least reliable positions
+            int pos = nWeak < CHASE_BITS ? nWeak++ : CHASE_BITS;
+            while (pos > 0 && std::abs(llr_[i]) < std::abs(llr_[weakest[pos - 1]])) {
+                if (pos < CHASE_BITS) weakest[pos] = weakest[pos - 1];
+                --pos;
+            }
+            if (pos < CHASE_BITS) weakest[pos] = i;
+        }
+        for (unsigned mask = 1; mask < (1u << nWeak); ++mask) {
+            std::string candidate = bytes;
+            for (int j = 0; j < nWeak; ++j)
+                if (mask >> j & 1) candidate[weakest[j] / 8] = (char) (candidate[weakest[j] / 8] ^ 1 << (weakest[j] % 8));
+            if (check(candidate)) {
+                bytes = std::move(candidate);
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    std::array<LLRType, MAX_FRAME_BITS> llr_{};
+    int nBits = 0;
+};
+
+#endif//SOFT_H
@@ -0,0 +1,127 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/* The few threading primitives the protocol stack needs, on top of the
+ * standard library so the core builds without JUCE. They keep the juce::
+ * names and semantics the code was written against; the namespace keeps them
+ * apart from JUCE's in translation units that include both.
+ */
+namespace aether {
+
+class CriticalSection {
+public:
+    void enter() const { mutex.lock(); }
+
+    bool tryEnter() const { return mutex.try_lock(); }
+
+    void exit() const { mutex.unlock(); }
+
+private:
+    mutable std::recursive_mutex mutex;
+};
+
+class ScopedLock {
+public:
+    explicit ScopedLock(const CriticalSection &section) : lock(section) { lock.enter(); }
+
+    ScopedLock(const ScopedLock &) = delete;
+
+    ~ScopedLock() { lock.exit(); }
+
+private:
+    const CriticalSection &lock;
+};
+
+// auto-reset: a successful wait() consumes the signal
+class WaitableEvent {
+public:
+    // false on timeout; a negative timeout waits forever
+    bool wait(int timeoutMs = -1) const {
+        std::unique_lock<std::mutex> guard(mutex);
+        auto isSignalled = [this]() { return signalled; };
+        if (timeoutMs < 0) changed.wait(guard, isSignalled);
+        else if (!changed.wait_for(guard, std::chrono::milliseconds(timeoutMs), isSignalled))
+            return false;
+        signalled = false;
+        return true;
+    }
+
+    void signal() const {
+        std::lock_guard<std::mutex> guard(mutex);
+        signalled = true;
+        changed.notify_all();
+    }
+
+    void reset() const {
+        std::lock_guard<std::mutex> guard(mutex);
+        signalled = false;
+    }
+
+private:
+    mutable std::mutex mutex;
+    mutable std::condition_variable changed;
+    mutable bool signalled = false;
+};
+
+/* Subclasses implement run() and poll threadShouldExit(). Unlike JUCE a
+ * thread cannot be killed, so stopThread() always waits for run() to return.
+ */
+class Thread {
+public:
+    explicit Thread(std::string threadName) : name(std::move(threadName)) {}
+
+    Thread(const Thread &) = delete;
+
+    virtual ~Thread() { stopThread(-1); }
+
+    virtual void run() = 0;
+
+    void startThread() {
+        if (thread.joinable()) return;
+        shouldExit = false;
+        thread = std::thread([this]() {
+            current = this;
+            run();
+        });
+    }
+
+    // the timeout only exists for JUCE compatibility
+    bool stopThread(int) {
+        signalThreadShouldExit();
+        if (!thread.joinable()) return true;
+        if (thread.get_id() == std::this_thread::get_id()) thread.detach();// stopping itself from run()
+        else
+            thread.join();
+        return true;
+    }
+
+    void signalThreadShouldExit() { shouldExit = true; }
+
+    [[nodiscard]] bool threadShouldExit() const { return shouldExit.load(std::memory_order_relaxed); }
+
+    // for code that does not know which thread runs it; false outside an aether::Thread
+    static bool currentThreadShouldExit() { return current && current->threadShouldExit(); }
+
+    [[nodiscard]] bool isThreadRunning() const { return thread.joinable(); }
+
+    [[nodiscard]] const std::string &getThreadName() const { return name; }
+
+    static void sleep(int ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+
+private:
+    static inline thread_local Thread *current = nullptr;
+    std::string name;
+    std::atomic<bool> shouldExit{false};
+    std::thread thread;
+};
+
+}// namespace aether
+
+#endif//THREAD_H
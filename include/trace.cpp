@@ -0,0 +1,111 @@
+#include "trace.h"
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> Trace::enabled{true};
+const MyTimer Trace::epoch;
+
+namespace {
+    struct Ring {
+        uint32_t tid = 0;
+        std::atomic<uint64_t> written{0};// total events ever appended; slot = written % TRACE_RING_EVENTS
+        TraceEvent events[TRACE_RING_EVENTS];
+    };
+
+    struct Registry {
+        std::mutex lock;
+        std::vector<std::string> names;
+        std::vector<std::shared_ptr<Ring>> rings;// kept after their thread exits so dump() still sees them,
+        std::vector<Ring *> free;                // until the next new thread takes one over
+        uint32_t threads = 0;
+    };
+
+    Registry &registry() {
+        static Registry r;
+        return r;
+    }
+
+    Ring *registerRing() {
+        auto &reg = registry();
+        std::lock_guard<std::mutex> lock(reg.lock);
+        Ring *r;
+        if (reg.free.empty()) {
+            reg.rings.push_back(std::make_shared<Ring>());
+            r = reg.rings.back().get();
+        } else {// a thread per tunnelled connection would otherwise leave a ring each behind
+            r = reg.free.back();
+            reg.free.pop_back();
+            r->written.store(0, std::memory_order_relaxed);
+        }
+        r->tid = reg.threads++;
+        return r;
+    }
+
+    // hands the ring back when its thread exits
+    struct RingReturn {
+        Ring *ring = nullptr;
+
+        ~RingReturn() {
+            if (!ring) return;
+            auto &reg = registry();
+            std::lock_guard<std::mutex> lock(reg.lock);
+            reg.free.push_back(ring);
+        }
+    };
+
+    // plain pointer: no TLS guard on the hot path, the registry owns the ring
+    thread_local Ring *ring = nullptr;
+    thread_local RingReturn ringReturn;
+}// namespace
+
+void Trace::append(const TraceEvent &event) {
+    if (!ring) ringReturn.ring = ring = registerRing();
+    uint64_t n = ring->written.load(std::memory_order_relaxed);
+    ring->events[n % TRACE_RING_EVENTS] = event;
+    ring->written.store(n + 1, std::memory_order_release);
+}
+
+uint32_t Trace::name(const char *name) {
+    auto &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.lock);
+    for (uint32_t i = 0; i < reg.names.size(); ++i)
+        if (reg.names[i] == name) return i;
+    reg.names.emplace_back(name);
+    return (uint32_t) reg.names.size() - 1;
+}
+
+bool Trace::dump(const std::string &path) {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) return false;
+    auto &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.lock);
+    auto put32 = [file](uint32_t v) { fwrite(&v, sizeof(v), 1, file); };
+    fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, file);
+    put32((uint32_t) reg.names.size());
+    for (uint32_t i = 0; i < reg.names.size(); ++i) {
+        put32(i);
+        put32((uint32_t) reg.names[i].size());
+        fwrite(reg.names[i].data(), 1, reg.names[i].size(), file);
+    }
+    put32((uint32_t) reg.rings.size());
+    std::vector<TraceEvent> copy;
+    for (auto &ring: reg.rings) {
+        // the owner keeps writing: take what is there now, oldest first, then drop the
+        // slots it may have overwritten while they were copied, and the one it may be writing
+        uint64_t end = ring->written.load(std::memory_order_acquire);
+        uint64_t begin = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0;
+        copy.clear();
+        for (uint64_t i = begin; i < end; ++i) copy.push_back(ring->events[i % TRACE_RING_EVENTS]);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t after = ring->written.load(std::memory_order_relaxed);
+        if (after >= TRACE_RING_EVENTS && after - TRACE_RING_EVENTS + 1 > begin)
+            copy.erase(copy.begin(), copy.begin() + (ptrdiff_t) std::min(after - TRACE_RING_EVENTS + 1 - begin, end - begin));
+        put32(ring->tid);
+        put32((uint32_t) copy.size());
+        fwrite(copy.data(), sizeof(TraceEvent), copy.size(), file);
+    }
+    return fclose(file) == 0;
+}
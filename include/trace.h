@@ -0,0 +1,81 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "utils.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+constexpr int TRACE_RING_EVENTS = 1 << 14;// per thread, oldest events are overwritten
+constexpr char TRACE_MAGIC[8] = {'A', 'E', 'T', 'R', 'A', 'C', 'E', '1'};
+
+enum class TraceKind : uint8_t { BEGIN = 0, END = 1, INSTANT = 2 };
+
+/* One record in the ring, also the on-disk layout.
+ * File: TRACE_MAGIC, u32 name count, per name {u32 id, u32 length, chars},
+ *       u32 thread count, per thread {u32 tid, u32 event count, events}.
+ */
+struct TraceEvent {
+    uint64_t ns;  // since process start (steady_clock)
+    uint64_t arg; // free-form: frame type, byte count, ...
+    uint32_t name;// id from Trace::name()
+    TraceKind kind;
+    uint8_t pad[3];
+};
+static_assert(sizeof(TraceEvent) == 24, "TraceEvent is written to disk as is");
+
+/* Per-thread ring-buffer tracer.
+ * record() only touches the calling thread's ring: one clock read, one
+ * 24-byte store and a relaxed index update. Names are interned once per call
+ * site. dump() copies every ring into a compact binary file that
+ * trace2chrome turns into Chrome's trace format.
+ */
+class Trace {
+public:
+    static uint32_t name(const char *name);
+
+    static void record(uint32_t name, TraceKind kind, uint64_t arg = 0) {
+        if (!enabled.load(std::memory_order_relaxed)) return;
+        append({nanoseconds(), arg, name, kind, {}});
+    }
+
+    static uint64_t nanoseconds() { return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock::now() - epoch.start).count(); }
+
+    // false on I/O error
+    static bool dump(const std::string &path);
+
+    static std::atomic<bool> enabled;
+
+private:
+    static void append(const TraceEvent &event);
+
+    static const MyTimer epoch;
+};
+
+// BEGIN now, END when the scope is left
+class TraceSpan {
+public:
+    TraceSpan(uint32_t nameId, uint64_t arg = 0) : name(nameId) { Trace::record(name, TraceKind::BEGIN, arg); }
+
+    TraceSpan(const TraceSpan &) = delete;
+
+    ~TraceSpan() { Trace::record(name, TraceKind::END); }
+
+private:
+    uint32_t name;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_ID(label)                                                                                                                                                            \
+    [] {                                                                                                                                                                           \
+        static const uint32_t id = Trace::name(label);                                                                                                                           \
+        return id;                                                                                                                                                                 \
+    }()
+// TRACE_SPAN("reader.frame") or TRACE_SPAN("reader.frame", frame.type)
+#define TRACE_SPAN(label, ...) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(TRACE_ID(label), ##__VA_ARGS__)
+#define TRACE_BEGIN(label, ...) Trace::record(TRACE_ID(label), TraceKind::BEGIN, ##__VA_ARGS__)
+#define TRACE_END(label) Trace::record(TRACE_ID(label), TraceKind::END)
+#define TRACE_INSTANT(label, ...) Trace::record(TRACE_ID(label), TraceKind::INSTANT, ##__VA_ARGS__)
+
+#endif//TRACE_H
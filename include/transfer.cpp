@@ -0,0 +1,382 @@
+#include "transfer.h"
+#include "log.h"
+#include "pool.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <system_error>
+
+namespace fs = std::filesystem;
+
+static const char MAP_MAGIC[] = "AETX";
+constexpr int LENGTH_FILE_ID = sizeof(TransferId);
+constexpr int LENGTH_FILE_DATA_HEADER = LENGTH_FILE_ID + sizeof(uint32_t);
+constexpr size_t RECENT_TRANSFERS = 64;
+
+uint32_t crc32Of(const char *data, size_t n) {
+    boost::crc_32_type crc;
+    crc.process_bytes(data, n);
+    return crc.checksum();
+}
+
+template<class T>
+static bool take(const std::string &body, size_t &at, T &value) {
+    if (body.size() - at < sizeof(T)) return false;
+    std::memcpy(&value, body.data() + at, sizeof(T));
+    at += sizeof(T);
+    return true;
+}
+
+static bool has(const std::vector<uint8_t> &bitmap, uint32_t block) { return bitmap[block >> 3] >> (block & 7) & 1; }
+
+void FileTransfer::shutdown() {
+    executor.stop();
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &[key, in]: incoming) saveMap(*in);// resumed by the next offer
+    incoming.clear();
+}
+
+FileTransfer::Result FileTransfer::send(IPType peer, const std::string &path, std::string name) {
+    Result result;
+    auto out = std::make_shared<Outgoing>();
+    if (!out->file.openRead(path)) {
+        result.error = "cannot open " + path;
+        return result;
+    }
+    if (name.empty()) name = fs::path(path).filename().string();
+    auto config = GlobalConfig::current();
+    int body = (std::min)(link->maxBodyLength(), config->mtu);
+    if (link->laneCount() > 1) body = link->maxBodyLength();// the MTU is for the gateway's single lane
+    if (body <= LENGTH_FILE_DATA_HEADER) {
+        result.error = "MTU " + std::to_string(body) + " leaves no room for a block";
+        return result;
+    }
+    out->peer = peer;
+    out->blockSize = (uint16_t) (body - LENGTH_FILE_DATA_HEADER);
+    out->crc = crc32Of(out->file.data(), out->file.size());
+    TransferId id;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        while (outgoing.count(id = ++nextId) || id == 0);
+        outgoing[id] = out;
+    }
+    out->offer = inString(id) + inString((uint64_t) out->file.size()) + inString(out->blockSize) + inString(out->crc) + name;
+    if ((int) out->offer.size() > link->maxBodyLength()) {
+        std::lock_guard<std::mutex> guard(lock);
+        outgoing.erase(id);
+        result.error = "file name too long";
+        return result;
+    }
+    LOG(Info, TRANSFER, "Offering %s (%llu bytes, %u-byte blocks) to %s as #%u", path.c_str(), (unsigned long long) out->file.size(), out->blockSize,
+        IPType2Str(peer).c_str(), id);
+    MyTimer timer;
+    link->send(FrameType{Config::FILE_OFFER, peer, 0, out->offer});
+
+    std::unique_lock<std::mutex> guard(lock);
+    while (!out->done) {
+        changed.wait_for(guard, std::chrono::milliseconds(FILE_TICK_MS));
+        if (out->done) break;
+        if (out->heard.duration() > FILE_IDLE_TIMEOUT) {
+            result.error = "no answer from " + IPType2Str(peer);
+            break;
+        }
+        // not answered, or the receiver went quiet, e.g. because it was restarted and forgot the transfer
+        if (out->heard.duration() > 2 * FILE_RTO && out->offered.duration() > 2 * FILE_RTO) {
+            out->offered.restart();
+            link->send(FrameType{Config::FILE_OFFER, peer, 0, out->offer});
+        }
+    }
+    outgoing.erase(id);
+    guard.unlock();
+    result.ok = out->done && out->status == 1;
+    result.bytes = out->file.size();
+    result.seconds = timer.duration();
+    if (out->done && !result.ok) result.error = out->status == FILE_REFUSED ? "the receiver refused it" : "the receiver's copy does not match";
+    LOG(Info, TRANSFER, "#%u %s: %s after %.1f s", id, path.c_str(), result.ok ? "delivered" : result.error.c_str(), result.seconds);
+    return result;
+}
+
+void FileTransfer::onFrame(const FrameType &frame) {
+    std::lock_guard<std::mutex> guard(lock);
+    switch (frame.type) {
+        case Config::FILE_OFFER:
+            offered(frame);
+            break;
+        case Config::FILE_REQ:
+            requested(frame);
+            break;
+        case Config::FILE_DATA:
+            received(frame);
+            break;
+        case Config::FILE_DONE:
+            finished(frame);
+            break;
+        default:
+            break;
+    }
+}
+
+void FileTransfer::offered(const FrameType &frame) {
+    size_t at = 0;
+    TransferId id;
+    uint64_t size;
+    uint16_t blockSize;
+    uint32_t crc;
+    if (!take(frame.body, at, id) || !take(frame.body, at, size) || !take(frame.body, at, blockSize) || !take(frame.body, at, crc) || blockSize == 0) return;
+    auto key = std::make_pair(frame.src, id);
+    auto offer = frame.body.substr(LENGTH_FILE_ID);
+    auto seen = recent.find(key);
+    if (seen != recent.end() && seen->second.offer == offer) {// our DONE got lost
+        link->send(FrameType{Config::FILE_DONE, frame.src, 0, inString(id) + inString(seen->second.status)});
+        return;
+    }
+    auto current = incoming.find(key);
+    if (current != incoming.end()) {
+        if (current->second->offer == offer) {// a repeated offer; the tick asks again for what is lost
+            current->second->heard.restart();
+            return;
+        }
+        // the sender restarted and reuses the ID for another file: keep the old one for resuming
+        saveMap(*current->second);
+        incoming.erase(current);
+    }
+    auto name = fs::path(frame.body.substr(at)).filename().string();// nothing outside the inbox
+    if (name.empty() || name == "." || name == "..") return;
+    std::error_code ec;
+    auto dir = fs::path(GlobalConfig::current()->inbox);
+    fs::create_directories(dir, ec);
+    auto space = fs::space(dir, ec);
+    if (size > FILE_MAX_SIZE || (!ec && space.available < size)) {
+        LOG(Warn, TRANSFER, "#%u %s refused: %llu bytes", id, name.c_str(), (unsigned long long) size);
+        link->send(FrameType{Config::FILE_DONE, frame.src, 0, inString(id) + inString(FILE_REFUSED)});
+        return;
+    }
+
+    auto in = std::make_unique<Incoming>();
+    in->peer = frame.src;
+    in->id = id;
+    in->offer = offer;
+    in->name = name;
+    in->size = size;
+    in->blockSize = blockSize;
+    in->crc = crc;
+    in->blocks = (uint32_t) ((size + blockSize - 1) / blockSize);
+    auto target = dir / name;
+    in->path = target.string() + ".part";
+
+    // the same file is already here, e.g. from an earlier run whose DONE was lost
+    if (fs::is_regular_file(target, ec) && fs::file_size(target, ec) == size) {
+        MappedFile existing;
+        if (existing.openRead(target.string()) && crc32Of(existing.data(), existing.size()) == crc) {
+            LOG(Info, TRANSFER, "#%u %s is already in %s", id, name.c_str(), dir.string().c_str());
+            link->send(FrameType{Config::FILE_DONE, frame.src, 0, inString(id) + inString((uint8_t) 1)});
+            remember(key, offer, 1);
+            return;
+        }
+    }
+
+    in->have.assign((in->blocks + 7) / 8, 0);
+    in->missing = in->blocks;
+    bool resumed = false;
+    if (FILE *map = fopen((in->path + ".map").c_str(), "rb")) {// left by an interrupted transfer of the same file
+        auto header = mapHeader(*in);
+        std::string stored(header.size(), '\0');
+        std::vector<uint8_t> bitmap(in->have.size());
+        if (fread(stored.data(), 1, stored.size(), map) == stored.size() && stored == header && fread(bitmap.data(), 1, bitmap.size(), map) == bitmap.size() &&
+            fs::file_size(in->path, ec) == size) {
+            in->have.swap(bitmap);
+            for (uint32_t b = 0; b < in->blocks; ++b)
+                if (has(in->have, b)) --in->missing;
+            resumed = true;
+        }
+        fclose(map);
+    }
+    if (!in->file.openWrite(in->path, size)) {
+        LOG(Error, TRANSFER, "#%u cannot create %s", id, in->path.c_str());
+        if (!resumed) fs::remove(in->path, ec);
+        link->send(FrameType{Config::FILE_DONE, frame.src, 0, inString(id) + inString(FILE_REFUSED)});
+        return;
+    }
+    LOG(Info, TRANSFER, "#%u receiving %s (%llu bytes) from %s%s", id, name.c_str(), (unsigned long long) size, IPType2Str(frame.src).c_str(),
+        resumed ? (", resuming with " + std::to_string(in->blocks - in->missing) + "/" + std::to_string(in->blocks) + " blocks").c_str() : "");
+    auto &stored = *(incoming[key] = std::move(in));
+    if (stored.missing == 0) {
+        complete(stored);
+        return;
+    }
+    stored.dirty = !resumed;
+    saveMap(stored);
+    ask(stored, FILE_WINDOW);
+    if (!ticking) {
+        ticking = true;
+        executor.after(FILE_TICK_MS / 1000.0, [this]() { tick(); });
+    }
+}
+
+void FileTransfer::requested(const FrameType &frame) {
+    size_t at = 0;
+    TransferId id;
+    if (!take(frame.body, at, id)) return;
+    auto it = outgoing.find(id);
+    if (it == outgoing.end() || it->second->peer != frame.src) return;
+    auto &out = *it->second;
+    out.heard.restart();
+    uint64_t size = out.file.size();
+    auto blocks = (uint32_t) ((size + out.blockSize - 1) / out.blockSize);
+    std::vector<FrameType> frames;
+    uint32_t first;
+    uint16_t count;
+    while (take(frame.body, at, first) && take(frame.body, at, count) && frames.size() < 2 * FILE_WINDOW) {
+        for (uint32_t b = first; b < blocks && b - first < count; ++b) {
+            uint64_t offset = (uint64_t) b * out.blockSize;
+            auto length = (size_t) (std::min)((uint64_t) out.blockSize, size - offset);
+            std::string body = BodyPool::take(LENGTH_FILE_DATA_HEADER + length);
+            body += inString(id);
+            body += inString(b);
+            body.append(out.file.data() + offset, length);// straight from the page cache into the frame
+            frames.emplace_back(Config::FILE_DATA, out.peer, 0, std::move(body));
+            bytesTx.add(length);
+        }
+    }
+    if (!frames.empty()) link->sendBurst(std::move(frames), GlobalConfig::current()->chunkGapMs);
+}
+
+void FileTransfer::received(const FrameType &frame) {
+    size_t at = 0;
+    TransferId id;
+    uint32_t block;
+    if (!take(frame.body, at, id) || !take(frame.body, at, block)) return;
+    auto it = incoming.find({frame.src, id});
+    if (it == incoming.end()) return;
+    auto &in = *it->second;
+    in.heard.restart();
+    if (block >= in.blocks) return;
+    uint64_t offset = (uint64_t) block * in.blockSize;
+    if (frame.body.size() - at != (std::min)((uint64_t) in.blockSize, in.size - offset)) return;
+    if (has(in.have, block)) {
+        duplicates.add(1);
+        return;
+    }
+    std::memcpy(in.file.data() + offset, frame.body.data() + at, frame.body.size() - at);
+    in.have[block >> 3] |= (uint8_t) (1u << (block & 7));
+    in.dirty = true;
+    --in.missing;
+    if (in.inFlight > 0) --in.inFlight;
+    in.progress.restart();
+    in.received += frame.body.size() - at;
+    bytesRx.add(frame.body.size() - at);
+    if (in.missing == 0) {
+        complete(in);
+        return;
+    }
+    if (in.inFlight <= FILE_WINDOW / 2) ask(in, FILE_WINDOW - in.inFlight);
+}
+
+void FileTransfer::finished(const FrameType &frame) {
+    size_t at = 0;
+    TransferId id;
+    uint8_t ok;
+    if (!take(frame.body, at, id) || !take(frame.body, at, ok)) return;
+    auto it = outgoing.find(id);
+    if (it == outgoing.end() || it->second->peer != frame.src) return;
+    it->second->done = true;
+    it->second->status = ok;
+    changed.notify_all();
+}
+
+void FileTransfer::ask(Incoming &in, int count) {
+    std::string body = inString(in.id);
+    int ranges = 0, asked = 0;
+    for (bool wrapped = false; asked < count && ranges < FILE_MAX_RANGES;) {
+        if (in.cursor >= in.blocks) {
+            // lost blocks are asked for again once nothing asked for is still on its way
+            if (wrapped || in.inFlight > 0) break;
+            in.cursor = 0;
+            wrapped = true;
+        }
+        while (in.cursor < in.blocks && has(in.have, in.cursor)) ++in.cursor;
+        if (in.cursor >= in.blocks) continue;
+        uint32_t first = in.cursor;
+        while (in.cursor < in.blocks && !has(in.have, in.cursor) && asked < count && in.cursor - first < 0xffff) ++in.cursor, ++asked;
+        body += inString(first) + inString((uint16_t) (in.cursor - first));
+        ++ranges;
+    }
+    if (!ranges) return;
+    in.inFlight += asked;
+    link->send(FrameType{Config::FILE_REQ, in.peer, 0, std::move(body)});
+}
+
+void FileTransfer::complete(Incoming &in) {
+    auto key = std::make_pair(in.peer, in.id);
+    bool ok = crc32Of(in.file.data(), in.file.size()) == in.crc;
+    std::error_code ec;
+    auto target = in.path.substr(0, in.path.size() - 5);// without ".part"
+    if (ok) {
+        in.file.flush();
+        in.file.close();
+        fs::rename(in.path, target, ec);
+        ok = !ec;
+        fs::remove(in.path + ".map", ec);
+    } else {// start over on the next offer
+        in.file.close();
+        fs::remove(in.path, ec);
+        fs::remove(in.path + ".map", ec);
+    }
+    double seconds = in.started.duration();
+    LOG(Info, TRANSFER, "#%u %s: %s, %llu bytes, %llu of them in %.1f s (%.0f B/s)", in.id, in.name.c_str(), ok ? "received and verified" : "CRC mismatch, discarded",
+        (unsigned long long) in.size, (unsigned long long) in.received, seconds, seconds > 0 ? (double) in.received / seconds : 0.0);
+    link->send(FrameType{Config::FILE_DONE, in.peer, 0, inString(in.id) + inString((uint8_t) ok)});
+    remember(key, in.offer, ok);
+    incoming.erase(key);
+}
+
+void FileTransfer::remember(std::pair<IPType, TransferId> key, const std::string &offer, uint8_t status) {
+    if (!recent.count(key)) {
+        recentOrder.push_back(key);
+        if (recentOrder.size() > RECENT_TRANSFERS) {
+            recent.erase(recentOrder.front());
+            recentOrder.pop_front();
+        }
+    }
+    recent[key] = Finished{offer, status};
+}
+
+std::string FileTransfer::mapHeader(const Incoming &in) const { return std::string(MAP_MAGIC, 4) + inString(in.size) + inString(in.blockSize) + inString(in.crc); }
+
+void FileTransfer::saveMap(Incoming &in) {
+    if (!in.dirty) return;
+    in.file.flush();// the blocks reach the disk before the bitmap that claims them does
+    auto path = in.path + ".map", temporary = path + ".tmp";
+    FILE *map = fopen(temporary.c_str(), "wb");
+    if (!map) return;
+    auto header = mapHeader(in);
+    bool ok = fwrite(header.data(), 1, header.size(), map) == header.size() && fwrite(in.have.data(), 1, in.have.size(), map) == in.have.size();
+    ok = fclose(map) == 0 && ok;
+    std::error_code ec;
+    if (ok) fs::rename(temporary, path, ec);
+    in.dirty = !ok || ec;
+    in.saved.restart();
+}
+
+void FileTransfer::tick() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = incoming.begin(); it != incoming.end();) {
+        auto &in = *it->second;
+        if (in.heard.duration() > FILE_IDLE_TIMEOUT) {
+            LOG(Warn, TRANSFER, "#%u %s: sender gone with %u/%u blocks, kept for resuming", in.id, in.name.c_str(), in.blocks - in.missing, in.blocks);
+            saveMap(in);
+            it = incoming.erase(it);
+            continue;
+        }
+        if (in.progress.duration() > FILE_RTO) {// what was asked for is lost, or the request was
+            in.inFlight = 0;
+            in.progress.restart();
+            ask(in, FILE_WINDOW);
+        }
+        if (in.saved.duration() >= 1.0) saveMap(in);
+        ++it;
+    }
+    ticking = !incoming.empty();
+    if (ticking) executor.after(FILE_TICK_MS / 1000.0, [this]() { tick(); });
+}
@@ -0,0 +1,155 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include "bond.h"
+#include "capture.h"
+#include "config.h"
+#include "executor.h"
+#include "metrics.h"
+#include "utils.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+using TransferId = unsigned short;
+
+constexpr int FILE_WINDOW = 32;           // blocks the receiver keeps asked for; more are asked for when half arrived
+constexpr double FILE_RTO = 3.0;          // seconds without a block before asking again; twice that without an answer before offering again
+constexpr double FILE_IDLE_TIMEOUT = 60.0;// seconds without a frame from the peer before a transfer is given up
+constexpr int FILE_TICK_MS = 200;
+constexpr int FILE_MAX_RANGES = 16;       // ranges in one FILE_REQ
+constexpr uint64_t FILE_MAX_SIZE = (uint64_t) 1 << 30;// larger offers are refused
+constexpr uint8_t FILE_REFUSED = 2;       // in FILE_DONE: the receiver cannot store the file
+
+// CRC-32 of a whole file, as in FILE_OFFER
+uint32_t crc32Of(const char *data, size_t n);
+
+/* FILE_* frames move a file from either node to the other's INBOX. BODY
+ * starts with the transfer's ID, chosen by the sender, then
+ * OFFER  SIZE 8 bytes, BLOCK 2 bytes, CRC 4 bytes (CRC-32 of the file), NAME
+ * REQ    {FIRST 4 bytes, COUNT 2 bytes} for each range of blocks wanted
+ * DATA   BLOCK NUMBER 4 bytes, the block
+ * DONE   OK 1 byte: 1 the whole file arrived and its CRC matches, 0 it does
+ *        not, FILE_REFUSED it is over FILE_MAX_SIZE or does not fit the disk
+ * The receiver drives: it keeps FILE_WINDOW blocks asked for, asks for more
+ * as they arrive and, after a pass over the file, again for what was lost.
+ * It writes each block in place into NAME.part, mapped and allocated to
+ * full size up front, and keeps NAME.part.map, a bitmap of the blocks it
+ * has, so an offer of the same file after an interruption resumes. At the
+ * end the file is checked against CRC and renamed. The sender cuts the
+ * blocks out of a MappedFile of the source, so neither end holds more of
+ * the file in its heap than the blocks on their way. An offer that repeats
+ * an ID is only taken for the same transfer if SIZE, BLOCK, CRC and NAME
+ * match as well: IDs start over when the sender restarts.
+ */
+class FileTransfer {
+public:
+    struct Result {
+        bool ok = false;
+        uint64_t bytes = 0;
+        double seconds = 0;
+        std::string error;
+    };
+
+    FileTransfer() = default;
+
+    FileTransfer(const FileTransfer &) = delete;
+
+    ~FileTransfer() { shutdown(); }
+
+    // must be called before any frame is sent or received
+    void attach(BondedLink &bondedLink) { link = &bondedLink; }
+
+    // sends path to peer under name (the file name of path if empty); blocks until the peer verified it or gave up
+    Result send(IPType peer, const std::string &path, std::string name = "");
+
+    void onFrame(const FrameType &frame);
+
+    // no more ticks, so the link may go; what is half received is kept for resuming
+    void shutdown();
+
+private:
+    struct Outgoing {
+        IPType peer = 0;
+        MappedFile file;
+        uint16_t blockSize = 0;
+        uint32_t crc = 0;
+        std::string offer;// body of FILE_OFFER
+        bool done = false;
+        uint8_t status = 0;// OK in FILE_DONE
+        MyTimer heard;  // since the last frame from the peer
+        MyTimer offered;// since FILE_OFFER was last sent
+    };
+
+    struct Incoming {
+        IPType peer = 0;
+        TransferId id = 0;
+        std::string offer;// FILE_OFFER body after the ID
+        std::string name;
+        std::string path;// of the .part file
+        uint64_t size = 0;
+        uint16_t blockSize = 0;
+        uint32_t crc = 0;
+        uint32_t blocks = 0;
+        MappedFile file;
+        std::vector<uint8_t> have;// bitmap
+        uint32_t missing = 0;
+        uint64_t received = 0;    // bytes in this run, for the rate
+        uint32_t cursor = 0;      // next block to consider asking for
+        int inFlight = 0;         // asked for and not arrived yet
+        bool dirty = false;       // bitmap changed since it was saved
+        MyTimer progress;         // since the last new block or the last time lost ones were asked for again
+        MyTimer heard;            // since the last frame from the sender
+        MyTimer saved;            // since the bitmap was saved
+        MyTimer started;
+    };
+
+    struct Finished {
+        std::string offer;
+        uint8_t status = 0;
+    };
+
+    void offered(const FrameType &frame);
+
+    void requested(const FrameType &frame);
+
+    void received(const FrameType &frame);
+
+    void finished(const FrameType &frame);
+
+    // the next count missing blocks from the cursor on, as FILE_REQ
+    void ask(Incoming &in, int count);
+
+    void complete(Incoming &in);
+
+    void saveMap(Incoming &in);
+
+    void tick();
+
+    // caller holds lock
+    void remember(std::pair<IPType, TransferId> key, const std::string &offer, uint8_t status);
+
+    [[nodiscard]] std::string mapHeader(const Incoming &in) const;
+
+    BondedLink *link = nullptr;
+    std::mutex lock;
+    std::condition_variable changed;// an outgoing transfer finished
+    std::map<TransferId, std::shared_ptr<Outgoing>> outgoing;
+    std::map<std::pair<IPType, TransferId>, std::unique_ptr<Incoming>> incoming;
+    std::map<std::pair<IPType, TransferId>, Finished> recent;// finished incoming transfers and their outcome, for late offers
+    std::deque<std::pair<IPType, TransferId>> recentOrder;  // oldest first
+    TransferId nextId = 0;
+    bool ticking = false;// a tick is scheduled
+    Counter &bytesTx = Metrics::counter("transfer.bytes_tx");
+    Counter &bytesRx = Metrics::counter("transfer.bytes_rx");
+    Counter &duplicates = Metrics::counter("transfer.duplicate_blocks");
+    Executor executor;// last: stopped before the transfers it ticks go away
+};
+
+#endif//TRANSFER_H
@@ -0,0 +1,490 @@
+#ifndef TUNNEL_H
+#define TUNNEL_H
+
+#include "bond.h"
+#include "config.h"
+#include "log.h"
+#include "metrics.h"
+#include "socket.h"
+#include "trace.h"
+#include "utils.h"
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using TunnelId = unsigned short;
+
+/* TUNNEL_* frames carry TCP connections over the link. BODY starts with
+ * ID       connection number, chosen by the side that opened it
+ * OFFSET   OPEN / OPENED / RESET: unused
+ *          DATA: position of the first byte carried
+ *          ACK: next byte expected
+ *          CLOSE: length of the stream; its end counts as one more byte,
+ *          so it is acknowledged like data
+ * OPEN carries NONCE (4 bytes, drawn when the opening side starts) and
+ * "host:port", DATA the bytes. Frames may be lost, so OPEN, DATA and CLOSE
+ * are sent again until answered. IDs start over when a node restarts: an
+ * OPEN whose NONCE differs from the one the ID was opened with ends the
+ * stale connection and opens a new one.
+ */
+struct TunnelHeader {
+    TunnelId id = 0;
+    unsigned int offset = 0;
+
+    [[nodiscard]] std::string inString() const { return ::inString(id) + ::inString(offset); }
+
+    // false if the body is too short to carry a header
+    bool fromBody(const std::string &body) {
+        if (body.size() < sizeof(id) + sizeof(offset)) return false;
+        const char *p = body.data();
+        std::copy(p, p + sizeof(id), (char *) &id), p += sizeof(id);
+        std::copy(p, p + sizeof(offset), (char *) &offset);
+        return true;
+    }
+};
+
+constexpr int LENGTH_TUNNEL_HEADER = sizeof(TunnelId) + sizeof(unsigned int);
+constexpr size_t TUNNEL_WINDOW = 4096;             // unacknowledged bytes per connection and direction
+constexpr size_t TUNNEL_MAX_BUFFERED = 64 << 10;   // received bytes held per connection
+constexpr double TUNNEL_INITIAL_RTO = 3.0;         // seconds before sending OPEN again; at least this long before DATA
+                                                   // is sent again until a round trip was measured
+constexpr double TUNNEL_MIN_RTO = 0.5;
+constexpr double TUNNEL_MAX_RTO = 30.0;
+constexpr double TUNNEL_OPEN_TIMEOUT = 30.0;       // seconds to wait for the gateway's connect
+constexpr double TUNNEL_IDLE_TIMEOUT = 300.0;      // seconds without a frame from the peer
+constexpr int TUNNEL_POLL_MS = 20;                 // acknowledgements are coalesced over this long
+
+/* Both ends of the tunnel. Node1 calls connect() for every application
+ * connection it accepted; Node2 gets TUNNEL_OPEN and connects upstream.
+ * Each connection has one thread that reads and writes its socket and
+ * sends; the Reader threads only queue what arrives, so an application
+ * that does not read never holds up the link. Many
+ * connections share the link: a connection never has more than
+ * TUNNEL_WINDOW bytes in flight, and a burst of reads goes out with a
+ * single sendBurst.
+ */
+class Tunnel {
+public:
+    Tunnel() = default;
+
+    Tunnel(const Tunnel &) = delete;
+
+    ~Tunnel() { shutdown(); }
+
+    // must be called before any frame is sent or received
+    void attach(BondedLink &bondedLink) { link = &bondedLink; }
+
+    // ends every connection and waits for their threads; the link must still be up
+    void shutdown() {
+        std::unique_lock<std::mutex> guard(lock);
+        stopping = true;
+        for (auto &entry: connections) {
+            std::lock_guard<std::mutex> connectionGuard(entry.second->lock);
+            entry.second->state = Connection::DONE;
+            entry.second->changed.notify_all();
+        }
+        idle.wait(guard, [this]() { return running == 0; });
+    }
+
+    /* Node1: carry a local connection to host:port through the gateway.
+     * `opened` is told whether the gateway could connect before any data
+     * moves; `initial` is sent ahead of what is read from the socket.
+     * Blocks until the connection is over and closes the socket.
+     */
+    bool connect(IPType gateway, socket_t local, const std::string &host, unsigned short port, const std::function<void(bool)> &opened,
+                 const std::string &initial = "") {
+        auto c = std::make_shared<Connection>(gateway, 0, local);
+        c->unacked = initial;
+        c->rto = initialRto();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (stopping) {
+                opened(false);
+                c->socket.close();
+                return false;
+            }
+            do c->id = nextId++;
+            while (connections.count(key(gateway, c->id)));
+            connections.emplace(key(gateway, c->id), c);
+            ++running;
+        }
+        LOG(Info, TUNNEL, "Connection %u to %s:%u", c->id, host.c_str(), port);
+        std::string target = host + ":" + std::to_string(port);
+        MyTimer waited;
+        std::unique_lock<std::mutex> guard(c->lock);
+        while (c->state == Connection::OPENING && waited.duration() < TUNNEL_OPEN_TIMEOUT) {
+            guard.unlock();
+            sendFrame(Config::TUNNEL_OPEN, gateway, {c->id, 0}, inString(boot) + target);
+            guard.lock();
+            c->changed.wait_for(guard, std::chrono::duration<double>(TUNNEL_INITIAL_RTO), [&c]() { return c->state != Connection::OPENING; });
+        }
+        bool ok = c->state == Connection::OPEN;
+        if (!ok) c->state = Connection::DONE;
+        guard.unlock();
+        opened(ok);
+        if (ok) {
+            {
+                std::lock_guard<std::mutex> connectionGuard(c->lock);
+                c->ready = true;// the application has its answer, peer data may follow
+            }
+            pump(c);
+        } else {
+            LOG(Warn, TUNNEL, "Connection %u to %s was not opened", c->id, target.c_str());
+            finish(c);
+        }
+        return ok;
+    }
+
+    // a TUNNEL_* frame from the Reader
+    void onFrame(const FrameType &frame) {
+        TunnelHeader header;
+        if (!header.fromBody(frame.body)) return;
+        std::string payload = frame.body.substr(LENGTH_TUNNEL_HEADER);
+        if (frame.type == Config::TUNNEL_OPEN) {
+            uint32_t nonce;
+            if (payload.size() < sizeof(nonce)) return;
+            std::copy(payload.begin(), payload.begin() + sizeof(nonce), (char *) &nonce);
+            accept(frame.src, header.id, nonce, payload.substr(sizeof(nonce)));
+            return;
+        }
+        std::shared_ptr<Connection> c;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (stopping) return;
+            auto it = connections.find(key(frame.src, header.id));
+            if (it != connections.end()) c = it->second;
+        }
+        if (!c) {
+            // the connection is gone here; make the peer give up on it too
+            if (frame.type != Config::TUNNEL_ACK && frame.type != Config::TUNNEL_RESET) sendFrame(Config::TUNNEL_RESET, frame.src, {header.id, 0}, "");
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(c->lock);
+            c->idle.restart();
+            switch (frame.type) {
+                case Config::TUNNEL_OPENED:
+                    if (c->state == Connection::OPENING) c->state = Connection::OPEN;
+                    break;
+                case Config::TUNNEL_DATA:
+                    receive(*c, header.offset, std::move(payload));// written by the pump
+                    break;
+                case Config::TUNNEL_ACK:
+                    acknowledge(*c, header.offset);
+                    break;
+                case Config::TUNNEL_CLOSE:
+                    c->peerEnd = true;
+                    c->peerLength = header.offset;
+                    c->ackDue = true;
+                    break;
+                case Config::TUNNEL_RESET:
+                    LOG(Info, TUNNEL, "Connection %u reset by %s", c->id, IPType2Str(frame.src).c_str());
+                    c->state = Connection::DONE;
+                    break;
+                default:
+                    break;
+            }
+            c->changed.notify_all();
+        }
+    }
+
+private:
+    struct Connection {
+        Connection(IPType peerIP, TunnelId connectionId, socket_t s) : peer(peerIP), id(connectionId), socket(s) {}
+
+        enum State { OPENING, OPEN, DONE };
+
+        IPType peer;
+        TunnelId id;
+        uint32_t nonce = 0;// of the OPEN, on the accepting side
+        socket_t socket;
+        std::mutex lock;
+        std::condition_variable changed;// state left OPENING
+        State state = OPENING;
+        bool ready = false;// data may be written to the socket
+        MyTimer idle;
+
+        // sending: unacked holds the bytes from `acked` on
+        std::string unacked;
+        unsigned int acked = 0;
+        unsigned int sent = 0;// bytes before this went out at least once
+        bool localEnd = false;// the socket reached end of file
+        bool endSent = false;
+        bool endAcked = false;
+        MyTimer sinceProgress;// retransmission timer
+        double rto = TUNNEL_INITIAL_RTO;// set from the link by initialRto()
+        double srtt = 0;
+        bool probing = false;// timing the round trip up to probe
+        unsigned int probe = 0;
+        MyTimer probeTimer;
+
+        // receiving: pending holds the bytes from `delivered` on that are not written yet
+        std::map<unsigned int, std::string> pending;
+        size_t buffered = 0;
+        unsigned int delivered = 0;
+        bool peerEnd = false;
+        unsigned int peerLength = 0;
+        bool shutDown = false;
+        bool ackDue = false;
+    };
+
+    static uint64_t key(IPType peer, TunnelId id) { return (uint64_t) peer << 16 | id; }
+
+    // Node2: connect upstream on a thread of its own, which then becomes the pump
+    void accept(IPType peer, TunnelId id, uint32_t nonce, const std::string &target) {
+        auto colon = target.rfind(':');
+        int port = colon == std::string::npos ? 0 : atoi(target.c_str() + colon + 1);
+        if (port <= 0 || port > 65535) {
+            sendFrame(Config::TUNNEL_RESET, peer, {id, 0}, "");
+            return;
+        }
+        std::string host = target.substr(0, colon);
+        std::shared_ptr<Connection> c;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (stopping) return;
+            auto it = connections.find(key(peer, id));
+            if (it != connections.end() && it->second->nonce == nonce) {
+                // our OPENED was lost
+                if (it->second->state == Connection::OPEN) sendFrame(Config::TUNNEL_OPENED, peer, {id, 0}, "");
+                return;
+            }
+            if (it != connections.end()) {
+                // the peer restarted and reuses the ID: its thread ends the stale connection without a RESET
+                LOG(Info, TUNNEL, "Connection %u from %s replaced", id, IPType2Str(peer).c_str());
+                std::lock_guard<std::mutex> connectionGuard(it->second->lock);
+                it->second->state = Connection::DONE;
+                it->second->changed.notify_all();
+                connections.erase(it);
+            }
+            c = std::make_shared<Connection>(peer, id, socket_t());
+            c->nonce = nonce;
+            c->rto = initialRto();
+            connections.emplace(key(peer, id), c);
+            ++running;
+        }
+        std::thread([this, c, host, port]() {
+            static auto &connectLatency = Metrics::histogram("tunnel.connect_us");
+            MyTimer timer;
+            tcp_client_t upstream;
+            TRACE_BEGIN("tunnel.connect");
+            int connected = upstream.connect(host.c_str(), (unsigned short) port);
+            TRACE_END("tunnel.connect");
+            connectLatency.record((uint64_t) (timer.duration() * 1e6));
+            bool ok;
+            {
+                std::lock_guard<std::mutex> guard(c->lock);
+                c->socket = upstream;
+                if (connected != 0) c->state = Connection::DONE;
+                else if (c->state == Connection::OPENING)
+                    c->state = Connection::OPEN, c->ready = true;
+                ok = c->state == Connection::OPEN;
+            }
+            if (!ok) {
+                // not when it was reset or replaced meanwhile: the ID may belong to a new connection by now
+                if (connected != 0) {
+                    LOG(Warn, TUNNEL, "Connection %u: cannot connect to %s:%d", c->id, host.c_str(), port);
+                    sendFrame(Config::TUNNEL_RESET, c->peer, {c->id, 0}, "");
+                }
+                finish(c);
+                return;
+            }
+            LOG(Info, TUNNEL, "Connection %u from %s to %s:%d", c->id, IPType2Str(c->peer).c_str(), host.c_str(), port);
+            sendFrame(Config::TUNNEL_OPENED, c->peer, {c->id, 0}, "");
+            pump(c);
+        }).detach();
+    }
+
+    // read the socket and send, until both directions are closed
+    void pump(const std::shared_ptr<Connection> &c) {
+        static auto &openConnections = Metrics::gauge("tunnel.open");
+        static std::atomic<int64_t> open{0};
+        openConnections.set(++open);
+        char buf[TUNNEL_WINDOW];
+        while (true) {
+            size_t room = 0;
+            {
+                std::lock_guard<std::mutex> guard(c->lock);
+                if (c->state == Connection::DONE) break;
+                if (!c->localEnd) room = TUNNEL_WINDOW - (std::min)(TUNNEL_WINDOW, c->unacked.size());
+            }
+            if (room > 0) {
+                int ready = c->socket.wait_readable(TUNNEL_POLL_MS);
+                int n = ready > 0 ? c->socket.read_some(buf, (int) room) : ready;
+                if (n != 0 || ready != 0) {
+                    std::lock_guard<std::mutex> guard(c->lock);
+                    if (n > 0) c->unacked.append(buf, n);
+                    else
+                        c->localEnd = true;
+                }
+            } else
+                std::this_thread::sleep_for(std::chrono::milliseconds(TUNNEL_POLL_MS));
+            std::vector<FrameType> frames;
+            deliver(*c, frames);
+            {
+                std::lock_guard<std::mutex> guard(c->lock);
+                service(*c, frames);
+            }
+            transmit(std::move(frames));
+        }
+        openConnections.set(--open);
+        finish(c);
+    }
+
+    // called with c.lock held: data, retransmissions, the end and the acknowledgement that are due
+    void service(Connection &c, std::vector<FrameType> &frames) {
+        static auto &retransmits = Metrics::counter("tunnel.retransmits");
+        static auto &bytesOut = Metrics::counter("tunnel.bytes_tx");
+        unsigned int end = c.acked + (unsigned int) c.unacked.size();
+        bool outstanding = c.sent > c.acked || (c.endSent && !c.endAcked);
+        if (outstanding && c.sinceProgress.duration() > c.rto) {
+            // go back to the first unacknowledged byte
+            c.sent = c.acked;
+            c.endSent = false;
+            c.probing = false;
+            c.rto = (std::min)(c.rto * 2, TUNNEL_MAX_RTO);
+            c.sinceProgress.restart();
+            retransmits.add();
+        }
+        int chunk = chunkSize();
+        bool sending = false;
+        while (c.sent < end) {
+            unsigned int n = (std::min)((unsigned int) chunk, end - c.sent);
+            frames.push_back(frame(Config::TUNNEL_DATA, c.peer, {c.id, c.sent}, c.unacked.substr(c.sent - c.acked, n)));
+            bytesOut.add(n);
+            c.sent += n;
+            sending = true;
+        }
+        if (c.localEnd && !c.endSent && c.sent == end) {
+            frames.push_back(frame(Config::TUNNEL_CLOSE, c.peer, {c.id, end}, ""));
+            c.endSent = true;
+            sending = true;
+        }
+        if (sending) {
+            if (!outstanding) c.sinceProgress.restart();
+            if (!c.probing) c.probing = true, c.probe = end + (c.endSent ? 1 : 0), c.probeTimer.restart();
+        }
+        if (c.ackDue) {
+            unsigned int next = c.delivered + (c.peerEnd && c.delivered == c.peerLength ? 1 : 0);
+            frames.push_back(frame(Config::TUNNEL_ACK, c.peer, {c.id, next}, ""));
+            c.ackDue = false;
+        }
+        if (c.endAcked && c.peerEnd && c.delivered == c.peerLength) c.state = Connection::DONE;
+        if (c.idle.duration() > TUNNEL_IDLE_TIMEOUT) {
+            LOG(Warn, TUNNEL, "Connection %u: nothing from %s for %.0f s", c.id, IPType2Str(c.peer).c_str(), TUNNEL_IDLE_TIMEOUT);
+            frames.push_back(frame(Config::TUNNEL_RESET, c.peer, {c.id, 0}, ""));
+            c.state = Connection::DONE;
+        }
+    }
+
+    // payload bytes per TUNNEL_DATA
+    int chunkSize() const { return (std::max)(1, (std::min)(GlobalConfig::current()->mtu, link->maxBodyLength()) - LENGTH_TUNNEL_HEADER); }
+
+    /* Before a round trip was measured: a full window takes seconds on air
+     * (about 3 s at 12 kbit/s, three times that in passband), and its ACK may
+     * queue behind as much going the other way, so allow the window twice.
+     */
+    double initialRto() const {
+        size_t chunk = (size_t) chunkSize();
+        size_t frames = (TUNNEL_WINDOW + chunk - 1) / chunk;
+        double window = link->airtime(TUNNEL_WINDOW + frames * LENGTH_TUNNEL_HEADER, chunk + LENGTH_TUNNEL_HEADER);
+        return (std::max)(TUNNEL_INITIAL_RTO, (std::min)(TUNNEL_MAX_RTO, 2 * window));
+    }
+
+    // called with c.lock held
+    static void acknowledge(Connection &c, unsigned int next) {
+        unsigned int end = c.acked + (unsigned int) c.unacked.size();
+        if (c.probing && next >= c.probe) {
+            double sample = c.probeTimer.duration();
+            c.srtt = c.srtt > 0 ? 0.875 * c.srtt + 0.125 * sample : sample;
+            c.rto = (std::max)(TUNNEL_MIN_RTO, (std::min)(TUNNEL_MAX_RTO, 2 * c.srtt));
+            c.probing = false;
+        }
+        if (next == end + 1 && c.endSent) c.endAcked = true, next = end;
+        if (next <= c.acked || next > end) return;
+        c.unacked.erase(0, next - c.acked);
+        c.acked = next;
+        c.sent = (std::max)(c.sent, c.acked);
+        c.sinceProgress.restart();
+    }
+
+    // called with c.lock held: keep what is new, within the buffer limit
+    static void receive(Connection &c, unsigned int offset, std::string data) {
+        c.ackDue = true;
+        if (offset < c.delivered) {
+            if (offset + data.size() <= c.delivered) return;
+            data.erase(0, c.delivered - offset);
+            offset = c.delivered;
+        }
+        if (data.empty() || c.pending.count(offset) || c.buffered + data.size() > TUNNEL_MAX_BUFFERED) return;
+        c.buffered += data.size();
+        c.pending.emplace(offset, std::move(data));
+    }
+
+    // pump thread: write the contiguous front of pending to the socket; the write blocks without c.lock held
+    void deliver(Connection &c, std::vector<FrameType> &frames) {
+        static auto &bytesIn = Metrics::counter("tunnel.bytes_rx");
+        std::string data;
+        bool end;
+        {
+            std::lock_guard<std::mutex> guard(c.lock);
+            if (!c.ready || c.state == Connection::DONE) return;
+            for (auto it = c.pending.begin(); it != c.pending.end() && it->first <= c.delivered; it = c.pending.erase(it)) {
+                c.buffered -= it->second.size();
+                if (it->first + it->second.size() <= c.delivered) continue;
+                data.append(it->second, c.delivered - it->first, std::string::npos);
+                c.delivered = it->first + (unsigned int) it->second.size();
+            }
+            end = c.peerEnd && c.delivered == c.peerLength && !c.shutDown;
+            if (end) c.shutDown = true;
+        }
+        if (!data.empty() && c.socket.write_all(data.data(), (int) data.size()) < 0) {
+            std::lock_guard<std::mutex> guard(c.lock);
+            frames.push_back(frame(Config::TUNNEL_RESET, c.peer, {c.id, 0}, ""));
+            c.state = Connection::DONE;
+            return;
+        }
+        bytesIn.add(data.size());
+        if (end) c.socket.shutdown_write();
+    }
+
+    void finish(const std::shared_ptr<Connection> &c) {
+        {
+            std::lock_guard<std::mutex> guard(c->lock);
+            if (c->socket.m_sockfd > 0) c->socket.close();
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = connections.find(key(c->peer, c->id));
+        if (it != connections.end() && it->second == c) connections.erase(it);
+        --running;
+        idle.notify_all();
+    }
+
+    static FrameType frame(Config::Type type, IPType peer, TunnelHeader header, const std::string &payload) {
+        return FrameType{type, peer, 0, header.inString() + payload};
+    }
+
+    void sendFrame(Config::Type type, IPType peer, TunnelHeader header, const std::string &payload) { link->send(frame(type, peer, header, payload)); }
+
+    void transmit(std::vector<FrameType> frames) {
+        if (!frames.empty()) link->sendBurst(std::move(frames));
+    }
+
+    BondedLink *link = nullptr;
+    std::mutex lock;
+    std::condition_variable idle;// running dropped
+    std::map<uint64_t, std::shared_ptr<Connection>> connections;
+    TunnelId nextId = 0;
+    const uint32_t boot = std::random_device()();// NONCE of the OPENs sent from here
+    int running = 0;// connections with a thread
+    bool stopping = false;
+};
+
+#endif//TUNNEL_H
@@ -1,14 +1,15 @@
 #include "utils.h"
-#include <JuceHeader.h>
+#include <cstdio>
 
 IPType Str2IPType(const std::string &ip) {
-    juce::IPAddress tmp(ip);
-    IPType ret = 0;
-    for (int i = 0; i < 4; ++i) ret = ret << 8 | tmp.address[i];
-    return ret;
+    unsigned a, b, c, d;
+    char tail;
+    if (sscanf(ip.c_str(), "%u.%u.%u.%u%c", &a, &b, &c, &d, &tail) != 4 || a > 255 || b > 255 || c > 255 || d > 255) return 0;
+    return a << 24 | b << 16 | c << 8 | d;
 }
 
 std::string IPType2Str(IPType ip) {
-    juce::IPAddress tmp(ip);
-    return tmp.toString().toStdString();
-}
\ No newline at end of file
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", ip >> 24, ip >> 16 & 255, ip >> 8 & 255, ip & 255);
+    return text;
+}
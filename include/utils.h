@@ -22,7 +22,8 @@ constexpr int LENGTH_TYPE = sizeof(TYPEType);
 constexpr int LENGTH_IP = sizeof(IPType);
 constexpr int LENGTH_PORT = sizeof(PORTType);
 constexpr int LENGTH_CRC = 4;
-constexpr int MAX_LENGTH_BODY = MTU - LENGTH_PREAMBLE - LENGTH_LEN - LENGTH_TYPE - LENGTH_IP - LENGTH_PORT - LENGTH_CRC;
+constexpr int LENGTH_HEADER = LENGTH_LEN + LENGTH_TYPE + 2 * LENGTH_IP + LENGTH_PORT;
+constexpr int MAX_LENGTH_BODY = MTU - LENGTH_PREAMBLE - LENGTH_HEADER - LENGTH_CRC;
 
 const std::string preamble{0x55, 0x55, 0x54};
 
@@ -39,7 +40,8 @@ template<class T>
  * PREAMBLE
  * LEN      the length of BODY;
  * TYP      type of protocol;
- * IP
+ * IP       destination link address
+ * SRC      source link address
  * PORT
  * BODY
  * CRC
@@ -50,6 +52,7 @@ public:
     LENType len = 0;
     TYPEType type = 0;
     IPType ip = 0;
+    IPType src = 0;// filled in by the link when left 0
     PORTType port = 0;
     std::string body;
 
@@ -57,12 +60,44 @@ public:
 
     FrameType(TYPEType nType, IPType nIp, PORTType nPort, std::string nBody) : len((LENType) nBody.size()), type(nType), ip(nIp), port(nPort), body(std::move(nBody)) {}
 
-    [[nodiscard]] std::string wholeString() const { return inString(len) + inString(type) + inString(ip) + inString(port) + body; }
+    [[nodiscard]] std::string wholeString() const { return inString(len) + inString(type) + inString(ip) + inString(src) + inString(port) + body; }
 
+    // the header fields in wire order, as (pointer, bytes), without building a string
+    template<class Sink>
+    void forEachHeaderField(Sink sink) const {
+        sink(&len, LENGTH_LEN);
+        sink(&type, LENGTH_TYPE);
+        sink(&ip, LENGTH_IP);
+        sink(&src, LENGTH_IP);
+        sink(&port, LENGTH_PORT);
+    }
+
+    // bytes of wholeString()
+    [[nodiscard]] size_t wholeLength() const { return LENGTH_HEADER + body.size(); }
+
+    // inverse of wholeString() + inString(crc()); true if the trailing CRC matches
+    bool fromRawString(const std::string &raw) { return fromRawBytes(raw.data(), raw.size()); }
+
+    bool fromRawBytes(const char *raw, size_t size) {
+        if (size < LENGTH_HEADER + LENGTH_CRC) return false;
+        const char *p = raw;
+        std::copy(p, p + LENGTH_LEN, (char *) &len), p += LENGTH_LEN;
+        std::copy(p, p + LENGTH_TYPE, (char *) &type), p += LENGTH_TYPE;
+        std::copy(p, p + LENGTH_IP, (char *) &ip), p += LENGTH_IP;
+        std::copy(p, p + LENGTH_IP, (char *) &src), p += LENGTH_IP;
+        std::copy(p, p + LENGTH_PORT, (char *) &port), p += LENGTH_PORT;
+        if (size != (size_t) (LENGTH_HEADER + len + LENGTH_CRC)) return false;
+        body.assign(p, len), p += len;
+        unsigned int crcRead;
+        std::copy(p, p + LENGTH_CRC, (char *) &crcRead);
+        return crcRead == crc();
+    }
+
+    // of wholeString(), computed field by field
     [[nodiscard]] unsigned int crc() const {
-        auto str = wholeString();
         boost::crc_32_type crc;
-        crc.process_bytes(str.c_str(), str.size());
+        forEachHeaderField([&crc](const void *field, size_t n) { crc.process_bytes(field, n); });
+        crc.process_bytes(body.data(), body.size());
         return crc.checksum();
     }
 };
@@ -95,6 +130,7 @@ public:
 };
 
 using ProcessorType = std::function<void(FrameType &)>;
+using AddressFilter = std::function<bool(const FrameType &)>;// sees the header only
 using ICMPProcessorType = std::function<void(ICMPFrameType &)>;
 
 using std::chrono::steady_clock;
@@ -0,0 +1,28 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+constexpr int VARINT_MAX_BYTES = 4;// 28 bits, more than any length on the link
+
+// little endian base 128, the high bit set on all but the last byte
+inline void putVarint(std::string &out, size_t n) {
+    for (; n >= 0x80; n >>= 7) out += (char) ((n & 0x7f) | 0x80);
+    out += (char) n;
+}
+
+// bytes the varint at data takes, 0 while it has not fully arrived, -1 if it is too long
+inline int getVarint(const char *data, size_t n, size_t &value) {
+    value = 0;
+    for (int used = 0; used < VARINT_MAX_BYTES; ++used) {
+        if ((size_t) used == n) return 0;
+        auto byte = (uint8_t) data[used];
+        value |= (size_t) (byte & 0x7f) << 7 * used;
+        if (!(byte & 0x80)) return used + 1;
+    }
+    return -1;
+}
+
+#endif//VARINT_H
@@ -1,11 +1,13 @@
 #ifndef WRITER_H
 #define WRITER_H
 
+#include "log.h"
+#include "pool.h"
+#include "thread.h"
+#include "trace.h"
 #include "utils.h"
-#include <JuceHeader.h>
 #include <cassert>
 #include <ostream>
-#include <queue>
 
 class Writer {
 public:
@@ -15,39 +17,54 @@ public:
 
     Writer(const Writer &&) = delete;
 
-    explicit Writer(std::queue<float> *bufferOut, CriticalSection *lockOutput) :
+    explicit Writer(SampleQueue *bufferOut, aether::CriticalSection *lockOutput) :
             output(bufferOut), protectOutput(lockOutput) {}
 
     void send(const FrameType &frame) {
+        TRACE_SPAN("writer.send", frame.type);
         // transmit
+        TRACE_BEGIN("writer.encode", frame.len);
         protectOutput->enter();
-        std::string str = preamble + frame.wholeString() + inString(frame.crc());
-        for (auto byte: str)
-            for (int bitPos = 0; bitPos < 8; ++bitPos) {
-                if (byte >> bitPos & 1) {
-                    output->push(1.0f);
-                    output->push(1.0f);
-                    output->push(-1.0f);
-                    output->push(-1.0f);
-                } else {
-                    output->push(-1.0f);
-                    output->push(-1.0f);
-                    output->push(1.0f);
-                    output->push(1.0f);
+        // straight from the frame's fields, no wire string is put together
+        auto emit = [this](const void *data, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                char byte = ((const char *) data)[i];
+                for (int bitPos = 0; bitPos < 8; ++bitPos) {
+                    if (byte >> bitPos & 1) {
+                        output->push(1.0f);
+                        output->push(1.0f);
+                        output->push(-1.0f);
+                        output->push(-1.0f);
+                    } else {
+                        output->push(-1.0f);
+                        output->push(-1.0f);
+                        output->push(1.0f);
+                        output->push(1.0f);
+                    }
                 }
             }
-        // wait until the transmission finished
-        while (!output->empty()) {
+        };
+        unsigned int crc = frame.crc();
+        emit(preamble.data(), preamble.size());
+        frame.forEachHeaderField(emit);
+        emit(frame.body.data(), frame.body.size());
+        emit(&crc, LENGTH_CRC);
+        TRACE_END("writer.encode");
+        // wait until the transmission finished, or the audio stopped and the lane is shutting down.
+        // Asleep, not spinning: on one core the other lanes' threads must get to queue their frames
+        TRACE_SPAN("writer.on_air");
+        while (!output->empty() && !aether::Thread::currentThreadShouldExit()) {
             protectOutput->exit();
+            aether::Thread::sleep(1);
             protectOutput->enter();
         }
         protectOutput->exit();
-        fprintf(stderr, "\tFrame sent! %s:%u %s\n", IPType2Str(frame.ip).c_str(), frame.port, frame.body.c_str());
+        Log::frame(LogLevel::Info, LogCategory::PHY, "Frame sent!", frame);
     }
 
 private:
-    std::queue<float> *output{nullptr};
-    CriticalSection *protectOutput;
+    SampleQueue *output{nullptr};
+    aether::CriticalSection *protectOutput;
 };
 
 #endif//WRITER_H
\ No newline at end of file
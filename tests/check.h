@@ -0,0 +1,21 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <cstdio>
+
+// No test framework: every test is a program of its own, CHECK counts the
+// failures and main returns how many there were.
+inline int &checkFailures() {
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        if (!(condition)) {                                                               \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            ++checkFailures();                                                            \
+        }                                                                                 \
+    } while (false)
+
+#endif//CHECK_H
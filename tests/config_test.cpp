@@ -0,0 +1,77 @@
+#include "check.h"
+#include "config.h"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+static std::shared_ptr<const ConfigSnapshot> parse(const std::string &text) {
+    std::istringstream in(text);
+    return ConfigSnapshot::parse(in);
+}
+
+static bool rejected(const std::string &text) {
+    try {
+        parse(text);
+        return false;
+    } catch (const ConfigError &) { return true; }
+}
+
+static const char *NODES = "NODE1 10.0.0.1\nNODE2 10.0.0.2 1234\n";
+
+static void testParse() {
+    auto config = parse(std::string("# comment\n\n") + NODES + "LANES 2\nPASSBAND 1\nCARRIER1 4000\nCARRIER2 23999\nMTU 50\nROUTE 192.168.0.0 16 10.0.0.2\n###\nnot read\n");
+    CHECK(config->get(Config::NODE1).ip == "10.0.0.1" && config->get(Config::NODE2).port == 1234);
+    CHECK(config->lanes == 2 && config->passband && config->carrier1 == 4000 && config->carrier2 == 23999 && config->mtu == 50);
+    CHECK(config->routes.size() == 1 && config->routes[0].length == 16);
+    CHECK(parse(NODES)->mtu == 100);// defaults for what is not there
+
+    CHECK(rejected("NODE1 10.0.0.1\n"));// every node is looked up
+    CHECK(rejected("NODE2 10.0.0.2 1234\n"));
+    CHECK(rejected(""));
+    CHECK(rejected(std::string(NODES) + "CARRIER2 24000\n"));// at the Nyquist frequency of 48 kHz
+    CHECK(rejected(std::string(NODES) + "CARRIER1 50\n"));
+    CHECK(rejected("NODE1 10.0.0.300\nNODE2 10.0.0.2 1234\n"));
+    CHECK(rejected("NODE1 10.0.0.1\nNODE2 10.0.0.2\n"));
+    CHECK(rejected(std::string(NODES) + "MTU 0\n"));
+    CHECK(rejected(std::string(NODES) + "LANES many\n"));
+    CHECK(rejected(std::string(NODES) + "COLOUR blue\n"));
+}
+
+static void write(const std::string &text) {
+    std::ofstream("config.txt.new") << text;
+    std::filesystem::rename("config.txt.new", "config.txt");// the way editors save
+}
+
+// true once current() satisfies done, within a few watcher rounds
+template<class Done>
+static bool waitFor(Done done) {
+    for (int i = 0; i < 40; ++i, std::this_thread::sleep_for(std::chrono::milliseconds(100)))
+        if (done(*GlobalConfig::current())) return true;
+    return false;
+}
+
+static void testReload() {
+    // GlobalConfig reads ./config.txt: a directory of our own, the other tests' file stays as it is
+    std::filesystem::create_directories("config_test.d");
+    std::filesystem::current_path("config_test.d");
+    write(std::string(NODES) + "MTU 50\n");
+    CHECK(GlobalConfig::current()->mtu == 50);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));// the watcher thread starts watching
+    write(std::string(NODES) + "MTU 60\n");
+    CHECK(waitFor([](const ConfigSnapshot &config) { return config.mtu == 60; }));
+    // a broken file keeps the snapshot before it
+    write("NODE1 10.0.0.1\nMTU 70\n");
+    CHECK(!waitFor([](const ConfigSnapshot &config) { return config.mtu == 70; }));
+    CHECK(GlobalConfig::current()->mtu == 60 && GlobalConfig::current()->get(Config::NODE2).port == 1234);
+    write(std::string(NODES) + "MTU 80\n");
+    CHECK(waitFor([](const ConfigSnapshot &config) { return config.mtu == 80; }));
+    std::filesystem::current_path("..");
+}
+
+int main() {
+    testParse();
+    testReload();
+    return checkFailures();
+}
@@ -0,0 +1,63 @@
+#include "check.h"
+#include "dedup.h"
+#include <algorithm>
+#include <random>
+#include <string>
+
+static std::string randomBytes(std::mt19937 &rng, size_t n) {
+    std::string bytes(n, '\0');
+    for (auto &c: bytes) c = (char) rng();
+    return bytes;
+}
+
+// records decoded in pieces of `feed` bytes, references looked up in `store`
+static bool dedupRoundTrip(const std::string &records, ChunkStore &store, size_t feed, std::string &body, size_t &referenced) {
+    body.clear();
+    referenced = 0;
+    bool missing = false;
+    DedupDecoder decoder([&](Fingerprint fp, const std::string &chunk) { store.put(fp, chunk), body += chunk; },
+                         [&](Fingerprint fp, size_t length) {
+                             std::string chunk;
+                             missing = missing || !store.get(fp, chunk) || chunk.size() != length;
+                             body += chunk, referenced += length;
+                         });
+    for (size_t at = 0; at < records.size(); at += feed)
+        if (!decoder.feed(records.data() + at, std::min(feed, records.size() - at))) return false;
+    return !missing;
+}
+
+static void testDedup() {
+    std::mt19937 rng(2);
+    std::string body = randomBytes(rng, 64 << 10), got;
+    size_t total = 0;
+    for (auto n: chunkBoundaries(body.data(), body.size())) {
+        CHECK(n <= CHUNK_MAX);
+        total += n;
+    }
+    CHECK(total == body.size());
+
+    ChunkStore peer(1 << 20), receiver(1 << 20);
+    size_t referenced;
+    std::string first = dedupEncode(body, peer);
+    CHECK(dedupRoundTrip(first, receiver, 1, got, referenced) && got == body && referenced == 0);
+    // the second time everything is a reference
+    std::string second = dedupEncode(body, peer);
+    CHECK(second.size() < body.size() / 100);
+    CHECK(dedupRoundTrip(second, receiver, 5, got, referenced) && got == body && referenced == body.size());
+    // an edit in the middle only resends the chunks around it
+    std::string edited = body;
+    edited.insert(30000, "inserted");
+    std::string third = dedupEncode(edited, peer);
+    CHECK(dedupRoundTrip(third, receiver, 4096, got, referenced) && got == edited);
+    CHECK(referenced > edited.size() / 2 && third.size() < edited.size() / 2);
+
+    CHECK(dedupEncode("", peer).empty());
+    std::string junk = "\x07garbage";
+    DedupDecoder decoder([](Fingerprint, const std::string &) {}, [](Fingerprint, size_t) {});
+    CHECK(!decoder.feed(junk.data(), junk.size()));
+}
+
+int main() {
+    testDedup();
+    return checkFailures();
+}
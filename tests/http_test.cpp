@@ -0,0 +1,68 @@
+#include "check.h"
+#include "http.h"
+#include <string>
+
+static void testRequest() {
+    HttpRequest request;
+    CHECK(HttpRequest::parse("example.com", request));
+    CHECK(request.method == "GET" && request.host == "example.com" && request.port == 80 && request.path == "/");
+    CHECK(HttpRequest::parse(" HEAD http://Example.com:8080/a?b=c ", request));
+    CHECK(request.method == "HEAD" && request.host == "Example.com" && request.port == 8080 && request.path == "/a?b=c");
+    CHECK(request.wire() == "HEAD /a?b=c HTTP/1.1\r\nHost: Example.com:8080\r\nAccept-Encoding: identity\r\nConnection: close\r\n\r\n");
+    CHECK(!HttpRequest::parse("example.com:0/", request));
+    CHECK(!HttpRequest::parse("example.com:65536/", request));
+    CHECK(!HttpRequest::parse("/no/host", request));
+}
+
+static void testResponse() {
+    HttpResponse response;
+    CHECK(HttpResponse::parse("HTTP/1.1 200 OK\r\nContent-Type:  text/html \r\nX-Empty:\r\nContent-Length: 5\r\n\r\nhello, and more", response));
+    CHECK(response.status == 200 && response.body == "hello");
+    CHECK(response.header("content-type") && *response.header("content-type") == "text/html");
+    CHECK(response.header("x-empty") && response.header("x-empty")->empty());
+    CHECK(!response.header("Content-Type"));// names are lower case
+
+    // the body is de-chunked, extensions and trailers ignored
+    CHECK(HttpResponse::parse("HTTP/1.1 404 Not Found\r\nTransfer-Encoding: Chunked\r\n\r\n"
+                              "4;ext=1\r\nWiki\r\n5\r\npedia\r\nE\r\n in\r\n\r\nchunks.\r\n0\r\nTrailer: x\r\n\r\n",
+                              response));
+    CHECK(response.status == 404 && response.body == "Wikipedia in\r\n\r\nchunks.");
+    // no Content-Length: everything up to the end
+    CHECK(HttpResponse::parse("HTTP/1.0 301 Moved\r\nLocation: /x\r\n\r\nbody", response) && response.body == "body");
+
+    CHECK(!HttpResponse::parse("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n", response));// header incomplete
+    CHECK(!HttpResponse::parse("<html>not a response</html>\r\n\r\n", response));
+    CHECK(!HttpResponse::parse("HTTP/1.1 abc\r\n\r\n", response));
+}
+
+static void testChunked() {
+    CHECK(decodeChunked("").empty());
+    CHECK(decodeChunked("3\r\nabc\r\n0\r\n\r\n") == "abc");
+    CHECK(decodeChunked("a\r\n0123456789\r\n1A\r\nabcdefghijklmnopqrstuvwxyz\r\n0\r\n\r\n") == "0123456789abcdefghijklmnopqrstuvwxyz");
+    // what decoded before a malformed or cut chunk is kept
+    CHECK(decodeChunked("3\r\nabc\r\nzz\r\nxyz\r\n") == "abc");
+    CHECK(decodeChunked("3\r\nabc\r\n8\r\nxyz") == "abcxyz");
+    CHECK(decodeChunked("3\r\nabc\r\n5") == "abc");
+}
+
+static void testEnvelope() {
+    HttpResponse response;
+    HttpResponse::parse("HTTP/1.1 302 Found\r\nLocation: /next\r\nServer: dropped\r\nContent-Type: text/plain\r\nSet-Cookie: " + std::string(300, 'c') + "\r\n\r\n", response);
+    HttpEnvelope envelope = HttpEnvelope::from(response);
+    CHECK(envelope.status == 302 && envelope.fields.size() == 3);
+    std::string wire = envelope.encode() + "body";
+    HttpEnvelope decoded;
+    CHECK(decoded.decode(wire.substr(0, 5)) == 0);// not whole yet
+    CHECK(decoded.decode(wire) == wire.size() - 4);
+    CHECK(decoded.status == 302 && decoded.get(HttpEnvelope::LOCATION) == "/next" && decoded.get(HttpEnvelope::CONTENT_TYPE) == "text/plain");
+    CHECK(decoded.get(HttpEnvelope::SET_COOKIE) == std::string(255, 'c'));
+    CHECK(decoded.get(HttpEnvelope::ETAG).empty());
+}
+
+int main() {
+    testRequest();
+    testResponse();
+    testChunked();
+    testEnvelope();
+    return checkFailures();
+}
@@ -0,0 +1,110 @@
+#include "check.h"
+#include "client.h"
+#include "gateway.h"
+#include "socket.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <thread>
+
+constexpr unsigned short SERVER_PORT = 18731;
+constexpr int SERVER_DELAY_MS = 500;// upstream latency, which prefetching hides
+constexpr int BLOCK = 480;          // audio samples per callback
+
+static const std::map<std::string, std::string> SITE = {
+        {"/index.html", "<html><head><link rel=\"stylesheet\" href=\"style.css\"><script src=\"/app.js\"></script></head>"
+                        "<body><img src='img/a.txt'> <img src=img/b.txt></body></html>"},
+        {"/style.css", std::string(600, 's')},
+        {"/app.js", std::string(900, 'j')},
+        {"/img/a.txt", std::string(800, 'a')},
+        {"/img/b.txt", std::string(800, 'b')},
+};
+
+static std::string readFile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(file), {}};
+}
+
+/* Node1 and Node2 in one process, the audio of each fed to the other in
+ * real time, fetching a page and then its resources from a slow server on
+ * the loopback interface: every resource is prefetched while the page is
+ * on air, so the server sees each path exactly once.
+ */
+int main() {
+    std::mutex lock;
+    std::map<std::string, int> gets;
+    std::atomic<bool> quit{false};
+    tcp_server_t server(SERVER_PORT, true);
+    std::thread upstream([&] {
+        while (true) {
+            socket_t connection = server.accept();
+            if (quit) break;
+            std::thread([&, connection]() mutable {
+                std::string request;
+                char buffer[1024];
+                for (int n; request.find("\r\n\r\n") == std::string::npos && (n = connection.read_some(buffer, sizeof(buffer))) > 0;) request.append(buffer, n);
+                auto begin = request.find(' ') + 1;
+                std::string path = request.substr(begin, request.find(' ', begin) - begin);
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    ++gets[path];
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(SERVER_DELAY_MS));
+                auto page = SITE.find(path);
+                std::string body = page == SITE.end() ? "" : page->second;
+                std::string response = std::string(page == SITE.end() ? "HTTP/1.1 404 Not Found" : "HTTP/1.1 200 OK") +
+                                       "\r\nContent-Type: text/html\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+                connection.write_all(response.data(), (int) response.size());
+                connection.close();
+            }).detach();
+        }
+    });
+
+    double rate = 48000;
+    auto client = std::make_unique<Client>(rate, Client::Callbacks{});
+    auto gateway = std::make_unique<Gateway>(rate);
+    std::thread audio([&] {
+        std::vector<float> toGateway(BLOCK), toClient(BLOCK), clientOut(BLOCK), gatewayOut(BLOCK);
+        MyTimer clock;
+        for (long blocks = 1; !quit; ++blocks) {
+            const float *clientIn[1] = {toClient.data()};
+            float *clientOuts[1] = {clientOut.data()};
+            client->bondedLink().processBlock(clientIn, clientOuts, 1, BLOCK);
+            const float *gatewayIn[1] = {toGateway.data()};
+            float *gatewayOuts[1] = {gatewayOut.data()};
+            gateway->bondedLink().processBlock(gatewayIn, gatewayOuts, 1, BLOCK);
+            toGateway.swap(clientOut), toClient.swap(gatewayOut);
+            while (clock.duration() < blocks * BLOCK / rate) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    std::string host = "127.0.0.1:" + std::to_string(SERVER_PORT);
+    MyTimer total;
+    // the page first, then what it links to
+    std::vector<std::string> order = {"/index.html", "/style.css", "/app.js", "/img/a.txt", "/img/b.txt"};
+    for (auto &path: order) {
+        std::string file = "loopback" + std::to_string(&path - order.data()) + ".out";
+        auto reply = client->get(host + path, file).reply.get();
+        printf("%5.1fs %-12s %s\n", total.duration(), path.c_str(), statusName(reply.status));
+        CHECK(reply.status == RequestStatus::OK && reply.result.envelope.status == 200);
+        CHECK(readFile(file) == SITE.at(path));
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto &path: order) CHECK(gets[path] == 1);
+    }
+    CHECK(Metrics::counter("prefetch.hits").value() >= 4);
+
+    quit = true;
+    tcp_client_t wake;// accept() returns
+    wake.connect("127.0.0.1", SERVER_PORT);
+    wake.close();
+    upstream.join();
+    audio.join();
+    gateway = nullptr;
+    client = nullptr;
+    return checkFailures();
+}
@@ -0,0 +1,61 @@
+#include "check.h"
+#include "compress.h"
+#include "varint.h"
+#include <algorithm>
+#include <random>
+#include <string>
+
+static std::string randomBytes(std::mt19937 &rng, size_t n) {
+    std::string bytes(n, '\0');
+    for (auto &c: bytes) c = (char) rng();
+    return bytes;
+}
+
+static std::string page(std::mt19937 &rng, size_t n) {
+    static const char *words[] = {"<div class=\"item\">", "</div>", "<a href=\"/news/", "\">", "</a>", "the ", "link ", "\n", "<p>", "</p>"};
+    std::string text;
+    while (text.size() < n) text += words[rng() % 10], text += std::to_string(rng() % 1000);
+    return text;
+}
+
+// the whole stream encoded in pieces of `step` bytes and decoded in pieces of `feed` bytes
+static bool lzRoundTrip(const std::string &data, size_t step, size_t feed) {
+    LzEncoder encoder;
+    std::string packed;
+    for (size_t at = 0; at < data.size(); at += step) encoder.encode(data.data() + at, std::min(step, data.size() - at), packed);
+    LzDecoder decoder;
+    std::string plain;
+    for (size_t at = 0; at < packed.size(); at += feed)
+        if (!decoder.decode(packed.data() + at, std::min(feed, packed.size() - at), plain)) return false;
+    return plain == data && decoder.idle();
+}
+
+static void testLz() {
+    std::mt19937 rng(1);
+    CHECK(lzRoundTrip("", 1, 1));
+    CHECK(lzRoundTrip("a", 1, 1));
+    CHECK(lzRoundTrip("HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n\r\n<!DOCTYPE html><html><head>", 7, 3));
+    std::string text = page(rng, 3 * LZ_WINDOW);// matches across blocks and beyond the window
+    CHECK(lzRoundTrip(text, LZ_BLOCK, 1000));
+    CHECK(lzRoundTrip(text, 777, 1));
+    CHECK(lzRoundTrip(randomBytes(rng, 10000), 10000, 333));// stored raw
+    std::string packed;
+    LzEncoder().encode(text.data(), text.size(), packed);
+    CHECK(packed.size() < text.size() / 2);
+
+    std::string body = page(rng, 200), small, back;
+    CHECK(lzCompress(body, small) && small.size() < body.size());
+    CHECK(lzExpand(small, back) && back == body);
+    CHECK(!lzCompress(randomBytes(rng, 200), small));
+
+    // a compressed block of one match at distance 0, and one longer than a block
+    std::string nowhere("\x07\x00\x00\x00", 4), tooLong, out;
+    putVarint(tooLong, (LZ_BLOCK + 1) << 1);
+    CHECK(!LzDecoder().decode(nowhere.data(), nowhere.size(), out));
+    CHECK(!LzDecoder().decode(tooLong.data(), tooLong.size(), out));
+}
+
+int main() {
+    testLz();
+    return checkFailures();
+}
@@ -0,0 +1,143 @@
+#include "check.h"
+#include "mac.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+static const IPType A = Str2IPType("10.0.0.1"), B = Str2IPType("10.0.0.2"), C = Str2IPType("10.0.0.3");
+constexpr int NOISE = 4800;                     // samples fed at a time, 0.1 s
+
+/* One lane's MAC: a Reader that hears nothing, and the control frames it
+ * sends handed to `peer`, if any, the way they would come out of the peer's
+ * Reader. wake() is answered by a thread of its own, like the lane's.
+ */
+struct Station {
+    explicit Station(IPType address)
+        : reader(&input, &inputLock, [](FrameType &) {}),
+          mac(reader, [this, address](FrameType frame) {
+              frame.src = address;
+              sent.push_back(frame);
+              if (peer) peer->mac.onControl(frame);
+          }, [this]() { replyPending.signal(); }, address),
+          lane([this]() {
+              while (!quit) {
+                  if (replyPending.wait(20)) mac.sendReplies();
+              }
+          }) {}
+
+    ~Station() {
+        quit = true;
+        lane.join();
+    }
+
+    // input energy: a loud carrier, or silence that lets the estimate decay
+    void hear(float amplitude) {
+        std::vector<float> samples(NOISE);
+        for (size_t i = 0; i < samples.size(); ++i) samples[i] = i % 2 ? amplitude : -amplitude;
+        mac.feed(samples.data(), (int) samples.size());
+    }
+
+    SampleQueue input;
+    aether::CriticalSection inputLock;
+    Reader reader;
+    std::vector<FrameType> sent;// only touched by the thread in acquire() and, for replies, by `lane`
+    Station *peer = nullptr;
+    aether::WaitableEvent replyPending;
+    std::atomic<bool> quit{false};
+    Mac mac;
+    std::thread lane;
+};
+
+static FrameType control(Config::Type type, IPType to, IPType from, unsigned short ms) {
+    FrameType frame(type, to, 0, inString(ms));
+    frame.src = from;
+    return frame;
+}
+
+// an idle medium: DIFS plus at most MAC_CW_MIN slots, no RTS for a short burst
+static void testIdle() {
+    Station a(A);
+    MyTimer timer;
+    CHECK(a.mac.acquire(100, 0.1, B));
+    CHECK(timer.duration() < (MAC_DIFS_SLOTS + MAC_CW_MIN) * MAC_SLOT + 0.2);
+    CHECK(a.mac.stats().transmissions == 1 && a.mac.stats().rtsSent == 0 && a.sent.empty());
+}
+
+// the backoff waits while somebody else talks, and resumes once the medium is quiet again
+static void testDefer() {
+    Station a(A);
+    a.hear(0.5f);
+    CHECK(a.mac.busy());
+    std::thread talker([&a]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        a.hear(0.0f);
+    });
+    MyTimer timer;
+    CHECK(a.mac.acquire(100, 0.1, B));
+    talker.join();
+    CHECK(timer.duration() >= 0.3);
+    CHECK(a.mac.stats().transmissions == 1 && a.mac.stats().drops == 0);
+
+    // busy for good: every attempt gives up after MAC_BUSY_TIMEOUT, then the burst is dropped
+    a.hear(0.5f);
+    timer.restart();
+    CHECK(!a.mac.acquire(100, 0.1, B));
+    CHECK(timer.duration() >= (MAC_MAX_RETRIES + 1) * MAC_BUSY_TIMEOUT);
+    CHECK(a.mac.stats().drops == 1 && a.mac.stats().deferrals >= (unsigned) MAC_MAX_RETRIES + 1);
+}
+
+// a long burst asks first: the peer answers the RTS with a CTS and stays quiet for the announced time
+static void testRtsCts() {
+    Station a(A), b(B);
+    a.peer = &b, b.peer = &a;
+    CHECK(a.mac.acquire(MAC_RTS_THRESHOLD, 0.5, B));
+    CHECK(a.mac.stats().rtsSent == 1 && a.mac.stats().collisions == 0 && a.mac.stats().transmissions == 1);
+    CHECK(a.sent.size() == 1 && a.sent[0].type == Config::MAC_RTS && a.sent[0].ip == B);
+    MyTimer waited;// b counts its CTS once sending it returned, after a already has it
+    while (b.mac.stats().ctsSent == 0 && waited.duration() < 1) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    CHECK(b.mac.stats().ctsSent == 1);
+    CHECK(b.sent.size() == 1 && b.sent[0].type == Config::MAC_CTS && b.sent[0].ip == A && b.sent[0].body == a.sent[0].body);
+    CHECK(b.mac.busy());// NAV for the burst and the CTS timeout
+    std::this_thread::sleep_for(std::chrono::milliseconds(900));
+    CHECK(!b.mac.busy());
+}
+
+// nobody answers: each attempt is a collision, the contention window grows, and the burst is dropped
+static void testNoCts() {
+    Station a(A);
+    MyTimer timer;
+    CHECK(!a.mac.acquire(MAC_RTS_THRESHOLD, 0.1, B));
+    CHECK(a.mac.stats().rtsSent == MAC_MAX_RETRIES + 1 && a.mac.stats().collisions == MAC_MAX_RETRIES + 1);
+    CHECK(a.mac.stats().drops == 1 && a.mac.stats().transmissions == 0);
+    CHECK(timer.duration() >= (MAC_MAX_RETRIES + 1) * (MAC_DIFS_SLOTS * MAC_SLOT + MAC_CTS_TIMEOUT));
+}
+
+// control frames overheard from others set the NAV; only an RTS for us gets a CTS
+static void testOverheard() {
+    Station a(A);
+    CHECK(a.mac.onControl(control(Config::MAC_RTS, C, B, 200)));
+    CHECK(a.mac.busy());
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    CHECK(a.mac.stats().ctsSent == 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    CHECK(!a.mac.busy());
+
+    CHECK(a.mac.onControl(control(Config::MAC_CTS, C, B, 200)));// a CTS for somebody else reserves as well
+    CHECK(a.mac.busy());
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+    CHECK(a.mac.onControl(control(Config::MAC_RTS, B, A, 200)));// our own RTS heard back
+    CHECK(!a.mac.busy());
+
+    CHECK(!a.mac.onControl(FrameType(Config::HTTP_RSP, A, 0, "not MAC")));
+}
+
+int main() {
+    testIdle();
+    testDefer();
+    testRtsCts();
+    testNoCts();
+    testOverheard();
+    return checkFailures();
+}
@@ -0,0 +1,111 @@
+#include "check.h"
+#include "metrics.h"
+#include "pool.h"
+#include <thread>
+#include <vector>
+
+static Counter &misses = Metrics::counter("pool.body_misses");
+static Counter &drops = Metrics::counter("pool.body_drops");
+
+static int64_t freeIn(size_t bodyClass) { return Metrics::gauge("pool.body" + std::to_string(bodyClass) + "_free").value(); }
+
+// a buffer given back is the one handed out next, empty, from the smallest class that fits
+static void testReuse() {
+    uint64_t missed = misses.value();
+    auto body = BodyPool::take(20);
+    CHECK(body.empty() && body.capacity() >= 20 && body.capacity() < BODY_CLASSES[1]);
+    CHECK(misses.value() == missed + 1);// nothing to reuse yet
+    body.assign(20, 'x');
+    const char *buffer = body.data();
+    BodyPool::give(std::move(body));
+    CHECK(body.empty());
+    CHECK(freeIn(32) == 1);
+
+    auto again = BodyPool::take(32);
+    CHECK(again.data() == buffer && again.empty());
+    CHECK(misses.value() == missed + 1 && freeIn(32) == 0);
+
+    auto larger = BodyPool::take(100);
+    CHECK(larger.capacity() >= 100 && larger.data() != buffer);
+    BodyPool::give(std::move(larger));
+    CHECK(freeIn(128) == 1);
+    BodyPool::give(std::move(again));
+}
+
+// buffers from elsewhere: kept if they can stand in for a class, freed if not
+static void testForeign() {
+    int64_t small = freeIn(32), largest = freeIn(256);
+    std::string tiny = "short";
+    BodyPool::give(std::move(tiny));
+    CHECK(freeIn(32) == small);
+    std::string big;
+    big.reserve(4096);
+    BodyPool::give(std::move(big));
+    CHECK(freeIn(256) == largest);
+    std::string odd;
+    odd.reserve(300);// more than 256: stands in for it
+    BodyPool::give(std::move(odd));
+    CHECK(freeIn(256) == largest + 1);
+    CHECK(BodyPool::take(256).capacity() >= 256);
+}
+
+// a class keeps at most BODY_POOL_DEPTH buffers, the rest are let go and counted
+static void testDepth() {
+    std::vector<std::string> bodies;
+    for (size_t i = 0; i <= BODY_POOL_DEPTH; ++i) bodies.push_back(BodyPool::take(64));
+    uint64_t dropped = drops.value();
+    for (auto &body: bodies) BodyPool::give(std::move(body));
+    CHECK(freeIn(64) == (int64_t) BODY_POOL_DEPTH);
+    CHECK(drops.value() == dropped + 1);
+    uint64_t missed = misses.value();
+    for (auto &body: bodies) body = BodyPool::take(64);
+    CHECK(misses.value() == missed + 1);// the one that was let go
+    for (auto &body: bodies) BodyPool::give(std::move(body));
+}
+
+// the Reader, the reorder buffer and the lanes take and give from their own threads
+static void testThreads() {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([t]() {
+            for (int i = 0; i < 20000; ++i) {
+                auto body = BodyPool::take((size_t) (1 + (i * 7 + t) % 255));
+                body.push_back((char) t);
+                BodyPool::give(std::move(body));
+            }
+        });
+    for (auto &thread: threads) thread.join();
+    for (auto bodyClass: BODY_CLASSES) CHECK(freeIn(bodyClass) >= 0 && freeIn(bodyClass) <= (int64_t) BODY_POOL_DEPTH);
+}
+
+// FIFO order across the wrap of the ring and while it grows
+static void testSampleQueue() {
+    SampleQueue queue;
+    CHECK(queue.empty() && queue.size() == 0);
+    float next = 0, expected = 0;
+    for (int i = 0; i < 1000; ++i) queue.push(next++);
+    for (int i = 0; i < 600; ++i) {
+        CHECK(queue.front() == expected);
+        queue.pop(), ++expected;
+    }
+    // past the end of the ring, then more than it holds
+    for (size_t i = 0; i < SAMPLE_QUEUE_INITIAL - 400; ++i) queue.push(next++);
+    CHECK(queue.size() == SAMPLE_QUEUE_INITIAL);
+    for (size_t i = 0; i < 3 * SAMPLE_QUEUE_INITIAL; ++i) queue.push(next++);
+    CHECK(queue.size() == 4 * SAMPLE_QUEUE_INITIAL);
+    bool inOrder = true;
+    while (!queue.empty()) {
+        inOrder = inOrder && queue.front() == expected;
+        queue.pop(), ++expected;
+    }
+    CHECK(inOrder && expected == next);
+}
+
+int main() {
+    testReuse();
+    testForeign();
+    testDepth();
+    testThreads();
+    testSampleQueue();
+    return checkFailures();
+}
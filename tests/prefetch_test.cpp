@@ -0,0 +1,99 @@
+#include "check.h"
+#include "prefetch.h"
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <thread>
+
+static const char *PAGE = "<html><head><title>t</title>\n"
+                          "<link rel=\"stylesheet\" href=\"style.css\">\n"
+                          "<script src=\"/app.js\"></script>\n"
+                          "<!-- <img src=\"commented.png\"> -->\n"
+                          "</head><body>\n"
+                          "<img src='img/a.png'> <img src=img/b.png>\n"
+                          "<a href=\"http://localhost:18001/\">l</a> <a href=\"https://www.iana.org/\">iana</a>\n"
+                          "<script>var s = \"<img src='inline.png'>\";</script>\n"
+                          "</body></html>";
+
+static void testLinks() {
+    auto links = extractLinks(PAGE);
+    CHECK(links.size() == 6);
+    if (links.size() != 6) return;
+    CHECK(links[0].url == "style.css" && links[0].priority == PrefetchPriority::BLOCKING && links[0].fetch);
+    CHECK(links[1].url == "/app.js" && links[1].priority == PrefetchPriority::BLOCKING && links[1].fetch);
+    CHECK(links[2].url == "img/a.png" && links[2].priority == PrefetchPriority::IMAGE && links[2].fetch);
+    CHECK(links[3].url == "img/b.png" && links[3].priority == PrefetchPriority::IMAGE && links[3].fetch);
+    CHECK(links[4].url == "http://localhost:18001/" && !links[4].fetch);
+    CHECK(linkHost(links[4].url) == "localhost" && linkHost(links[0].url).empty());
+
+    HttpRequest page, request;
+    HttpRequest::parse("host.test:8000/dir/index.html?q=1", page);
+    CHECK(resolveLink(page, "style.css", request) && request.host == "host.test" && request.port == 8000 && request.path == "/dir/style.css");
+    CHECK(resolveLink(page, "../a/./b/../c.css", request) && request.path == "/a/c.css");
+    CHECK(resolveLink(page, "?x=2", request) && request.path == "/dir/index.html?x=2");
+    CHECK(resolveLink(page, "//cdn.test:8080/z.js", request) && request.host == "cdn.test" && request.port == 8080 && request.path == "/z.js");
+    CHECK(resolveLink(page, "b c.png", request) && request.path == "/dir/b%20c.png");
+    CHECK(!resolveLink(page, "https://www.iana.org/", request));
+    CHECK(!resolveLink(page, "data:image/png;base64,AAAA", request));
+    CHECK(!resolveLink(page, "#top", request));
+}
+
+static void testPrefetcher() {
+    std::mutex lock;
+    std::multiset<std::string> started, fetched;
+    std::atomic<int> resolved{0};
+    Prefetcher prefetcher(
+            [&](const HttpRequest &request) {
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    started.insert(request.path);
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                std::lock_guard<std::mutex> guard(lock);
+                fetched.insert(request.path);
+                return "HTTP/1.1 200 OK\r\n\r\nbody of " + request.path;
+            },
+            [&](const std::string &host, std::string &ip) {
+                ++resolved;
+                ip = "1.2.3.4";
+                return host == "localhost";
+            });
+    HttpRequest page, request;
+    HttpRequest::parse("host.test/", page);
+    HttpResponse response;
+    HttpResponse::parse(std::string("HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n\r\n") + PAGE, response);
+    prefetcher.learn(page, response);
+
+    // asked for while it is being fetched: waits for that fetch instead of starting another
+    for (MyTimer waited; waited.duration() < 10; std::this_thread::sleep_for(std::chrono::milliseconds(5))) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (started.count("/style.css")) break;
+    }
+    std::string raw;
+    HttpRequest::parse("host.test/style.css", request);
+    CHECK(prefetcher.take(request, raw) && raw == "HTTP/1.1 200 OK\r\n\r\nbody of /style.css");
+    // the rest, and the names after the pages, arrive in the background; a loaded machine may take a while
+    std::string ip;
+    for (MyTimer waited; waited.duration() < 10; std::this_thread::sleep_for(std::chrono::milliseconds(20))) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (fetched.size() == 4 && resolved == 2 && prefetcher.address("localhost", ip)) break;
+    }
+    HttpRequest::parse("host.test/img/b.png", request);
+    CHECK(prefetcher.take(request, raw) && raw == "HTTP/1.1 200 OK\r\n\r\nbody of /img/b.png");
+    HttpRequest::parse("host.test/img/c.png", request);
+    CHECK(!prefetcher.take(request, raw));// not on the page
+    HttpRequest::parse("HEAD host.test/app.js", request);
+    CHECK(!prefetcher.take(request, raw));// only GET is prefetched
+    CHECK(prefetcher.address("localhost", ip) && ip == "1.2.3.4");
+    CHECK(!prefetcher.address("elsewhere.test", ip));
+    prefetcher.shutdown();
+    CHECK(fetched == std::multiset<std::string>({"/style.css", "/app.js", "/img/a.png", "/img/b.png"}));
+    CHECK(resolved == 2);// localhost and www.iana.org: a name is resolved even where the page cannot be fetched
+    CHECK(prefetcher.bytes() > 0);
+}
+
+int main() {
+    testLinks();
+    testPrefetcher();
+    return checkFailures();
+}
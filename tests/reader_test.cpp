@@ -0,0 +1,87 @@
+#include "check.h"
+#include "config.h"
+#include "reader.h"
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+constexpr int FRAMES = 200;
+constexpr float WEAK = 0.1f;// amplitude of a weak bit, below PREAMBLE_THRESHOLD
+
+struct Outcome {
+    int frames = 0;
+    int intact = 0;// with the body that was sent
+    unsigned rephased = 0, addressDrops = 0;
+};
+
+/* FRAMES frames for `ip`, each with `weak` bits at WEAK amplitude somewhere
+ * in [from, to) of the frame after the PREAMBLE (to = 0: up to the end),
+ * straight into a Reader that only takes frames for IP 1.
+ */
+static Outcome run(IPType ip, int weak, int from, int to) {
+    SampleQueue input;
+    aether::CriticalSection lock;
+    std::vector<std::string> sent;
+    Outcome outcome;
+    Reader reader(&input, &lock, [&](FrameType &frame) {
+        ++outcome.frames;
+        outcome.intact += frame.port < sent.size() && frame.body == sent[frame.port];
+    }, [](const FrameType &frame) { return frame.ip == 1; });
+    std::mt19937 rng(1);
+    lock.enter();
+    for (int n = 0; n < FRAMES; ++n) {
+        std::string body(100, '\0');
+        for (auto &c: body) c = (char) rng();
+        sent.push_back(body);
+        FrameType frame(Config::HTTP_RSP, ip, (PORTType) n, body);
+        std::string raw = frame.wholeString() + inString(frame.crc());
+        int bits = (int) raw.size() * 8, end = to ? to : bits;
+        std::vector<int> weakAt;
+        for (int w = 0; w < weak; ++w) weakAt.push_back(from + (int) (rng() % (end - from)));
+        raw = preamble + raw;
+        for (int i = 0; i < 400; ++i) input.push(0);
+        for (int k = 0; k < (int) raw.size() * 8; ++k) {
+            float a = std::find(weakAt.begin(), weakAt.end(), k - 8 * LENGTH_PREAMBLE) != weakAt.end() ? WEAK : 1.0f;
+            float s = raw[k / 8] >> (k % 8) & 1 ? a : -a;
+            input.push(s), input.push(s), input.push(-s), input.push(-s);
+        }
+    }
+    for (int i = 0; i < 400; ++i) input.push(0);
+    lock.exit();
+    reader.startThread();
+    for (bool empty = false; !empty; std::this_thread::sleep_for(std::chrono::milliseconds(10))) {
+        lock.enter();
+        empty = input.empty();
+        lock.exit();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    reader.signalThreadShouldExit();
+    reader.stopThread(1000);
+    outcome.rephased = reader.stats().rephased;
+    outcome.addressDrops = reader.stats().addressDrops;
+    return outcome;
+}
+
+int main() {
+    auto clean = run(1, 0, 0, 0);
+    CHECK(clean.frames == FRAMES && clean.intact == FRAMES && clean.rephased == 0);
+    // a weak bit makes the decoder slide by a sample, into the wrong phase for the rest of the frame
+    auto one = run(1, 1, 0, 0);
+    printf("1 weak bit: %d/%d frames, %u rephased\n", one.intact, FRAMES, one.rephased);
+    CHECK(one.intact >= FRAMES * 97 / 100 && one.frames == one.intact);
+    auto two = run(1, 2, 0, 0);
+    printf("2 weak bits: %d/%d frames, %u rephased\n", two.intact, FRAMES, two.rephased);
+    CHECK(two.intact >= FRAMES * 95 / 100 && two.frames == two.intact);
+    // in IP or SRC, the slide turns the address into another one
+    constexpr int IP_BIT = (LENGTH_LEN + LENGTH_TYPE) * 8, PORT_BIT = IP_BIT + 2 * LENGTH_IP * 8;
+    auto address = run(1, 1, IP_BIT, PORT_BIT);
+    printf("1 weak bit in the addresses: %d/%d frames, %u rephased\n", address.intact, FRAMES, address.rephased);
+    CHECK(address.intact >= FRAMES * 97 / 100 && address.frames == address.intact);
+    // frames for another node stay dropped, whatever the phase (the PREAMBLE search may also hit in a skipped BODY)
+    auto other = run(2, 1, IP_BIT, PORT_BIT);
+    CHECK(other.frames == 0 && other.addressDrops >= FRAMES);
+    auto otherClean = run(2, 0, 0, 0);
+    CHECK(otherClean.frames == 0 && otherClean.addressDrops >= FRAMES);
+    return checkFailures();
+}
@@ -0,0 +1,165 @@
+#include "check.h"
+#include "reassembly.h"
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+static std::string readFile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(file), {}};
+}
+
+static std::string randomText(std::mt19937 &rng, size_t n) {
+    std::string text(n, '\0');
+    for (auto &c: text) c = (char) ('a' + rng() % 26);
+    return text;
+}
+
+// the HTTP_RSP bodies for a response, the way the gateway cuts it
+static std::vector<std::string> segments(StreamType stream, const std::string &data, bool compressed, bool deduplicated, size_t size = 100) {
+    SegmentHeader header{stream, 0, (unsigned int) data.size(), compressed, deduplicated};
+    std::vector<std::string> bodies;
+    for (size_t at = 0; at < data.size(); at += size) {
+        header.offset = (unsigned int) at;
+        bodies.push_back(header.inString() + data.substr(at, size));
+    }
+    return bodies;
+}
+
+static std::string envelope(uint16_t status) {
+    HttpEnvelope head;
+    head.status = status;
+    head.fields.emplace_back(HttpEnvelope::CONTENT_TYPE, "text/plain");
+    return head.encode();
+}
+
+static void testOutOfOrder() {
+    std::mt19937 rng(1);
+    std::vector<Reassembler::Result> results;
+    Reassembler reassembler([&results](const Reassembler::Result &result) { results.push_back(result); });
+    std::string body = randomText(rng, 5000);
+    auto bodies = segments(7, envelope(200) + body, false, false);
+    // reordered, with repeats, and one request nobody asked for
+    auto shuffled = bodies;
+    shuffled.insert(shuffled.end(), bodies.begin(), bodies.begin() + 10);
+    std::shuffle(shuffled.begin(), shuffled.end(), rng);
+    reassembler.add(bodies[0], 2);
+    reassembler.expect(1, "reassembly_order.out");
+    CHECK(!reassembler.started(1));
+    for (auto &segment: shuffled) reassembler.add(segment, 1);
+    CHECK(reassembler.started(1));
+    CHECK(results.size() == 1);
+    if (results.size() != 1) return;
+    auto &result = results[0];
+    CHECK(result.complete && result.request == 1 && result.stream == 7 && result.bytes == body.size());
+    CHECK(result.envelope.status == 200 && result.envelope.get(HttpEnvelope::CONTENT_TYPE) == "text/plain");
+    CHECK(readFile(result.path) == body);
+}
+
+static void testCompressedDeduplicated() {
+    std::mt19937 rng(2);
+    std::vector<Reassembler::Result> results;
+    ChunkStore gateway(1 << 20), node(1 << 20);
+    Reassembler reassembler([&results](const Reassembler::Result &result) { results.push_back(result); }, &node);
+    std::string body = randomText(rng, 40000);
+    for (RequestId request = 1; request <= 2; ++request) {// the second time it is all references
+        std::string plain = envelope(200) + dedupEncode(body, gateway), packed;
+        LzEncoder().encode(plain.data(), plain.size(), packed);
+        auto bodies = segments(1, packed, true, true);
+        std::shuffle(bodies.begin(), bodies.end(), rng);
+        reassembler.expect(request, "reassembly_dedup" + std::to_string(request) + ".out");
+        for (auto &segment: bodies) reassembler.add(segment, request);
+    }
+    // STREAM 1 twice: told apart by the request
+    CHECK(results.size() == 2);
+    for (auto &result: results) CHECK(result.complete && readFile(result.path) == body);
+}
+
+static void testMissingChunk() {
+    std::mt19937 rng(3);
+    std::vector<Reassembler::Result> results;
+    std::vector<Fingerprint> asked;
+    ChunkStore gateway(1 << 20), node(1 << 20);
+    Reassembler reassembler([&results](const Reassembler::Result &result) { results.push_back(result); }, &node,
+                            [&asked](const std::vector<Fingerprint> &fps) { asked.insert(asked.end(), fps.begin(), fps.end()); });
+    std::string body = randomText(rng, 20000);
+    // the gateway believes Node1 holds the chunks, which it lost
+    dedupEncode(body, gateway);
+    auto bodies = segments(3, envelope(200) + dedupEncode(body, gateway), false, true);
+    reassembler.expect(5, "reassembly_hole.out");
+    for (auto &segment: bodies) reassembler.add(segment, 5);
+    CHECK(results.empty() && !asked.empty());
+    // CHUNK_RSP in pieces, one chunk that nobody has any more last
+    std::sort(asked.begin(), asked.end());
+    asked.erase(std::unique(asked.begin(), asked.end()), asked.end());
+    for (auto fp: asked) {
+        std::string chunk;
+        CHECK(gateway.get(fp, chunk));
+        ChunkHeader header{fp, 0, (unsigned short) chunk.size(), false};
+        for (size_t at = 0; at < chunk.size(); at += 300) {
+            header.offset = (unsigned short) at;
+            reassembler.addChunk(header.inString() + chunk.substr(at, 300));
+        }
+    }
+    CHECK(results.size() == 1 && results[0].complete && readFile(results[0].path) == body);
+
+    // a chunk the gateway does not have either ends the response incomplete
+    results.clear(), asked.clear();
+    ChunkStore empty(1 << 20);
+    Reassembler lost([&results](const Reassembler::Result &result) { results.push_back(result); }, &empty,
+                     [&asked](const std::vector<Fingerprint> &fps) { asked.insert(asked.end(), fps.begin(), fps.end()); });
+    lost.expect(6, "reassembly_lost.out");
+    for (auto &segment: bodies) lost.add(segment, 6);
+    CHECK(!asked.empty());
+    if (!asked.empty()) lost.addChunk(ChunkHeader{asked[0], 0, 0, false}.inString());
+    CHECK(results.size() == 1 && !results[0].complete);
+}
+
+static void testForget() {
+    std::vector<Reassembler::Result> results;
+    Reassembler reassembler([&results](const Reassembler::Result &result) { results.push_back(result); });
+    auto bodies = segments(9, envelope(200) + std::string(1000, 'x'), false, false);
+    reassembler.expect(3, "reassembly_forget.out");
+    reassembler.add(bodies[0], 3);
+    reassembler.forget(3);
+    for (auto &segment: bodies) reassembler.add(segment, 3);
+    CHECK(results.empty());
+}
+
+static void testOutOfRange() {
+    std::vector<Reassembler::Result> results;
+    Reassembler reassembler([&results](const Reassembler::Result &result) { results.push_back(result); });
+    std::string data = envelope(200) + std::string(1000, 'x');
+    auto bodies = segments(4, data, false, false);
+    reassembler.expect(8, "reassembly_range.out");
+    // beyond TOTAL: would otherwise be held, or make the response look complete early
+    SegmentHeader header{4, (unsigned int) data.size() - 10, (unsigned int) data.size(), false, false};
+    reassembler.add(header.inString() + std::string(100, 'y'), 8);
+    CHECK(!reassembler.started(8));
+    for (auto &segment: bodies) reassembler.add(segment, 8);
+    header.offset = 0xfffffff0u;
+    reassembler.add(header.inString() + "y", 8);
+    CHECK(results.size() == 1 && results[0].complete && readFile(results[0].path) == std::string(1000, 'x'));
+}
+
+static void testUnwritable() {
+    std::vector<Reassembler::Result> results;
+    Reassembler reassembler([&results](const Reassembler::Result &result) { results.push_back(result); });
+    auto bodies = segments(5, envelope(200) + std::string(1000, 'x'), false, false);
+    reassembler.expect(9, "no such directory/reassembly.out");
+    for (auto &segment: bodies) reassembler.add(segment, 9);
+    CHECK(results.size() == 1 && !results[0].complete);
+}
+
+int main() {
+    testOutOfOrder();
+    testCompressedDeduplicated();
+    testMissingChunk();
+    testForget();
+    testOutOfRange();
+    testUnwritable();
+    return checkFailures();
+}
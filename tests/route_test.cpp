@@ -0,0 +1,115 @@
+#include "check.h"
+#include "config.h"
+#include "reader.h"
+#include "route.h"
+#include <chrono>
+#include <thread>
+#include <vector>
+
+static IPType ip(const char *text) { return Str2IPType(text); }
+
+static FrameType frame(Config::Type type, const char *to, const char *from, const std::string &body = "body") {
+    FrameType f(type, ip(to), 0, body);
+    f.src = ip(from);
+    return f;
+}
+
+// the longest matching prefix wins, /0 is the default route
+static void testTable() {
+    RoutingTable table;
+    CHECK(table.empty() && !table.lookup(ip("192.168.1.1")));
+    table.add({ip("192.168.0.0"), 16, ip("10.0.0.2")});
+    table.add({ip("192.168.1.0"), 24, ip("10.0.0.3")});
+    table.add({ip("192.168.1.7"), 32, ip("10.0.0.4")});
+    CHECK(!table.empty());
+    CHECK(!table.lookup(ip("172.16.0.1")));
+    CHECK(table.lookup(ip("192.168.2.1")) && table.lookup(ip("192.168.2.1"))->nextHop == ip("10.0.0.2"));
+    CHECK(table.lookup(ip("192.168.1.1")) && table.lookup(ip("192.168.1.1"))->nextHop == ip("10.0.0.3"));
+    CHECK(table.lookup(ip("192.168.1.7")) && table.lookup(ip("192.168.1.7"))->nextHop == ip("10.0.0.4"));
+    table.add({0, 0, ip("10.0.0.9")});
+    CHECK(table.lookup(ip("172.16.0.1")) && table.lookup(ip("172.16.0.1"))->nextHop == ip("10.0.0.9"));
+    CHECK(table.lookup(ip("192.168.1.7"))->nextHop == ip("10.0.0.4"));
+
+    Route odd{ip("10.0.0.128"), 25, 0};// the bits past the length do not count
+    CHECK(odd.matches(ip("10.0.0.255")) && odd.matches(ip("10.0.0.128")) && !odd.matches(ip("10.0.0.127")));
+}
+
+/* Node 10.0.0.2 between 10.0.0.1 and the 192.168.0.0/16 network behind
+ * 10.0.0.3: it takes what is for it, broadcasts and MAC control frames, and
+ * what it is the hop for, but not what comes back from its own next hop.
+ */
+static void testAccept() {
+    Router router(ip("10.0.0.2"), RoutingTable({{ip("192.168.0.0"), 16, ip("10.0.0.3")}}));
+    CHECK(router.accept(frame(Config::HTTP_REQ, "10.0.0.2", "10.0.0.1"), false));
+    CHECK(router.accept(frame(Config::HTTP_REQ, "255.255.255.255", "10.0.0.1"), false));
+    CHECK(router.accept(frame(Config::MAC_RTS, "10.0.0.1", "10.0.0.3"), true));
+    CHECK(!router.accept(frame(Config::HTTP_REQ, "10.0.0.1", "10.0.0.3"), false));  // another node's, no route
+    CHECK(router.accept(frame(Config::HTTP_REQ, "192.168.4.4", "10.0.0.1"), false));// ours to forward
+    CHECK(!router.accept(frame(Config::HTTP_REQ, "192.168.4.4", "10.0.0.3"), false));// the next hop's own
+    CHECK(!router.accept(frame(Config::HTTP_REQ, "192.168.4.4", "10.0.0.2"), false));// our own, heard back
+}
+
+// a frame is forwarded once: the same one heard again is a loop or an echo
+static void testForward() {
+    Router router(ip("10.0.0.2"), RoutingTable({{ip("192.168.0.0"), 16, ip("10.0.0.3")}}));
+    auto first = frame(Config::HTTP_REQ, "192.168.4.4", "10.0.0.1", "first");
+    CHECK(router.shouldForward(first));
+    CHECK(!router.shouldForward(first));
+    CHECK(!router.shouldForward(frame(Config::HTTP_REQ, "10.0.0.2", "10.0.0.1")));// local, processed instead
+    CHECK(!router.shouldForward(frame(Config::HTTP_REQ, "10.0.0.1", "10.0.0.3")));// no route
+    // the history is bounded: after FORWARD_HISTORY others the first one goes again
+    for (size_t i = 0; i < FORWARD_HISTORY; ++i) CHECK(router.shouldForward(frame(Config::HTTP_REQ, "192.168.4.4", "10.0.0.1", std::to_string(i))));
+    CHECK(router.shouldForward(first));
+}
+
+/* The Router as the Reader's address filter: frames for other nodes are
+ * dropped right after the header, before the BODY and the CRC are read.
+ */
+static void testFilter() {
+    auto router = std::make_shared<Router>(ip("10.0.0.2"), RoutingTable({{ip("192.168.0.0"), 16, ip("10.0.0.3")}}));
+    std::vector<FrameType> sent = {
+            frame(Config::HTTP_REQ, "10.0.0.2", "10.0.0.1", "for us"),
+            frame(Config::HTTP_REQ, "10.0.0.1", "10.0.0.3", "for another node"),
+            frame(Config::MAC_CTS, "10.0.0.1", "10.0.0.3", "ms"),
+            frame(Config::HTTP_REQ, "192.168.4.4", "10.0.0.1", "forwarded"),
+            frame(Config::HTTP_REQ, "192.168.4.4", "10.0.0.3", "back from the next hop"),
+            frame(Config::HTTP_REQ, "255.255.255.255", "10.0.0.1", "broadcast"),
+    };
+    SampleQueue input;
+    aether::CriticalSection lock;
+    std::vector<std::string> received;
+    Reader reader(&input, &lock, [&](FrameType &f) { received.push_back(f.body); }, [router](const FrameType &header) {
+        return router->accept(header, header.type == Config::MAC_RTS || header.type == Config::MAC_CTS);
+    });
+    lock.enter();
+    for (auto &f: sent) {
+        std::string raw = preamble + f.wholeString() + inString(f.crc());
+        for (int i = 0; i < 400; ++i) input.push(0);
+        for (int k = 0; k < (int) raw.size() * 8; ++k) {
+            float s = raw[k / 8] >> (k % 8) & 1 ? 1.0f : -1.0f;
+            input.push(s), input.push(s), input.push(-s), input.push(-s);
+        }
+    }
+    for (int i = 0; i < 400; ++i) input.push(0);
+    lock.exit();
+    reader.startThread();
+    for (bool empty = false; !empty; std::this_thread::sleep_for(std::chrono::milliseconds(10))) {
+        lock.enter();
+        empty = input.empty();
+        lock.exit();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    reader.signalThreadShouldExit();
+    reader.stopThread(1000);
+    CHECK((received == std::vector<std::string>{"for us", "ms", "forwarded", "broadcast"}));
+    // and more if the skipped BODY happens to look like a PREAMBLE: the header after it is not for us either
+    CHECK(reader.stats().addressDrops >= 2);
+}
+
+int main() {
+    testTable();
+    testAccept();
+    testForward();
+    testFilter();
+    return checkFailures();
+}
@@ -0,0 +1,123 @@
+#include "bond.h"
+#include "check.h"
+#include "transfer.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <random>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+constexpr int BLOCK = 480;// audio samples per callback
+constexpr size_t FILE_BYTES = 6000;
+
+static std::string readFile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(file), {}};
+}
+
+static void writeFile(const std::string &path, const std::string &data) {
+    std::ofstream file(path, std::ios::binary);
+    file << data;
+}
+
+static bool isFileFrame(const FrameType &frame) { return frame.type >= Config::FILE_OFFER && frame.type <= Config::FILE_DONE; }
+
+/* Node1 sends files to Node2's INBOX, the audio of each fed to the other
+ * in real time. Node2 restarts halfway through the first file and resumes
+ * it from NAME.part.map; a block of the second is damaged in a way the link
+ * cannot see, which the CRC of the whole file catches.
+ */
+int main() {
+    double rate = 48000;
+    auto config = GlobalConfig::current();
+    IPType node2 = Str2IPType(config->get(Config::NODE2).ip);
+    auto inbox = fs::path(config->inbox);
+    std::error_code ec;
+    fs::remove_all(inbox, ec);
+
+    FileTransfer sender;
+    std::mutex lock;
+    std::unique_ptr<FileTransfer> receiver;// null while Node2 restarts
+    std::atomic<bool> damage{false};
+    auto senderLink = makeNodeLink(Config::NODE1, [&](FrameType &frame) {
+        if (isFileFrame(frame)) sender.onFrame(frame);
+    }, rate);
+    auto receiverLink = makeNodeLink(Config::NODE2, [&](FrameType &frame) {
+        if (!isFileFrame(frame)) return;
+        if (frame.type == Config::FILE_DATA && damage.exchange(false)) frame.body.back() ^= 1;
+        std::lock_guard<std::mutex> guard(lock);
+        if (receiver) receiver->onFrame(frame);
+    }, rate);
+    sender.attach(*senderLink);
+    receiver = std::make_unique<FileTransfer>();
+    receiver->attach(*receiverLink);
+
+    std::atomic<bool> quit{false};
+    std::thread audio([&] {
+        std::vector<float> toReceiver(BLOCK), toSender(BLOCK), senderOut(BLOCK), receiverOut(BLOCK);
+        MyTimer clock;
+        for (long blocks = 1; !quit; ++blocks) {
+            const float *senderIn[1] = {toSender.data()};
+            float *senderOuts[1] = {senderOut.data()};
+            senderLink->processBlock(senderIn, senderOuts, 1, BLOCK);
+            const float *receiverIn[1] = {toReceiver.data()};
+            float *receiverOuts[1] = {receiverOut.data()};
+            receiverLink->processBlock(receiverIn, receiverOuts, 1, BLOCK);
+            toReceiver.swap(senderOut), toSender.swap(receiverOut);
+            while (clock.duration() < blocks * BLOCK / rate) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    std::mt19937 rng(1);
+    std::string data(FILE_BYTES, '\0');
+    for (auto &c: data) c = (char) rng();
+    writeFile("transfer_a.bin", data);
+    auto &bytesRx = Metrics::counter("transfer.bytes_rx");
+
+    // resume: Node2 goes away with part of the file and picks up where it was
+    uint64_t before = bytesRx.value();
+    auto first = std::async(std::launch::async, [&]() { return sender.send(node2, "transfer_a.bin"); });
+    MyTimer waited;
+    while (bytesRx.value() - before < FILE_BYTES / 3 && waited.duration() < 30) std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        receiver = nullptr;// saves the bitmap
+    }
+    CHECK(fs::exists(inbox / "transfer_a.bin.part.map"));
+    uint64_t restarted = bytesRx.value();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        receiver = std::make_unique<FileTransfer>();
+        receiver->attach(*receiverLink);
+    }
+    auto result = first.get();
+    CHECK(result.ok);
+    CHECK(readFile((inbox / "transfer_a.bin").string()) == data);
+    CHECK(bytesRx.value() - restarted < FILE_BYTES - FILE_BYTES / 3 + FILE_BYTES / 10);// what it had is not sent again
+    CHECK(!fs::exists(inbox / "transfer_a.bin.part") && !fs::exists(inbox / "transfer_a.bin.part.map"));
+
+    // a block damaged past the link's CRC: the file's CRC fails and nothing is left in the inbox
+    std::reverse(data.begin(), data.end());
+    writeFile("transfer_b.bin", data);
+    damage = true;
+    result = sender.send(node2, "transfer_b.bin");
+    CHECK(!result.ok && result.error == "the receiver's copy does not match");
+    CHECK(!fs::exists(inbox / "transfer_b.bin") && !fs::exists(inbox / "transfer_b.bin.part") && !fs::exists(inbox / "transfer_b.bin.part.map"));
+    result = sender.send(node2, "transfer_b.bin");// starts over
+    CHECK(result.ok && readFile((inbox / "transfer_b.bin").string()) == data);
+
+    sender.shutdown();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        receiver = nullptr;
+    }
+    quit = true;
+    audio.join();
+    return checkFailures();
+}
@@ -0,0 +1,142 @@
+#include "bond.h"
+#include "check.h"
+#include "socket.h"
+#include "tunnel.h"
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <thread>
+
+constexpr unsigned short ECHO_PORT = 18741;
+constexpr unsigned short APP_PORT = 18742;
+constexpr int BLOCK = 480;// audio samples per callback
+constexpr long LOST_FROM = 150, LOST_TO = 180;// blocks of Node1's audio the gateway never hears
+
+// an application connection: what the test writes to `app` comes out of `local`, which the tunnel takes
+struct AppConnection {
+    tcp_client_t app;
+    socket_t local;
+};
+
+static AppConnection appConnection(tcp_server_t &server) {
+    AppConnection c;
+    c.app.connect("127.0.0.1", APP_PORT);
+    c.local = server.accept();
+    return c;
+}
+
+static std::string readAtLeast(socket_t &socket, size_t size, double seconds) {
+    std::string data;
+    char buffer[1024];
+    MyTimer waited;
+    while (data.size() < size && waited.duration() < seconds) {
+        if (socket.wait_readable(100) <= 0) continue;
+        int n = socket.read_some(buffer, sizeof(buffer));
+        if (n <= 0) break;
+        data.append(buffer, n);
+    }
+    return data;
+}
+
+/* Node1 and Node2 in one process, the audio of each fed to the other in
+ * real time, with an echo server behind the gateway. A stretch of Node1's
+ * audio is lost, which the first connection gets over by going back to
+ * what was not acknowledged. Node1 then restarts its tunnel while that
+ * connection is still open: the new tunnel reuses ID 0, and the gateway
+ * drops the stale connection for it instead of mixing the two.
+ */
+int main() {
+    std::atomic<bool> quit{false};
+    std::atomic<int> echoClosed{0};
+    tcp_server_t echo(ECHO_PORT, true);
+    std::thread upstream([&] {
+        while (true) {
+            socket_t connection = echo.accept();
+            if (quit) break;
+            std::thread([&, connection]() mutable {
+                char buffer[1024];
+                for (int n; (n = connection.read_some(buffer, sizeof(buffer))) > 0;) connection.write_all(buffer, n);
+                connection.close();
+                ++echoClosed;
+            }).detach();
+        }
+    });
+
+    double rate = 48000;
+    auto config = GlobalConfig::current();
+    IPType gatewayAddress = Str2IPType(config->get(Config::NODE2).ip);
+    Tunnel gatewayTunnel, first, restarted;
+    std::atomic<Tunnel *> clientTunnel{&first};
+    auto tunnelFrames = [](Tunnel &tunnel, FrameType &frame) {
+        if (frame.type >= Config::TUNNEL_OPEN && frame.type <= Config::TUNNEL_RESET) tunnel.onFrame(frame);
+    };
+    auto clientLink = makeNodeLink(Config::NODE1, [&](FrameType &frame) { tunnelFrames(*clientTunnel, frame); }, rate);
+    auto gatewayLink = makeNodeLink(Config::NODE2, [&](FrameType &frame) { tunnelFrames(gatewayTunnel, frame); }, rate);
+    first.attach(*clientLink);
+    restarted.attach(*clientLink);
+    gatewayTunnel.attach(*gatewayLink);
+    std::thread audio([&] {
+        std::vector<float> toGateway(BLOCK), toClient(BLOCK), clientOut(BLOCK), gatewayOut(BLOCK);
+        MyTimer clock;
+        for (long blocks = 1; !quit; ++blocks) {
+            const float *clientIn[1] = {toClient.data()};
+            float *clientOuts[1] = {clientOut.data()};
+            clientLink->processBlock(clientIn, clientOuts, 1, BLOCK);
+            const float *gatewayIn[1] = {toGateway.data()};
+            float *gatewayOuts[1] = {gatewayOut.data()};
+            gatewayLink->processBlock(gatewayIn, gatewayOuts, 1, BLOCK);
+            if (blocks >= LOST_FROM && blocks < LOST_TO) std::fill(clientOut.begin(), clientOut.end(), 0.0f);
+            toGateway.swap(clientOut), toClient.swap(gatewayOut);
+            while (clock.duration() < blocks * BLOCK / rate) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    tcp_server_t apps(APP_PORT, true);
+    auto connectThrough = [&](Tunnel &tunnel, socket_t local) {
+        auto opened = std::make_shared<std::promise<bool>>();
+        auto result = opened->get_future();
+        std::thread([&tunnel, local, gatewayAddress, opened]() {
+            tunnel.connect(gatewayAddress, local, "127.0.0.1", ECHO_PORT, [opened](bool ok) { opened->set_value(ok); });
+        }).detach();
+        return result;
+    };
+
+    // Go-back-N: what was lost while the gateway did not hear is sent again, in order
+    auto &retransmits = Metrics::counter("tunnel.retransmits");
+    uint64_t retransmitsBefore = retransmits.value();
+    auto one = appConnection(apps);
+    auto oneOpened = connectThrough(first, one.local);
+    CHECK(oneOpened.get());
+    std::string sent;
+    for (int i = 0; i < 3000; ++i) sent += (char) ('a' + i % 26 + i / 26 % 2 * ('A' - 'a'));
+    one.app.write_all(sent.data(), (int) sent.size());
+    std::string echoed = readAtLeast(one.app, sent.size(), 60);
+    CHECK(echoed == sent);
+    CHECK(retransmits.value() > retransmitsBefore);
+
+    // a restart: the new tunnel opens ID 0 again under another NONCE while the gateway still has the old one
+    clientTunnel = &restarted;
+    auto two = appConnection(apps);
+    auto twoOpened = connectThrough(restarted, two.local);
+    CHECK(twoOpened.get());
+    std::string again = "after the restart";
+    two.app.write_all(again.data(), (int) again.size());
+    CHECK(readAtLeast(two.app, again.size(), 30) == again);
+    MyTimer waited;
+    while (echoClosed < 1 && waited.duration() < 10) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK(echoClosed == 1);// the stale upstream connection, and only that one
+
+    two.app.close();
+    one.app.close();
+    first.shutdown();
+    restarted.shutdown();
+    gatewayTunnel.shutdown();
+    quit = true;
+    tcp_client_t wake;// accept() returns
+    wake.connect("127.0.0.1", ECHO_PORT);
+    wake.close();
+    upstream.join();
+    audio.join();
+    return checkFailures();
+}
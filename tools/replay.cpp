@@ -0,0 +1,70 @@
+// Feed a sample file recorded with CAPTURE back through the receive path,
+// offline and by default as fast as the Readers can decode.
+//
+//     replay capture.bin [--output] [--passband <carrier Hz>] [--realtime]
+//
+// --output replays what the node transmitted instead of what it heard.
+#include "../include/bond.h"
+#include "../include/capture.h"
+#include "../include/log.h"
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+constexpr size_t REPLAY_BACKLOG = 1 << 16;// samples queued per lane before we wait for its Reader
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s capture.bin [--output] [--passband <carrier Hz>] [--realtime]\n", argv[0]);
+        return 2;
+    }
+    auto direction = CaptureDirection::INPUT;
+    double carrier = 0;
+    bool realtime = false;
+    for (int i = 2; i < argc; ++i) {
+        if (!strcmp(argv[i], "--output")) direction = CaptureDirection::OUTPUT;
+        else if (!strcmp(argv[i], "--passband") && i + 1 < argc)
+            carrier = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--realtime"))
+            realtime = true;
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+    CaptureFile file;
+    if (!file.open(argv[1])) {
+        fprintf(stderr, "%s is not a capture file\n", argv[1]);
+        return 1;
+    }
+    auto &header = file.header();
+    PassbandConfig band{carrier, carrier, header.sampleRate};
+    std::atomic<unsigned> frames{0};
+    BondedLink link((int) header.lanes, [&frames](FrameType &frame) {
+        ++frames;
+        Log::frame(LogLevel::Info, LogCategory::PHY, "Replayed", frame);
+    }, header.sampleRate, carrier > 0 ? &band : nullptr);
+
+    MyTimer wall;
+    uint64_t samples = 0;
+    file.forEach([&](const CaptureBlock &block, const float *data) {
+        if (block.direction != direction || block.lane >= header.lanes) return;
+        if (realtime)
+            while (wall.duration() * 1e9 < (double) block.ns) std::this_thread::sleep_for(1ms);
+        while (link.pendingSamples(block.lane) > REPLAY_BACKLOG) std::this_thread::sleep_for(1ms);
+        link.pushInput(block.lane, data, (int) block.count);
+        samples += block.count;
+    });
+    for (int lane = 0; lane < link.laneCount(); ++lane)
+        while (link.pendingSamples(lane) > 0) std::this_thread::sleep_for(1ms);
+    std::this_thread::sleep_for(100ms);// let the last frame be processed
+
+    double seconds = wall.duration();
+    double audio = (double) samples / header.sampleRate / header.lanes;
+    printf("%u frame(s) from %.1f s of audio in %.2f s (%.1fx real time)\n", frames.load(), audio, seconds, seconds > 0 ? audio / seconds : 0.0);
+    printf("%s", link.report().c_str());
+    Log::flush();
+    return 0;
+}
@@ -0,0 +1,60 @@
+// Convert a binary trace written by Trace::dump() into Chrome's trace event
+// format (load it in chrome://tracing or https://ui.perfetto.dev).
+//
+//     trace2chrome trace.bin > trace.json
+#include "../include/trace.h"
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+static bool get32(FILE *file, uint32_t &v) { return fread(&v, sizeof(v), 1, file) == 1; }
+
+static std::string escape(const std::string &s) {
+    std::string out;
+    for (char c: s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s trace.bin > trace.json\n", argv[0]);
+        return 2;
+    }
+    FILE *file = fopen(argv[1], "rb");
+    char magic[sizeof(TRACE_MAGIC)];
+    if (!file || fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s is not a trace file\n", argv[1]);
+        return 1;
+    }
+    std::map<uint32_t, std::string> names;
+    uint32_t count, id, length, threads, tid;
+    if (!get32(file, count)) return 1;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!get32(file, id) || !get32(file, length)) return 1;
+        std::string name(length, 0);
+        if (fread(&name[0], 1, length, file) != length) return 1;
+        names[id] = escape(name);
+    }
+    printf("{\"traceEvents\":[");
+    bool first = true;
+    if (!get32(file, threads)) return 1;
+    for (uint32_t t = 0; t < threads; ++t) {
+        if (!get32(file, tid) || !get32(file, count)) return 1;
+        std::vector<TraceEvent> events(count);
+        if (fread(events.data(), sizeof(TraceEvent), count, file) != count) return 1;
+        for (auto &e: events) {
+            const char *ph = e.kind == TraceKind::BEGIN ? "B" : e.kind == TraceKind::END ? "E" : "i";
+            printf("%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"arg\":%llu}%s}", first ? "" : ",",
+                   names[e.name].c_str(), ph, (double) e.ns / 1000, tid, (unsigned long long) e.arg, e.kind == TraceKind::INSTANT ? ",\"s\":\"t\"" : "");
+            first = false;
+        }
+    }
+    printf("\n]}\n");
+    fclose(file);
+    return 0;
+}